@@ -130,6 +130,7 @@ public:
     ~Arm64TaskData() {}
     unsigned allocReg; // The register to take the allocated space.
     POLYUNSIGNED allocWords; // The words to allocate.
+    PolyWord* allocSampleBase; // The allocation pointer when we last entered ML.
 
     AssemblyArgs assemblyInterface;
     uint32_t saveRegisterMask; // Registers that need to be updated by a GC.
@@ -158,6 +159,10 @@ public:
 
     virtual void addProfileCount(POLYUNSIGNED words) { addSynchronousCount((POLYCODEPTR)assemblyInterface.entryPoint, words); }
 
+    // Count an allocation if we are sampling allocations.
+    virtual void sampleAllocation(POLYUNSIGNED words, PolyObject *obj)
+    { addAllocationSample(this, (POLYCODEPTR)assemblyInterface.entryPoint, assemblyInterface.stackPtr, words, obj); }
+
     // PreRTSCall: After calling from ML to the RTS we need to save the current heap pointer
     virtual void PreRTSCall(void) { TaskData::PreRTSCall();  SaveMemRegisters(); }
     // PostRTSCall: Before returning we need to restore the heap pointer.
@@ -298,7 +303,7 @@ extern "C" {
 };
 
 Arm64TaskData::Arm64TaskData() : ByteCodeInterpreter(&assemblyInterface.stackPtr, &assemblyInterface.stackLimit),
-    allocReg(0), allocWords(0), saveRegisterMask(0)
+    allocReg(0), allocWords(0), allocSampleBase(0), saveRegisterMask(0)
 {
     assemblyInterface.enterInterpreter = (byte*)Arm64AsmCallExtraRETURN_ENTER_INTERPRETER;
     assemblyInterface.heapOverFlowCall = (byte*)Arm64AsmCallExtraRETURN_HEAP_OVERFLOW;
@@ -815,6 +820,8 @@ void Arm64TaskData::SetMemRegisters()
         // We will have already garbage collected and recovered sufficient space.
         // This also happens if we have just trapped because of store profiling.
         allocPointer -= allocWords; // Now allocate
+        if (profileMode == kProfileAllocationStacks)
+            sampleAllocation(allocWords, (PolyObject*)(allocPointer + 1));
         // Set the allocation register to this area. N.B.  This is an absolute address.
         assemblyInterface.registers[allocReg].codeAddr = (POLYCODEPTR)(allocPointer + 1); /* remember: it's off-by-one */
         allocWords = 0;
@@ -835,6 +842,14 @@ void Arm64TaskData::SetMemRegisters()
     // will be generated.
     if (profileMode == kProfileStoreAllocation)
         assemblyInterface.localMbottom = assemblyInterface.localMpointer;
+    // If we are sampling allocations we only need a trap when the next sample is due.
+    allocSampleBase = allocPointer;
+    if (profileMode == kProfileAllocationStacks)
+    {
+        POLYUNSIGNED toSample = allocationWordsBeforeSample(this);
+        if (toSample <= (POLYUNSIGNED)(allocPointer - allocLimit))
+            assemblyInterface.localMbottom = allocPointer + 2 - toSample;
+    }
 
     assemblyInterface.threadId = stackItem(threadObject);
 }
@@ -847,6 +862,9 @@ void Arm64TaskData::SaveMemRegisters()
         // The normal return is to the link register address.
         assemblyInterface.entryPoint = assemblyInterface.linkRegister;
         allocPointer = assemblyInterface.localMpointer - 1;
+        // Count what the ML code has allocated without a trap.
+        if (profileMode == kProfileAllocationStacks && allocPointer <= allocSampleBase)
+            allocSinceSample += allocSampleBase - allocPointer;
     }
     allocWords = 0;
     assemblyInterface.exceptionPacket = TAGGED(0);
@@ -1007,7 +1025,7 @@ bool Arm64TaskData::AddTimeProfileCount(SIGNALCONTEXT *context)
         MemSpace* space = gMem.SpaceForAddress(pc);
         if (space != 0 && (space->spaceType == ST_CODE || space->spaceType == ST_PERMANENT))
         {
-            incrementCountAsynch(pc);
+            incrementCountAsynch(this, pc, sp);
             return true;
         }
     }
@@ -1019,7 +1037,7 @@ bool Arm64TaskData::AddTimeProfileCount(SIGNALCONTEXT *context)
         MemSpace* space = gMem.SpaceForAddress(pc);
         if (space != 0 && (space->spaceType == ST_CODE || space->spaceType == ST_PERMANENT))
         {
-            incrementCountAsynch(pc);
+            incrementCountAsynch(this, pc, sp+1);
             return true;
         }
     }
@@ -1034,7 +1052,7 @@ bool Arm64TaskData::AddTimeProfileCount(SIGNALCONTEXT *context)
         MemSpace* space = gMem.SpaceForAddress(pc);
         if (space != 0 && (space->spaceType == ST_CODE || space->spaceType == ST_PERMANENT))
         {
-            incrementCountAsynch(pc);
+            incrementCountAsynch(this, pc, sp+1);
             return true;
         }
     }
@@ -0,0 +1,911 @@
+/*
+    Title:      Asynchronous I/O.
+
+    Copyright (c) 2026 David C. J. Matthews
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+/*
+    A thread starts any number of reads, writes and accepts and later waits
+    for each of them to complete.  Starting a request only queues it so a batch
+    of requests is passed to the kernel in a single call when the thread waits
+    for one of them or calls PolyAsyncIOSubmit.
+    On Linux the requests are submitted through io_uring and a thread collects
+    the completions and wakes the waiting ML threads.  If io_uring is not
+    available a small pool of threads performs the requests.
+    The data for a request is held in memory allocated here rather than in the
+    ML heap so that the GC can run while the request is in progress.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#elif defined(_WIN32)
+#include "winconfig.h"
+#else
+#error "No configuration file"
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_ASSERT_H
+#include <assert.h>
+#define ASSERT(x) assert(x)
+#else
+#define ASSERT(x)
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#if (!defined(_WIN32))
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#include <map>
+#include <deque>
+#include <vector>
+
+#include "globals.h"
+#include "asyncio.h"
+#include "run_time.h"
+#include "arb.h"
+#include "processes.h"
+#include "polystring.h"
+#include "save_vec.h"
+#include "rts_module.h"
+#include "rtsentry.h"
+#include "memmgr.h"
+#include "locking.h"
+#include "io_internal.h"
+
+extern "C" {
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyAsyncIOStart(POLYUNSIGNED threadId, POLYUNSIGNED args);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyAsyncIOSubmit(POLYUNSIGNED threadId);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyAsyncIOIsComplete(POLYUNSIGNED threadId, POLYUNSIGNED id);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyAsyncIOWait(POLYUNSIGNED threadId, POLYUNSIGNED id);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyAsyncIOCancel(POLYUNSIGNED threadId, POLYUNSIGNED id);
+}
+
+#define SAVE(x) taskData->saveVec.push(x)
+
+// Kinds of request.  These must match the ML code.
+#define ASYNC_READ      0
+#define ASYNC_WRITE     1
+#define ASYNC_ACCEPT    2
+
+#if (!defined(_WIN32))
+
+class AsyncRequest
+{
+public:
+    AsyncRequest(int k, int f): kind(k), fd(f), position(-1), length(0), buffer(0),
+        addrLen(sizeof(addr)), complete(false), cancelled(false), result(0), error(0), pollError(0) {}
+    ~AsyncRequest() { free(buffer); }
+
+    int kind, fd;
+    int64_t position; // File position or -1 for the current position.
+    size_t length;
+    char *buffer; // The data to write or the space for the data read.
+    struct sockaddr_storage addr; // The address for an accept.
+    socklen_t addrLen;
+    bool complete;
+    bool cancelled; // No longer in the table.  Deleted when it completes.
+    ssize_t result; // Number of bytes or the new descriptor.
+    int error; // Non-zero if it failed.
+    int pollError; // Used with io_uring.
+};
+
+// This protects all the data here.
+static PLock asyncLock("Async I/O");
+// Signalled when any request completes.
+static PCondVar completionCond;
+
+// Delete a request whose result will not be returned.  If it accepted a
+// connection the new descriptor is closed.
+static void DisposeRequest(AsyncRequest *req)
+{
+    if (req->kind == ASYNC_ACCEPT && req->complete && req->error == 0)
+        close((int)req->result);
+    delete req;
+}
+
+// Called with asyncLock held.
+static void RequestComplete(AsyncRequest *req)
+{
+    req->complete = true;
+    if (req->cancelled)
+        DisposeRequest(req);
+    else completionCond.Signal();
+}
+
+// Block all signals in the threads created here so they are delivered to the ML threads.
+static void BlockSignals(void)
+{
+    sigset_t active_signals;
+    sigfillset(&active_signals);
+    pthread_sigmask(SIG_SETMASK, &active_signals, NULL);
+}
+
+class AsyncIOEngine
+{
+public:
+    virtual ~AsyncIOEngine() {}
+    // Queue a request.  Called with asyncLock held.
+    virtual void Start(AsyncRequest *req) = 0;
+    // Pass any queued requests to the kernel.  Called with asyncLock held.
+    virtual void Submit(void) {}
+    // Cancel a request that has not completed.  Returns true if it had not been
+    // started and can be deleted now, false if it will be passed to RequestComplete
+    // later.  Called with asyncLock held.
+    virtual bool Cancel(AsyncRequest *req) = 0;
+    virtual void Stop(void) = 0;
+};
+
+#ifdef HAVE_IO_URING
+
+#define URING_ENTRIES   256
+
+class UringEngine: public AsyncIOEngine
+{
+public:
+    UringEngine(): ringFd(-1), stopFd(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqes((struct io_uring_sqe *)MAP_FAILED),
+        sqLocalTail(0), sqSubmitted(0), threadRunning(false), terminate(false) {}
+    ~UringEngine();
+    bool Initialise(void);
+    virtual void Start(AsyncRequest *req);
+    virtual void Submit(void);
+    virtual bool Cancel(AsyncRequest *req);
+    virtual void Stop(void);
+
+private:
+    bool HaveSpace(unsigned n) { return sqLocalTail + n - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) <= sqEntries; }
+    struct io_uring_sqe *GetSqe(void);
+    void QueueRequest(AsyncRequest *req);
+    void ProcessCompletions(void);
+    static void *CompletionThread(void *);
+
+    int ringFd;
+    int stopFd; // Written by Stop.  A poll on this is always in the ring.
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sqEntries, *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    unsigned sqLocalTail, sqSubmitted;
+    // Requests that didn't fit in the submission ring.
+    std::deque<AsyncRequest*> overflow;
+    pthread_t threadId;
+    bool threadRunning, terminate;
+};
+
+bool UringEngine::Initialise(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ringFd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ringFd < 0) return false;
+    // We need the kernel to keep completions rather than dropping them if the
+    // completion ring is full.
+    if ((params.features & IORING_FEAT_NODROP) == 0) return false;
+
+    // Check the operations we use are supported.
+    const unsigned probeOps = 256;
+    struct io_uring_probe *probe =
+        (struct io_uring_probe *)calloc(1, sizeof(struct io_uring_probe) + probeOps * sizeof(struct io_uring_probe_op));
+    if (probe == 0) return false;
+    bool supported = syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, probeOps) >= 0;
+    const unsigned ops[] = { IORING_OP_POLL_ADD, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_ACCEPT, IORING_OP_ASYNC_CANCEL };
+    for (unsigned i = 0; supported && i < sizeof(ops)/sizeof(ops[0]); i++)
+        supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) != 0;
+    free(probe);
+    if (! supported) return false;
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMap)
+    {
+        if (cqRingSize > sqRingSize) sqRingSize = cqRingSize;
+        cqRingSize = sqRingSize;
+    }
+    sqRing = mmap(0, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) return false;
+    if (singleMap) cqRing = sqRing;
+    else
+    {
+        cqRing = mmap(0, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) return false;
+    }
+    sqes = (struct io_uring_sqe *)mmap(0, params.sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return false;
+
+    char *sq = (char*)sqRing, *cq = (char*)cqRing;
+    sqEntries = params.sq_entries;
+    sqHead = (unsigned*)(sq + params.sq_off.head);
+    sqTail = (unsigned*)(sq + params.sq_off.tail);
+    sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+    sqArray = (unsigned*)(sq + params.sq_off.array);
+    cqHead = (unsigned*)(cq + params.cq_off.head);
+    cqTail = (unsigned*)(cq + params.cq_off.tail);
+    cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    sqLocalTail = sqSubmitted = *sqTail;
+
+    // Stop may be called when the submission ring is full so the request that
+    // wakes the thread is submitted now.
+    stopFd = eventfd(0, EFD_CLOEXEC);
+    if (stopFd < 0) return false;
+    struct io_uring_sqe *stopSqe = GetSqe();
+    stopSqe->opcode = IORING_OP_POLL_ADD;
+    stopSqe->fd = stopFd;
+    stopSqe->poll_events = POLLIN;
+    stopSqe->user_data = 0;
+    Submit();
+    if (sqSubmitted != sqLocalTail) return false;
+
+    threadRunning = pthread_create(&threadId, NULL, CompletionThread, this) == 0;
+    return threadRunning;
+}
+
+UringEngine::~UringEngine()
+{
+    if (sqes != MAP_FAILED) munmap(sqes, sqEntries * sizeof(struct io_uring_sqe));
+    if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+    if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+    if (ringFd >= 0) close(ringFd);
+    if (stopFd >= 0) close(stopFd);
+}
+
+struct io_uring_sqe *UringEngine::GetSqe(void)
+{
+    unsigned index = sqLocalTail & *sqMask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray[index] = index;
+    sqLocalTail++;
+    return sqe;
+}
+
+// Each request is a poll linked to the operation.  The descriptors are normally
+// non-blocking and io_uring would return EAGAIN rather than waiting.
+void UringEngine::QueueRequest(AsyncRequest *req)
+{
+    struct io_uring_sqe *pollSqe = GetSqe();
+    pollSqe->opcode = IORING_OP_POLL_ADD;
+    pollSqe->fd = req->fd;
+    pollSqe->poll_events = req->kind == ASYNC_WRITE ? POLLOUT : POLLIN;
+    pollSqe->flags = IOSQE_IO_LINK;
+    pollSqe->user_data = (uintptr_t)req | 1; // Distinguish the poll from the operation.
+
+    struct io_uring_sqe *sqe = GetSqe();
+    sqe->fd = req->fd;
+    sqe->user_data = (uintptr_t)req;
+    switch (req->kind)
+    {
+    case ASYNC_READ:
+    case ASYNC_WRITE:
+        sqe->opcode = req->kind == ASYNC_READ ? IORING_OP_READ : IORING_OP_WRITE;
+        sqe->addr = (uintptr_t)req->buffer;
+        sqe->len = (unsigned)req->length;
+        sqe->off = (uint64_t)req->position; // -1 means the current position.
+        break;
+    case ASYNC_ACCEPT:
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->addr = (uintptr_t)&req->addr;
+        sqe->addr2 = (uintptr_t)&req->addrLen;
+        break;
+    }
+}
+
+void UringEngine::Start(AsyncRequest *req)
+{
+    if (overflow.empty() && HaveSpace(2))
+        QueueRequest(req);
+    else overflow.push_back(req);
+}
+
+void UringEngine::Submit(void)
+{
+    while (true)
+    {
+        while (! overflow.empty() && HaveSpace(2))
+        {
+            QueueRequest(overflow.front());
+            overflow.pop_front();
+        }
+        unsigned toSubmit = sqLocalTail - sqSubmitted;
+        if (toSubmit == 0) return;
+        __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+        int n = (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, 0, 0, NULL, 0);
+        if (n < 0 && errno == EINTR) continue;
+        // If the kernel can't take them now they are submitted on the next call.
+        if (n <= 0) return;
+        sqSubmitted += n;
+        if (overflow.empty()) return;
+    }
+}
+
+bool UringEngine::Cancel(AsyncRequest *req)
+{
+    for (std::deque<AsyncRequest*>::iterator i = overflow.begin(); i != overflow.end(); i++)
+    {
+        if (*i == req)
+        {
+            overflow.erase(i);
+            return true;
+        }
+    }
+    // Cancelling the poll cancels the operation linked to it.  If the poll has
+    // already completed the operation will finish shortly.  If there is no room
+    // in the ring the request is left to complete.
+    if (HaveSpace(1))
+    {
+        struct io_uring_sqe *sqe = GetSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (uintptr_t)req | 1;
+        sqe->user_data = 0; // The completion is ignored.
+        Submit();
+    }
+    return false;
+}
+
+void UringEngine::Stop(void)
+{
+    if (! threadRunning) return;
+    {
+        PLocker lock(&asyncLock);
+        terminate = true;
+    }
+    // This completes the poll queued in Initialise and wakes the thread.
+    uint64_t one = 1;
+    while (write(stopFd, &one, sizeof(one)) < 0 && errno == EINTR) {}
+    pthread_join(threadId, NULL);
+    threadRunning = false;
+}
+
+// Called with asyncLock held.
+void UringEngine::ProcessCompletions(void)
+{
+    unsigned head = *cqHead;
+    unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    bool resubmit = false;
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe *cqe = &cqes[head & *cqMask];
+        if (cqe->user_data == 0) continue; // The poll on stopFd or a cancel.
+        AsyncRequest *req = (AsyncRequest *)(uintptr_t)(cqe->user_data & ~(uint64_t)1);
+        if (cqe->user_data & 1)
+        {
+            // The poll.  If this failed the operation is cancelled.
+            if (cqe->res < 0) req->pollError = -cqe->res;
+        }
+        else if ((cqe->res == -EAGAIN || cqe->res == -EINTR) && ! req->cancelled)
+        {
+            // Another thread may have read the data first.  Wait again.
+            overflow.push_back(req);
+            resubmit = true;
+        }
+        else
+        {
+            if (cqe->res >= 0) req->result = cqe->res;
+            else if (cqe->res == -ECANCELED && req->pollError != 0)
+                req->error = req->pollError;
+            else req->error = -cqe->res;
+            RequestComplete(req);
+        }
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    if (resubmit) Submit();
+}
+
+void *UringEngine::CompletionThread(void *arg)
+{
+    UringEngine *engine = (UringEngine *)arg;
+    BlockSignals();
+    while (true)
+    {
+        int n = (int)syscall(__NR_io_uring_enter, engine->ringFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return 0;
+        PLocker lock(&asyncLock);
+        engine->ProcessCompletions();
+        if (engine->terminate) return 0;
+    }
+}
+
+#endif
+
+#define ASYNC_POOL_THREADS  4
+
+// Used if io_uring is not available.  The threads poll briefly before each
+// operation so that a request that is not ready does not hold up the others.
+class ThreadPoolEngine: public AsyncIOEngine
+{
+public:
+    ThreadPoolEngine(): terminate(false) {}
+    bool Initialise(void);
+    virtual void Start(AsyncRequest *req) { queue.push_back(req); workAvailable.Signal(); }
+    virtual bool Cancel(AsyncRequest *req);
+    virtual void Stop(void);
+
+private:
+    static void *WorkerThread(void *);
+    static bool Perform(AsyncRequest *req);
+
+    std::deque<AsyncRequest*> queue;
+    PCondVar workAvailable;
+    std::vector<pthread_t> threads;
+    bool terminate;
+};
+
+bool ThreadPoolEngine::Initialise(void)
+{
+    for (unsigned i = 0; i < ASYNC_POOL_THREADS; i++)
+    {
+        pthread_t threadId;
+        if (pthread_create(&threadId, NULL, WorkerThread, this) == 0)
+            threads.push_back(threadId);
+    }
+    return ! threads.empty();
+}
+
+// If a worker thread has the request it completes it.
+bool ThreadPoolEngine::Cancel(AsyncRequest *req)
+{
+    for (std::deque<AsyncRequest*>::iterator i = queue.begin(); i != queue.end(); i++)
+    {
+        if (*i == req)
+        {
+            queue.erase(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPoolEngine::Stop(void)
+{
+    {
+        PLocker lock(&asyncLock);
+        terminate = true;
+        workAvailable.Signal();
+    }
+    for (std::vector<pthread_t>::iterator i = threads.begin(); i != threads.end(); i++)
+        pthread_join(*i, NULL);
+    threads.clear();
+}
+
+void *ThreadPoolEngine::WorkerThread(void *arg)
+{
+    ThreadPoolEngine *engine = (ThreadPoolEngine *)arg;
+    BlockSignals();
+    asyncLock.Lock();
+    while (! engine->terminate)
+    {
+        if (engine->queue.empty())
+        {
+            engine->workAvailable.Wait(&asyncLock);
+            continue;
+        }
+        AsyncRequest *req = engine->queue.front();
+        engine->queue.pop_front();
+        asyncLock.Unlock();
+        bool done = Perform(req);
+        asyncLock.Lock();
+        if (done) RequestComplete(req);
+        else if (req->cancelled) DisposeRequest(req);
+        else engine->queue.push_back(req);
+    }
+    asyncLock.Unlock();
+    return 0;
+}
+
+// Try the operation.  Returns false if it would block.
+bool ThreadPoolEngine::Perform(AsyncRequest *req)
+{
+    struct pollfd pfd;
+    pfd.fd = req->fd;
+    pfd.events = req->kind == ASYNC_WRITE ? POLLOUT : POLLIN;
+    pfd.revents = 0;
+    int res = poll(&pfd, 1, 100);
+    if (res == 0 || (res < 0 && errno == EINTR)) return false;
+    ssize_t r = -1;
+    if (res > 0)
+    {
+        switch (req->kind)
+        {
+        case ASYNC_READ:
+            if (req->position < 0) r = read(req->fd, req->buffer, req->length);
+            else r = pread(req->fd, req->buffer, req->length, (off_t)req->position);
+            break;
+        case ASYNC_WRITE:
+            if (req->position < 0) r = write(req->fd, req->buffer, req->length);
+            else r = pwrite(req->fd, req->buffer, req->length, (off_t)req->position);
+            break;
+        case ASYNC_ACCEPT:
+            r = accept(req->fd, (struct sockaddr*)&req->addr, &req->addrLen);
+            break;
+        }
+    }
+    if (r < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return false;
+        req->error = errno;
+    }
+    else req->result = r;
+    return true;
+}
+
+class AsyncIOModule: public RtsModule
+{
+public:
+    AsyncIOModule(): engine(0), engineFailed(false), nextId(1) {}
+    virtual void Stop(void);
+    virtual void ForkChild(void);
+
+    AsyncIOEngine *GetEngine(void);
+    void CancelRequest(std::map<POLYUNSIGNED, AsyncRequest*>::iterator i);
+
+    AsyncIOEngine *engine;
+    bool engineFailed;
+    POLYUNSIGNED nextId;
+    // The requests that have been started and not yet waited for.
+    std::map<POLYUNSIGNED, AsyncRequest*> requests;
+};
+
+// Declare this.  It will be automatically added to the table.
+static AsyncIOModule asyncIOModule;
+
+// Create the engine the first time it is needed.  Called with asyncLock held.
+AsyncIOEngine *AsyncIOModule::GetEngine(void)
+{
+    if (engine != 0 || engineFailed) return engine;
+#ifdef HAVE_IO_URING
+    UringEngine *uring = new UringEngine;
+    if (uring->Initialise())
+        return engine = uring;
+    delete uring;
+#endif
+    ThreadPoolEngine *pool = new ThreadPoolEngine;
+    if (pool->Initialise())
+        return engine = pool;
+    delete pool;
+    engineFailed = true;
+    return 0;
+}
+
+void AsyncIOModule::Stop(void)
+{
+    if (engine != 0) engine->Stop();
+}
+
+// Remove a request from the table.  It is deleted now if it has completed or
+// has not been started, otherwise when it completes.  Called with asyncLock held.
+void AsyncIOModule::CancelRequest(std::map<POLYUNSIGNED, AsyncRequest*>::iterator i)
+{
+    AsyncRequest *req = i->second;
+    requests.erase(i);
+    if (req->complete || engine->Cancel(req))
+        DisposeRequest(req);
+    else req->cancelled = true;
+}
+
+// The threads don't exist in the child so start again.  The engine is not
+// deleted because it may be in an inconsistent state.
+void AsyncIOModule::ForkChild(void)
+{
+    engine = 0;
+    engineFailed = false;
+    requests.clear();
+}
+
+// Waits until the request has completed.
+class WaitAsyncRequest: public Waiter
+{
+public:
+    WaitAsyncRequest(POLYUNSIGNED i): id(i) {}
+    virtual void Wait(unsigned maxMillisecs);
+private:
+    POLYUNSIGNED id;
+};
+
+void WaitAsyncRequest::Wait(unsigned maxMillisecs)
+{
+    PLocker lock(&asyncLock);
+    std::map<POLYUNSIGNED, AsyncRequest*>::iterator i = asyncIOModule.requests.find(id);
+    if (i != asyncIOModule.requests.end() && ! i->second->complete)
+        completionCond.WaitFor(&asyncLock, maxMillisecs);
+}
+
+// Cancel any requests on a descriptor that is being closed.  With io_uring they
+// would otherwise wait for ever and with the thread pool they could be applied
+// to a new descriptor with the same number.
+void CancelAsyncIO(int fd)
+{
+    PLocker lock(&asyncLock);
+    std::map<POLYUNSIGNED, AsyncRequest*>::iterator i = asyncIOModule.requests.begin();
+    while (i != asyncIOModule.requests.end())
+    {
+        std::map<POLYUNSIGNED, AsyncRequest*>::iterator next = i;
+        next++;
+        if (i->second->fd == fd)
+            asyncIOModule.CancelRequest(i);
+        i = next;
+    }
+}
+
+// Find a request.  Called with asyncLock held.
+static AsyncRequest *findRequest(TaskData *taskData, POLYUNSIGNED id)
+{
+    std::map<POLYUNSIGNED, AsyncRequest*>::iterator i = asyncIOModule.requests.find(id);
+    if (i == asyncIOModule.requests.end())
+        raise_syscall(taskData, "Invalid asynchronous I/O request", EINVAL);
+    return i->second;
+}
+
+#endif
+
+// Start a request.  The argument is a tuple of the kind, the stream, the base and
+// offset of the data to write, the length and the file position or ~1.
+// Returns an identifier for the request.
+POLYUNSIGNED PolyAsyncIOStart(POLYUNSIGNED threadId, POLYUNSIGNED argsAsWord)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle args = taskData->saveVec.push(argsAsWord);
+    Handle result = 0;
+
+    try {
+#if (defined(_WIN32))
+        raise_fail(taskData, "Asynchronous I/O is not supported");
+#else
+        PolyObject *argObj = args->WordP();
+        int kind = (int)getPolySigned(taskData, argObj->Get(0));
+        int fd = getStreamFileDescriptor(taskData, argObj->Get(1));
+        POLYUNSIGNED offset = getPolyUnsigned(taskData, argObj->Get(3));
+        size_t length = getPolyUnsigned(taskData, argObj->Get(4));
+        int64_t position = getPolySigned(taskData, argObj->Get(5));
+        // io_uring takes a 32-bit length.  A shorter transfer is always allowed.
+        if (length > 0x40000000) length = 0x40000000;
+        AsyncRequest *req = new AsyncRequest(kind, fd);
+        req->position = position < 0 ? -1 : position;
+        if (kind == ASYNC_READ || kind == ASYNC_WRITE)
+        {
+            req->length = length;
+            req->buffer = (char*)malloc(length == 0 ? 1 : length);
+            if (req->buffer == 0)
+            {
+                delete req;
+                raise_syscall(taskData, "Insufficient memory", ENOMEM);
+            }
+            if (kind == ASYNC_WRITE)
+            {
+                byte *base = argObj->Get(2).AsObjPtr()->AsBytePtr() + offset;
+                gMem.LoadLazyData(base, length);
+                memcpy(req->buffer, base, length);
+            }
+        }
+        POLYUNSIGNED id;
+        {
+            PLocker lock(&asyncLock);
+            AsyncIOEngine *engine = asyncIOModule.GetEngine();
+            if (engine == 0)
+            {
+                delete req;
+                raise_fail(taskData, "Unable to start asynchronous I/O");
+            }
+            id = asyncIOModule.nextId++;
+            asyncIOModule.requests[id] = req;
+            engine->Start(req);
+        }
+        result = Make_fixed_precision(taskData, id);
+#endif
+    }
+    catch (...) { } // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    if (result == 0) return TAGGED(0).AsUnsigned();
+    else return result->Word().AsUnsigned();
+}
+
+// Pass any requests that have been started to the kernel.
+POLYUNSIGNED PolyAsyncIOSubmit(POLYUNSIGNED threadId)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+#if (!defined(_WIN32))
+    {
+        PLocker lock(&asyncLock);
+        if (asyncIOModule.engine != 0) asyncIOModule.engine->Submit();
+    }
+#endif
+    taskData->PostRTSCall();
+    return TAGGED(0).AsUnsigned();
+}
+
+// Test whether a request has completed without blocking.
+POLYUNSIGNED PolyAsyncIOIsComplete(POLYUNSIGNED threadId, POLYUNSIGNED id)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    bool complete = false;
+
+    try {
+#if (!defined(_WIN32))
+        PLocker lock(&asyncLock);
+        AsyncRequest *req = findRequest(taskData, PolyWord::FromUnsigned(id).UnTaggedUnsigned());
+        if (asyncIOModule.engine != 0) asyncIOModule.engine->Submit();
+        complete = req->complete;
+#endif
+    }
+    catch (...) { } // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    return TAGGED(complete ? 1 : 0).AsUnsigned();
+}
+
+// Wait for a request to complete and return the result.  For a read this is the
+// data, for a write the number of bytes written and for an accept a pair of the
+// new socket and the address.  Raises an exception if the request failed.
+POLYUNSIGNED PolyAsyncIOWait(POLYUNSIGNED threadId, POLYUNSIGNED idAsWord)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle result = 0;
+    POLYUNSIGNED id = PolyWord::FromUnsigned(idAsWord).UnTaggedUnsigned();
+
+    try {
+#if (!defined(_WIN32))
+        AsyncRequest *req = 0;
+        while (req == 0)
+        {
+            {
+                PLocker lock(&asyncLock);
+                AsyncRequest *r = findRequest(taskData, id);
+                if (asyncIOModule.engine != 0) asyncIOModule.engine->Submit();
+                if (r->complete)
+                {
+                    asyncIOModule.requests.erase(id);
+                    req = r;
+                }
+            }
+            if (req == 0)
+            {
+                WaitAsyncRequest waiter(id);
+                processes->ThreadPauseForIO(taskData, &waiter);
+            }
+        }
+        int error = req->error;
+        if (error == 0)
+        {
+            try {
+                switch (req->kind)
+            {
+                case ASYNC_READ:
+                    result = SAVE(C_string_to_Poly(taskData, req->buffer, req->result));
+                    break;
+                case ASYNC_WRITE:
+                    result = Make_fixed_precision(taskData, req->result);
+                    break;
+                case ASYNC_ACCEPT:
+                    {
+                        socklen_t addrLen = req->addrLen;
+                        if (addrLen > sizeof(req->addr)) addrLen = sizeof(req->addr);
+                        Handle addrHandle = SAVE(C_string_to_Poly(taskData, (char*)&req->addr, addrLen));
+                        Handle resSkt = wrapFileDescriptor(taskData, (int)req->result);
+                        result = alloc_and_save(taskData, 2);
+                        result->WordP()->Set(0, resSkt->Word());
+                        result->WordP()->Set(1, addrHandle->Word());
+                        break;
+                    }
+                }
+            }
+            catch (...) {
+                // The result can't be returned so close any new descriptor.
+                DisposeRequest(req);
+                throw;
+            }
+        }
+        delete req;
+        if (error != 0)
+            raise_syscall(taskData, "Asynchronous I/O failed", error);
+#endif
+    }
+    catch (KillException &) {
+        processes->ThreadExit(taskData); // TestAnyEvents may test for kill
+    }
+    catch (...) { } // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    if (result == 0) return TAGGED(0).AsUnsigned();
+    else return result->Word().AsUnsigned();
+}
+
+// Cancel a request that will not be waited for.  If it has already completed
+// its result is discarded.
+POLYUNSIGNED PolyAsyncIOCancel(POLYUNSIGNED threadId, POLYUNSIGNED id)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+#if (!defined(_WIN32))
+    {
+        PLocker lock(&asyncLock);
+        std::map<POLYUNSIGNED, AsyncRequest*>::iterator i =
+            asyncIOModule.requests.find(PolyWord::FromUnsigned(id).UnTaggedUnsigned());
+        if (i != asyncIOModule.requests.end())
+            asyncIOModule.CancelRequest(i);
+    }
+#endif
+    taskData->PostRTSCall();
+    return TAGGED(0).AsUnsigned();
+}
+
+struct _entrypts asyncIOEPT[] =
+{
+    { "PolyAsyncIOStart",               (polyRTSFunction)&PolyAsyncIOStart},
+    { "PolyAsyncIOSubmit",              (polyRTSFunction)&PolyAsyncIOSubmit},
+    { "PolyAsyncIOIsComplete",          (polyRTSFunction)&PolyAsyncIOIsComplete},
+    { "PolyAsyncIOWait",                (polyRTSFunction)&PolyAsyncIOWait},
+    { "PolyAsyncIOCancel",              (polyRTSFunction)&PolyAsyncIOCancel},
+
+    { NULL, NULL} // End of list.
+};
@@ -89,6 +89,12 @@ DCJM May 2000.
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
 #ifdef HAVE_MALLOC_H
 #include <malloc.h>
 #endif
@@ -140,6 +146,9 @@ DCJM May 2000.
 #include "locking.h"
 #include "rtsentry.h"
 #include "timing.h"
+#include "memmgr.h"
+#include "ioreactor.h"
+#include "asyncio.h"
 
 
 #define TOOMANYFILES EMFILE
@@ -165,25 +174,24 @@ extern "C" {
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyBasicIOGeneral(POLYUNSIGNED threadId, POLYUNSIGNED code, POLYUNSIGNED strm, POLYUNSIGNED arg);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyPollIODescriptors(POLYUNSIGNED threadId, POLYUNSIGNED streamVec, POLYUNSIGNED bitVec, POLYUNSIGNED maxMillisecs);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyPosixCreatePersistentFD(POLYUNSIGNED threadId, POLYUNSIGNED fd);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyBasicIOWriteVectors(POLYUNSIGNED threadId, POLYUNSIGNED strm, POLYUNSIGNED vecs);
 }
 
 static bool isAvailable(TaskData *taskData, int ioDesc)
 {
-#ifdef __CYGWIN__
-      static struct timeval poll = {0,1};
-#else
-      static struct timeval poll = {0,0};
-#endif
-      fd_set read_fds;
-      int selRes;
-      FD_ZERO(&read_fds);
-      FD_SET(ioDesc, &read_fds);
+      // Use poll rather than select so that descriptors above FD_SETSIZE work.
+      struct pollfd fds;
+      fds.fd = ioDesc;
+      fds.events = POLLIN;
+      fds.revents = 0;
 
       /* If there is something there we can return. */
-      selRes = select(FD_SETSIZE, &read_fds, NULL, NULL, &poll);
-      if (selRes > 0) return true; /* Something waiting. */
-      else if (selRes < 0 && errno != EINTR) // Maybe another thread closed descr
-          raise_syscall(taskData, "select error", ERRORNUMBER);
+      int pollRes = poll(&fds, 1, 0);
+      if (pollRes > 0 && (fds.revents & POLLNVAL))
+          raise_syscall(taskData, "poll error", EBADF);
+      if (pollRes > 0) return true; /* Something waiting. */
+      else if (pollRes < 0 && errno != EINTR) // Maybe another thread closed descr
+          raise_syscall(taskData, "poll error", ERRORNUMBER);
       else return false;
 }
 
@@ -253,6 +261,8 @@ static Handle close_file(TaskData *taskData, Handle stream)
     // Don't close it if it's already closed or any of the standard streams 
     if (descr > 2)
     {
+        ForgetDescriptor(descr);
+        CancelAsyncIO(descr);
         close(descr);
         *(intptr_t*)(stream->WordP()) = 0; // Mark as closed
     }
@@ -300,6 +310,8 @@ static Handle readArray(TaskData *taskData, Handle stream, Handle args, bool/*is
         byte *base = DEREFHANDLE(args)->Get(0).AsObjPtr()->AsBytePtr();
         POLYUNSIGNED offset = getPolyUnsigned(taskData, DEREFWORDHANDLE(args)->Get(1));
         size_t length = getPolyUnsigned(taskData, DEREFWORDHANDLE(args)->Get(2));
+        // The kernel can't write to a protected card so mark it as dirty first.
+        gMem.MarkCardsDirty(base + offset, length);
         ssize_t haveRead = read(fd, base + offset, length);
         if (haveRead >= 0)
             return Make_fixed_precision(taskData, haveRead); // Success.
@@ -309,6 +321,34 @@ static Handle readArray(TaskData *taskData, Handle stream, Handle args, bool/*is
     }
 }
 
+// Return the number of bytes it is worth allocating for a read of up to
+// "length" bytes.  The result string is allocated before the read so avoid
+// allocating a large object when only a small amount can be returned.
+static size_t readSizeLimit(int fd, size_t length)
+{
+    const size_t minRead = 65536;
+    if (length <= minRead) return length;
+    size_t available = 0;
+    struct stat statBuff;
+    if (fstat(fd, &statBuff) == 0 && S_ISREG(statBuff.st_mode))
+    {
+        // Some files, e.g. in /proc, report a size of zero.
+        off_t pos = lseek(fd, 0, SEEK_CUR);
+        if (pos >= 0 && statBuff.st_size > pos)
+            available = (size_t)(statBuff.st_size - pos);
+    }
+#ifdef FIONREAD
+    else
+    {
+        int readable = 0;
+        if (ioctl(fd, FIONREAD, &readable) == 0 && readable > 0)
+            available = readable;
+    }
+#endif
+    if (available < minRead) return minRead;
+    return available < length ? available : length;
+}
+
 /* Return input as a string. We don't actually need both readArray and
    readString but it's useful to have both to reduce unnecessary garbage.
    The IO library will construct one from the other but the higher levels
@@ -327,20 +367,25 @@ static Handle readString(TaskData *taskData, Handle stream, Handle args, bool/*i
 
         // We can now try to read without blocking.
         int fd = getStreamFileDescriptor(taskData, stream->Word());
-        // We previously allocated the buffer on the stack but that caused
-        // problems with multi-threading at least on Mac OS X because of
-        // stack exhaustion.  We limit the space to 100k. */
-        if (length > 102400) length = 102400;
-        byte *buff = (byte*)malloc(length);
-        if (buff == 0) raise_syscall(taskData, "Unable to allocate buffer", NOMEMORY);
-        ssize_t haveRead = read(fd, buff, length);
+        size_t maxRead = readSizeLimit(fd, length);
+        // Allocate the result and read directly into it.  The allocation
+        // may GC but nothing can move the string after that.
+        POLYUNSIGNED allocated = WORDS(maxRead) + 1;
+        PolyStringObject *result = (PolyStringObject *)alloc(taskData, allocated, F_BYTE_OBJ);
+        gMem.MarkCardsDirty(result->chars, maxRead);
+        ssize_t haveRead = read(fd, result->chars, maxRead);
         if (haveRead >= 0)
         {
-            Handle result = SAVE(C_string_to_Poly(taskData, (char*)buff, haveRead));
-            free(buff);
-            return result;
+            result->length = (POLYUNSIGNED)haveRead;
+            // Shrink the string to the data read and turn the rest into a dummy object.
+            POLYUNSIGNED used = WORDS((size_t)haveRead) + 1;
+            if (used < allocated)
+            {
+                result->SetLengthWord(used, F_BYTE_OBJ);
+                gMem.FillUnusedSpace((PolyWord*)result + used, allocated - used);
+            }
+            return SAVE(result);
         }
-        free(buff);
         // If it failed because it was interrupted keep trying otherwise it's an error.
         if (errno != EINTR)
             raise_syscall(taskData, "Error while reading", ERRORNUMBER);
@@ -359,34 +404,135 @@ static Handle writeArray(TaskData *taskData, Handle stream, Handle args, bool/*i
     int fd = getStreamFileDescriptor(taskData, stream->Word());
     /* We don't actually handle cases of blocking on output. */
     byte *toWrite = base.AsObjPtr()->AsBytePtr();
+    gMem.LoadLazyData(toWrite+offset, length);
     ssize_t haveWritten = write(fd, toWrite+offset, length);
     if (haveWritten < 0) raise_syscall(taskData, "Error while writing", ERRORNUMBER);
 
     return Make_fixed_precision(taskData, haveWritten);
 }
 
+// Wait until output is possible on a descriptor.  ML memory is released
+// while waiting so other threads can GC.
+class WaitOutputFD: public Waiter
+{
+public:
+    WaitOutputFD(int fd): waitFD(fd) {}
+    virtual void Wait(unsigned maxMillisecs)
+    {
+        struct pollfd fds;
+        fds.fd = waitFD;
+        fds.events = POLLOUT;
+        fds.revents = 0;
+        (void)WaitForDescriptors(&fds, 1, maxMillisecs);
+    }
+private:
+    int waitFD;
+};
+
+// Maximum number of buffers passed in a single call.  If the list is longer
+// only the first ones are written and the caller writes the rest later.
+#define MAX_WRITE_VECTORS   64
+
+// Write a list of (base, offset, length) buffers with a single system call
+// and return the number of bytes written.  The iovecs point directly at the
+// ML objects so we must not release ML memory while the call is in progress.
+// Instead we wait until output is possible and then make a call that should
+// not block: sockets use MSG_DONTWAIT and writes to a pipe are limited to the
+// space available.  Regular files and devices are written directly.
+static Handle writeVectors(TaskData *taskData, Handle stream, Handle args)
+{
+    // We should check for interrupts even if we're not going to block.
+    processes->TestAnyEvents(taskData);
+
+    int fd = getStreamFileDescriptor(taskData, stream->Word());
+    struct stat statBuff;
+    if (fstat(fd, &statBuff) < 0) raise_syscall(taskData, "Stat failed", ERRORNUMBER);
+    bool isSocket = S_ISSOCK(statBuff.st_mode), isPipe = S_ISFIFO(statBuff.st_mode);
+
+    while (true)
+    {
+        // Wait until we can write.  This may GC so the addresses of the
+        // buffers must be found after it.
+        struct pollfd fds;
+        fds.fd = fd;
+        fds.events = POLLOUT;
+        fds.revents = 0;
+        if (poll(&fds, 1, 0) == 0)
+        {
+            WaitOutputFD waiter(fd);
+            processes->ThreadPauseForIO(taskData, &waiter);
+            continue;
+        }
+
+        size_t limit = SSIZE_MAX;
+        if (isPipe)
+        {
+            // A write to a pipe in blocking mode only returns when everything
+            // has been written.
+            limit = PIPE_BUF;
+#if defined(F_GETPIPE_SZ) && defined(FIONREAD)
+            int capacity = fcntl(fd, F_GETPIPE_SZ), used = 0;
+            if (capacity > 0 && ioctl(fd, FIONREAD, &used) == 0 && capacity - used > PIPE_BUF)
+                limit = capacity - used;
+#endif
+        }
+
+        struct iovec iov[MAX_WRITE_VECTORS];
+        int nVecs = 0;
+        size_t total = 0;
+        for (PolyWord p = DEREFWORD(args); !ML_Cons_Cell::IsNull(p) && nVecs < MAX_WRITE_VECTORS && total < limit;
+                p = ((ML_Cons_Cell*)p.AsObjPtr())->t)
+        {
+            PolyObject *buff = ((ML_Cons_Cell*)p.AsObjPtr())->h.AsObjPtr();
+            POLYUNSIGNED offset = getPolyUnsigned(taskData, buff->Get(1));
+            size_t length = getPolyUnsigned(taskData, buff->Get(2));
+            if (length > limit - total) length = limit - total;
+            if (length == 0) continue;
+            byte *toWrite = buff->Get(0).AsObjPtr()->AsBytePtr() + offset;
+            gMem.LoadLazyData(toWrite, length);
+            iov[nVecs].iov_base = toWrite;
+            iov[nVecs].iov_len = length;
+            nVecs++;
+            total += length;
+        }
+        if (nVecs == 0) return Make_fixed_precision(taskData, 0);
+
+        ssize_t haveWritten;
+        if (isSocket)
+        {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = nVecs;
+            haveWritten = sendmsg(fd, &msg, MSG_DONTWAIT);
+        }
+        else haveWritten = writev(fd, iov, nVecs);
+        if (haveWritten >= 0)
+            return Make_fixed_precision(taskData, haveWritten);
+        // Another thread may have filled the space or the descriptor may be
+        // in non-blocking mode.  Wait and try again.
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+            raise_syscall(taskData, "Error while writing", ERRORNUMBER);
+    }
+}
+
 // Test whether we can write without blocking.  Returns false if it will block,
 // true if it will not.
 static bool canOutput(TaskData *taskData, Handle stream)
 {
     int fd = getStreamFileDescriptor(taskData, stream->Word());
 
-    /* Unix - use "select" to find out if output is possible. */
-#ifdef __CYGWIN__
-    static struct timeval poll = {0,1};
-#else
-    static struct timeval poll = {0,0};
-#endif
-    fd_set read_fds, write_fds, except_fds;
-    int sel;
-    FD_ZERO(&read_fds);
-    FD_ZERO(&write_fds);
-    FD_ZERO(&except_fds);
-    FD_SET(fd, &write_fds);
-    sel = select(FD_SETSIZE,&read_fds,&write_fds,&except_fds,&poll);
-    if (sel < 0 && errno != EINTR)
-        raise_syscall(taskData, "select failed", ERRORNUMBER);
-    return sel > 0;
+    /* Unix - use "poll" to find out if output is possible. */
+    struct pollfd fds;
+    fds.fd = fd;
+    fds.events = POLLOUT;
+    fds.revents = 0;
+    int pollRes = poll(&fds, 1, 0);
+    if (pollRes < 0 && errno != EINTR)
+        raise_syscall(taskData, "poll failed", ERRORNUMBER);
+    if (pollRes > 0 && (fds.revents & POLLNVAL))
+        raise_syscall(taskData, "poll failed", EBADF);
+    return pollRes > 0;
 }
 
 static long seekStream(TaskData *taskData, int fd, long pos, int origin)
@@ -477,7 +623,7 @@ void WaitPoll::Wait(unsigned maxMillisecs)
 {
     // N.B. We use this for OS.Process.sleep with empty descriptor list.
     if (maxTime < maxMillisecs) maxMillisecs = maxTime;
-    pollResult = poll(fdVec, nDescr, maxMillisecs);
+    pollResult = WaitForDescriptors(fdVec, (unsigned)nDescr, maxMillisecs);
     if (pollResult < 0) errorResult = ERRORNUMBER;
 }
 
@@ -1102,6 +1248,31 @@ POLYUNSIGNED PolyBasicIOGeneral(POLYUNSIGNED threadId, POLYUNSIGNED code, POLYUN
     else return result->Word().AsUnsigned();
 }
 
+// Write a list of buffers with a single system call.
+POLYEXTERNALSYMBOL POLYUNSIGNED PolyBasicIOWriteVectors(POLYUNSIGNED threadId, POLYUNSIGNED strm, POLYUNSIGNED vecs)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle pushedStrm = taskData->saveVec.push(strm);
+    Handle pushedVecs = taskData->saveVec.push(vecs);
+    Handle result = 0;
+
+    try {
+        result = writeVectors(taskData, pushedStrm, pushedVecs);
+    }
+    catch (KillException &) {
+        processes->ThreadExit(taskData); // TestAnyEvents may test for kill
+    }
+    catch (...) { } // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    if (result == 0) return TAGGED(0).AsUnsigned();
+    else return result->Word().AsUnsigned();
+}
+
 // Create a persistent file descriptor value for Posix.FileSys.stdin etc.
 POLYEXTERNALSYMBOL POLYUNSIGNED PolyPosixCreatePersistentFD(POLYUNSIGNED threadId, POLYUNSIGNED fd)
 {
@@ -1130,6 +1301,7 @@ struct _entrypts basicIOEPT[] =
     { "PolyBasicIOGeneral",             (polyRTSFunction)&PolyBasicIOGeneral},
     { "PolyPollIODescriptors",          (polyRTSFunction)&PolyPollIODescriptors },
     { "PolyPosixCreatePersistentFD",    (polyRTSFunction)&PolyPosixCreatePersistentFD},
+    { "PolyBasicIOWriteVectors",        (polyRTSFunction)&PolyBasicIOWriteVectors},
 
     { NULL, NULL} // End of list.
 };
@@ -1,7 +1,7 @@
 /*
     Title:  Bitmap.  Generally used by the garbage collector to indicate allocated words
 
-    Copyright (c) 2006, 2012, 2017  David C.J. Matthews
+    Copyright (c) 2006, 2012, 2017, 2026  David C.J. Matthews
        Based on original code in garbage_collect.c.
 
     This library is free software; you can redistribute it and/or
@@ -24,6 +24,10 @@
    Bitmaps are used particularly in the garbage collector to indicate allocated
    words.  The efficiency of this code is crucial for the speed of the garbage
    collector.
+   The bits are held in machine words rather than bytes.  Runs of zeros or ones
+   are skipped a word at a time and the position of the first or last set bit in
+   a word is found with the bit-scan instructions.  The compilers generate these
+   from the intrinsics; there is a portable version for other compilers.
 */
 
 #ifdef HAVE_CONFIG_H
@@ -55,12 +59,85 @@
 
 #include "bitmap.h"
 #include "globals.h"
+#include "locking.h"
+#include "arb.h"
+#include "processes.h"
+#include "run_time.h"
+#include "rtsentry.h"
+
+extern "C" {
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyBitmapTest(POLYUNSIGNED threadId);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyBitmapBenchmark(POLYUNSIGNED threadId, POLYUNSIGNED op, POLYUNSIGNED bitwise, POLYUNSIGNED repeats);
+}
+
+#if (defined(_MSC_VER))
+#include <intrin.h>
+#endif
+
+#define ALL_ONES        (~(uintptr_t)0)
+
+// Mask with the bottom n bits set.  n must be less than BITS_PER_WORD.
+static inline uintptr_t LowBits(uintptr_t n) { return ((uintptr_t)1 << n) - 1; }
+
+// Position of the lowest set bit.  w must be non-zero.
+static inline unsigned FirstSetBit(uintptr_t w)
+{
+#if (defined(__GNUC__))
+    return (unsigned)__builtin_ctzll((unsigned long long)w);
+#elif (defined(_MSC_VER) && defined(_WIN64))
+    unsigned long r;
+    _BitScanForward64(&r, w);
+    return (unsigned)r;
+#elif (defined(_MSC_VER))
+    unsigned long r;
+    _BitScanForward(&r, w);
+    return (unsigned)r;
+#else
+    unsigned r = 0;
+    while ((w & 1) == 0) { w >>= 1; r++; }
+    return r;
+#endif
+}
+
+// Position of the highest set bit.  w must be non-zero.
+static inline unsigned LastSetBit(uintptr_t w)
+{
+#if (defined(__GNUC__))
+    return 63 - (unsigned)__builtin_clzll((unsigned long long)w);
+#elif (defined(_MSC_VER) && defined(_WIN64))
+    unsigned long r;
+    _BitScanReverse64(&r, w);
+    return (unsigned)r;
+#elif (defined(_MSC_VER))
+    unsigned long r;
+    _BitScanReverse(&r, w);
+    return (unsigned)r;
+#else
+    unsigned r = 0;
+    while ((w >>= 1) != 0) r++;
+    return r;
+#endif
+}
+
+// Number of set bits in the word.
+static inline uintptr_t PopCount(uintptr_t w)
+{
+#if (defined(__GNUC__))
+    return (uintptr_t)__builtin_popcountll((unsigned long long)w);
+#else
+    // The popcnt instruction is not available on all the processors that
+    // MSVC targets so use the bit-twiddling version.
+    uintptr_t count = 0;
+    while (w != 0) { w &= w - 1; count++; }
+    return count;
+#endif
+}
 
 bool Bitmap::Create(size_t bits)
 {
     free(m_bits); // Any previous data
-    size_t bytes = (bits+7) >> 3;
-    m_bits = (unsigned char*)calloc(bytes, sizeof(unsigned char));
+    size_t words = (bits + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    m_bits = (uintptr_t*)calloc(words, sizeof(uintptr_t));
     return m_bits != 0;
 }
 
@@ -75,145 +152,94 @@ Bitmap::~Bitmap()
     Destroy();
 }
 
-// Set a range of bits in a bitmap.  This checks that the bits are not already set.
+// Set a range of bits in a bitmap.
 void Bitmap::SetBits(uintptr_t bitno, uintptr_t length)
 {
-    uintptr_t byte_index = bitno >> 3;
-    
     ASSERT (0 < length); // Strictly positive
-    
-    /* Set the first part byte */
-    uintptr_t start_bit_index = bitno & 7;
-    uintptr_t stop_bit_index  = start_bit_index + length;
-    /* Do we need to change more than one byte? */
-    if (stop_bit_index < 8)
+    uintptr_t wordIndex = bitno / BITS_PER_WORD;
+    uintptr_t startBit = bitno % BITS_PER_WORD;
+
+    // Do we need to change more than one word?
+    if (startBit + length < BITS_PER_WORD)
     {
-        const unsigned mask1 = 0xff << start_bit_index;
-        const unsigned mask2 = 0xff << stop_bit_index;
-        const unsigned mask  = mask1 & ~mask2;
-        
-//        ASSERT((m_bits[byte_index] & mask) == 0);
-        m_bits[byte_index] |= mask;
+        m_bits[wordIndex] |= LowBits(length) << startBit;
         return;
     }
-    else /* Set all the bits we can in the first byte */
-    {
-        const unsigned mask  = 0xff << start_bit_index;
-        
-//        ASSERT((m_bits[byte_index] & mask) == 0);
-        m_bits[byte_index] |= mask;
-        
-        /* length = length - (8 - start_bit_index); */
-        length = stop_bit_index - 8;
-    }
-    
-    /* Set as many full bytes as possible */
-    if (8 <= length)
+    // Set all the bits we can in the first word
+    m_bits[wordIndex++] |= ALL_ONES << startBit;
+    length -= BITS_PER_WORD - startBit;
+
+    // Set as many full words as possible
+    while (length >= BITS_PER_WORD)
     {
-        memset(m_bits + byte_index + 1, 0xff, length >> 3);
-        byte_index += length >> 3;
-        length &= 7;
+        m_bits[wordIndex++] = ALL_ONES;
+        length -= BITS_PER_WORD;
     }
-    
-    /* Invariant: 0 <= length < 8 */
-    ASSERT(length < 8);
-    if (length == 0) return;
-    
-    /* Invariant: 0 < length < 8 */
-    
-    /* Set the final part byte */
-    byte_index ++;
-    const unsigned mask  = 0xff & ~(0xff << length);
-//    ASSERT((m_bits[byte_index] & mask) == 0);
-    m_bits[byte_index] |= mask;
+
+    // Set the final part word
+    if (length != 0)
+        m_bits[wordIndex] |= LowBits(length);
 }
 
-// This previously cleared whole bytes.  It now works the same as
-// SetBits to clear a range of bits and is a modified version of that code.
+// Clear a range of bits.  This is the same as SetBits except for the operation.
 void Bitmap::ClearBits(uintptr_t bitno, uintptr_t length)
 {
-    uintptr_t byte_index = bitno >> 3;
-    uintptr_t start_bit_index = bitno & 7;
-    uintptr_t stop_bit_index = start_bit_index + length;
-    /* Do we need to change more than one byte? */
-    if (stop_bit_index < 8)
+    if (length == 0) return;
+    uintptr_t wordIndex = bitno / BITS_PER_WORD;
+    uintptr_t startBit = bitno % BITS_PER_WORD;
+
+    if (startBit + length < BITS_PER_WORD)
     {
-        const unsigned mask1 = 0xff << start_bit_index;
-        const unsigned mask2 = 0xff << stop_bit_index;
-        const unsigned mask = mask1 & ~mask2;
-        m_bits[byte_index] &= 0xff ^ mask;
+        m_bits[wordIndex] &= ~(LowBits(length) << startBit);
         return;
     }
-    else /* Clear all the bits we can in the first byte */
-    {
-        const unsigned mask = 0xff << start_bit_index;
-        m_bits[byte_index] &= 0xff ^ mask;
-        length = stop_bit_index - 8;
-    }
+    m_bits[wordIndex++] &= ~(ALL_ONES << startBit);
+    length -= BITS_PER_WORD - startBit;
 
-    /* Clear as many full bytes as possible */
-    if (8 <= length)
+    if (length >= BITS_PER_WORD)
     {
-        memset(m_bits + byte_index + 1, 0, length >> 3);
-        byte_index += length >> 3;
-        length &= 7;
+        memset(m_bits + wordIndex, 0, (length / BITS_PER_WORD) * sizeof(uintptr_t));
+        wordIndex += length / BITS_PER_WORD;
+        length %= BITS_PER_WORD;
     }
 
-    /* Invariant: 0 <= length < 8 */
-    ASSERT(length < 8);
-    if (length == 0) return;
-
-    /* Invariant: 0 < length < 8 */
-
-    /* Clear the final part byte */
-    byte_index++;
-    const unsigned mask = 0xff & ~(0xff << length);
-    //    ASSERT((m_bits[byte_index] & mask) == 0);
-    m_bits[byte_index] &= 0xff ^ mask;
-
+    if (length != 0)
+        m_bits[wordIndex] &= ~LowBits(length);
 }
 
-// How many zero bits (maximum n) are there in the bitmap, starting at location start? */
+// How many zero bits (maximum n) are there in the bitmap, starting at location start?
 uintptr_t Bitmap::CountZeroBits(uintptr_t bitno, uintptr_t n) const
 {
-    uintptr_t byte_index = bitno >> 3;
-    unsigned bit_index  = bitno & 7;
-    unsigned mask  = 1 << bit_index;
-    uintptr_t zero_bits  = 0;
     ASSERT (0 < n); // Strictly positive
-    
-    /* Check the first part byte */
-    while (mask != 0)
-    {
-        /* zero_bits < n */
-        if ((m_bits[byte_index] & mask) != 0) return zero_bits;
-        zero_bits ++;
-        if (zero_bits == n) return zero_bits;
-        mask = (mask << 1) & 0xff;
-        /* zero_bits < n */
-    }
-    
-    /* zero_bits < n */
-    
-    /* Check as many bytes as possible */
-    byte_index ++;
-    while (zero_bits < n && m_bits[byte_index] == 0)
+    uintptr_t wordIndex = bitno / BITS_PER_WORD;
+    unsigned startBit = (unsigned)(bitno % BITS_PER_WORD);
+
+    // Check the first part word.  Shifting brings in zeros at the top
+    // but if the result is non-zero the first set bit is a real one.
+    uintptr_t w = m_bits[wordIndex] >> startBit;
+    if ((w & 1) != 0)
+        return 0; // Common case when scanning adjacent objects.
+    if (w != 0)
     {
-        zero_bits += 8;
-        byte_index ++;
+        uintptr_t zeroBits = FirstSetBit(w);
+        return zeroBits < n ? zeroBits : n;
     }
-    
-    /* Check the final part byte */
-    mask = 1;
-    while (zero_bits < n && (m_bits[byte_index] & mask) == 0)
+    uintptr_t zeroBits = BITS_PER_WORD - startBit;
+
+    // Skip zero words.  We only look at words that contain bits within the range.
+    while (zeroBits < n)
     {
-        zero_bits ++;
-        mask = (mask << 1) & 0xff;
+        w = m_bits[++wordIndex];
+        if (w != 0)
+        {
+            zeroBits += FirstSetBit(w);
+            break;
+        }
+        zeroBits += BITS_PER_WORD;
     }
-    
-    return zero_bits;
-}
 
+    return zeroBits < n ? zeroBits : n;
+}
 
 // Search the bitmap from the high end down looking for n contiguous zeros
 // Returns the value of "bitno" on failure. .
@@ -247,23 +273,18 @@ uintptr_t Bitmap::FindFree
 // Count the number of set bits in the bitmap.
 uintptr_t Bitmap::CountSetBits(uintptr_t size) const
 {
-    size_t bytes = (size+7) >> 3;
+    uintptr_t words = size / BITS_PER_WORD;
     uintptr_t count = 0;
-    for (size_t i = 0; i < bytes; i++)
+    for (uintptr_t i = 0; i < words; i++)
     {
-        unsigned char byte = m_bits[i];
-        if (byte == 0xff) // Common case
-            count += 8;
-        else
-        {
-            while (byte != 0)
-            {
-                unsigned char b = byte & (-byte);
-                count++;
-                byte -= b;
-            }
-        }
+        uintptr_t w = m_bits[i];
+        if (w == ALL_ONES) // Common case
+            count += BITS_PER_WORD;
+        else if (w != 0)
+            count += PopCount(w);
     }
+    if (size % BITS_PER_WORD != 0)
+        count += PopCount(m_bits[words] & LowBits(size % BITS_PER_WORD));
     return count;
 }
 
@@ -271,16 +292,318 @@ uintptr_t Bitmap::CountSetBits(uintptr_t size) const
 // Returns zero if no bit is set.
 uintptr_t Bitmap::FindLastSet(uintptr_t bitno) const
 {
-    size_t byteno = bitno >> 3;
+    uintptr_t wordIndex = bitno / BITS_PER_WORD;
+    unsigned lastBit = (unsigned)(bitno % BITS_PER_WORD);
+    // Ignore any bits above bitno.
+    uintptr_t w = m_bits[wordIndex];
+    if (lastBit != BITS_PER_WORD - 1)
+        w &= LowBits(lastBit + 1);
     // Code cells are quite long so most of the bitmap will be zero.
-    if (m_bits[byteno] == 0)
+    while (w == 0)
+    {
+        if (wordIndex == 0) return 0;
+        w = m_bits[--wordIndex];
+    }
+    return wordIndex * BITS_PER_WORD + LastSetBit(w);
+}
+
+// Find the first set bit at or after bitno.  Returns limit if there is none.
+uintptr_t Bitmap::FindNextSet(uintptr_t bitno, uintptr_t limit) const
+{
+    if (bitno >= limit) return limit;
+    uintptr_t wordIndex = bitno / BITS_PER_WORD;
+    uintptr_t lastWord = (limit - 1) / BITS_PER_WORD;
+    uintptr_t w = m_bits[wordIndex] & (ALL_ONES << (bitno % BITS_PER_WORD));
+    while (w == 0)
     {
-       do {
-            if (byteno == 0) return 0;
-            byteno--;
-        } while (m_bits[byteno] == 0);
-        bitno = (byteno << 3) + 7; // Set it to the last bit
+        if (wordIndex == lastWord) return limit;
+        w = m_bits[++wordIndex];
     }
-    while (bitno > 0 && ! TestBit(bitno)) bitno--;
+    uintptr_t result = wordIndex * BITS_PER_WORD + FirstSetBit(w);
+    return result < limit ? result : limit;
+}
+
+// Set a bit and return true if this thread set it.  Other threads may be setting
+// bits in the same word so this must be atomic.
+#if (defined(__GNUC__))
+bool Bitmap::TestAndSetBit(uintptr_t n)
+{
+    uintptr_t bit = BitN(n);
+    return (__atomic_fetch_or(&m_bits[WordN(n)], bit, __ATOMIC_RELAXED) & bit) == 0;
+}
+#elif (defined(_MSC_VER) && defined(_WIN64))
+#pragma intrinsic(_InterlockedOr64)
+
+bool Bitmap::TestAndSetBit(uintptr_t n)
+{
+    __int64 bit = (__int64)BitN(n);
+    return (_InterlockedOr64((volatile __int64*)&m_bits[WordN(n)], bit) & bit) == 0;
+}
+#elif (defined(_MSC_VER))
+#pragma intrinsic(_InterlockedOr)
+
+bool Bitmap::TestAndSetBit(uintptr_t n)
+{
+    long bit = (long)BitN(n);
+    return (_InterlockedOr((volatile long*)&m_bits[WordN(n)], bit) & bit) == 0;
+}
+#else
+static PLock bitmapAtomicLock("Bitmap atomic");
+
+bool Bitmap::TestAndSetBit(uintptr_t n)
+{
+    PLocker l(&bitmapAtomicLock);
+    if (TestBit(n))
+        return false;
+    SetBit(n);
+    return true;
+}
+#endif
+
+/*
+   The scans as they were before the bitmap was held in words.  They test one
+   bit at a time.  PolyBitmapTest checks that the word versions give the same
+   results and PolyBitmapBenchmark times each of them.
+*/
+
+static uintptr_t BitCountZeroBits(const Bitmap &bm, uintptr_t bitno, uintptr_t n)
+{
+    uintptr_t i = 0;
+    while (i < n && ! bm.TestBit(bitno + i)) i++;
+    return i;
+}
+
+static uintptr_t BitFindFree(const Bitmap &bm, uintptr_t limit, uintptr_t start, uintptr_t n)
+{
+    if (limit + n >= start)
+        return start;
+    uintptr_t candidate = start - n;
+    while (1)
+    {
+        uintptr_t bits_free = BitCountZeroBits(bm, candidate, n);
+        if (n <= bits_free)
+            return candidate;
+        if (candidate < n - bits_free + limit)
+            return start;
+        candidate -= (n - bits_free);
+    }
+}
+
+static uintptr_t BitCountSetBits(const Bitmap &bm, uintptr_t size)
+{
+    uintptr_t count = 0;
+    for (uintptr_t i = 0; i < size; i++)
+        if (bm.TestBit(i)) count++;
+    return count;
+}
+
+static uintptr_t BitFindLastSet(const Bitmap &bm, uintptr_t bitno)
+{
+    while (bitno > 0 && ! bm.TestBit(bitno)) bitno--;
     return bitno;
-}
\ No newline at end of file
+}
+
+static uintptr_t BitFindNextSet(const Bitmap &bm, uintptr_t bitno, uintptr_t limit)
+{
+    while (bitno < limit && ! bm.TestBit(bitno)) bitno++;
+    return bitno < limit ? bitno : limit;
+}
+
+// Small generator so that the patterns are the same on every platform.
+static uintptr_t NextRandom(uint32_t &seed)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) & 0x7fff;
+}
+
+// Fill the bitmap with runs of set bits separated by gaps.  This is the pattern
+// the GC sees: live objects between free space.
+static void FillBitmap(Bitmap &bm, uintptr_t size, uint32_t seed, uintptr_t maxRun, uintptr_t maxGap)
+{
+    bm.ClearBits(0, size);
+    uintptr_t i = NextRandom(seed) % (maxGap + 1);
+    while (i < size)
+    {
+        uintptr_t run = NextRandom(seed) % maxRun + 1;
+        if (run > size - i) run = size - i;
+        bm.SetBits(i, run);
+        i += run + NextRandom(seed) % (maxGap + 1);
+    }
+}
+
+// Compare the two versions on one bitmap.  Returns the number of differences.
+static uintptr_t CheckScans(const Bitmap &bm, uintptr_t size)
+{
+    static const uintptr_t lengths[] = { 1, 2, 31, 63, 64, 65, 127, 128, 129, 300 };
+    const unsigned nLengths = sizeof(lengths)/sizeof(lengths[0]);
+    uintptr_t errors = 0;
+    // CountSetBits with every size, including zero and partial last words.
+    for (uintptr_t s = 0; s <= size; s++)
+        if (bm.CountSetBits(s) != BitCountSetBits(bm, s)) errors++;
+    for (uintptr_t b = 0; b < size; b++)
+    {
+        if (bm.FindLastSet(b) != BitFindLastSet(bm, b)) errors++;
+        // An empty range returns the limit.
+        if (bm.FindNextSet(b, b) != b) errors++;
+        for (unsigned l = 0; l < nLengths; l++)
+        {
+            uintptr_t n = lengths[l];
+            if (n <= size - b)
+            {
+                if (bm.FindNextSet(b, b + n) != BitFindNextSet(bm, b, b + n)) errors++;
+                if (bm.CountZeroBits(b, n) != BitCountZeroBits(bm, b, n)) errors++;
+                // Search down from b+n to the bottom, to half way and with no room.
+                uintptr_t limits[] = { 0, b / 2, b };
+                for (unsigned i = 0; i < 3; i++)
+                    if (bm.FindFree(limits[i], b + n, n) != BitFindFree(bm, limits[i], b + n, n)) errors++;
+            }
+            // A range with no room in it always fails.
+            if (bm.FindFree(b, b, n) != b) errors++;
+        }
+    }
+    return errors;
+}
+
+// Check SetBits and ClearBits against setting and clearing each bit.
+static uintptr_t CheckSetAndClear(Bitmap &bm, Bitmap &ref, uintptr_t size)
+{
+    uintptr_t errors = 0;
+    for (uintptr_t start = 0; start < size; start += 13)
+    {
+        for (uintptr_t n = 0; n <= size - start; n += 11)
+        {
+            FillBitmap(bm, size, (uint32_t)(start * 7 + n), 8, 8);
+            FillBitmap(ref, size, (uint32_t)(start * 7 + n), 8, 8);
+            bool set = (n & 1) != 0;
+            if (set && n != 0) bm.SetBits(start, n);
+            else if (! set) bm.ClearBits(start, n);
+            for (uintptr_t i = start; i < start + n; i++)
+            {
+                if (set) ref.SetBit(i); else ref.ClearBit(i);
+            }
+            for (uintptr_t i = 0; i < size; i++)
+                if (bm.TestBit(i) != ref.TestBit(i)) { errors++; break; }
+        }
+    }
+    return errors;
+}
+
+static uintptr_t CheckBitmaps(TaskData *taskData)
+{
+    // Sizes either side of word boundaries.
+    static const uintptr_t sizes[] = { 1, 2, 31, 32, 33, 63, 64, 65, 127, 128, 129, 191, 1000 };
+    // Dense, sparse, long runs, long gaps and alternate bits.
+    static const uintptr_t patterns[][2] = { { 8, 2 }, { 2, 40 }, { 150, 20 }, { 20, 150 }, { 1, 1 } };
+    uintptr_t errors = 0;
+    for (unsigned s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++)
+    {
+        uintptr_t size = sizes[s];
+        Bitmap bm, ref;
+        if (! bm.Create(size) || ! ref.Create(size))
+            raise_fail(taskData, "Insufficient memory");
+        // All clear and all set.
+        errors += CheckScans(bm, size);
+        bm.SetBits(0, size);
+        errors += CheckScans(bm, size);
+        for (unsigned p = 0; p < sizeof(patterns)/sizeof(patterns[0]); p++)
+        {
+            FillBitmap(bm, size, (uint32_t)(s * 100 + p), patterns[p][0], patterns[p][1]);
+            errors += CheckScans(bm, size);
+        }
+        errors += CheckSetAndClear(bm, ref, size);
+    }
+    return errors;
+}
+
+// Run the check and return the number of differences.
+POLYUNSIGNED PolyBitmapTest(POLYUNSIGNED threadId)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle result = 0;
+
+    try {
+        result = Make_fixed_precision(taskData, CheckBitmaps(taskData));
+    }
+    catch (...) { } // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    if (result == 0) return TAGGED(0).AsUnsigned();
+    else return result->Word().AsUnsigned();
+}
+
+#define BENCHMARK_BITS  (1024*1024)
+
+// Operations for PolyBitmapBenchmark.  These must match the ML code.
+#define BENCH_FINDFREE      0
+#define BENCH_COUNTSET      1
+#define BENCH_FINDLASTSET   2
+
+// Repeat one of the scans on a bitmap of a million bits with a GC-like pattern.
+// Uses the bit-at-a-time version if bitwise is true.  Returns the sum of the
+// results so that the two versions can be compared and the work can't be
+// optimised away.
+static uintptr_t RunBenchmark(TaskData *taskData, unsigned op, bool bitwise, uintptr_t repeats)
+{
+    Bitmap bm;
+    if (! bm.Create(BENCHMARK_BITS))
+        raise_fail(taskData, "Insufficient memory");
+    // Objects of up to 32 words with gaps of up to 48 words.
+    FillBitmap(bm, BENCHMARK_BITS, 1, 32, 48);
+    uintptr_t sum = 0;
+    for (uintptr_t r = 0; r < repeats; r++)
+    {
+        switch (op)
+        {
+        case BENCH_FINDFREE:
+            // Look for space for objects of several sizes, as the GC does when
+            // it compacts.  The largest usually has to search the whole map.
+            for (uintptr_t n = 16; n <= 64; n += 16)
+                sum += bitwise ? BitFindFree(bm, 0, BENCHMARK_BITS, n) : bm.FindFree(0, BENCHMARK_BITS, n);
+            break;
+        case BENCH_COUNTSET:
+            sum += bitwise ? BitCountSetBits(bm, BENCHMARK_BITS) : bm.CountSetBits(BENCHMARK_BITS);
+            break;
+        case BENCH_FINDLASTSET:
+            for (uintptr_t b = r % 1009; b < BENCHMARK_BITS; b += 1009)
+                sum += bitwise ? BitFindLastSet(bm, b) : bm.FindLastSet(b);
+            break;
+        default:
+            raise_fail(taskData, "Unknown bitmap benchmark");
+        }
+    }
+    return sum;
+}
+
+POLYUNSIGNED PolyBitmapBenchmark(POLYUNSIGNED threadId, POLYUNSIGNED op, POLYUNSIGNED bitwise, POLYUNSIGNED repeats)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle result = 0;
+
+    try {
+        uintptr_t sum = RunBenchmark(taskData, (unsigned)PolyWord::FromUnsigned(op).UnTaggedUnsigned(),
+            PolyWord::FromUnsigned(bitwise).UnTaggedUnsigned() != 0,
+            getPolyUnsigned(taskData, PolyWord::FromUnsigned(repeats)));
+        result = Make_arbitrary_precision(taskData, sum);
+    }
+    catch (...) { } // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    if (result == 0) return TAGGED(0).AsUnsigned();
+    else return result->Word().AsUnsigned();
+}
+
+struct _entrypts bitmapEPT[] =
+{
+    { "PolyBitmapTest",                 (polyRTSFunction)&PolyBitmapTest},
+    { "PolyBitmapBenchmark",            (polyRTSFunction)&PolyBitmapBenchmark},
+
+    { NULL, NULL} // End of list.
+};
@@ -1,7 +1,7 @@
 /*
     Title:  Bitmap.  Generally used by the garbage collector to indicate allocated words
 
-    Copyright (c) 2006, 2012, 2017  David C.J. Matthews
+    Copyright (c) 2006, 2012, 2017, 2026  David C.J. Matthews
 
     This library is free software; you can redistribute it and/or
     modify it under the terms of the GNU Lesser General Public
@@ -37,20 +37,24 @@ public:
     void Destroy();
 
 private:
-    static unsigned char BitN(uintptr_t n) { return 1 << (n & 7); }
+    // The bits are held in machine words so that scans can test a whole word
+    // at a time and use the bit-scan instructions to find the first or last set bit.
+    enum { BITS_PER_WORD = sizeof(uintptr_t) * 8 };
+    static uintptr_t WordN(uintptr_t n) { return n / BITS_PER_WORD; }
+    static uintptr_t BitN(uintptr_t n) { return (uintptr_t)1 << (n & (BITS_PER_WORD-1)); }
 public:
     // Test to see if it has been created
     bool Created() const { return m_bits != 0; }
     // Set a single bit
-    void SetBit(uintptr_t n) { m_bits[n >> 3] |=  BitN(n); }
+    void SetBit(uintptr_t n) { m_bits[WordN(n)] |=  BitN(n); }
     // Clear a single bit
-    void ClearBit(uintptr_t n) { m_bits[n >> 3] &= (0xff ^ BitN(n)); }
+    void ClearBit(uintptr_t n) { m_bits[WordN(n)] &= ~BitN(n); }
     // Set a range of bits
     void SetBits(uintptr_t bitno, uintptr_t length);
     // Clear a range of bits.
     void ClearBits(uintptr_t bitno, uintptr_t length);
     // Test a bit
-    bool TestBit(uintptr_t n) const { return (m_bits[n >> 3] & BitN(n)) != 0; }
+    bool TestBit(uintptr_t n) const { return (m_bits[WordN(n)] & BitN(n)) != 0; }
     // How many zero bits (maximum n) are there in the bitmap, starting at location start?
     uintptr_t CountZeroBits(uintptr_t bitno, uintptr_t n) const;
     //* search the bitmap from the high end down looking for n contiguous zeros
@@ -59,9 +63,13 @@ public:
     uintptr_t CountSetBits(uintptr_t size) const;
     // Find the last set bit before here.
     uintptr_t FindLastSet(uintptr_t bitno) const;
+    // Find the first set bit at or after bitno.  Returns limit if there is none.
+    uintptr_t FindNextSet(uintptr_t bitno, uintptr_t limit) const;
+    // Atomically set a bit.  Returns true if it was previously clear.
+    bool TestAndSetBit(uintptr_t n);
 private:
 
-    unsigned char *m_bits;
+    uintptr_t *m_bits;
 };
 
 // A wrapper class that adds the address range.  It is used when scanning
@@ -81,6 +89,9 @@ protected:
     PolyWord  *m_top;
 };
 
+// Entries to check and time the bitmap scans.
+extern struct _entrypts bitmapEPT[];
+
 #endif
 
 
@@ -178,6 +178,8 @@ PolyObject* ByteCodeInterpreter::allocateMemory(TaskData * taskData, POLYUNSIGNE
         if (words & 1) words++;
 #endif
         taskData->allocPointer -= words;
+        if (profileMode == kProfileAllocationStacks)
+            addAllocationSample(taskData, pc, sp, words, (PolyObject*)(taskData->allocPointer + 1));
         return (PolyObject*)(taskData->allocPointer + 1);
     }
     // Insufficient space.
@@ -189,6 +191,8 @@ PolyObject* ByteCodeInterpreter::allocateMemory(TaskData * taskData, POLYUNSIGNE
     PolyWord* space = processes->FindAllocationSpace(taskData, words, true);
     LoadInterpreterState(pc, sp);
     if (space == 0) return 0;
+    if (profileMode == kProfileAllocationStacks)
+        addAllocationSample(taskData, pc, sp, words, (PolyObject*)(space + 1));
     return (PolyObject*)(space + 1);
 }
 
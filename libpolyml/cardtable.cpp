@@ -0,0 +1,163 @@
+/*
+    Title:  cardtable.cpp - Card table for the minor GC
+
+    Copyright (c) 2026 David C.J. Matthews
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License version 2.1 as published by the Free Software Foundation.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#elif defined(_WIN32)
+#include "winconfig.h"
+#else
+#error "No configuration file"
+#endif
+
+#ifdef HAVE_ASSERT_H
+#include <assert.h>
+#define ASSERT(h) assert(h)
+#else
+#define ASSERT(h)
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "globals.h"
+#include "cardtable.h"
+#include "diagnostics.h"
+
+// Default to 4k bytes.  This is reset to the page size.
+unsigned CardTable::cardShift = SIZEOF_POLYWORD == 8 ? 9 : 10;
+
+void CardTable::SetCardSize(uintptr_t bytes)
+{
+    uintptr_t words = bytes / sizeof(PolyWord);
+    unsigned shift = 0;
+    while (((uintptr_t)1 << shift) < words) shift++;
+    cardShift = shift;
+}
+
+bool CardTable::Create(PolyWord *bottom, PolyWord *top)
+{
+    Destroy();
+    uintptr_t cardMask = CardBytes() - 1;
+    cardBase = (PolyWord*)(((uintptr_t)bottom + cardMask) & ~cardMask);
+    PolyWord *cardTop = (PolyWord*)((uintptr_t)top & ~cardMask);
+    nCards = cardTop > cardBase ? (uintptr_t)(cardTop - cardBase) >> cardShift : 0;
+    mappedLowerTop = bottom;
+    mappedUpperBase = 0;
+    writeProtected = false;
+    if (nCards == 0)
+        return false;
+    cards = (unsigned char*)malloc(nCards);
+    // The extra entry in the object map is for the partial card at the end.
+    objectStarts = (PolyWord**)calloc(nCards+1, sizeof(PolyWord*));
+    if (cards == 0 || objectStarts == 0)
+    {
+        Destroy();
+        return false;
+    }
+    SetAllDirty();
+    return true;
+}
+
+void CardTable::Destroy()
+{
+    free(cards);
+    free(objectStarts);
+    cards = 0;
+    objectStarts = 0;
+    nCards = 0;
+    writeProtected = false;
+}
+
+CardTable::~CardTable()
+{
+    Destroy();
+}
+
+void CardTable::SetAllDirty()
+{
+    memset(cards, 1, nCards);
+}
+
+void CardTable::ClearAll()
+{
+    memset(cards, 0, nCards);
+}
+
+void CardTable::MarkRange(const PolyWord *start, const PolyWord *end)
+{
+    if (start < cardBase) start = cardBase;
+    if (end > CardsEnd()) end = CardsEnd();
+    if (start >= end)
+        return;
+    uintptr_t last = CardNo(end-1);
+    for (uintptr_t n = CardNo(start); n <= last; n++)
+        SetDirty(n);
+}
+
+uintptr_t CardTable::CountDirty() const
+{
+    uintptr_t count = 0;
+    for (uintptr_t n = 0; n < nCards; n++)
+    {
+        if (cards[n] != 0)
+            count++;
+    }
+    return count;
+}
+
+// Walk the objects between start and end and record, for each card whose first
+// word is within an object, the address of the length word of that object.
+// The entry for nCards is the object that covers CardsEnd().
+// Padding, zero words and forwarded objects are treated in the same way as
+// ScanAddress::ScanAddressesInRegion.
+void CardTable::MapObjects(PolyWord *start, PolyWord *end)
+{
+    PolyWord *pt = start;
+    while (pt < end)
+    {
+        PolyWord *objStart = pt;
+#ifdef POLYML32IN64
+        if ((((uintptr_t)pt) & 4) == 0)
+            pt++; // Padding: the length word is on an odd-word boundary.
+        else
+#endif
+        {
+            PolyObject *obj = (PolyObject*)(pt+1);
+            if (obj->ContainsForwardingPtr())
+                obj = obj->FollowForwardingChain();
+            ASSERT(obj->ContainsNormalLengthWord());
+            pt += obj->Length() + 1;
+        }
+        if (pt > end)
+            Crash("Malformed object at %p - length %lu\n", objStart+1, (unsigned long)(pt-objStart-1));
+        // Set the entries for the cards that start in [objStart, pt).
+        if (pt <= cardBase || objStart > CardsEnd())
+            continue;
+        uintptr_t first = objStart <= cardBase ? 0 : CardNo(objStart - 1) + 1;
+        uintptr_t last = pt > CardsEnd() ? nCards + 1 : CardNo(pt - 1) + 1;
+        for (uintptr_t n = first; n < last; n++)
+            objectStarts[n] = objStart;
+    }
+}
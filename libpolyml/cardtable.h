@@ -0,0 +1,99 @@
+/*
+    Title:  cardtable.h - Card table for the minor GC
+
+    Copyright (c) 2026 David C.J. Matthews
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License version 2.1 as published by the Free Software Foundation.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#ifndef CARDTABLE_H_DEFINED
+#define CARDTABLE_H_DEFINED
+
+#include "globals.h"
+
+// Card marking is only possible if we can trap writes to a protected page
+// and run the handler on the signal stack.
+#if (!defined(_WIN32) && !defined(MACOSX) && defined(HAVE_SIGALTSTACK))
+#define CARD_MARKING_SUPPORTED 1
+#endif
+
+/*
+    A card table records which parts of a mutable area have been written
+    since the last GC.  After a GC there are no addresses in the mutable
+    areas that point into the allocation areas so the minor GC only needs
+    to scan cards that have been written to since then.  The card size is
+    the page size because the compiled ML code does not have a write barrier.
+    Instead the clean cards are write-protected and the first write to a card
+    is trapped and marks it as dirty.
+    The object map records, for each card, the start of the object that covers
+    the first word of the card.  This allows the scan to begin part way through
+    an area.
+*/
+class CardTable
+{
+public:
+    CardTable(): cardBase(0), nCards(0), cards(0), objectStarts(0),
+        mappedLowerTop(0), mappedUpperBase(0), writeProtected(false) {}
+    ~CardTable();
+
+    // Allocate the card table for an area.  Only whole cards within the area
+    // have entries.  Cards are initially dirty.
+    bool Create(PolyWord *bottom, PolyWord *top);
+    void Destroy();
+    bool Created() const { return cards != 0; }
+
+    // Set the card size.  Must be a power of two number of words.
+    static void SetCardSize(uintptr_t bytes);
+    static uintptr_t CardWords() { return (uintptr_t)1 << cardShift; }
+    static uintptr_t CardBytes() { return CardWords() * sizeof(PolyWord); }
+
+    uintptr_t CardNo(const PolyWord *p) const { return (uintptr_t)(p - cardBase) >> cardShift; }
+    PolyWord *CardAddr(uintptr_t n) const { return cardBase + (n << cardShift); }
+    PolyWord *CardsEnd() const { return CardAddr(nCards); }
+    bool InCards(const void *p) const { return p >= (void*)cardBase && p < (void*)CardsEnd(); }
+
+    bool IsDirty(uintptr_t n) const { return cards[n] != 0; }
+    void SetDirty(uintptr_t n) { cards[n] = 1; }
+    void SetAllDirty();
+    void ClearAll();
+    // Mark any cards that overlap the range as dirty.
+    void MarkRange(const PolyWord *start, const PolyWord *end);
+    uintptr_t CountDirty() const;
+
+    // Record the object starts for the objects in the range.  "start" must
+    // point at a length word.
+    void MapObjects(PolyWord *start, PolyWord *end);
+    // Discard the object map.  Called when objects may have been moved.
+    void ResetMap(PolyWord *bottom) { mappedLowerTop = bottom; mappedUpperBase = 0; }
+    // Return the length word of the object that covers the first word of the card.
+    PolyWord *ObjectStart(uintptr_t n) const { return objectStarts[n]; }
+
+    PolyWord *cardBase;       // Start of the first whole card
+    uintptr_t nCards;         // Number of whole cards.
+
+private:
+    unsigned char *cards;     // One byte per card.  Non-zero if dirty.
+    PolyWord **objectStarts;  // Object map.
+    static unsigned cardShift;
+
+public:
+    // Local spaces are mapped incrementally.  The lower part of the space is
+    // extended by the minor GC so we only need to map the new objects.
+    PolyWord *mappedLowerTop;  // The lower region has been mapped up to here.
+    PolyWord *mappedUpperBase; // The upper region has been mapped from here.  Zero if not mapped.
+    bool writeProtected;       // Set while the clean cards are protected.
+};
+
+#endif
@@ -38,6 +38,9 @@
 #include <string.h>
 #endif
 
+#include <algorithm>
+#include <new>
+
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
@@ -72,6 +75,7 @@
 #include "processes.h" // For IO_SPACING
 #include "sys.h" // For EXC_Fail
 #include "rtsentry.h"
+#include "profiling.h"
 
 #include "pexport.h"
 
@@ -94,8 +98,12 @@
 extern "C" {
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyExport(POLYUNSIGNED threadId, POLYUNSIGNED fileName, POLYUNSIGNED root);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyExportPortable(POLYUNSIGNED threadId, POLYUNSIGNED fileName, POLYUNSIGNED root);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyExportPortableBinary(POLYUNSIGNED threadId, POLYUNSIGNED fileName, POLYUNSIGNED root);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolySetObjectOrder(POLYUNSIGNED threadId, POLYUNSIGNED arg);
 }
 
+ExportObjectOrder exportObjectOrder = kOrderDepthFirst;
+
 /*
 To export the function and everything reachable from it we need to copy
 all the objects into a new area.  We leave tombstones in the original
@@ -130,7 +138,8 @@ public:
     POLYUNSIGNED mutSize, noOverSize;
 };
 
-CopyScan::CopyScan(unsigned h/*=0*/): hierarchy(h)
+CopyScan::CopyScan(unsigned h/*=0*/, bool separateConsts/*=true*/):
+    scanningQueue(false), order(exportObjectOrder), hierarchy(h), separateConstants(separateConsts)
 {
     defaultImmSize = defaultMutSize = defaultCodeSize = defaultNoOverSize = 0;
     tombs = 0;
@@ -190,6 +199,15 @@ void CopyScan::initialise(bool isExport/*=true*/)
                 graveYard[tombs].endAddr = space->top;
                 tombs++;
             }
+            // Copying the objects will load the rest of a lazy space so we have
+            // to record which units were in use before we start.
+            if (order == kOrderProfile && ! space->lazyState.empty())
+            {
+                LazyUnits units;
+                units.space = space;
+                units.loaded = space->lazyState;
+                lazyUnits.push_back(units);
+            }
         }
     }
     for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
@@ -355,6 +373,7 @@ POLYUNSIGNED CopyScan::ScanAddress(PolyObject **pt)
     else if (obj->IsCodeObject()) naType = NACode;
     else if (obj->IsByteObject()) naType = NAByte;
     else naType = NAWord;
+    bool isHot = order == kOrderProfile && IsHotObject(obj, space);
     PolyObject* newObj;
 #if((defined(HOSTARCHITECTURE_X86_64) || defined(HOSTARCHITECTURE_AARCH64)) && ! defined(POLYML32IN64) && !defined(CODEISNOTEXECUTABLE) && !defined(_WIN32))
     // SELinux, OpenBSD and Mac OS, at least on the ARM, require or prefer executavle code segments without
@@ -363,32 +382,51 @@ POLYUNSIGNED CopyScan::ScanAddress(PolyObject **pt)
     // out and put it into the read-only, non-executable area.
     // Interpreted code and code for 32-in-64 aren't executable (32-in-64 code is copied during start-up).
     // We also don't need this on Windows, thankfully.
+    PolyWord* constPtr = 0;
+    POLYUNSIGNED numConsts = 0;
+    bool constsWereIncluded = true;
     if (obj->IsCodeObject() && hierarchy == 0)
     {
-        PolyWord* constPtr;
-        POLYUNSIGNED numConsts;
         machineDependent->GetConstSegmentForCode(obj, constPtr, numConsts);
         // Newly generated code will have the constants included with the code
         // but if this is in the executable the constants will have been extracted before.
-        bool constsWereIncluded = constPtr > (PolyWord*)obj && constPtr < ((PolyWord*)obj) + words;
+        constsWereIncluded = constPtr > (PolyWord*)obj && constPtr < ((PolyWord*)obj) + words;
+    }
+    if (obj->IsCodeObject() && hierarchy == 0 && separateConstants)
+    {
         POLYUNSIGNED codeAreaSize = words;
         if (constsWereIncluded)
             codeAreaSize -= numConsts + 1;
-        newObj = newAddressForObject(codeAreaSize, NACode);
+        newObj = newAddressForObject(codeAreaSize, NACode, isHot);
         PolyObject* writableObj = gMem.SpaceForObjectAddress(newObj)->writeAble(newObj);
         writableObj->SetLengthWord(codeAreaSize, F_CODE_OBJ); // set length word
         lengthWord = newObj->LengthWord(); // Get the actual length word used
         memcpy(writableObj, obj, codeAreaSize * sizeof(PolyWord));
-        PolyObject* newConsts = newAddressForObject(numConsts, NACodeConst);
+        PolyObject* newConsts = newAddressForObject(numConsts, NACodeConst, isHot);
         PolyObject* writableConsts = gMem.SpaceForObjectAddress(newConsts)->writeAble(newConsts);
         writableConsts->SetLengthWord(numConsts);
         memcpy(writableConsts, constPtr, numConsts * sizeof(PolyWord));
         machineDependent->SetAddressOfConstants(newObj, writableObj, codeAreaSize, (PolyWord*)newConsts);
     }
+    else if (obj->IsCodeObject() && hierarchy == 0 && ! constsWereIncluded)
+    {
+        // The portable format needs the constants within the code so we have to
+        // put back the constants that were extracted from code in the executable.
+        // The constant count goes before the constants and the last word is the offset.
+        POLYUNSIGNED newWords = words + numConsts + 1;
+        newObj = newAddressForObject(newWords, NACode, isHot);
+        PolyObject* writableObj = gMem.SpaceForObjectAddress(newObj)->writeAble(newObj);
+        writableObj->SetLengthWord(newWords, F_CODE_OBJ);
+        lengthWord = newObj->LengthWord();
+        memcpy(writableObj, obj, (words - 1) * sizeof(PolyWord));
+        writableObj->Set(words - 1, PolyWord::FromUnsigned(numConsts));
+        memcpy(writableObj->Offset(words), constPtr, numConsts * sizeof(PolyWord));
+        machineDependent->SetAddressOfConstants(newObj, writableObj, newWords, newObj->Offset(words));
+    }
     else
 #endif
     {
-        newObj = newAddressForObject(words, naType);
+        newObj = newAddressForObject(words, naType, isHot);
         PolyObject* writAble = gMem.SpaceForObjectAddress(newObj)->writeAble(newObj);
         writAble->SetLengthWord(lengthWord); // copy length word
 
@@ -462,16 +500,88 @@ POLYUNSIGNED CopyScan::ScanAddress(PolyObject **pt)
         machineDependent->ScanConstantsWithinCode(newObj, obj, newObj->Length(), newConstAddr, oldConstAddr, count, this);
     }
     *pt = newObj; // Update it to the newly copied object.
-    return lengthWord;  // This new object needs to be scanned.
+    if (order == kOrderDepthFirst)
+        return lengthWord;  // This new object needs to be scanned.
+    // Otherwise add it to the queue to be scanned later.  Byte objects
+    // contain no addresses.
+    if (! OBJ_IS_BYTE_OBJECT(lengthWord))
+    {
+        try {
+            if (isHot)
+                hotQueue.push_back(QueuedObject(newObj, lengthWord));
+            else coldQueue.push_back(QueuedObject(newObj, lengthWord));
+        }
+        catch (std::bad_alloc &) {
+            throw MemoryException();
+        }
+    }
+    return 0;
+}
+
+// In profile order an object is hot if it is code that has been run while
+// profiling or if it is in part of a lazily loaded space that has been used.
+bool CopyScan::IsHotObject(PolyObject *obj, MemSpace *space)
+{
+    if (obj->IsCodeObject() && getProfileCountForCode(obj) != 0)
+        return true;
+    for (std::vector<LazyUnits>::iterator i = lazyUnits.begin(); i < lazyUnits.end(); i++)
+    {
+        if (i->space == space)
+        {
+            uintptr_t unitNo = ((char*)obj - (char*)space->bottom) / i->space->lazyUnitBytes;
+            return i->loaded[unitNo] != LAZY_UNLOADED;
+        }
+    }
+    return false;
+}
+
+class IsHotSpace {
+public:
+    IsHotSpace(const std::vector<PermanentMemSpace*> &h): hotSpaces(h) {}
+    bool operator()(PermanentMemSpace *space) const
+        { return std::find(hotSpaces.begin(), hotSpaces.end(), space) != hotSpaces.end(); }
+    const std::vector<PermanentMemSpace*> &hotSpaces;
+};
+
+void CopyScan::ScanQueuedObjects()
+{
+    // This may be called recursively via ScanObjectAddress when the constants
+    // in code are scanned.  The outer call will deal with the queue.
+    if (scanningQueue)
+        return;
+    scanningQueue = true;
+    while (! hotQueue.empty() || ! coldQueue.empty())
+    {
+        std::deque<QueuedObject> &queue = hotQueue.empty() ? coldQueue : hotQueue;
+        QueuedObject next = queue.front();
+        queue.pop_front();
+        ScanAddressesInObject(next.obj, next.lengthWord);
+    }
+    scanningQueue = false;
+    // Put the hot spaces first so that they are together at the start of the file.
+    if (! hotSpaces.empty())
+    {
+        std::stable_partition(gMem.eSpaces.begin(), gMem.eSpaces.end(), IsHotSpace(hotSpaces));
+        if (debugOptions & DEBUG_SAVING)
+        {
+            IsHotSpace isHot(hotSpaces);
+            for (std::vector<PermanentMemSpace*>::iterator i = gMem.eSpaces.begin(); i < gMem.eSpaces.end(); i++)
+                Log("SAVE: Export space %u: %s, %s\n", (*i)->index,
+                    (*i)->isCode ? "code" : (*i)->isMutable ? "mutable" : "immutable", isHot(*i) ? "hot" : "cold");
+        }
+    }
 }
 
-PolyObject* CopyScan::newAddressForObject(POLYUNSIGNED words, enum _newAddrType naType)
+PolyObject* CopyScan::newAddressForObject(POLYUNSIGNED words, enum _newAddrType naType, bool isHot)
 {
     PolyObject* newObj = 0;
-    // Allocate a new address for the object.
+    // Allocate a new address for the object.  Hot and cold objects are kept in
+    // separate spaces.
     for (std::vector<PermanentMemSpace*>::iterator i = gMem.eSpaces.begin(); i < gMem.eSpaces.end(); i++)
     {
         PermanentMemSpace* space = *i;
+        if (order == kOrderProfile && isHot != (std::find(hotSpaces.begin(), hotSpaces.end(), space) != hotSpaces.end()))
+            continue;
         bool match = false;
         switch (naType)
         {
@@ -528,6 +638,15 @@ PolyObject* CopyScan::newAddressForObject(POLYUNSIGNED words, enum _newAddrType
             // Unable to allocate this.
             throw MemoryException();
         }
+        if (isHot)
+        {
+            try {
+                hotSpaces.push_back(space);
+            }
+            catch (std::bad_alloc &) {
+                throw MemoryException();
+            }
+        }
         newObj = (PolyObject*)(space->topPointer + 1);
         space->topPointer += words + 1;
 #ifdef POLYML32IN64
@@ -560,6 +679,7 @@ PolyObject *CopyScan::ScanObjectAddress(PolyObject *base)
     POLYUNSIGNED lengthWord = CopyScan::ScanAddressAt(&val);
     if (lengthWord)
         ScanAddressesInObject(val.AsObjPtr(), lengthWord);
+    ScanQueuedObjects();
     return val.AsObjPtr();
 }
 
@@ -679,7 +799,7 @@ void Exporter::RunExport(PolyObject *rootFunction)
     Exporter *exports = this;
 
     PolyObject *copiedRoot = 0;
-    CopyScan copyScan(hierarchy);
+    CopyScan copyScan(hierarchy, separateConstants());
 
     try {
         copyScan.initialise();
@@ -873,6 +993,25 @@ POLYUNSIGNED PolyExportPortable(POLYUNSIGNED threadId, POLYUNSIGNED fileName, PO
     return TAGGED(0).AsUnsigned(); // Returns unit
 }
 
+POLYUNSIGNED PolyExportPortableBinary(POLYUNSIGNED threadId, POLYUNSIGNED fileName, POLYUNSIGNED root)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle pushedName = taskData->saveVec.push(fileName);
+    Handle pushedRoot = taskData->saveVec.push(root);
+
+    try {
+        PExport exports(true);
+        exporter(taskData, pushedName, pushedRoot, _T(".pxb"), &exports);
+    } catch (...) { } // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    return TAGGED(0).AsUnsigned(); // Returns unit
+}
+
 
 // Helper functions for exporting.  We need to produce relocation information
 // and this code is common to every method.
@@ -947,6 +1086,22 @@ void Exporter::relocateObject(PolyObject *p)
     }
 }
 
+// Set the order in which objects are placed when exporting or saving.
+POLYUNSIGNED PolySetObjectOrder(POLYUNSIGNED threadId, POLYUNSIGNED arg)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    switch (PolyWord::FromUnsigned(arg).UnTagged())
+    {
+    case 1: exportObjectOrder = kOrderBreadthFirst; break;
+    case 2: exportObjectOrder = kOrderProfile; break;
+    default: exportObjectOrder = kOrderDepthFirst; break;
+    }
+    taskData->PostRTSCall();
+    return TAGGED(0).AsUnsigned();
+}
+
 ExportStringTable::ExportStringTable(): strings(0), stringSize(0), stringAvailable(0)
 {
 }
@@ -984,6 +1139,8 @@ struct _entrypts exporterEPT[] =
 {
     { "PolyExport",                     (polyRTSFunction)&PolyExport},
     { "PolyExportPortable",             (polyRTSFunction)&PolyExportPortable},
+    { "PolyExportPortableBinary",       (polyRTSFunction)&PolyExportPortableBinary},
+    { "PolySetObjectOrder",             (polyRTSFunction)&PolySetObjectOrder},
 
     { NULL, NULL} // End of list.
 };
@@ -54,6 +54,8 @@ protected:
     void createRelocation(PolyWord *pt);
     unsigned findArea(void *p); // Find index of area that address is in.
     virtual void addExternalReference(void *p, const char *entryPoint, bool isFuncPtr) {}
+    // Native code exports put the constants for code in a separate area.
+    virtual bool separateConstants() { return true; }
 
 public:
     FILE     *exportFile;
@@ -81,6 +83,11 @@ public:
 };
 
 #include "scanaddrs.h"
+#include <deque>
+#include <vector>
+
+class PermanentMemSpace;
+class MemSpace;
 
 // Because permanent immutable areas are read-only we need to
 // have somewhere else to hold the tomb-stones.
@@ -92,12 +99,28 @@ public:
     PolyWord *startAddr, *endAddr;
 };
 
+// The order in which objects are placed when they are copied.  Depth-first
+// follows the first pointer in each object before the others.  Breadth-first
+// places the objects reachable from an object next to each other.  Profile order
+// places code that has been run and data that has been loaded from a lazily
+// loaded saved state in separate segments ahead of everything else.
+typedef enum {
+    kOrderDepthFirst = 0,
+    kOrderBreadthFirst,
+    kOrderProfile
+} ExportObjectOrder;
+
+extern ExportObjectOrder exportObjectOrder;
+
 class CopyScan: public ScanAddress
 {
 public:
-    CopyScan(unsigned h=0);
+    CopyScan(unsigned h=0, bool separateConsts=true);
     void initialise(bool isExport=true);
     ~CopyScan();
+    // Scan the objects that have been copied but not yet scanned.  Only
+    // needed if the objects are not copied depth-first.
+    void ScanQueuedObjects();
 protected:
     virtual POLYUNSIGNED ScanAddressAt(PolyWord *pt);
     // Have to follow pointers from closures into code.
@@ -113,7 +136,28 @@ private:
         NACodeConst
     };
 
-    PolyObject* newAddressForObject(POLYUNSIGNED words, enum _newAddrType naType);
+    PolyObject* newAddressForObject(POLYUNSIGNED words, enum _newAddrType naType, bool isHot);
+    bool IsHotObject(PolyObject *obj, MemSpace *space);
+
+    // Objects that have been copied but not yet scanned.  Hot objects are
+    // scanned first.
+    class QueuedObject {
+    public:
+        QueuedObject(PolyObject *o, POLYUNSIGNED l): obj(o), lengthWord(l) {}
+        PolyObject *obj;
+        POLYUNSIGNED lengthWord;
+    };
+    std::deque<QueuedObject> hotQueue, coldQueue;
+    bool scanningQueue;
+    ExportObjectOrder order;
+    std::vector<PermanentMemSpace*> hotSpaces;
+    // The units of lazily loaded spaces that had been loaded before the copy.
+    class LazyUnits {
+    public:
+        PermanentMemSpace *space;
+        std::vector<unsigned char> loaded;
+    };
+    std::vector<LazyUnits> lazyUnits;
 
 public:
     virtual PolyObject *ScanObjectAddress(PolyObject *base);
@@ -121,6 +165,7 @@ public:
     // Default sizes of the segments.
     uintptr_t defaultImmSize, defaultCodeSize, defaultMutSize, defaultNoOverSize;
     unsigned hierarchy;
+    bool separateConstants;
 
     GraveYard *graveYard;
     unsigned tombs;
@@ -51,6 +51,7 @@
 #include "rts_module.h"
 #include "memmgr.h"
 #include "gctaskfarm.h"
+#include "numa.h"
 #include "mpoly.h"
 #include "statistics.h"
 #include "profiling.h"
@@ -120,6 +121,8 @@ static bool doGC(const POLYUNSIGNED wordsRequiredToAllocate)
     // Data sharing pass.
     if (gHeapSizeParameters.PerformSharingPass())
     {
+        // The sharing pass moves objects so any concurrent marks are invalid.
+        GCDiscardConcurrentMark();
         globalStats.incCount(PSC_GC_SHARING);
         GCSharingPhase();
     }
@@ -186,6 +189,7 @@ static bool doGC(const POLYUNSIGNED wordsRequiredToAllocate)
             }
         }
     }
+    gMem.ResetCurrentAllocation();
     for(std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
     {
         LocalMemSpace *lSpace = *i;
@@ -198,10 +202,15 @@ static bool doGC(const POLYUNSIGNED wordsRequiredToAllocate)
         lSpace->lowerAllocPtr = lSpace->bottom;
 #endif
         lSpace->upperAllocPtr = lSpace->top;
+        // Objects will be moved so the card object map is no longer valid.
+        lSpace->cardTable.ResetMap(lSpace->bottom);
     }
 
 	gcProgressSetPercent(25);
 
+    // The mark bits show which of the sampled objects survived.
+    checkAllocationSamples(false);
+
     if (debugOptions & DEBUG_GC) Log("GC: Check weak refs\n");
     /* Detect unreferenced streams, windows etc. */
     GCheckWeakRefs();
@@ -244,6 +253,7 @@ static bool doGC(const POLYUNSIGNED wordsRequiredToAllocate)
     GCUpdatePhase();
 
     gHeapSizeParameters.RecordGCTime(HeapSizeParameters::GCTimeIntermediate, "Update");
+    gNumaTopology.ReportScans();
 
     {
         uintptr_t iUpdated = 0, mUpdated = 0, iMarked = 0, mMarked = 0;
@@ -354,13 +364,27 @@ void CreateHeap()
     initialiseMarkerTables();
 }
 
+static void RecordPause(const TIMEDATA &start)
+{
+    TIMEDATA pause = GetRealTime();
+    pause.sub(start);
+    globalStats.recordGCPause(pause.toSeconds());
+}
+
 class FullGCRequest: public MainThreadRequest
 {
 public:
     FullGCRequest(): MainThreadRequest(MTP_GCPHASEMARK) {}
     virtual void Perform()
     {
+        TIMEDATA start = GetRealTime();
+        // An explicit full GC should not retain anything that was only reachable
+        // when the concurrent marking started.
+        GCDiscardConcurrentMark();
         doGC (0);
+        // There are now no pointers from the mutable areas into the allocation areas.
+        gMem.ResetCards();
+        RecordPause(start);
     }
 };
 
@@ -371,12 +395,18 @@ public:
 
     virtual void Perform()
     {
-        result =
+        TIMEDATA start = GetRealTime();
+        bool minorGC = false;
 #ifndef DEBUG_ONLY_FULL_GC
 // If DEBUG_ONLY_FULL_GC is defined then we skip the partial GC.
-            RunQuickGC(wordsRequired) ||
+        minorGC = RunQuickGC(wordsRequired);
 #endif
-            doGC (wordsRequired);
+        result = minorGC || doGC (wordsRequired);
+        gMem.ResetCards();
+        // If the next GC is going to be a major GC we can start marking now.
+        if (minorGC && gHeapSizeParameters.MajorGCExpected())
+            GCStartConcurrentMark();
+        RecordPause(start);
     }
 
     bool result;
@@ -412,6 +442,7 @@ bool QuickGC(TaskData *taskData, POLYUNSIGNED wordsRequiredToAllocate)
 // Called in RunShareData.  This is called as a root function
 void FullGCForShareCommonData(void)
 {
+    GCDiscardConcurrentMark();
     doGC(0);
 }
 
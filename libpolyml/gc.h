@@ -57,4 +57,13 @@ extern void GCheckWeakRefs(void);
 extern void GCCopyPhase(void);
 extern void GCUpdatePhase(void);
 
+// Concurrent marking.
+class ScanAddress;
+extern void GCStartConcurrentMark(void);
+extern void GCResumeConcurrentMark(void);
+extern void GCSuspendConcurrentMark(void);
+extern void GCDiscardConcurrentMark(void);
+extern bool GCTransferConcurrentMarks(void);
+extern void GCRescanAfterConcurrentMark(ScanAddress *marker);
+
 #endif
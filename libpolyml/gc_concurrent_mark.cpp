@@ -0,0 +1,530 @@
+/*
+    Title:      Multi-Threaded Garbage Collector - Concurrent mark phase
+
+    Copyright (c) 2026 David C. J. Matthews
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License version 2.1 as published by the Free Software Foundation.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+/*
+This allows most of the marking for a major GC to be done by the GC worker
+threads while the ML threads continue to run.  It is started at the end of
+a minor GC when the heap sizing code has decided that the next GC will be a
+major GC.  The roots are recorded during the minor GC pause and the worker
+threads then trace the heap, recording the reachable objects in a separate
+bitmap for each space rather than in the headers.  The ML code may clear
+the mutable bit in the header of an object at any time so we must not
+write to the headers while the ML code is running.
+
+There is no write barrier in the compiled ML code so this is a "mostly
+parallel" collector rather than a snapshot-at-the-beginning one.  The card
+tables used by the minor GC record which pages of the mutable areas have
+been written since the minor GC.  When the major GC starts the marks are
+copied into the headers and the mark phase then rescans the roots, any
+marked objects on dirty cards and any objects that could not be scanned
+safely while the ML code was running.  Any objects allocated since the
+marking began are unmarked and are traced in the normal way.
+
+Mutable objects that are not covered by a card table, such as those in the
+allocation areas or mutable code objects, are marked but not scanned.  They
+are scanned when the mark phase starts.  The marks are discarded if anything
+other than a major GC, for example a minor GC or sharing, runs first.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#elif defined(_WIN32)
+#include "winconfig.h"
+#else
+#error "No configuration file"
+#endif
+
+#ifdef HAVE_ASSERT_H
+#include <assert.h>
+#define ASSERT(x)   assert(x)
+#else
+#define ASSERT(x)
+#endif
+
+#include <vector>
+
+#include "globals.h"
+#include "gc.h"
+#include "scanaddrs.h"
+#include "memmgr.h"
+#include "machine_dep.h"
+#include "diagnostics.h"
+#include "gctaskfarm.h"
+#include "locking.h"
+#include "rts_module.h"
+#include "statistics.h"
+#include "mpoly.h"
+#include "profiling.h"
+
+// Number of objects on a marker stack before we consider handing some over
+// to another worker and the number of objects scanned between checks for
+// a request to stop.
+#define CONCURRENT_SPLIT_SIZE   64
+#define CONCURRENT_CHECK_STOP   256
+
+typedef std::vector<PolyObject*> ObjectVector;
+
+static enum {
+    CM_IDLE,        // Not running.  There are no marks.
+    CM_PREPARED,    // The roots have been recorded but the tasks have not been started.
+    CM_RUNNING,     // The worker threads are marking.
+    CM_SUSPENDED    // Marking has stopped.  The marks can be used by a major GC.
+} concurrentState = CM_IDLE;
+
+// Set by the main GC thread to stop the worker threads.
+static volatile bool stopMarking;
+
+// The roots recorded at the start.
+static ObjectVector *initialRoots;
+
+// Objects that have been marked but must be scanned in the mark phase.
+static PLock leftoverLock("Concurrent mark");
+static ObjectVector leftovers;
+
+// Number of objects scanned by the workers.
+static size_t objectsScanned;
+
+class ConcurrentMarker: public ScanAddress
+{
+public:
+    ConcurrentMarker(): scanned(0) {}
+
+    virtual PolyObject *ScanObjectAddress(PolyObject *obj) { Mark(obj); return obj; }
+    virtual void ScanRuntimeAddress(PolyObject **pt, RtsStrength weak)
+        { if (weak == STRENGTH_STRONG) Mark(*pt); }
+    virtual void ScanConstant(PolyObject *base, byte *addressOfConstant, ScanRelocationKind code, intptr_t displacement);
+    virtual void ScanAddressesInObject(PolyObject *obj, POLYUNSIGNED lengthWord);
+
+    void Mark(PolyObject *obj, bool scan = true);
+    void MarkWord(PolyWord w, bool scan = true)
+        { if (w.IsDataPtr() && w != PolyWord::FromUnsigned(0)) Mark(w.AsObjPtr(), scan); }
+    void Drain();
+    void Finish();
+
+    ObjectVector markStack;
+
+protected:
+    virtual POLYUNSIGNED ScanCodeAddressAt(PolyObject **pt) { Mark(*pt); return 0; }
+
+private:
+    bool MustDefer(MarkableSpace *space, PolyObject *obj, POLYUNSIGNED L);
+
+    ObjectVector deferred;
+    size_t scanned;
+};
+
+static void ConcurrentMarkTask(GCTaskId *, void *arg1, void *arg2);
+
+// Mark an object if it is in a space being collected and push it to be scanned.
+// This never writes to the heap.
+void ConcurrentMarker::Mark(PolyObject *obj, bool scan)
+{
+    MemSpace *sp = gMem.SpaceForObjectAddress(obj);
+    if (sp == 0 || (sp->spaceType != ST_LOCAL && sp->spaceType != ST_CODE))
+        return; // Ignore it if it points to a permanent area
+    // There should not be forwarding pointers after a successful minor GC
+    // but follow them just in case.
+    if (obj->ContainsForwardingPtr())
+    {
+        while (obj->ContainsForwardingPtr())
+            obj = obj->GetForwardingPtr();
+        sp = gMem.SpaceForObjectAddress(obj);
+    }
+    MarkableSpace *space = (MarkableSpace*)sp;
+    // Spaces created since the start only contain new objects.
+    if (! space->concurrentMarks.Created())
+        return;
+    // Segments are allocated from lowerAllocPtr so objects between the value
+    // at the start and upperAllocPtr are new.  They may not have been
+    // initialised yet so they are left to the mark phase.
+    if (sp->spaceType == ST_LOCAL)
+    {
+        LocalMemSpace *lSpace = (LocalMemSpace*)sp;
+        if (lSpace->allocationSpace && (PolyWord*)obj >= lSpace->concurrentMarkBase &&
+                (PolyWord*)obj < lSpace->upperAllocPtr)
+            return;
+    }
+    if (! space->concurrentMarks.TestAndSetBit((PolyWord*)obj - space->bottom))
+        return; // Already marked
+    POLYUNSIGNED L = obj->LengthWord();
+    if (OBJ_IS_BYTE_OBJECT(L) || ! scan)
+        return;
+    if (MustDefer(space, obj, L))
+        deferred.push_back(obj);
+    else markStack.push_back(obj);
+}
+
+// A mutable object can only be scanned now if any change to it will be
+// recorded in a card table.  Otherwise it is scanned in the mark phase.
+// Code objects are always deferred.  Their constants are written through
+// the shadow mapping so the card tables do not see the change.
+bool ConcurrentMarker::MustDefer(MarkableSpace *space, PolyObject *obj, POLYUNSIGNED L)
+{
+    if (OBJ_IS_CODE_OBJECT(L))
+        return true;
+    if (! OBJ_IS_MUTABLE_OBJECT(L))
+        return false;
+    CardTable *cards = gMem.CardTableForSpace(space);
+    if (cards == 0 || ! cards->Created())
+        return true;
+    return (PolyWord*)obj - 1 < cards->cardBase || (PolyWord*)obj + OBJ_OBJECT_LENGTH(L) > cards->CardsEnd();
+}
+
+void ConcurrentMarker::ScanConstant(PolyObject *base, byte *addressOfConstant, ScanRelocationKind code, intptr_t displacement)
+{
+    PolyObject *p = GetConstantValue(addressOfConstant, code, displacement);
+    if (p != 0)
+        Mark(p);
+}
+
+// Mark the addresses in an object.  Unlike the normal mark phase this
+// pushes the addresses on the stack rather than following them.
+void ConcurrentMarker::ScanAddressesInObject(PolyObject *obj, POLYUNSIGNED lengthWord)
+{
+    if (OBJ_IS_BYTE_OBJECT(lengthWord))
+        return;
+
+    POLYUNSIGNED length = OBJ_OBJECT_LENGTH(lengthWord);
+    PolyWord *baseAddr = (PolyWord*)obj;
+
+    if (OBJ_IS_WEAKREF_OBJECT(lengthWord))
+    {
+        // Mark the "SOME" cells but not their contents.
+        for (POLYUNSIGNED i = 0; i < length; i++)
+            MarkWord(baseAddr[i], false);
+        return;
+    }
+    else if (OBJ_IS_CODE_OBJECT(lengthWord))
+    {
+        // Constants within the code and then the constant area.
+        machineDependent->ScanConstantsWithinCode(obj, length, this);
+        machineDependent->GetConstSegmentForCode(obj, length, baseAddr, length);
+    }
+    else if (OBJ_IS_CLOSURE_OBJECT(lengthWord))
+    {
+        // The first word is the absolute address of the code unless it
+        // has not yet been set.
+        PolyObject *codeAddr = *(PolyObject**)obj;
+        if (((uintptr_t)codeAddr & 1) == 0)
+            Mark(codeAddr);
+        baseAddr += sizeof(PolyObject*) / sizeof(PolyWord);
+        length -= sizeof(PolyObject*) / sizeof(PolyWord);
+    }
+
+    for (POLYUNSIGNED i = 0; i < length; i++)
+        MarkWord(baseAddr[i]);
+}
+
+// Scan everything on the stack.  If other workers are idle some of the work
+// is handed over to them.  If the main thread wants to stop the marking the
+// remaining objects are saved for the mark phase.
+void ConcurrentMarker::Drain()
+{
+    while (! markStack.empty())
+    {
+        if ((++scanned % CONCURRENT_CHECK_STOP) == 0 && stopMarking)
+            return;
+        PolyObject *obj = markStack.back();
+        markStack.pop_back();
+        ScanAddressesInObject(obj, obj->LengthWord());
+
+        if (markStack.size() >= CONCURRENT_SPLIT_SIZE && gpTaskFarm->Draining())
+        {
+            // Give half the stack to a new task.
+            size_t half = markStack.size() / 2;
+            ObjectVector *work = new ObjectVector(markStack.begin(), markStack.begin() + half);
+            if (gpTaskFarm->AddWork(ConcurrentMarkTask, work, 0))
+                markStack.erase(markStack.begin(), markStack.begin() + half);
+            else delete work;
+        }
+    }
+}
+
+// Save anything that has not been scanned.
+void ConcurrentMarker::Finish()
+{
+    PLocker lock(&leftoverLock);
+    leftovers.insert(leftovers.end(), deferred.begin(), deferred.end());
+    leftovers.insert(leftovers.end(), markStack.begin(), markStack.end());
+    objectsScanned += scanned;
+}
+
+// Task to scan a group of objects that have already been marked.
+static void ConcurrentMarkTask(GCTaskId *, void *arg1, void *)
+{
+    ObjectVector *work = (ObjectVector*)arg1;
+    ConcurrentMarker marker;
+    marker.markStack.swap(*work);
+    delete work;
+    if (! stopMarking)
+        marker.Drain();
+    marker.Finish();
+}
+
+// Task to scan a permanent mutable area.
+static void ConcurrentPermanentTask(GCTaskId *, void *arg1, void *)
+{
+    PermanentMemSpace *space = (PermanentMemSpace*)arg1;
+    ConcurrentMarker marker;
+    if (! stopMarking)
+    {
+        marker.ScanAddressesInRegion(space->bottom, space->top);
+        marker.Drain();
+    }
+    marker.Finish();
+}
+
+static void FreeConcurrentMarks()
+{
+    for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
+        (*i)->concurrentMarks.Destroy();
+    for (std::vector<CodeSpace*>::iterator i = gMem.cSpaces.begin(); i < gMem.cSpaces.end(); i++)
+        (*i)->concurrentMarks.Destroy();
+    delete initialRoots;
+    initialRoots = 0;
+    ObjectVector().swap(leftovers);
+    concurrentState = CM_IDLE;
+}
+
+// Called at the end of a minor GC when the next GC is expected to be a major
+// GC.  This is called while the ML threads are stopped and records the roots.
+// The marking starts when the ML threads are resumed.
+void GCStartConcurrentMark()
+{
+    if (! userOptions.gcconcurrent || ! gMem.CardMarking() || gpTaskFarm->ThreadCount() == 0)
+        return;
+    // Profiling live data requires the objects to be recorded as they are marked.
+    if (profileMode == kProfileLiveData || profileMode == kProfileLiveMutables)
+        return;
+    ASSERT(concurrentState == CM_IDLE);
+
+    for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
+    {
+        if (! (*i)->concurrentMarks.Create((*i)->spaceSize()))
+        {
+            FreeConcurrentMarks();
+            return;
+        }
+        (*i)->concurrentMarkBase = (*i)->lowerAllocPtr;
+    }
+    for (std::vector<CodeSpace*>::iterator i = gMem.cSpaces.begin(); i < gMem.cSpaces.end(); i++)
+    {
+        if (! (*i)->concurrentMarks.Create((*i)->spaceSize()))
+        {
+            FreeConcurrentMarks();
+            return;
+        }
+    }
+
+    // Mark the roots.  This does not scan them.
+    ConcurrentMarker rootMarker;
+    GCModules(&rootMarker);
+    initialRoots = new ObjectVector;
+    initialRoots->swap(rootMarker.markStack);
+    rootMarker.Finish(); // Any deferred roots.
+
+    objectsScanned = 0;
+    stopMarking = false;
+    concurrentState = CM_PREPARED;
+
+    if (debugOptions & DEBUG_GC)
+        Log("GC: Concurrent mark: Starting with %" PRI_SIZET " roots\n", initialRoots->size());
+}
+
+// Called when the ML threads are about to be resumed.  Start the marking if
+// it has been prepared.  If marking was suspended for some other request the
+// marks are no longer valid.
+void GCResumeConcurrentMark()
+{
+    if (concurrentState == CM_SUSPENDED)
+        GCDiscardConcurrentMark();
+    if (concurrentState != CM_PREPARED)
+        return;
+
+    concurrentState = CM_RUNNING;
+    // Spread the roots over the workers.
+    unsigned threads = gpTaskFarm->ThreadCount();
+    size_t roots = initialRoots->size();
+    size_t perTask = (roots + threads - 1) / threads;
+    for (size_t n = 0; n < roots; n += perTask)
+    {
+        size_t end = n + perTask < roots ? n + perTask : roots;
+        ObjectVector *work = new ObjectVector(initialRoots->begin() + n, initialRoots->begin() + end);
+        gpTaskFarm->AddWorkOrRunNow(ConcurrentMarkTask, work, 0);
+    }
+    delete initialRoots;
+    initialRoots = 0;
+
+    for (std::vector<PermanentMemSpace*>::iterator i = gMem.pSpaces.begin(); i < gMem.pSpaces.end(); i++)
+    {
+        PermanentMemSpace *space = *i;
+        if (space->isMutable && ! space->byteOnly)
+            gpTaskFarm->AddWorkOrRunNow(ConcurrentPermanentTask, space, 0);
+    }
+}
+
+// Called before a request is performed with the ML threads stopped.  Stop
+// the workers.  Anything not yet scanned is kept for the mark phase.
+void GCSuspendConcurrentMark()
+{
+    if (concurrentState != CM_RUNNING)
+        return;
+    stopMarking = true;
+    gpTaskFarm->WaitForCompletion();
+    concurrentState = CM_SUSPENDED;
+    if (debugOptions & DEBUG_GC)
+        Log("GC: Concurrent mark: Suspended after scanning %" PRI_SIZET " objects, %" PRI_SIZET " left\n",
+            objectsScanned, leftovers.size());
+}
+
+// Discard the marks.  Called if the heap may have changed in a way that
+// invalidates them.
+void GCDiscardConcurrentMark()
+{
+    GCSuspendConcurrentMark();
+    if (concurrentState == CM_IDLE)
+        return;
+    if (debugOptions & DEBUG_GC)
+        Log("GC: Concurrent mark: Discarding marks\n");
+    FreeConcurrentMarks();
+}
+
+// Copy the marks for a space into the object headers.
+static void TransferMarksTask(GCTaskId *, void *arg1, void *)
+{
+    MarkableSpace *space = (MarkableSpace*)arg1;
+    uintptr_t size = space->spaceSize();
+    for (uintptr_t bitno = space->concurrentMarks.FindNextSet(0, size); bitno < size;
+         bitno = space->concurrentMarks.FindNextSet(bitno+1, size))
+    {
+        PolyObject *obj = (PolyObject*)(space->bottom + bitno);
+        space->writeAble(obj)->SetLengthWord(obj->LengthWord() | _OBJ_GC_MARK);
+    }
+    space->concurrentMarks.Destroy();
+}
+
+// Called at the start of the mark phase of a major GC.  If the concurrent marks
+// are available they are copied into the headers and the result is true.  The
+// mark phase must then call GCRescanAfterConcurrentMark.
+bool GCTransferConcurrentMarks()
+{
+    if (concurrentState != CM_SUSPENDED)
+        return false;
+    for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
+    {
+        if ((*i)->concurrentMarks.Created())
+            gpTaskFarm->AddWorkOrRunNow(TransferMarksTask, *i, 0);
+    }
+    for (std::vector<CodeSpace*>::iterator i = gMem.cSpaces.begin(); i < gMem.cSpaces.end(); i++)
+    {
+        if ((*i)->concurrentMarks.Created())
+            gpTaskFarm->AddWorkOrRunNow(TransferMarksTask, *i, 0);
+    }
+    gpTaskFarm->WaitForCompletion();
+    globalStats.incCount(PSC_GC_CONCURRENT);
+    return true;
+}
+
+// Rescan the marked objects that overlap dirty cards.  Objects that are not
+// entirely within the cards will have been deferred.
+class DirtyCardRescanner: public ScanAddress
+{
+public:
+    DirtyCardRescanner(ScanAddress *marker, CardTable *cards): m_marker(marker), m_cards(cards), rescanned(0) {}
+
+    virtual void ScanAddressesInObject(PolyObject *obj, POLYUNSIGNED lengthWord)
+    {
+        if ((lengthWord & _OBJ_GC_MARK) == 0)
+            return;
+        PolyWord *start = (PolyWord*)obj - 1, *end = (PolyWord*)obj + OBJ_OBJECT_LENGTH(lengthWord);
+        if (start < m_cards->cardBase || end > m_cards->CardsEnd())
+            return;
+        uintptr_t last = m_cards->CardNo(end - 1);
+        for (uintptr_t n = m_cards->CardNo(start); n <= last; n++)
+        {
+            if (m_cards->IsDirty(n))
+            {
+                m_marker->ScanAddressesInObject(obj, lengthWord);
+                rescanned++;
+                return;
+            }
+        }
+    }
+
+    virtual PolyObject *ScanObjectAddress(PolyObject *base) { ASSERT(false); return 0; }
+    virtual POLYUNSIGNED ScanCodeAddressAt(PolyObject **pt) { ASSERT(false); return 0; }
+
+private:
+    ScanAddress *m_marker;
+    CardTable *m_cards;
+public:
+    size_t rescanned;
+};
+
+// Called from the mark phase after the roots have been marked.  Scans the objects
+// that were not scanned by the concurrent marking and the marked objects that
+// may have been modified since they were scanned.
+void GCRescanAfterConcurrentMark(ScanAddress *marker)
+{
+    ASSERT(concurrentState == CM_SUSPENDED);
+    size_t leftoverCount = leftovers.size(), dirtyCount = 0;
+    for (ObjectVector::iterator i = leftovers.begin(); i < leftovers.end(); i++)
+        marker->ScanAddressesInObject(*i, (*i)->LengthWord());
+
+    for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
+    {
+        LocalMemSpace *space = *i;
+        CardTable *cards = gMem.CardTableForSpace(space);
+        if (cards != 0 && cards->Created())
+        {
+            DirtyCardRescanner rescanner(marker, cards);
+            rescanner.ScanAddressesInRegion(space->bottom, space->top);
+            dirtyCount += rescanner.rescanned;
+        }
+    }
+    if (debugOptions & DEBUG_GC)
+        Log("GC: Concurrent mark: Rescanned %" PRI_SIZET " unscanned and %" PRI_SIZET " dirty objects\n",
+            leftoverCount, dirtyCount);
+    FreeConcurrentMarks();
+}
+
+// RTS module for the concurrent mark.
+class ConcurrentMarkModule : public RtsModule
+{
+public:
+    virtual void Stop(void);
+    virtual void ForkChild(void);
+};
+
+// The workers must not be scanning the heap while it is being freed.
+void ConcurrentMarkModule::Stop(void)
+{
+    GCDiscardConcurrentMark();
+}
+
+// The worker threads do not exist in the child so we can't wait for them.
+void ConcurrentMarkModule::ForkChild(void)
+{
+    if (concurrentState == CM_IDLE)
+        return;
+    stopMarking = true;
+    FreeConcurrentMarks();
+}
+
+// Declare this.  It will be automatically added to the table.
+static ConcurrentMarkModule concurrentMarkModule;
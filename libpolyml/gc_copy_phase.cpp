@@ -52,6 +52,16 @@ can't.
 Once a thread has started copying into or out of an area it takes
 ownership of the area and no other thread can use the area.  This
 avoids 
+
+Searching the bit-maps for free space becomes expensive when the heap is
+fragmented.  With --gcevacuate N the up to N spaces with the lowest
+proportion of live data are evacuated instead.  Only spaces that are less
+than half full are considered.  New spaces are created, large enough to hold
+the live data from the chosen spaces, and the cells are copied into them by
+simply moving the allocation pointer down.  The new spaces are only used as
+destinations for evacuated cells and the evacuated spaces are not used as
+destinations at all, so once the copy is complete they are empty and are
+removed after the update phase.
 */
 
 #ifdef HAVE_CONFIG_H
@@ -73,6 +83,10 @@ avoids
 #include <string.h>
 #endif
 
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
 #include "globals.h"
 #include "machine_dep.h"
 #include "processes.h"
@@ -81,8 +95,10 @@ avoids
 #include "bitmap.h"
 #include "memmgr.h"
 #include "gctaskfarm.h"
+#include "numa.h"
 #include "locking.h"
 #include "diagnostics.h"
+#include "mpoly.h"
 
 static PLock copyLock("Copy");
 
@@ -163,6 +179,41 @@ static inline PolyWord *FindFreeAndAllocate(LocalMemSpace *dst, uintptr_t limit,
     return newp;
 }
 
+// Allocate space in an evacuation target.  As with compaction the data
+// is placed at the top of the space so we allocate downwards.
+static inline PolyWord *BumpAllocate(LocalMemSpace *dst, uintptr_t n)
+{
+    if (dst == 0 || dst->freeSpace() <= n) return 0;
+    PolyWord *newp = dst->upperAllocPtr - n;
+#ifdef POLYML32IN64
+    // The length word must be on an odd-word boundary.  This leaves
+    // a hole which will be zeroed in the update phase.
+    if ((dst->wordNo(newp) & 1) == 0)
+        newp--;
+#endif
+    dst->bitmap.SetBits(dst->wordNo(newp), n);
+    dst->upperAllocPtr = newp;
+    return newp;
+}
+
+// Release the current evacuation target and find another that no other thread is using.
+static LocalMemSpace *FindEvacuationTarget(LocalMemSpace *current, bool isMutable, GCTaskId *id)
+{
+    PLocker lock(&copyLock);
+    if (current != 0)
+        current->spaceOwner = 0;
+    for (std::vector<LocalMemSpace*>::iterator m = gMem.lSpaces.begin(); m < gMem.lSpaces.end(); m++)
+    {
+        LocalMemSpace *lSpace = *m;
+        if (lSpace != current && lSpace->evacuationTarget && lSpace->isMutable == isMutable && lSpace->spaceOwner == 0)
+        {
+            lSpace->spaceOwner = id;
+            return lSpace;
+        }
+    }
+    return 0;
+}
+
 // Copy a cell to its new address.
 void CopyObjectToNewAddress(PolyObject *srcAddress, PolyObject *destAddress, POLYUNSIGNED L)
 {
@@ -210,7 +261,8 @@ static bool FindNextSpace(LocalMemSpace *src, LocalMemSpace **dst, bool isMutabl
             *dst = src;
             return true; // We already own it
         }
-        if (lSpace->isMutable == isMutable && !lSpace->allocationSpace && lSpace->spaceOwner == 0)
+        if (lSpace->isMutable == isMutable && !lSpace->allocationSpace && !lSpace->largeObjectSpace &&
+                !lSpace->evacuate && !lSpace->evacuationTarget && lSpace->spaceOwner == 0)
         {
             // Now acquire the lock.  We have to retest spaceOwner with the lock held.
             PLocker lock(&copyLock);
@@ -229,16 +281,21 @@ static bool FindNextSpace(LocalMemSpace *src, LocalMemSpace **dst, bool isMutabl
     return false;
 }
 
-// Copy objects from the source space into an earlier space or up within the
-// current space.
-static void copyAllData(GCTaskId *id, void * /*arg1*/, void * /*arg2*/)
+// Copy objects from the source spaces into earlier spaces or up within the
+// current space.  If node is not NUMA_ANY_NODE only the spaces on that node are copied.
+static void copySpaces(GCTaskId *id, LocalMemSpace *&mutableDest, LocalMemSpace *&immutableDest, unsigned node)
 {
-    LocalMemSpace *mutableDest = 0, *immutableDest = 0;
-
     for (std::vector<LocalMemSpace*>::reverse_iterator i = gMem.lSpaces.rbegin(); i != gMem.lSpaces.rend(); i++)
     {
         LocalMemSpace *src = *i;
 
+        if (node != NUMA_ANY_NODE && src->numaNode != node)
+            continue;
+
+        // Evacuation targets only contain cells that have already been copied.
+        if (src->evacuationTarget)
+            continue;
+
         if (src->spaceOwner == 0)
         {
             PLocker lock(&copyLock);
@@ -249,6 +306,18 @@ static void copyAllData(GCTaskId *id, void * /*arg1*/, void * /*arg2*/)
         else if (src->spaceOwner != id)
             continue;
 
+        // A large object is never moved.  If it is reachable the space is set
+        // to contain it.  If not it is left empty and is deleted after the GC.
+        if (src->largeObjectSpace)
+        {
+            uintptr_t highest = src->wordNo(src->top);
+            uintptr_t bitno = src->bitmap.FindNextSet(src->wordNo(src->fullGCLowerLimit), highest);
+            if (bitno < highest)
+                src->upperAllocPtr = src->wordAddr(bitno);
+            src->fullGCLowerLimit = src->top;
+            continue;
+        }
+
         if (debugOptions & DEBUG_GC_ENHANCED)
             Log("GC: Copy: copying area %p (thread %p) %s \n", src, id, src->spaceTypeString());
 
@@ -264,6 +333,14 @@ static void copyAllData(GCTaskId *id, void * /*arg1*/, void * /*arg2*/)
         // src->highest is the bit position that corresponds to the top of
         // generation we're copying.
         uintptr_t  highest = src->wordNo(src->top);
+        // If we have already copied this space there's nothing to do.
+        if (bitno < highest)
+            gNumaTopology.RecordScan(src->numaNode, src->i_marked + src->m_marked);
+
+        // Evacuation targets in use by this thread, indexed by isMutable.  If
+        // we run out of targets the remaining cells are copied as normal.
+        LocalMemSpace *evacuationDest[2] = { 0, 0 };
+        bool noTarget[2] = { false, false };
 
         for (;;)
         {
@@ -293,18 +370,34 @@ static void copyAllData(GCTaskId *id, void * /*arg1*/, void * /*arg2*/)
             // saved state segments into local areas.  It's much better to delete them
             // if possible.
             bool isMutable = OBJ_IS_MUTABLE_OBJECT(L);
-            LocalMemSpace *destSpace = isMutable || immutableDest == 0 ? mutableDest : immutableDest;
-            PolyWord *newp = FindFreeAndAllocate(destSpace, (src == destSpace) ? bitno : 0, n);
-            if (newp == 0 && src != destSpace)
+            PolyWord *newp = 0;
+            if (src->evacuate && ! noTarget[isMutable])
             {
-                // See if we can find a different space.
-                // N.B.  FindNextSpace side-effects mutableDest/immutableDest to give the next space.
-                if (FindNextSpace(src, isMutable ? &mutableDest : &immutableDest, isMutable, id))
+                newp = BumpAllocate(evacuationDest[isMutable], n);
+                if (newp == 0)
                 {
+                    evacuationDest[isMutable] = FindEvacuationTarget(evacuationDest[isMutable], isMutable, id);
+                    if (evacuationDest[isMutable] == 0)
+                        noTarget[isMutable] = true;
                     bitno -= n; // Redo this object
                     continue;
                 }
-                // else just leave it
+            }
+            else
+            {
+                LocalMemSpace *destSpace = isMutable || immutableDest == 0 ? mutableDest : immutableDest;
+                newp = FindFreeAndAllocate(destSpace, (src == destSpace) ? bitno : 0, n);
+                if (newp == 0 && src != destSpace)
+                {
+                    // See if we can find a different space.
+                    // N.B.  FindNextSpace side-effects mutableDest/immutableDest to give the next space.
+                    if (FindNextSpace(src, isMutable ? &mutableDest : &immutableDest, isMutable, id))
+                    {
+                        bitno -= n; // Redo this object
+                        continue;
+                    }
+                    // else just leave it
+                }
             }
 
             if (newp == 0) /* no room */
@@ -340,6 +433,89 @@ static void copyAllData(GCTaskId *id, void * /*arg1*/, void * /*arg2*/)
             mutableDest = 0;
         if (immutableDest == src)
             immutableDest = 0;
+
+        // Let other threads use the targets.
+        if (evacuationDest[0] != 0 || evacuationDest[1] != 0)
+        {
+            PLocker lock(&copyLock);
+            if (evacuationDest[0] != 0)
+                evacuationDest[0]->spaceOwner = 0;
+            if (evacuationDest[1] != 0)
+                evacuationDest[1]->spaceOwner = 0;
+        }
+    }
+}
+
+static void copyAllData(GCTaskId *id, void * /*arg1*/, void * /*arg2*/)
+{
+    LocalMemSpace *mutableDest = 0, *immutableDest = 0;
+    // In NUMA mode take the spaces on the node of this thread first.
+    if (gNumaTopology.NodeCount() > 1)
+        copySpaces(id, mutableDest, immutableDest, gpTaskFarm->CurrentNode());
+    copySpaces(id, mutableDest, immutableDest, NUMA_ANY_NODE);
+}
+
+// Order spaces by the proportion of live data.
+static int compareLiveRatio(const void *a, const void *b)
+{
+    LocalMemSpace *x = *(LocalMemSpace * const *)a;
+    LocalMemSpace *y = *(LocalMemSpace * const *)b;
+    // Compare live/size for each space without dividing.
+    double xs = (double)(x->i_marked + x->m_marked) * (double)y->spaceSize();
+    double ys = (double)(y->i_marked + y->m_marked) * (double)x->spaceSize();
+    return xs < ys ? -1 : xs > ys ? 1 : 0;
+}
+
+// Choose the spaces to evacuate and create the spaces to copy their data into.
+static void SelectSpacesForEvacuation(unsigned maxSpaces)
+{
+    std::vector<LocalMemSpace*> candidates;
+    for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
+    {
+        LocalMemSpace *lSpace = *i;
+        uintptr_t live = lSpace->i_marked + lSpace->m_marked;
+        if (debugOptions & DEBUG_GC)
+            Log("GC: Copy: %s space %p %" PRI_SIZET " live in %" PRI_SIZET " words %2.1f%% live\n",
+                lSpace->spaceTypeString(), lSpace, live, lSpace->spaceSize(),
+                (float)live * 100 / (float)lSpace->spaceSize());
+        // Allocation spaces are always emptied.  There's no point in evacuating
+        // a space with nothing in it or one that is more than half full.
+        if (! lSpace->allocationSpace && ! lSpace->largeObjectSpace && live != 0 && live < lSpace->spaceSize() / 2)
+            candidates.push_back(lSpace);
+    }
+    if (candidates.empty())
+        return;
+
+    qsort(&candidates[0], candidates.size(), sizeof(LocalMemSpace*), compareLiveRatio);
+    if (candidates.size() > maxSpaces)
+        candidates.resize(maxSpaces);
+
+    uintptr_t iLive = 0, mLive = 0;
+    for (std::vector<LocalMemSpace*>::iterator i = candidates.begin(); i < candidates.end(); i++)
+    {
+        iLive += (*i)->i_marked;
+        mLive += (*i)->m_marked;
+    }
+
+    // Create the targets.  Allow a little extra for alignment.  If we can't
+    // create a target the cells are copied in the normal way.
+    if (iLive != 0)
+    {
+        LocalMemSpace *target = gMem.NewLocalSpace(iLive + iLive / 8, false);
+        if (target != 0) target->evacuationTarget = true;
+    }
+    if (mLive != 0)
+    {
+        LocalMemSpace *target = gMem.NewLocalSpace(mLive + mLive / 8, true);
+        if (target != 0) target->evacuationTarget = true;
+    }
+
+    for (std::vector<LocalMemSpace*>::iterator i = candidates.begin(); i < candidates.end(); i++)
+    {
+        LocalMemSpace *lSpace = *i;
+        lSpace->evacuate = true;
+        if (debugOptions & DEBUG_GC)
+            Log("GC: Copy: evacuating %s space %p\n", lSpace->spaceTypeString(), lSpace);
     }
 }
 
@@ -347,6 +523,9 @@ void GCCopyPhase()
 {
     mainThreadPhase = MTP_GCPHASECOMPACT;
 
+    if (userOptions.gcevacuate != 0)
+        SelectSpacesForEvacuation(userOptions.gcevacuate);
+
     for(std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
     {
         LocalMemSpace *lSpace = *i;
@@ -375,4 +554,7 @@ void GCCopyPhase()
     }
 
     gpTaskFarm->WaitForCompletion();
+
+    for(std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
+        (*i)->evacuate = (*i)->evacuationTarget = false;
 }
@@ -109,7 +109,7 @@ public:
         nThreads = threads;
     }
 
-    static void MarkRoots(void);
+    static void MarkRoots(bool afterConcurrentMark);
     static bool RescanForStackOverflow();
 
 private:
@@ -591,7 +591,7 @@ void MTGCProcessMarkPointers::ScanConstant(PolyObject *base, byte *addressOfCons
 
 // Mark all the roots.  This is run in the main thread and has the effect
 // of starting new tasks as the scanning runs.
-void MTGCProcessMarkPointers::MarkRoots(void)
+void MTGCProcessMarkPointers::MarkRoots(bool afterConcurrentMark)
 {
     ASSERT(nThreads >= 1);
     ASSERT(nInUse == 0);
@@ -611,6 +611,11 @@ void MTGCProcessMarkPointers::MarkRoots(void)
     // Scan the RTS roots.
     GCModules(marker);
 
+    // If the marks were made concurrently we have to scan anything that
+    // has not been scanned or may have changed since.
+    if (afterConcurrentMark)
+        GCRescanAfterConcurrentMark(marker);
+
     ASSERT(marker->markStack[0] == 0);
 
     // When this has finished there may well be other tasks running.
@@ -838,7 +843,10 @@ void GCMarkPhase(void)
         space->fullGCRescanEnd = space->bottom;
     }
     
-    MTGCProcessMarkPointers::MarkRoots();
+    // Copy any marks made concurrently into the headers.
+    bool afterConcurrentMark = GCTransferConcurrentMarks();
+
+    MTGCProcessMarkPointers::MarkRoots(afterConcurrentMark);
     gpTaskFarm->WaitForCompletion();
 
     // Do we have to rescan because the mark stack overflowed?
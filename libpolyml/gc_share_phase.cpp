@@ -69,6 +69,15 @@
     for each visited cell so at the start of the sharing phase all
     reachable cells will be marked.  We remove the mark if the cell
     is to be removed.  This requires the bitmap to be locked.
+
+    With --gcsharebudget the pass is incremental.  Rather than following
+    the roots each pass takes the objects in the next few local spaces.
+    The spaces are scanned in parallel by the GC task farm, each
+    into its own tables, and the tables are then merged.  The pass
+    stops adding spaces, and stops the word passes, once the time
+    budget has been used.  The next pass continues from the next space.
+    Objects outside the chosen spaces are never chained so they are
+    treated in the same way as cells that cannot be shared.
 */
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -103,6 +112,9 @@
 #include "gctaskfarm.h"
 #include "heapsizing.h"
 #include "gc_progress.h"
+#include "timing.h"
+#include "mpoly.h"
+#include "statistics.h"
 
 #ifdef POLYML32IN64
 #define ENDOFLIST ((PolyObject*)globalHeapBase)
@@ -161,8 +173,9 @@ public:
 class SortVector
 {
 public:
-    SortVector(): totalCount(0), carryOver(0) {}
+    SortVector(): totalCount(0), carryOver(0), lastObject(ENDOFLIST) {}
     void AddToVector(PolyObject *obj, POLYUNSIGNED length);
+    void Merge(SortVector &other);
     void SortData(void);
     POLYUNSIGNED TotalCount() const { return totalCount; }
     POLYUNSIGNED CurrentCount() const { return baseObject.objCount; }
@@ -181,6 +194,7 @@ private:
     POLYUNSIGNED totalCount;
     POLYUNSIGNED lengthWord;
     POLYUNSIGNED carryOver;
+    PolyObject *lastObject; // The end of baseObject.objList.
 };
 
 POLYUNSIGNED SortVector::Shared() const
@@ -194,12 +208,29 @@ POLYUNSIGNED SortVector::Shared() const
 
 void SortVector::AddToVector(PolyObject *obj, POLYUNSIGNED length)
 {
+    if (baseObject.objList == ENDOFLIST)
+        lastObject = obj;
     obj->SetForwardingPtr(baseObject.objList);
     baseObject.objList = obj;
     baseObject.objCount++;
     totalCount++;
 }
 
+// Add the entries from another vector to the start of this one.
+void SortVector::Merge(SortVector &other)
+{
+    if (other.baseObject.objList == ENDOFLIST)
+        return;
+    other.lastObject->SetForwardingPtr(baseObject.objList);
+    if (baseObject.objList == ENDOFLIST)
+        lastObject = other.lastObject;
+    baseObject.objList = other.baseObject.objList;
+    baseObject.objCount += other.baseObject.objCount;
+    totalCount += other.totalCount;
+    other.baseObject.objList = ENDOFLIST;
+    other.baseObject.objCount = 0;
+}
+
 // The number of byte and word entries.
 // Objects of up to and including this size are shared.
 // Byte objects include strings so it is more likely that
@@ -448,6 +479,11 @@ class GetSharing: public RecursiveScanWithStack
 public:
     GetSharing();
     void SortData(void);
+    // Add the objects in a region without following their addresses.
+    void AddObjectsInRegion(PolyWord *start, PolyWord *end);
+    void Merge(GetSharing &other);
+    // Stop the word passes after this time.  Zero means no limit.
+    void SetTimeLimit(const TIMEDATA &start, float limit) { startTime = start; timeLimit = limit; }
     static void shareByteData(GCTaskId *, void *, void *);
     static void shareWordData(GCTaskId *, void *, void *);
     static void shareRemainingWordData(GCTaskId *, void *, void *);
@@ -465,8 +501,11 @@ private:
     SortVector wordVectors[NUM_WORD_VECTORS];
 
     POLYUNSIGNED largeWordCount, largeByteCount, excludedCount;
+    TIMEDATA startTime;
+    float timeLimit;
 public:
     POLYUNSIGNED totalVisited, byteAdded, wordAdded, totalSize;
+    POLYUNSIGNED totalRecovered;
 };
 
 GetSharing::GetSharing()
@@ -479,6 +518,53 @@ GetSharing::GetSharing()
 
     largeWordCount = largeByteCount = excludedCount = 0;
     totalVisited = byteAdded = wordAdded = totalSize = 0;
+    totalRecovered = 0;
+    timeLimit = 0;
+}
+
+void GetSharing::AddObjectsInRegion(PolyWord *start, PolyWord *end)
+{
+    PolyWord *pt = start;
+    while (pt < end)
+    {
+#ifdef POLYML32IN64
+        if ((((uintptr_t)pt) & 4) == 0)
+        {
+            // Skip any padding.  The length word should be on an odd-word boundary.
+            pt++;
+            continue;
+        }
+#endif
+        PolyObject *obj = (PolyObject*)(pt+1);
+        if (obj->ContainsForwardingPtr())
+        {
+            // Skip over a moved object.
+            pt += obj->FollowForwardingChain()->Length() + 1;
+            continue;
+        }
+        ASSERT(obj->ContainsNormalLengthWord());
+        POLYUNSIGNED length = obj->Length();
+        pt += length + 1;
+        totalVisited += 1;
+        totalSize += length + 1;
+        MarkAsScanning(obj);
+        Completed(obj);
+    }
+}
+
+void GetSharing::Merge(GetSharing &other)
+{
+    for (unsigned i = 0; i < NUM_BYTE_VECTORS; i++)
+        byteVectors[i].Merge(other.byteVectors[i]);
+    for (unsigned j = 0; j < NUM_WORD_VECTORS; j++)
+        wordVectors[j].Merge(other.wordVectors[j]);
+    largeWordCount += other.largeWordCount;
+    largeByteCount += other.largeByteCount;
+    excludedCount += other.excludedCount;
+    totalVisited += other.totalVisited;
+    byteAdded += other.byteAdded;
+    wordAdded += other.wordAdded;
+    totalSize += other.totalSize;
 }
 
 // This is called for roots and also for constants in the constant area.
@@ -884,6 +970,15 @@ void GetSharing::SortData()
         if (pass > 1 && (lastCount - postCount) * 10 < lastCount && (carryOver*2 < (lastCount-postCount) || (lastCount - postCount) * 1000 < lastCount ))
             break;
 
+        // In the incremental pass stop if we have used the time.
+        if (timeLimit != 0)
+        {
+            TIMEDATA now = GetRealTime();
+            now.sub(startTime);
+            if (now.toSeconds() > timeLimit)
+                break;
+        }
+
         lastCount = postCount;
         lastShared = postShared;
     }
@@ -904,7 +999,8 @@ void GetSharing::SortData()
     }
 
     // Calculate the totals.
-    POLYUNSIGNED totalSize = 0, totalShared = 0, totalRecovered = 0;
+    POLYUNSIGNED totalSize = 0, totalShared = 0;
+    totalRecovered = 0;
     for (unsigned k = 0; k < NUM_BYTE_VECTORS; k++)
     {
         totalSize += byteVectors[k].TotalCount();
@@ -936,6 +1032,91 @@ void GetSharing::SortData()
     }
 
     gHeapSizeParameters.RecordSharingData(totalRecovered);
+    globalStats.setSize(PSS_GC_SHARE_SAVED, totalRecovered * sizeof(PolyWord));
+}
+
+// The next local space to be processed by the incremental sharing pass.
+static size_t nextShareSpace = 0;
+
+static void addSpaceTask(GCTaskId *, void *arg1, void *arg2)
+{
+    GetSharing *sharer = (GetSharing *)arg1;
+    LocalMemSpace *space = (LocalMemSpace *)arg2;
+    sharer->AddObjectsInRegion(space->bottom, space->lowerAllocPtr);
+    sharer->AddObjectsInRegion(space->upperAllocPtr, space->top);
+}
+
+// Share the objects in the next set of local spaces within the time budget.
+static void IncrementalSharingPhase(void)
+{
+    TIMEDATA startTime = GetRealTime();
+    float timeLimit = (float)userOptions.gcsharebudget / 1000.0f;
+    GetSharing sharer;
+    sharer.SetTimeLimit(startTime, timeLimit);
+
+    size_t nSpaces = gMem.lSpaces.size();
+    if (nextShareSpace >= nSpaces)
+        nextShareSpace = 0;
+    unsigned batchSize = gpTaskFarm->ThreadCount();
+    if (batchSize == 0) batchSize = 1;
+
+    // Scan the spaces a batch at a time, each into a separate table, until
+    // half the budget has been used or we have been round all of them.
+    // The allocation spaces contain only recent data so are skipped.
+    std::vector<GetSharing*> tables;
+    size_t processed = 0, spacesScanned = 0;
+    bool outOfMemory = false;
+    while (processed < nSpaces && ! outOfMemory)
+    {
+        for (unsigned n = 0; n < batchSize && processed < nSpaces; processed++)
+        {
+            LocalMemSpace *space = gMem.lSpaces[(nextShareSpace + processed) % nSpaces];
+            if (space->allocationSpace)
+                continue;
+            GetSharing *table;
+            try {
+                table = new GetSharing;
+            }
+            catch (std::bad_alloc &) {
+                outOfMemory = true;
+                break;
+            }
+            tables.push_back(table);
+            gpTaskFarm->AddWorkOrRunNow(addSpaceTask, table, space);
+            spacesScanned++;
+            n++;
+        }
+        gpTaskFarm->WaitForCompletion();
+        TIMEDATA now = GetRealTime();
+        now.sub(startTime);
+        if (now.toSeconds() * 2 > timeLimit)
+            break;
+    }
+    nextShareSpace = nSpaces == 0 ? 0 : (nextShareSpace + processed) % nSpaces;
+
+    for (std::vector<GetSharing*>::iterator i = tables.begin(); i < tables.end(); i++)
+    {
+        sharer.Merge(**i);
+        delete(*i);
+    }
+
+    if (debugOptions & DEBUG_GC)
+        Log("GC: Share: Incremental: %" PRI_SIZET " of %" PRI_SIZET " spaces: Total %" POLYUFMT " (%" POLYUFMT " words) byte %" POLYUFMT " word %" POLYUFMT ".\n",
+            spacesScanned, nSpaces, sharer.totalVisited, sharer.totalSize, sharer.byteAdded, sharer.wordAdded);
+
+    gHeapSizeParameters.RecordGCTime(HeapSizeParameters::GCTimeIntermediate, "Table");
+
+    sharer.SortData();
+
+    gHeapSizeParameters.RecordGCTime(HeapSizeParameters::GCTimeIntermediate, "Sort");
+
+    if (debugOptions & DEBUG_GC)
+    {
+        TIMEDATA now = GetRealTime();
+        now.sub(startTime);
+        Log("GC: Share: Incremental pass saved %" POLYUFMT " bytes in %1.3f seconds\n",
+            sharer.totalRecovered * sizeof(PolyWord), now.toSeconds());
+    }
 }
 
 void GCSharingPhase(void)
@@ -943,14 +1124,20 @@ void GCSharingPhase(void)
     mainThreadPhase = MTP_GCPHASESHARING;
     gcProgressBeginSharingGC();
 
-    GetSharing sharer;
-
     for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
     {
         LocalMemSpace *lSpace = *i;
         lSpace->bitmap.ClearBits(0, lSpace->spaceSize());
     }
 
+    if (userOptions.gcsharebudget != 0)
+    {
+        IncrementalSharingPhase();
+        return;
+    }
+
+    GetSharing sharer;
+
     // Scan the code areas to share any constants.  We don't share the code
     // cells themselves.
     for (std::vector<CodeSpace *>::iterator i = gMem.cSpaces.begin(); i < gMem.cSpaces.end(); i++)
@@ -52,6 +52,7 @@ tomb-stone that contains its new location.
 #include "bitmap.h"
 #include "memmgr.h"
 #include "gctaskfarm.h"
+#include "numa.h"
 #include "diagnostics.h"
 
 class MTGCProcessUpdate: public ScanAddress
@@ -218,6 +219,7 @@ static void updateLocalArea(GCTaskId*, void *arg1, void *arg2)
         Log("GC: Update local area %p\n", space);
     // Process the current generation for mutable or immutable areas.
     processUpdate->UpdateObjectsInArea(space);
+    gNumaTopology.RecordScan(space->numaNode, space->updated);
     if (debugOptions & DEBUG_GC_ENHANCED)
         Log("GC: Completed local update for %p. %lu words updated\n", space, space->updated);
 }
@@ -258,7 +260,7 @@ void GCUpdatePhase()
     {
         LocalMemSpace *space = *i;
         // As well as updating the addresses this also clears the bitmaps.
-        gpTaskFarm->AddWorkOrRunNow(&updateLocalArea, &processUpdate, space);
+        gpTaskFarm->AddWorkOrRunNow(&updateLocalArea, &processUpdate, space, space->numaNode);
     }
     // Scan the permanent mutable areas and the code areas.
     for (std::vector<PermanentMemSpace*>::iterator i = gMem.pSpaces.begin(); i < gMem.pSpaces.end(); i++)
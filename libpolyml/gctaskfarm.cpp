@@ -1,7 +1,7 @@
 /*
     Title:      Task farm for Multi-Threaded Garbage Collector
 
-    Copyright (c) 2010, 2019, 2021 David C. J. Matthews
+    Copyright (c) 2010, 2019, 2021, 2026 David C. J. Matthews
 
     This library is free software; you can redistribute it and/or
     modify it under the terms of the GNU Lesser General Public
@@ -37,6 +37,10 @@
 #include <sys/time.h>
 #endif
 
+#if (!defined(_WIN32))
+#include <sched.h>
+#endif
+
 #ifdef HAVE_ASSERT_H
 #include <assert.h>
 #define ASSERT(x)   assert(x)
@@ -47,62 +51,217 @@
 #include "gctaskfarm.h"
 #include "diagnostics.h"
 #include "timing.h"
+#include "statistics.h"
 
 static GCTaskId gTask;
 
 GCTaskId *globalTask = &gTask;
 
-GCTaskFarm::GCTaskFarm(): workLock("GC task farm work")
+// Atomic operations used in the deques.  All of these are full barriers
+// apart from the plain loads and stores.
+#if (defined(__GNUC__))
+static inline intptr_t atomicLoad(intptr_t *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline void atomicStore(intptr_t *p, intptr_t v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+static inline bool atomicCAS(intptr_t *p, intptr_t oldV, intptr_t newV)
+    { return __atomic_compare_exchange_n(p, &oldV, newV, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED); }
+static inline intptr_t atomicAdd(intptr_t *p, intptr_t v) { return __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST); }
+static inline void memoryFence() { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+#elif (defined(_MSC_VER))
+static inline intptr_t atomicLoad(intptr_t *p) { intptr_t v = *(volatile intptr_t*)p; _ReadWriteBarrier(); return v; }
+static inline void atomicStore(intptr_t *p, intptr_t v) { _ReadWriteBarrier(); *(volatile intptr_t*)p = v; }
+# if (SIZEOF_VOIDP == 8)
+static inline bool atomicCAS(intptr_t *p, intptr_t oldV, intptr_t newV)
+    { return InterlockedCompareExchange64((LONGLONG*)p, newV, oldV) == oldV; }
+static inline intptr_t atomicAdd(intptr_t *p, intptr_t v) { return InterlockedExchangeAdd64((LONGLONG*)p, v) + v; }
+# else
+static inline bool atomicCAS(intptr_t *p, intptr_t oldV, intptr_t newV)
+    { return InterlockedCompareExchange((LONG*)p, newV, oldV) == oldV; }
+static inline intptr_t atomicAdd(intptr_t *p, intptr_t v) { return InterlockedExchangeAdd((LONG*)p, v) + v; }
+# endif
+static inline void memoryFence() { MemoryBarrier(); }
+#else
+// Fallback on other targets.
+static PLock atomicLock("GC task farm atomic");
+static inline intptr_t atomicLoad(intptr_t *p) { PLocker l(&atomicLock); return *p; }
+static inline void atomicStore(intptr_t *p, intptr_t v) { PLocker l(&atomicLock); *p = v; }
+static inline bool atomicCAS(intptr_t *p, intptr_t oldV, intptr_t newV)
+{
+    PLocker l(&atomicLock);
+    if (*p != oldV) return false;
+    *p = newV;
+    return true;
+}
+static inline intptr_t atomicAdd(intptr_t *p, intptr_t v) { PLocker l(&atomicLock); return *p += v; }
+static inline void memoryFence() { PLocker l(&atomicLock); }
+#endif
+
+// Chase-Lev work-stealing deque.  The owner adds and removes entries at the
+// bottom and other threads steal from the top.  The buffer is fixed size so
+// adding an entry fails if it is full.
+class GCWorkDeque
 {
-    queueSize = queueIn = queuedItems = 0;
-    workQueue = 0;
+public:
+    GCWorkDeque(): top(0), bottom(0), buffer(0), mask(0), steals(0), idleSpins(0), seed(0) {}
+    ~GCWorkDeque() { free(buffer); }
+
+    bool Initialise(unsigned size, unsigned s);
+    bool Push(const queue_entry &entry);
+    bool Pop(queue_entry &entry);
+    bool Steal(queue_entry &entry);
+    bool IsEmpty() { return atomicLoad(&bottom) <= atomicLoad(&top); }
+    unsigned Random();
+
+    intptr_t top, bottom;
+    queue_entry *buffer;
+    intptr_t mask;
+    // Statistics.  Only updated by the worker that owns the deque.
+    size_t steals, idleSpins;
+    unsigned seed;
+};
+
+bool GCWorkDeque::Initialise(unsigned size, unsigned s)
+{
+    unsigned capacity = 1;
+    while (capacity < size) capacity <<= 1;
+    buffer = (queue_entry*)calloc(capacity, sizeof(queue_entry));
+    if (buffer == 0) return false;
+    mask = capacity-1;
+    seed = s;
+    return true;
+}
+
+bool GCWorkDeque::Push(const queue_entry &entry)
+{
+    intptr_t b = bottom; // Only the owner modifies bottom.
+    intptr_t t = atomicLoad(&top);
+    if (b - t > mask)
+        return false; // Full
+    buffer[b & mask] = entry;
+    atomicStore(&bottom, b+1);
+    return true;
+}
+
+bool GCWorkDeque::Pop(queue_entry &entry)
+{
+    intptr_t b = bottom - 1;
+    atomicStore(&bottom, b);
+    memoryFence();
+    intptr_t t = atomicLoad(&top);
+    if (t > b)
+    {
+        // Empty
+        atomicStore(&bottom, b+1);
+        return false;
+    }
+    entry = buffer[b & mask];
+    if (t == b)
+    {
+        // This is the last entry.  We have to compete with any thief.
+        bool won = atomicCAS(&top, t, t+1);
+        atomicStore(&bottom, b+1);
+        return won;
+    }
+    return true;
+}
+
+bool GCWorkDeque::Steal(queue_entry &entry)
+{
+    intptr_t t = atomicLoad(&top);
+    memoryFence();
+    intptr_t b = atomicLoad(&bottom);
+    if (t >= b)
+        return false;
+    // Read the entry before claiming it.  If the owner has wrapped round and
+    // overwritten it the CAS will fail.
+    entry = buffer[t & mask];
+    return atomicCAS(&top, t, t+1);
+}
+
+// Simple xorshift generator used to choose the victim for stealing.
+unsigned GCWorkDeque::Random()
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+GCTaskFarm::GCTaskFarm(): workLock("GC task farm work"), externalLock("GC task farm external")
+{
+    queueSize = 0;
+    deques = 0;
+    sharedDeques = 1;
+    queuedItems = pendingTasks = sleepingThreads = 0;
     terminate = false;
-    threadCount = activeThreadCount = 0;
+    threadCount = 0;
     threadHandles = 0;
+    workerArgs = 0;
 }
 
 GCTaskFarm::~GCTaskFarm()
 {
     Terminate();
-    free(workQueue);
+    delete[](deques);
     free(threadHandles);
+    free(workerArgs);
 }
 
+// Argument for a worker thread.
+struct WorkerArg {
+    GCTaskFarm *farm;
+    unsigned workerNo;
+};
 
 bool GCTaskFarm::Initialise(unsigned thrdCount, unsigned qSize)
 {
     terminate = false;
     if (!waitForWork.Init(0, thrdCount)) return false;
-    workQueue = (queue_entry*)calloc(qSize, sizeof(queue_entry));
-    if (workQueue == 0) return false;
+    // There is one deque for each worker and then one for each node for other threads.
+    sharedDeques = gNumaTopology.NodeCount();
+    deques = new GCWorkDeque[thrdCount+sharedDeques];
+    for (unsigned d = 0; d < thrdCount+sharedDeques; d++)
+    {
+        if (! deques[d].Initialise(qSize, d * 2654435761U + 1))
+            return false;
+    }
 #if (!defined(_WIN32))
-    queueSize = qSize;
+    if (pthread_key_create(&workerKey, NULL) != 0) return false;
     threadHandles = (pthread_t*)calloc(thrdCount, sizeof(pthread_t));
     if (threadHandles == 0) return false;
 #else
-    queueSize = qSize;
+    workerKey = TlsAlloc();
+    if (workerKey == TLS_OUT_OF_INDEXES) return false;
     threadHandles = (HANDLE*)calloc(thrdCount, sizeof(HANDLE));
     if (threadHandles == 0) return false;
 #endif
+    WorkerArg *args = (WorkerArg*)calloc(thrdCount, sizeof(WorkerArg));
+    if (args == 0) return false;
+    // The threads reference the arguments so they are freed in the destructor.
+    workerArgs = args;
     // Create the worker threads.
     for (unsigned i = 0; i < thrdCount; i++) {
+        args[i].farm = this;
+        args[i].workerNo = i;
         // Fork a thread
 #if (!defined(_WIN32))
         // Create a thread that isn't joinable since we don't want to wait
         // for it to finish.
         pthread_t pthreadId;
-        bool isError = pthread_create(&pthreadId, NULL, WorkerThreadFunction, this) != 0;
+        bool isError = pthread_create(&pthreadId, NULL, WorkerThreadFunction, &args[i]) != 0;
         if (isError) break;
         threadHandles[threadCount++] = pthreadId;
 #else
         DWORD dwThrdId; // Have to provide this although we don't use it.
         HANDLE threadHandle =
-            CreateThread(NULL, 0, WorkerThreadFunction, this, 0, &dwThrdId);
+            CreateThread(NULL, 0, WorkerThreadFunction, &args[i], 0, &dwThrdId);
         if (threadHandle == NULL) break;
         threadHandles[threadCount++] = threadHandle;
 #endif
     }
-
+    // The deques are only used if there is at least one worker.  If we
+    // couldn't create all the threads the deques for the missing workers
+    // remain empty.
+    queueSize = threadCount == 0 ? 0 : qSize;
     return true;
 }
 
@@ -121,131 +280,244 @@ void GCTaskFarm::Terminate()
 #endif
 }
 
-// Add work to the queue.  Returns true if it succeeds.
-bool GCTaskFarm::AddWork(gctask work, void *arg1, void *arg2)
+// Add work to the queue.  Returns true if it succeeds.  A worker adds the
+// work to its own deque unless it is for another node.  Any other thread adds
+// it to the shared deque for the node.
+bool GCTaskFarm::AddWork(gctask work, void *arg1, void *arg2, unsigned node)
 {
-    bool wantSignal = false;
+    if (queueSize == 0)
+        return false; // Single-threaded
+    queue_entry entry;
+    entry.task = work;
+    entry.arg1 = arg1;
+    entry.arg2 = arg2;
+#if (!defined(_WIN32))
+    uintptr_t worker = (uintptr_t)pthread_getspecific(workerKey);
+#else
+    uintptr_t worker = (uintptr_t)TlsGetValue(workerKey);
+#endif
+    // The pending count must be incremented before the task can be stolen.
+    atomicAdd(&pendingTasks, 1);
+    bool added;
+    if (node != NUMA_ANY_NODE && node >= sharedDeques)
+        node = NUMA_ANY_NODE;
+    if (worker != 0 && (node == NUMA_ANY_NODE || node == DequeNode((unsigned)worker-1)))
+        added = deques[worker-1].Push(entry);
+    else
     {
-        PLocker l(&workLock);
-        if (queuedItems == queueSize)
-			return false; // Queue is full
-        workQueue[queueIn].task = work;
-        workQueue[queueIn].arg1 = arg1;
-        workQueue[queueIn].arg2 = arg2;
-        queueIn++;
-        if (queueIn == queueSize) queueIn = 0;
-        queuedItems++;
-        wantSignal = queuedItems <= threadCount;
+        PLocker l(&externalLock);
+        added = deques[threadCount + (node == NUMA_ANY_NODE ? 0 : node)].Push(entry);
     }
-    if (wantSignal) waitForWork.Signal();
+    if (! added)
+    {
+        TaskCompleted(); // Queue is full
+        return false;
+    }
+    atomicAdd(&queuedItems, 1);
+    // This must follow the push with a full barrier.  A worker that is about
+    // to sleep registers and then checks the deques.
+    memoryFence();
+    if (atomicLoad(&sleepingThreads) != 0)
+        WakeWorker();
     return true;
 }
 
+// Wake a sleeping worker if there is one.
+void GCTaskFarm::WakeWorker()
+{
+    while (true)
+    {
+        intptr_t sleepers = atomicLoad(&sleepingThreads);
+        if (sleepers == 0)
+            return;
+        if (atomicCAS(&sleepingThreads, sleepers, sleepers-1))
+        {
+            waitForWork.Signal();
+            return;
+        }
+    }
+}
+
+// Called when a task has finished.  If it was the last one signal the thread
+// in WaitForCompletion.
+void GCTaskFarm::TaskCompleted()
+{
+    if (atomicAdd(&pendingTasks, -1) == 0)
+    {
+        PLocker l(&workLock);
+        waitForCompletion.Signal();
+    }
+}
+
 // Schedule this as a task or run it immediately if the queue is full.
-void GCTaskFarm::AddWorkOrRunNow(gctask work, void *arg1, void *arg2)
+void GCTaskFarm::AddWorkOrRunNow(gctask work, void *arg1, void *arg2, unsigned node)
 {
-    if (! AddWork(work, arg1, arg2))
+    if (! AddWork(work, arg1, arg2, node))
         (*work)(globalTask, arg1, arg2);
 }
 
-void GCTaskFarm::ThreadFunction()
+unsigned GCTaskFarm::CurrentNode()
+{
+    // The key is only created if there are worker threads.
+    if (queueSize == 0)
+        return gNumaTopology.CurrentNode(0);
+#if (!defined(_WIN32))
+    uintptr_t worker = (uintptr_t)pthread_getspecific(workerKey);
+#else
+    uintptr_t worker = (uintptr_t)TlsGetValue(workerKey);
+#endif
+    if (worker != 0)
+        return DequeNode((unsigned)worker-1);
+    return gNumaTopology.CurrentNode(0);
+}
+
+// Look for work, first in our own deque and then by stealing from
+// another deque chosen at random.  In NUMA mode we try the deques on
+// our own node before those on other nodes.
+bool GCTaskFarm::FindWork(unsigned workerNo, queue_entry &entry)
+{
+    GCWorkDeque *own = &deques[workerNo];
+    if (own->Pop(entry))
+        return true;
+    unsigned nDeques = threadCount+sharedDeques;
+    unsigned start = own->Random() % nDeques;
+    unsigned ownNode = gNumaTopology.NodeOfWorker(workerNo);
+    for (unsigned pass = 0; pass < 2; pass++)
+    {
+        for (unsigned i = 0; i < nDeques; i++)
+        {
+            unsigned victim = (start + i) % nDeques;
+            if (victim == workerNo || (DequeNode(victim) == ownNode) != (pass == 0))
+                continue;
+            // Retry if we lost a race with another thread since there may still be work.
+            while (! deques[victim].IsEmpty())
+            {
+                if (deques[victim].Steal(entry))
+                {
+                    own->steals++;
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+// Number of times a worker looks for work before it sleeps.
+#define GC_IDLE_SPINS   100
+
+void GCTaskFarm::ThreadFunction(unsigned workerNo)
 {
 #ifdef HAVE_PTHREAD_JIT_WRITE_PROTECT_NP
     // On MacOS this thread needs to be marked to write rather than execute.
     pthread_jit_write_protect_np(false);
 #endif
+#if (!defined(_WIN32))
+    pthread_setspecific(workerKey, (void*)(uintptr_t)(workerNo+1));
+#else
+    TlsSetValue(workerKey, (void*)(uintptr_t)(workerNo+1));
+#endif
+    gNumaTopology.PinThreadToNode(gNumaTopology.NodeOfWorker(workerNo));
     GCTaskId myTaskId;
+    GCWorkDeque *own = &deques[workerNo];
 #if (defined(_WIN32))
     DWORD startActive = GetTickCount();
 #else
     struct timeval startTime;
     gettimeofday(&startTime, NULL);
 #endif
-    workLock.Lock();
-    activeThreadCount++;
+    unsigned spins = 0;
     while (! terminate) {
-        // Invariant: We have the lock and the activeThreadCount includes this thread.
-        // Find some work.
-
-        if (queuedItems > 0) { // There is work
-            unsigned outPos;
-            if (queuedItems > queueIn)
-                outPos = queueIn+queueSize-queuedItems;
-            else outPos = queueIn-queuedItems;
-            gctask work = workQueue[outPos].task;
-            void *arg1 = workQueue[outPos].arg1;
-            void *arg2 = workQueue[outPos].arg2;
-            workQueue[outPos].task = 0;
-            queuedItems--;
-            ASSERT(work != 0);
-            workLock.Unlock();
-            (*work)(&myTaskId, arg1, arg2);
-            workLock.Lock();
+        queue_entry entry;
+        if (FindWork(workerNo, entry))
+        {
+            atomicAdd(&queuedItems, -1);
+            ASSERT(entry.task != 0);
+            (*entry.task)(&myTaskId, entry.arg1, entry.arg2);
+            TaskCompleted();
+            spins = 0;
+            continue;
         }
-        else {
-            activeThreadCount--; // We're no longer active
-            // If there is no work and we're the last active thread signal the
-            // main thread that the queue is empty
-            bool wantSignal = activeThreadCount == 0;
-            if (wantSignal)
-                waitForCompletion.Signal();
-            // Now release the lock.  In our Windows partial implementation of
-            // condition vars we assume that signalling is done with the lock
-            // still held.
-            workLock.Unlock();
-
-            if (debugOptions & DEBUG_GCTASKS)
-            {
+        if (spins++ < GC_IDLE_SPINS)
+        {
+            own->idleSpins++;
 #if (defined(_WIN32))
-                Log("GCTask: Thread %p blocking after %u milliseconds\n", &myTaskId,
-                     GetTickCount() - startActive);
+            SwitchToThread();
 #else
-                struct timeval endTime;
-                gettimeofday(&endTime, NULL);
-                subTimevals(&endTime, &startTime);
-                Log("GCTask: Thread %p blocking after %0.4f seconds\n", &myTaskId,
-                    (float)endTime.tv_sec + (float)endTime.tv_usec / 1.0E6);
+            sched_yield();
 #endif
+            continue;
+        }
+        spins = 0;
+        // Register to be woken and then check again.  Any thread that adds work
+        // after this will see the registration.
+        atomicAdd(&sleepingThreads, 1);
+        if (atomicLoad(&queuedItems) != 0)
+        {
+            // Work has arrived.  Cancel the registration unless a thread has
+            // already taken it in which case there will be a signal to absorb.
+            intptr_t sleepers;
+            bool cancelled = false;
+            while ((sleepers = atomicLoad(&sleepingThreads)) != 0)
+            {
+                if (atomicCAS(&sleepingThreads, sleepers, sleepers-1))
+                {
+                    cancelled = true;
+                    break;
+                }
             }
+            if (! cancelled)
+                waitForWork.Wait();
+            continue;
+        }
 
-            if (terminate) return;
-            // Block until there's work.
-            waitForWork.Wait();
-            // We've been woken up
-            if (debugOptions & DEBUG_GCTASKS)
-            {
+        if (debugOptions & DEBUG_GCTASKS)
+        {
 #if (defined(_WIN32))
-                startActive = GetTickCount();
+            Log("GCTask: Thread %p blocking after %u milliseconds\n", &myTaskId,
+                 GetTickCount() - startActive);
 #else
-                gettimeofday(&startTime, NULL);
+            struct timeval endTime;
+            gettimeofday(&endTime, NULL);
+            subTimevals(&endTime, &startTime);
+            Log("GCTask: Thread %p blocking after %0.4f seconds\n", &myTaskId,
+                (float)endTime.tv_sec + (float)endTime.tv_usec / 1.0E6);
 #endif
-                Log("GCTask: Thread %p resuming\n", &myTaskId);
-            }
-            workLock.Lock();
-            activeThreadCount++;
+        }
+
+        if (terminate) return;
+        // Block until there's work.
+        waitForWork.Wait();
+        // We've been woken up
+        if (debugOptions & DEBUG_GCTASKS)
+        {
+#if (defined(_WIN32))
+            startActive = GetTickCount();
+#else
+            gettimeofday(&startTime, NULL);
+#endif
+            Log("GCTask: Thread %p resuming\n", &myTaskId);
         }
     }
-    activeThreadCount--;
-    workLock.Unlock();
 }
 
 #if (!defined(_WIN32))
 void *GCTaskFarm::WorkerThreadFunction(void *parameter)
 {
-    GCTaskFarm *t = (GCTaskFarm *)parameter;
-    t->ThreadFunction();
+    WorkerArg *arg = (WorkerArg *)parameter;
+    arg->farm->ThreadFunction(arg->workerNo);
     return 0;
 }
 #else
 DWORD WINAPI GCTaskFarm::WorkerThreadFunction(void *parameter)
 {
-    GCTaskFarm *t = (GCTaskFarm *)parameter;
-    t->ThreadFunction();
+    WorkerArg *arg = (WorkerArg *)parameter;
+    arg->farm->ThreadFunction(arg->workerNo);
     return 0;
 }
 #endif
 
-// Wait until the queue is empty.
+// Wait until all the tasks have completed.
 void GCTaskFarm::WaitForCompletion(void)
 {
 #if (defined(_WIN32))
@@ -258,10 +530,22 @@ void GCTaskFarm::WaitForCompletion(void)
         gettimeofday(&startWait, NULL);
 #endif
     workLock.Lock();
-    while (activeThreadCount > 0 || queuedItems > 0)
+    while (atomicLoad(&pendingTasks) != 0)
         waitForCompletion.Wait(&workLock);
     workLock.Unlock();
 
+    // Update the statistics.  The workers are idle so we can read their counts.
+    size_t steals = 0, idleSpins = 0;
+    for (unsigned i = 0; i < threadCount; i++)
+    {
+        steals += deques[i].steals;
+        idleSpins += deques[i].idleSpins;
+        if (debugOptions & DEBUG_GCTASKS)
+            Log("GCTask: Worker %u: %" PRI_SIZET " steals %" PRI_SIZET " idle spins\n", i, deques[i].steals, deques[i].idleSpins);
+    }
+    globalStats.setCount(PSC_GC_TASK_STEALS, steals);
+    globalStats.setCount(PSC_GC_TASK_IDLE, idleSpins);
+
     if (debugOptions & DEBUG_GCTASKS)
     {
 #if (defined(_WIN32))
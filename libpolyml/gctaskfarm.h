@@ -1,7 +1,7 @@
 /*
     Title:      Task farm for Multi-Threaded Garbage Collector
 
-    Copyright (c) 2010-12, 2019 David C. J. Matthews
+    Copyright (c) 2010-12, 2019, 2026 David C. J. Matthews
 
     This library is free software; you can redistribute it and/or
     modify it under the terms of the GNU Lesser General Public
@@ -22,7 +22,9 @@
 #ifndef GCTASKFARM_H_INCLUDED
 #define GCTASKFARM_H_INCLUDED
 
+#include "globals.h"
 #include "locking.h"
+#include "numa.h"
 
 // An empty class just used as an ID.
 class GCTaskId {
@@ -42,6 +44,11 @@ typedef struct {
     void    *arg2;
 } queue_entry;
 
+// Work-stealing deque.  There is one for each worker thread and one for each
+// NUMA node that is shared by any other thread that adds work.
+class GCWorkDeque;
+struct WorkerArg;
+
 class GCTaskFarm {
 public:
     GCTaskFarm();
@@ -53,8 +60,9 @@ public:
     // Posix fork in case there is a GC before the exec.
     void SetSingleThreaded() { threadCount = 0; queueSize = 0; }
 
-    bool AddWork(gctask task, void *arg1, void *arg2);
-    void AddWorkOrRunNow(gctask task, void *arg1, void *arg2);
+    // In NUMA mode work for a particular node is preferentially run by a worker on that node.
+    bool AddWork(gctask task, void *arg1, void *arg2, unsigned node = NUMA_ANY_NODE);
+    void AddWorkOrRunNow(gctask task, void *arg1, void *arg2, unsigned node = NUMA_ANY_NODE);
     void WaitForCompletion(void);
     void Terminate(void);
     // See if the queue is draining.  Used as a hint as to whether
@@ -62,31 +70,46 @@ public:
     bool Draining(void) const { return queuedItems == 0; }
 
     unsigned ThreadCount(void) const { return threadCount; }
+    // The NUMA node of the calling thread.
+    unsigned CurrentNode(void);
 
 private:
-    // The semaphore is zero if there is no work or some value up to
-    // the number of threads if there is work.
+    // Workers block on the semaphore when they can't find any work.  It is
+    // signalled once for each sleeping worker when work is added.
     PSemaphore waitForWork;
-    // The lock protects the queue and the item count.
+    // The lock is only used with the condition variable.
     PLock workLock;
-    // The condition variable is signalled when the queue is empty.
+    // The condition variable is signalled when all the tasks have completed.
     // This can only be waited for by a single thread because it's not a proper
     // implementation of a condition variable in Windows.
     PCondVar waitForCompletion;
-    unsigned queueSize, queueIn, queuedItems;
-    queue_entry *workQueue; // Array of unit->unit functions.
+    // Serialises additions from threads that are not workers.
+    PLock externalLock;
+    unsigned queueSize; // Capacity of each deque.
+    GCWorkDeque *deques; // One per worker and one per node for other threads.
+    unsigned sharedDeques; // Number of deques for other threads.
+    intptr_t queuedItems; // Tasks added but not yet started.
+    intptr_t pendingTasks; // Tasks added but not yet finished.
+    intptr_t sleepingThreads; // Workers that have registered to be woken.
     bool terminate; // Set to true to kill all workers.
     unsigned threadCount; // Count of workers.
-    unsigned activeThreadCount; // Count of workers doing work.
+    WorkerArg *workerArgs; // Arguments passed to the worker threads.
 
-    void ThreadFunction(void);
+    void ThreadFunction(unsigned workerNo);
+    bool FindWork(unsigned workerNo, queue_entry &entry);
+    void WakeWorker(void);
+    void TaskCompleted(void);
+    unsigned DequeNode(unsigned d) const
+        { return d < threadCount ? gNumaTopology.NodeOfWorker(d) : d - threadCount; }
 
 #if (!defined(_WIN32))
     static void *WorkerThreadFunction(void *parameter);
     pthread_t *threadHandles;
+    pthread_key_t workerKey; // Holds the deque number plus one for a worker thread.
 #else
     static DWORD WINAPI WorkerThreadFunction(void *parameter);
     HANDLE *threadHandles;
+    DWORD workerKey;
 #endif
 };
 
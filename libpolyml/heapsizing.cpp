@@ -1,7 +1,7 @@
 /*
     Title:  heapsizing.cpp - parameters to adjust heap size
 
-    Copyright (c) Copyright David C.J. Matthews 2012, 2015, 2017
+    Copyright (c) Copyright David C.J. Matthews 2012, 2015, 2017, 2026
 
     This library is free software; you can redistribute it and/or
     modify it under the terms of the GNU Lesser General Public
@@ -23,6 +23,13 @@ This module is intended to deal with heap sizing based on measurements of the ti
 in the GC compared with the application code.  Currently it is very basic.
 This also provides GC timing information to the ML code as well as statistics and
 debugging.
+There is an alternative policy, selected with --gcpause, for applications where the
+length of each pause matters more than the total time in the GC.  The time for a
+minor GC is roughly proportional to the amount of data it copies so the allocation
+area is sized from the measured pause per word copied and the proportion of the
+area that survives.  A major GC is started before the minor GCs can no longer promote
+their data.  The major GC pause depends on the live data rather than the heap size
+so if it exceeds the target the heap is grown, up to the maximum, to make them less frequent.
 */
 
 #ifdef HAVE_CONFIG_H
@@ -106,6 +113,10 @@ HeapSizeParameters::HeapSizeParameters()
     allocationFailedBeforeLastMajorGC = false;
     minHeapSize = 0;
     maxHeapSize = 0; // Unlimited
+    pauseTarget = 0; // Use the GC ratio
+    lastGCPause = 0;
+    minorSurvivalRate = 0;
+    pausePerWordCopied = 0;
     lastFreeSpace = 0;
     pagingLimitSize = 0;
     highWaterMark = 0;
@@ -137,7 +148,7 @@ static size_t GetPhysicalMemorySize(void);
 
 // Set the initial size based on any parameters specified on the command line.
 // Any of these can be zero indicating they should default.
-void HeapSizeParameters::SetHeapParameters(uintptr_t minsize, uintptr_t maxsize, uintptr_t initialsize, unsigned percent)
+void HeapSizeParameters::SetHeapParameters(uintptr_t minsize, uintptr_t maxsize, uintptr_t initialsize, unsigned percent, unsigned pauseMs)
 {
     minHeapSize = K_to_words(minsize); // If these overflow assume the result will be zero
     maxHeapSize = K_to_words(maxsize);
@@ -190,6 +201,7 @@ void HeapSizeParameters::SetHeapParameters(uintptr_t minsize, uintptr_t maxsize,
         userGCRatio = (float)percent / (float)(100 - percent);
 
     predictedRatio = lastMajorGCRatio = userGCRatio;
+    pauseTarget = (double)pauseMs / 1000.0;
 
     if (debugOptions & DEBUG_HEAPSIZE)
     {
@@ -199,7 +211,10 @@ void HeapSizeParameters::SetHeapParameters(uintptr_t minsize, uintptr_t maxsize,
         LogSize(minHeapSize);
         Log(" maximum ");
         LogSize(maxHeapSize);
-        Log(" target ratio %f\n", userGCRatio);
+        Log(" target ratio %f", userGCRatio);
+        if (pauseTarget != 0)
+            Log(" target pause %0.3f", pauseTarget);
+        Log("\n");
     }
 }
 
@@ -426,6 +441,25 @@ void HeapSizeParameters::AdjustSizeAfterMajorGC(uintptr_t wordsRequired)
         }
     }
 
+    // If we have a pause-time target and this GC exceeded it we can't make the
+    // next major GC any shorter but we can make them less frequent.
+    if (pauseTarget != 0 && lastGCPause > pauseTarget)
+    {
+        uintptr_t pauseHeapSize = heapSpace * 2;
+        if (pauseHeapSize > maxHeapSize) pauseHeapSize = maxHeapSize;
+        if (pauseHeapSize > newHeapSize)
+        {
+            if (debugOptions & DEBUG_HEAPSIZE)
+            {
+                Log("Heap: Major GC pause %0.3f exceeds target %0.3f: growing heap to ", lastGCPause, pauseTarget);
+                LogSize(pauseHeapSize);
+                Log("\n");
+            }
+            newHeapSize = pauseHeapSize;
+            cost = costFunction(newHeapSize, false, true);
+        }
+    }
+
     if (debugOptions & DEBUG_HEAPSIZE)
     {
         if (performSharingPass)
@@ -509,6 +543,24 @@ bool HeapSizeParameters::AdjustSizeAfterMinorGC(uintptr_t spaceAfterGC, uintptr_
     // rather than run out of space.
     if (allocationFailedBeforeLastMajorGC)
         allowedAlloc = allowedAlloc / 2;
+    if (pauseTarget != 0)
+    {
+        allowedAlloc = PauseTargetAllocation(allowedAlloc, spaceCopiedOut);
+        // Run a major GC if the heap, as sized by the last major GC, would not hold
+        // the data we expect the next minor GC to promote.  If the minor GC fails
+        // we have the cost of that as well as the major GC.
+        uintptr_t expectedPromotion = (uintptr_t)((double)allowedAlloc * minorSurvivalRate);
+        if (nonAlloc + allowedAlloc + expectedPromotion > gMem.SpaceForHeap())
+        {
+            if (debugOptions & DEBUG_HEAPSIZE)
+            {
+                Log("Heap: Expected promotion of ");
+                LogSize(expectedPromotion);
+                Log(" will not fit: next GC will be a major GC\n");
+            }
+            fullGCNextTime = true;
+        }
+    }
     if (gMem.CurrentAllocSpace() - allocatedInAlloc != allowedAlloc)
     {
         if (debugOptions & DEBUG_HEAPSIZE)
@@ -531,6 +583,48 @@ bool HeapSizeParameters::AdjustSizeAfterMinorGC(uintptr_t spaceAfterGC, uintptr_
     return true;
 }
 
+// Choose the size of the allocation area that should give a minor GC pause
+// close to the target.  The result is no more than allowedAlloc, the space the
+// heap limit allows, and it doesn't grow by more than a factor of two each time.
+uintptr_t HeapSizeParameters::PauseTargetAllocation(uintptr_t allowedAlloc, uintptr_t spaceCopiedOut)
+{
+    uintptr_t currentAlloc = gMem.SpaceBeforeMinorGC();
+    if (currentAlloc == 0)
+        return allowedAlloc;
+    // Use a moving average to smooth out variations between GCs.
+    double survival = (double)spaceCopiedOut / (double)currentAlloc;
+    if (survival > 1.0) survival = 1.0;
+    minorSurvivalRate = minorSurvivalRate == 0 ? survival : (minorSurvivalRate + survival) / 2;
+    if (spaceCopiedOut != 0)
+    {
+        double perWord = lastGCPause / (double)spaceCopiedOut;
+        pausePerWordCopied = pausePerWordCopied == 0 ? perWord : (pausePerWordCopied + perWord) / 2;
+    }
+
+    uintptr_t newAlloc = allowedAlloc;
+    if (minorSurvivalRate != 0 && pausePerWordCopied != 0)
+    {
+        double target = pauseTarget / (pausePerWordCopied * minorSurvivalRate);
+        if (target < (double)newAlloc)
+            newAlloc = (uintptr_t)target;
+    }
+    if (newAlloc > currentAlloc * 2)
+        newAlloc = currentAlloc * 2;
+    // AdjustSizeAfterMinorGC runs a major GC if the area is smaller than this.
+    uintptr_t minAlloc = gMem.DefaultSpaceSize() * 2;
+    if (newAlloc < minAlloc)
+        newAlloc = minAlloc < allowedAlloc ? minAlloc : allowedAlloc;
+
+    if (debugOptions & DEBUG_HEAPSIZE)
+    {
+        Log("Heap: Minor GC pause %0.3f (target %0.3f) survival rate %0.3f: allocation area ",
+            lastGCPause, pauseTarget, minorSurvivalRate);
+        LogSize(newAlloc);
+        Log("\n");
+    }
+    return newAlloc;
+}
+
 // Estimate the GC cost for a given heap size.  The result is the ratio of
 // GC time to application time.
 // This is really guesswork.
@@ -749,6 +843,7 @@ void HeapSizeParameters::RecordGCTime(gcTime isEnd, const char *stage)
             totalGCUserCPU.add(userTime);
             totalGCSystemCPU.add(systemTime);
             totalGCReal.add(realTime);
+            lastGCPause = realTime.toSeconds();
 
             if (debugOptions & DEBUG_GC)
             {
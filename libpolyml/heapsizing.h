@@ -34,7 +34,9 @@ public:
     Handle getGCUtime(TaskData *taskData) const;
     Handle getGCStime(TaskData *taskData) const;
 
-    void SetHeapParameters(uintptr_t minsize, uintptr_t maxsize, uintptr_t initialsize, unsigned percent);
+    // If pauseMs is non-zero the allocation area and the heap are sized to keep the
+    // GC pauses within that time rather than purely by the GC time percentage.
+    void SetHeapParameters(uintptr_t minsize, uintptr_t maxsize, uintptr_t initialsize, unsigned percent, unsigned pauseMs);
 
     void SetReservation(uintptr_t rsize);
 
@@ -52,6 +54,8 @@ public:
 
     // Returns true if we should run a major GC at this point
     bool RunMajorGCImmediately();
+    // Returns true if the next GC is expected to be a major GC.
+    bool MajorGCExpected() const { return fullGCNextTime; }
 
     /* Called by the garbage collector at the beginning and
        end of garbage collection. */
@@ -79,6 +83,9 @@ private:
 
     bool getCostAndSize(uintptr_t &heapSize, double &cost, bool withSharing);
 
+    // Size the allocation area from the pause time and survival rate of the last minor GC.
+    uintptr_t PauseTargetAllocation(uintptr_t allowedAlloc, uintptr_t spaceCopiedOut);
+
     // Set if we should do a full GC next time instead of a minor GC.
     bool fullGCNextTime;
 
@@ -98,6 +105,13 @@ private:
 
     // Target GC cost requested by the user.
     double userGCRatio;
+    // Target pause time in seconds.  Zero if we are sizing only by the GC cost.
+    double pauseTarget;
+    // Real time taken by the last GC.
+    double lastGCPause;
+    // Smoothed estimates of the proportion of the allocation area that survives
+    // a minor GC and the minor GC pause for each word copied.
+    double minorSurvivalRate, pausePerWordCopied;
     // Actual ratio for the last major GC
     double lastMajorGCRatio;
     // Predicted ratio for the next GC
@@ -87,6 +87,9 @@ public:
 
     virtual void addProfileCount(POLYUNSIGNED words) { addSynchronousCount(interpreterPc, words); }
 
+    virtual void sampleAllocation(POLYUNSIGNED words, PolyObject *obj)
+    { addAllocationSample(this, interpreterPc, taskSp, words, obj); }
+
     virtual void CopyStackFrame(StackObject *old_stack, uintptr_t old_length, StackObject *new_stack, uintptr_t new_length);
 
     PLock interruptLock;
@@ -315,7 +318,7 @@ bool IntTaskData::AddTimeProfileCount(SIGNALCONTEXT *context)
         MemSpace *space = gMem.SpaceForAddress(interpreterPc);
         if (space != 0 && (space->spaceType == ST_CODE || space->spaceType == ST_PERMANENT))
         {
-            incrementCountAsynch(interpreterPc);
+            incrementCountAsynch(this, interpreterPc, taskSp);
             return true;
         }
     }
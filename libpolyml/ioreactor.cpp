@@ -0,0 +1,396 @@
+/*
+    Title:  ioreactor.cpp - Wait for file descriptors to become ready
+
+    Copyright (c) 2026 David C.J. Matthews
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#elif defined(_WIN32)
+#include "winconfig.h"
+#else
+#error "No configuration file"
+#endif
+
+#if (!defined(_WIN32))
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef __linux__
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <vector>
+#include <utility>
+#endif
+
+#include "ioreactor.h"
+#include "locking.h"
+#include "rts_module.h"
+
+#ifdef __linux__
+
+// A thread blocked in WaitForDescriptors.
+class ReactorWaiter
+{
+public:
+    ReactorWaiter(): woken(false) {}
+    PCondVar wakeUp;
+    bool woken;
+};
+
+// Once a descriptor has been waited for it is registered with epoll and
+// remains registered until it is closed.  It is level-triggered and one-shot
+// for the events the threads waiting for it want.  When epoll reports it the
+// reactor thread marks it as ready and it is disarmed, so a descriptor that
+// nobody reads doesn't keep waking the reactor.  A wait only has to look again
+// at descriptors that have been reported or are not yet armed for the events it
+// wants.  An idle descriptor therefore costs nothing after the first wait.
+class DescriptorEntry
+{
+public:
+    DescriptorEntry(): registered(false), ready(false), armedEvents(0) {}
+    bool registered;
+    bool ready; // Reported by epoll since it was last armed.
+    short armedEvents; // The poll events it is armed for.  Zero if disarmed.
+    // The waiting threads and the poll events each is waiting for.
+    std::vector<std::pair<ReactorWaiter*, short> > waiters;
+};
+
+class IOReactor: public RtsModule
+{
+public:
+    IOReactor(): reactorLock("IO reactor"), epollFd(-1), stopFd(-1),
+        threadRunning(false), startFailed(false) {}
+
+    virtual void Stop(void);
+    virtual void ForkChild(void);
+
+    int Wait(struct pollfd *fds, unsigned nfds, unsigned maxMillisecs);
+    void Forget(int fd);
+
+private:
+    bool StartThread(void);
+    void AddWaiter(ReactorWaiter *waiter, struct pollfd *fds, unsigned nfds);
+    void RemoveWaiter(ReactorWaiter *waiter, struct pollfd *fds, unsigned nfds);
+    int CheckDescriptors(struct pollfd *fds, unsigned nfds);
+    bool Arm(int fd);
+    void CloseDescriptors(void);
+    void ReactorThread(void);
+    static void *ReactorThreadFunction(void *);
+
+    PLock reactorLock; // Protects everything here.
+    int epollFd, stopFd;
+    bool threadRunning, startFailed;
+    pthread_t threadId;
+    std::vector<DescriptorEntry> descriptors; // Indexed by descriptor.
+};
+
+// Declare this.  It will be automatically added to the table.
+static IOReactor ioReactorModule;
+
+static unsigned ElapsedMillisecs(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned)((now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000);
+}
+
+int IOReactor::Wait(struct pollfd *fds, unsigned nfds, unsigned maxMillisecs)
+{
+    // With no time or no descriptors this is simply a poll or a sleep.
+    if (maxMillisecs == 0 || nfds == 0)
+        return poll(fds, nfds, maxMillisecs);
+
+    struct timespec startTime;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    ReactorWaiter waiter;
+    int result = -1;
+    {
+        PLocker lock(&reactorLock);
+        if (StartThread())
+        {
+            // Add the waiter first so that any event after we have looked at
+            // a descriptor wakes us.
+            AddWaiter(&waiter, fds, nfds);
+            while (true)
+            {
+                result = CheckDescriptors(fds, nfds);
+                if (result != 0) break;
+                unsigned elapsed = ElapsedMillisecs(&startTime);
+                if (elapsed >= maxMillisecs) break;
+                // We may be woken for an event we're not interested in.
+                if (! waiter.woken)
+                    waiter.wakeUp.WaitFor(&reactorLock, maxMillisecs - elapsed);
+                waiter.woken = false;
+            }
+            RemoveWaiter(&waiter, fds, nfds);
+        }
+    }
+    // If epoll can't be used, e.g. for a regular file, just poll.
+    if (result < 0)
+    {
+        unsigned elapsed = ElapsedMillisecs(&startTime);
+        return poll(fds, nfds, elapsed >= maxMillisecs ? 0 : maxMillisecs - elapsed);
+    }
+    return result;
+}
+
+// Add the waiter to the lists for the descriptors.
+void IOReactor::AddWaiter(ReactorWaiter *waiter, struct pollfd *fds, unsigned nfds)
+{
+    for (unsigned i = 0; i < nfds; i++)
+    {
+        int fd = fds[i].fd;
+        if (fd < 0) continue; // Ignored by poll.
+        if ((unsigned)fd >= descriptors.size())
+            descriptors.resize(fd + 1);
+        descriptors[fd].waiters.push_back(std::pair<ReactorWaiter*, short>(waiter, fds[i].events));
+    }
+}
+
+void IOReactor::RemoveWaiter(ReactorWaiter *waiter, struct pollfd *fds, unsigned nfds)
+{
+    for (unsigned i = 0; i < nfds; i++)
+    {
+        int fd = fds[i].fd;
+        if (fd < 0) continue;
+        std::vector<std::pair<ReactorWaiter*, short> > &waiters = descriptors[fd].waiters;
+        for (std::vector<std::pair<ReactorWaiter*, short> >::iterator j = waiters.begin(); j != waiters.end(); j++)
+        {
+            if (j->first == waiter)
+            {
+                waiters.erase(j);
+                break;
+            }
+        }
+    }
+}
+
+// Poll the descriptors that epoll has reported or that are not armed for the
+// events we want and arm those that are not ready.  The others cannot have
+// become ready since they were armed.  Sets the revents fields and returns the
+// number that are ready or -1 if epoll cannot be used for one of them.
+// Called with reactorLock held.
+int IOReactor::CheckDescriptors(struct pollfd *fds, unsigned nfds)
+{
+    std::vector<struct pollfd> toCheck;
+    std::vector<unsigned> indexes;
+    for (unsigned i = 0; i < nfds; i++)
+    {
+        fds[i].revents = 0;
+        int fd = fds[i].fd;
+        if (fd < 0) continue;
+        DescriptorEntry &entry = descriptors[fd];
+        if (entry.ready || (entry.armedEvents & fds[i].events) != fds[i].events)
+        {
+            toCheck.push_back(fds[i]);
+            indexes.push_back(i);
+        }
+    }
+    if (toCheck.empty()) return 0;
+    int result = poll(&toCheck[0], (nfds_t)toCheck.size(), 0);
+    if (result < 0) return result;
+    for (unsigned j = 0; j < toCheck.size(); j++)
+    {
+        if (toCheck[j].revents != 0)
+            fds[indexes[j]].revents = toCheck[j].revents;
+        else if (! Arm(toCheck[j].fd))
+            return -1;
+    }
+    return result;
+}
+
+// Arm the descriptor for the events its waiters want.  If it was closed
+// without ForgetDescriptor being called and the number has been reused epoll
+// will have dropped it so it is added again.
+bool IOReactor::Arm(int fd)
+{
+    DescriptorEntry &entry = descriptors[fd];
+    short wanted = 0;
+    for (std::vector<std::pair<ReactorWaiter*, short> >::iterator j = entry.waiters.begin(); j != entry.waiters.end(); j++)
+        wanted |= j->second;
+    struct epoll_event ev;
+    ev.events = EPOLLONESHOT;
+    if (wanted & POLLIN) ev.events |= EPOLLIN | EPOLLRDHUP;
+    if (wanted & POLLOUT) ev.events |= EPOLLOUT;
+    if (wanted & POLLPRI) ev.events |= EPOLLPRI;
+    ev.data.fd = fd;
+    bool armed = epoll_ctl(epollFd, entry.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) == 0;
+    if (! armed && entry.registered && (errno == ENOENT || errno == EBADF))
+        armed = epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) == 0;
+    entry.registered = armed;
+    if (! armed) return false;
+    entry.ready = false;
+    entry.armedEvents = wanted;
+    return true;
+}
+
+void IOReactor::Forget(int fd)
+{
+    PLocker lock(&reactorLock);
+    if (fd < 0 || (unsigned)fd >= descriptors.size() || ! descriptors[fd].registered)
+        return;
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, 0);
+    descriptors[fd].registered = false;
+    descriptors[fd].ready = false;
+    descriptors[fd].armedEvents = 0;
+}
+
+// Create the epoll instance and the thread the first time it is needed.
+// Called with reactorLock held.
+bool IOReactor::StartThread(void)
+{
+    if (threadRunning) return true;
+    if (startFailed) return false;
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    // The thread is stopped by writing to this.
+    stopFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (epollFd >= 0 && stopFd >= 0)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = stopFd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, stopFd, &ev) == 0)
+            threadRunning = pthread_create(&threadId, NULL, ReactorThreadFunction, this) == 0;
+    }
+    if (! threadRunning)
+    {
+        CloseDescriptors();
+        startFailed = true;
+    }
+    return threadRunning;
+}
+
+void *IOReactor::ReactorThreadFunction(void *arg)
+{
+    // Block all signals so they will be delivered to the ML threads.
+    sigset_t active_signals;
+    sigfillset(&active_signals);
+    pthread_sigmask(SIG_SETMASK, &active_signals, NULL);
+    ((IOReactor*)arg)->ReactorThread();
+    return 0;
+}
+
+void IOReactor::ReactorThread(void)
+{
+    struct epoll_event events[64];
+    while (true)
+    {
+        int n = epoll_wait(epollFd, events, sizeof(events)/sizeof(events[0]), -1);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            return;
+        }
+        PLocker lock(&reactorLock);
+        for (int i = 0; i < n; i++)
+        {
+            int fd = events[i].data.fd;
+            if (fd == stopFd) return;
+            if ((unsigned)fd >= descriptors.size()) continue;
+            // It is now disarmed until a waiting thread looks at it again.
+            descriptors[fd].ready = true;
+            descriptors[fd].armedEvents = 0;
+            uint32_t ev = events[i].events;
+            short pollEvents = 0;
+            if (ev & (EPOLLIN | EPOLLRDHUP)) pollEvents |= POLLIN;
+            if (ev & EPOLLOUT) pollEvents |= POLLOUT;
+            if (ev & EPOLLPRI) pollEvents |= POLLPRI;
+            // Errors and hang-ups are reported whatever the thread is waiting for.
+            bool wakeAll = (ev & (EPOLLERR | EPOLLHUP)) != 0;
+            std::vector<std::pair<ReactorWaiter*, short> > &waiters = descriptors[fd].waiters;
+            for (std::vector<std::pair<ReactorWaiter*, short> >::iterator j = waiters.begin(); j != waiters.end(); j++)
+            {
+                if (wakeAll || (j->second & pollEvents) != 0)
+                {
+                    j->first->woken = true;
+                    j->first->wakeUp.Signal();
+                }
+            }
+        }
+    }
+}
+
+void IOReactor::CloseDescriptors(void)
+{
+    if (epollFd >= 0) close(epollFd);
+    if (stopFd >= 0) close(stopFd);
+    epollFd = stopFd = -1;
+    descriptors.clear();
+}
+
+void IOReactor::Stop(void)
+{
+    if (! threadRunning) return;
+    uint64_t one = 1;
+    if (write(stopFd, &one, sizeof(one)) == sizeof(one))
+        pthread_join(threadId, NULL);
+    threadRunning = false;
+    startFailed = true; // Any further waits just poll.
+}
+
+// The thread doesn't exist in the child and the epoll instance is shared with
+// the parent so the child creates its own if it needs one.
+void IOReactor::ForkChild(void)
+{
+    threadRunning = false;
+    startFailed = false;
+    CloseDescriptors();
+}
+
+int WaitForDescriptors(struct pollfd *fds, unsigned nfds, unsigned maxMillisecs)
+{
+    return ioReactorModule.Wait(fds, nfds, maxMillisecs);
+}
+
+void ForgetDescriptor(int fd)
+{
+    ioReactorModule.Forget(fd);
+}
+
+#else
+
+int WaitForDescriptors(struct pollfd *fds, unsigned nfds, unsigned maxMillisecs)
+{
+    return poll(fds, nfds, maxMillisecs);
+}
+
+void ForgetDescriptor(int /*fd*/)
+{
+}
+
+#endif
+
+#endif
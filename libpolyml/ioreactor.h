@@ -0,0 +1,41 @@
+/*
+    Title:  ioreactor.h - Wait for file descriptors to become ready
+
+    Copyright (c) 2026 David C.J. Matthews
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#ifndef IOREACTOR_H_INCLUDED
+#define IOREACTOR_H_INCLUDED 1
+
+#if (!defined(_WIN32))
+
+struct pollfd;
+
+// Wait until one of the descriptors is ready or the time expires.  This has
+// the same interface as "poll" and sets the revents fields.  On Linux a single
+// thread waits for all the descriptors in use with epoll and wakes the threads
+// that are waiting for them.  Elsewhere this simply calls poll.
+// This is called when the thread has released the ML memory.
+extern int WaitForDescriptors(struct pollfd *fds, unsigned nfds, unsigned maxMillisecs);
+
+// Must be called before a descriptor that may have been waited for is closed.
+extern void ForgetDescriptor(int fd);
+
+#endif
+
+#endif
@@ -34,6 +34,15 @@
 
 #include <stdio.h>
 
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#if (!defined(_WIN32))
+#include <signal.h>
+#include <pthread.h>
+#endif
+
 #include <new>
 
 #include "globals.h"
@@ -46,6 +55,11 @@
 #include "statistics.h"
 #include "processes.h"
 #include "machine_dep.h"
+#include "cardtable.h"
+#include "sighandler.h"
+#include "numa.h"
+#include "gctaskfarm.h"
+#include "gc.h"
 
 
 #ifdef POLYML32IN64
@@ -99,6 +113,8 @@ LocalMemSpace::LocalMemSpace(OSMem *alloc): MarkableSpace(alloc)
     start_index = 0;
     i_marked = m_marked = updated = 0;
     allocationSpace = false;
+    largeObjectSpace = false;
+    numaNode = 0;
 }
 
 bool LocalMemSpace::InitSpace(PolyWord *heapSpace, uintptr_t size, bool mut)
@@ -109,7 +125,7 @@ bool LocalMemSpace::InitSpace(PolyWord *heapSpace, uintptr_t size, bool mut)
     // Initialise all the fields.  The partial GC in particular relies on this.
     upperAllocPtr = partialGCTop = fullGCRescanStart = fullGCLowerLimit = lowestWeak = top;
     lowerAllocPtr = partialGCScan = partialGCRootBase = partialGCRootTop =
-        fullGCRescanEnd = highestWeak = bottom;
+        fullGCRescanEnd = highestWeak = concurrentMarkBase = bottom;
 #ifdef POLYML32IN64
     // The address must be on an odd-word boundary so that after the length
     // word is put in the actual cell address is on an even-word boundary.
@@ -117,24 +133,36 @@ bool LocalMemSpace::InitSpace(PolyWord *heapSpace, uintptr_t size, bool mut)
     lowerAllocPtr = bottom + 1;
 #endif
     spaceOwner = 0;
+    evacuate = evacuationTarget = false;
 
     allocationSpace = false;
+    largeObjectSpace = false;
+    numaNode = 0;
 
     // Bitmap for the space.
     return bitmap.Create(size);
 }
 
-MemMgr::MemMgr(): allocLock("Memmgr alloc"), codeBitmapLock("Code bitmap")
+MemMgr::MemMgr(): allocLock("Memmgr alloc"), codeBitmapLock("Code bitmap"), lazyLock("Lazy loading")
 {
     nextIndex = 0;
     reservedSpace = 0;
     nextAllocator = 0;
+    currentAllocation = 0;
     defaultSpaceSize = 0;
     spaceBeforeMinorGC = 0;
     spaceForHeap = 0;
     currentAllocSpace = currentHeapSize = 0;
     defaultSpaceSize = 1024 * 1024 / sizeof(PolyWord); // 1Mbyte segments.
     spaceTree = new SpaceTreeTree;
+#ifdef CARD_MARKING_SUPPORTED
+    cardMarking = true;
+#else
+    cardMarking = false;
+#endif
+    cardsClean = false;
+    faultHandler = false;
+    lazyThreadRunning = false;
 }
 
 MemMgr::~MemMgr()
@@ -152,8 +180,30 @@ MemMgr::~MemMgr()
         delete(*i);
 }
 
+#ifdef CARD_MARKING_SUPPORTED
+// The last address at which this thread faulted on a unit that was already loaded.
+static __thread const void *lastLazyFault;
+
+// Called when ML code or the RTS writes to a protected card or accesses part
+// of a lazily loaded space.  If it isn't one of ours restore the default action.
+// The access will be retried and the process will be terminated in the usual way.
+static void catchMemoryFault(int sig, siginfo_t *info, void *)
+{
+    if (! gMem.HandleCardFault(info->si_addr) && ! gMem.HandleLazyFault(info->si_addr))
+        signal(sig, SIG_DFL);
+}
+#endif
+
 bool MemMgr::Initialise()
 {
+#ifdef CARD_MARKING_SUPPORTED
+    CardTable::SetCardSize(sysconf(_SC_PAGESIZE));
+    // The handler is installed even without card marking because it is also
+    // used for lazy loading.
+    faultHandler = setSignalHandler(SIGSEGV, catchMemoryFault) && setSignalHandler(SIGBUS, catchMemoryFault);
+    if (! faultHandler)
+        cardMarking = false;
+#endif
 #ifdef POLYML32IN64
     // Reserve a single 16G area but with no access.
     void *heapBase;
@@ -185,7 +235,7 @@ bool MemMgr::Initialise()
 }
 
 // Create and initialise a new local space and add it to the table.
-LocalMemSpace* MemMgr::NewLocalSpace(uintptr_t size, bool mut)
+LocalMemSpace* MemMgr::NewLocalSpace(uintptr_t size, bool mut, unsigned node)
 {
     try {
         LocalMemSpace *space = new LocalMemSpace(&osHeapAlloc);
@@ -221,6 +271,9 @@ LocalMemSpace* MemMgr::NewLocalSpace(uintptr_t size, bool mut)
                     space, space->spaceSize()/1024, space->bottom, space->top);
             currentHeapSize += space->spaceSize();
             globalStats.setSize(PSS_TOTAL_HEAP, currentHeapSize * sizeof(PolyWord));
+            // Spaces created by GC workers are placed on the worker's node.
+            space->numaNode = node == NUMA_ANY_NODE ? gpTaskFarm->CurrentNode() : node;
+            gNumaTopology.BindMemory(space->bottom, space->spaceSize()*sizeof(PolyWord), space->numaNode);
             return space;
         }
 
@@ -238,9 +291,9 @@ LocalMemSpace* MemMgr::NewLocalSpace(uintptr_t size, bool mut)
 }
 
 // Create a local space for initial allocation.
-LocalMemSpace *MemMgr::CreateAllocationSpace(uintptr_t size)
+LocalMemSpace *MemMgr::CreateAllocationSpace(uintptr_t size, unsigned node)
 {
-    LocalMemSpace *result = NewLocalSpace(size, true);
+    LocalMemSpace *result = NewLocalSpace(size, true, node);
     if (result) 
     {
         result->allocationSpace = true;
@@ -257,6 +310,7 @@ void MemMgr::ConvertAllocationSpaceToLocal(LocalMemSpace *space)
 {
     ASSERT(space->allocationSpace);
     space->allocationSpace = false;
+    if (space == currentAllocation) currentAllocation = 0;
     // Currently it is left as a mutable area but if the contents are all
     // immutable e.g. a large vector it could be better to turn it into an
     // immutable area.
@@ -350,25 +404,36 @@ PermanentMemSpace *MemMgr::AllocateNewPermanentSpace(uintptr_t byteSize, unsigne
         space->bottom = base;
         space->shadowSpace = (PolyWord*)newShadow;
         space->topPointer = space->top = space->bottom + actualSize/sizeof(PolyWord);
-        space->spaceType = ST_PERMANENT;
-        space->isMutable = flags & MTF_WRITEABLE ? true : false;
-        space->noOverwrite = flags & MTF_NO_OVERWRITE ? true : false;
-        space->byteOnly = flags & MTF_BYTES ? true : false;
-        space->isCode = flags & MTF_EXECUTABLE ? true : false;
-        space->index = index;
-        space->hierarchy = hierarchy;
-        if (index >= nextIndex) nextIndex = index + 1;
+        if (! AddPermanentSpace(space, flags, index, hierarchy))
+            return 0;
+        return space;
+    }
+    catch (std::bad_alloc&) {
+        return 0;
+    }
+}
 
-        // Extend the permanent memory table and add this space to it.
-        try {
-            AddTree(space);
-            pSpaces.push_back(space);
-        }
-        catch (std::exception&) {
-            RemoveTree(space);
-            delete space;
+PermanentMemSpace *MemMgr::MapPermanentSpace(int fd, uint64_t offset, uintptr_t byteSize, void *address,
+                                             unsigned flags, unsigned index, unsigned hierarchy)
+{
+    // Code has to be in the code area so is always read in.
+    if (flags & MTF_EXECUTABLE) return 0;
+    try {
+        PermanentMemSpace *space = new PermanentMemSpace(&osHeapAlloc);
+        PolyWord *base = (PolyWord*)osHeapAlloc.MapFileDataArea(fd, offset, byteSize, address);
+        if (base == 0)
+        {
+            delete(space);
             return 0;
         }
+        // The top is the end of the segment rather than the end of the last page.
+        // The rest of the page is whatever follows in the file.
+        space->bottom = base;
+        space->topPointer = space->top = space->bottom + byteSize/sizeof(PolyWord);
+        if (! AddPermanentSpace(space, flags, index, hierarchy))
+            return 0;
+        if (debugOptions & DEBUG_MEMMGR)
+            Log("MMGR: New permanent space %p mapped from file at %p, size %" PRI_SIZET " bytes\n", space, base, byteSize);
         return space;
     }
     catch (std::bad_alloc&) {
@@ -376,6 +441,32 @@ PermanentMemSpace *MemMgr::AllocateNewPermanentSpace(uintptr_t byteSize, unsigne
     }
 }
 
+// Set the properties of a new permanent space and add it to the table.
+// Deletes the space if it cannot be added.
+bool MemMgr::AddPermanentSpace(PermanentMemSpace *space, unsigned flags, unsigned index, unsigned hierarchy)
+{
+    space->spaceType = ST_PERMANENT;
+    space->isMutable = flags & MTF_WRITEABLE ? true : false;
+    space->noOverwrite = flags & MTF_NO_OVERWRITE ? true : false;
+    space->byteOnly = flags & MTF_BYTES ? true : false;
+    space->isCode = flags & MTF_EXECUTABLE ? true : false;
+    space->index = index;
+    space->hierarchy = hierarchy;
+    if (index >= nextIndex) nextIndex = index + 1;
+
+    // Extend the permanent memory table and add this space to it.
+    try {
+        AddTree(space);
+        pSpaces.push_back(space);
+    }
+    catch (std::exception&) {
+        RemoveTree(space);
+        delete space;
+        return false;
+    }
+    return true;
+}
+
 bool MemMgr::CompletePermanentSpaceAllocation(PermanentMemSpace *space)
 {
     // Remove write access unless it is mutable.
@@ -398,6 +489,7 @@ void MemMgr::DeleteLocalSpace(std::vector<LocalMemSpace*>::iterator &iter)
     currentHeapSize -= sp->spaceSize();
     globalStats.setSize(PSS_TOTAL_HEAP, currentHeapSize * sizeof(PolyWord));
     if (sp->allocationSpace) currentAllocSpace -= sp->spaceSize();
+    if (sp == currentAllocation) currentAllocation = 0;
     RemoveTree(sp);
     delete(sp);
     iter = lSpaces.erase(iter);
@@ -511,7 +603,10 @@ bool MemMgr::PromoteExportSpaces(unsigned hierarchy)
         else
         {
             try {
-                // Turn this into a local space or a code space
+                // Turn this into a local space or a code space.  A lazy space must be
+                // completely loaded first.
+                if (! CompleteLazySpace(pSpace))
+                    return false;
                 // Remove this from the tree - AddLocalSpace will make an entry for the local version.
                 RemoveTree(pSpace);
 
@@ -658,12 +753,96 @@ void MemMgr::FillUnusedSpace(PolyWord *base, uintptr_t words)
     }
 }
 
+// The allocation pointers of the allocation spaces are advanced with a
+// compare-and-swap so that heap segments can be handed out without
+// taking allocLock.  Where that isn't available everything is done with the lock.
+#if (defined(__GNUC__))
+#define LOCK_FREE_ALLOCATION
+static inline PolyWord *loadAllocPtr(PolyWord **p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline bool casAllocPtr(PolyWord **p, PolyWord *oldV, PolyWord *newV)
+    { return __atomic_compare_exchange_n(p, &oldV, newV, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED); }
+static inline LocalMemSpace *loadSpace(LocalMemSpace **p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline void storeSpace(LocalMemSpace **p, LocalMemSpace *v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+#elif (defined(_MSC_VER))
+#define LOCK_FREE_ALLOCATION
+static inline PolyWord *loadAllocPtr(PolyWord **p) { PolyWord *v = *(PolyWord * volatile *)p; _ReadWriteBarrier(); return v; }
+static inline bool casAllocPtr(PolyWord **p, PolyWord *oldV, PolyWord *newV)
+    { return InterlockedCompareExchangePointer((PVOID volatile *)p, newV, oldV) == oldV; }
+static inline LocalMemSpace *loadSpace(LocalMemSpace **p) { LocalMemSpace *v = *(LocalMemSpace * volatile *)p; _ReadWriteBarrier(); return v; }
+static inline void storeSpace(LocalMemSpace **p, LocalMemSpace *v) { _ReadWriteBarrier(); *(LocalMemSpace * volatile *)p = v; }
+#else
+static inline void storeSpace(LocalMemSpace **p, LocalMemSpace *v) { *p = v; }
+#endif
+
+// Try to allocate between minWords and maxWords in an allocation space.
+// Returns zero if there is not enough space.
+PolyWord *MemMgr::AllocInSpace(LocalMemSpace *space, uintptr_t minWords, uintptr_t &maxWords, bool doAllocation)
+{
+    while (true)
+    {
+#ifdef LOCK_FREE_ALLOCATION
+        PolyWord *result = loadAllocPtr(&space->lowerAllocPtr);
+#else
+        PolyWord *result = space->lowerAllocPtr;
+#endif
+        uintptr_t available = space->upperAllocPtr - result;
+        if (available == 0 || available < minWords)
+            return 0;
+        uintptr_t words = maxWords;
+        // Reduce the maximum value if we had less than that.
+        if (available < words) words = available;
+#ifdef POLYML32IN64
+        // If necessary round down to an even boundary
+        if (words & 1)
+        {
+            words--;
+            if (words < minWords)
+                return 0;
+        }
+#endif
+        if (! doAllocation)
+        {
+            maxWords = words;
+            return result;
+        }
+#ifdef LOCK_FREE_ALLOCATION
+        if (! casAllocPtr(&space->lowerAllocPtr, result, result+words))
+            continue; // Another thread has allocated from this space.
+#else
+        space->lowerAllocPtr = result+words;
+#endif
+#ifdef POLYML32IN64
+        // If we have left a single word at the end it must be zeroed.
+        if (result+words+1 == space->upperAllocPtr)
+            result[words] = PolyWord::FromUnsigned(0);
+        ASSERT((uintptr_t)result & 4); // Must be odd-word aligned
+#endif
+        maxWords = words;
+        return result;
+    }
+}
+
 // Allocate an area of the heap of at least minWords and at most maxWords.
 // This is used both when allocating single objects (when minWords and maxWords
 // are the same) and when allocating heap segments.  If there is insufficient
 // space to satisfy the minimum it will return 0.
-PolyWord *MemMgr::AllocHeapSpace(uintptr_t minWords, uintptr_t &maxWords, bool doAllocation)
+PolyWord *MemMgr::AllocHeapSpace(uintptr_t minWords, uintptr_t &maxWords, bool doAllocation, unsigned node)
 {
+#ifdef LOCK_FREE_ALLOCATION
+    // Try the space we used last time without taking the lock.  A space
+    // is only made current once something has been allocated in it so it
+    // will not be deleted by RemoveExcessAllocation until the next GC.
+    if (doAllocation)
+    {
+        LocalMemSpace *space = loadSpace(&currentAllocation);
+        if (space != 0 && space->numaNode == node)
+        {
+            PolyWord *result = AllocInSpace(space, minWords, maxWords, true);
+            if (result != 0)
+                return result;
+        }
+    }
+#endif
     PLocker locker(&allocLock);
     // We try to distribute the allocations between the memory spaces
     // so that at the next GC we don't have all the most recent cells in
@@ -677,27 +856,13 @@ PolyWord *MemMgr::AllocHeapSpace(uintptr_t minWords, uintptr_t &maxWords, bool d
     {
         if (j >= gMem.lSpaces.size()) j = 0;
         LocalMemSpace *space = gMem.lSpaces[j++];
-        if (space->allocationSpace)
+        if (space->allocationSpace && space->numaNode == node)
         {
-            uintptr_t available = space->freeSpace();
-            if (available > 0 && available >= minWords)
+            PolyWord *result = AllocInSpace(space, minWords, maxWords, doAllocation);
+            if (result != 0)
             {
-                // Reduce the maximum value if we had less than that.
-                if (available < maxWords) maxWords = available;
-#ifdef POLYML32IN64
-                // If necessary round down to an even boundary
-                if (maxWords & 1)
-                {
-                    maxWords--;
-                    space->lowerAllocPtr[maxWords] = PolyWord::FromUnsigned(0);
-                }
-#endif
-                PolyWord *result = space->lowerAllocPtr; // Return the address.
-                if (doAllocation)
-                    space->lowerAllocPtr += maxWords; // Allocate it.
-#ifdef POLYML32IN64
-                ASSERT((uintptr_t)result & 4); // Must be odd-word aligned
-#endif
+                if (doAllocation && maxWords != 0)
+                    storeSpace(&currentAllocation, space);
                 return result;
             }
         }
@@ -724,7 +889,7 @@ PolyWord *MemMgr::AllocHeapSpace(uintptr_t minWords, uintptr_t &maxWords, bool d
 #else
         if (minWords > spaceSize) spaceSize = minWords; // If we really want a large space.
 #endif
-        LocalMemSpace *space = CreateAllocationSpace(spaceSize);
+        LocalMemSpace *space = CreateAllocationSpace(spaceSize, node);
         if (space == 0) return 0; // Can't allocate it
         // Allocate our space in this new area.
         uintptr_t available = space->freeSpace();
@@ -743,12 +908,31 @@ PolyWord *MemMgr::AllocHeapSpace(uintptr_t minWords, uintptr_t &maxWords, bool d
         }
         PolyWord *result = space->lowerAllocPtr; // Return the address.
         if (doAllocation)
+        {
             space->lowerAllocPtr += maxWords; // Allocate it.
+            if (maxWords != 0)
+                storeSpace(&currentAllocation, space);
+        }
 #ifdef POLYML32IN64
         ASSERT((uintptr_t)result & 4); // Must be odd-word aligned
 #endif
         return result;
     }
+    // In NUMA mode we may not be able to create a new space on this node
+    // but there may be space on another node.
+    if (gNumaTopology.NodeCount() > 1)
+    {
+        for (std::vector<LocalMemSpace*>::iterator i = lSpaces.begin(); i < lSpaces.end(); i++)
+        {
+            LocalMemSpace *space = *i;
+            if (space->allocationSpace && space->numaNode != node)
+            {
+                PolyWord *result = AllocInSpace(space, minWords, maxWords, doAllocation);
+                if (result != 0)
+                    return result;
+            }
+        }
+    }
     return 0; // There isn't space even for the minimum.
 }
 
@@ -940,6 +1124,41 @@ bool MemMgr::CheckForAllocation(uintptr_t words)
     return AllocHeapSpace(words, allocated, false) != 0;
 }
 
+// Allocate a large object in its own space.  The object is placed at the top of
+// the space in the same way as data that has been compacted by a full GC so the
+// minor GC scans it as part of the mutable area.  The space is always mutable
+// because the caller will initialise the object and that will not be recorded
+// in the card table.  The first minor GC scans the whole of the new space.
+PolyWord *MemMgr::AllocLargeObject(uintptr_t words, unsigned node)
+{
+    PLocker locker(&allocLock);
+    // If this would go over the limit the caller allocates the object in the
+    // allocation area and that triggers a GC in the normal way.
+    if (currentHeapSize + words > spaceForHeap)
+        return 0;
+    uintptr_t spaceSize = words;
+#ifdef POLYML32IN64
+    spaceSize++; // Allow for aligning the length word.
+#endif
+    LocalMemSpace *space = NewLocalSpace(spaceSize, true, node);
+    if (space == 0)
+        return 0;
+    space->largeObjectSpace = true;
+    PolyWord *result = space->top - words;
+#ifdef POLYML32IN64
+    // The length word must be on an odd-word boundary.  Leave a zero word at the top.
+    if (((uintptr_t)result & 4) == 0)
+    {
+        result--;
+        result[words] = PolyWord::FromUnsigned(0);
+    }
+#endif
+    space->upperAllocPtr = result;
+    if (debugOptions & DEBUG_MEMMGR)
+        Log("MMGR: Large object of %" PRI_SIZET " words in space %p\n", words, space);
+    return result;
+}
+
 // Adjust the allocation area by removing free areas so that the total
 // size of the allocation area is less than the required value.  This
 // is used after the quick GC and also if we need to allocate a large
@@ -951,14 +1170,14 @@ void MemMgr::RemoveExcessAllocation(uintptr_t words)
     {
         LocalMemSpace *space = *i;
         if (space->allocationSpace && space->isEmpty() &&
-                space->spaceSize() != defaultSpaceSize)
+                space->spaceSize() != defaultSpaceSize && space != currentAllocation)
             DeleteLocalSpace(i);
         else i++;
     }
     for (std::vector<LocalMemSpace*>::iterator i = lSpaces.begin(); currentAllocSpace > words && i < lSpaces.end(); )
     {
         LocalMemSpace *space = *i;
-        if (space->allocationSpace && space->isEmpty())
+        if (space->allocationSpace && space->isEmpty() && space != currentAllocation)
             DeleteLocalSpace(i);
         else i++;
     }
@@ -1042,6 +1261,321 @@ void MemMgr::ProtectImmutable(bool on)
     }
 }
 
+// Return the card table if this is a space that is scanned by card in the minor GC.
+// This is called from the signal handler so must not take any locks.
+CardTable *MemMgr::CardTableForSpace(MemSpace *space)
+{
+    if (! space->isMutable)
+        return 0;
+    if (space->spaceType == ST_LOCAL)
+    {
+        LocalMemSpace *lSpace = (LocalMemSpace*)space;
+        // The allocation spaces are always scanned.
+        return lSpace->allocationSpace ? 0 : &lSpace->cardTable;
+    }
+    if (space->spaceType == ST_PERMANENT)
+    {
+        PermanentMemSpace *pSpace = (PermanentMemSpace*)space;
+        return pSpace->byteOnly ? 0 : &pSpace->cardTable;
+    }
+    return 0;
+}
+
+// This is called with all the ML threads stopped before and after a request.  While
+// the GC or other request is running everything must be writable.  Afterwards, if the
+// request was a GC, the cards are clean and can be protected.  Any other request may
+// have written to the heap or moved objects so the cards have to be treated as dirty
+// and the object maps rebuilt.
+void MemMgr::ProtectCards(bool on)
+{
+    if (! cardMarking)
+        return;
+    for (std::vector<LocalMemSpace*>::iterator i = lSpaces.begin(); i < lSpaces.end(); i++)
+        ProtectCardsInSpace(*i, on);
+    for (std::vector<PermanentMemSpace*>::iterator i = pSpaces.begin(); i < pSpaces.end(); i++)
+        ProtectCardsInSpace(*i, on);
+    cardsClean = false;
+}
+
+void MemMgr::ProtectCardsInSpace(MemSpace *space, bool on)
+{
+    CardTable *cards = CardTableForSpace(space);
+    if (cards == 0 || ! cards->Created())
+        return;
+    if (on && ! cardsClean)
+    {
+        cards->SetAllDirty();
+        cards->ResetMap(space->bottom);
+        return;
+    }
+    if (! on && ! cards->writeProtected)
+        return;
+    if (osHeapAlloc.EnableWrite(!on, cards->cardBase, cards->nCards * CardTable::CardBytes()))
+        cards->writeProtected = on;
+    else
+    {
+        // If we can't protect the space we have to scan all of it.
+        if (debugOptions & DEBUG_MEMMGR)
+            Log("MMGR: Unable to %s cards at %p\n", on ? "protect" : "unprotect", cards->cardBase);
+        cards->SetAllDirty();
+        if (on) cards->writeProtected = false;
+    }
+}
+
+void MemMgr::ResetCards()
+{
+    if (! cardMarking)
+        return;
+    for (std::vector<LocalMemSpace*>::iterator i = lSpaces.begin(); i < lSpaces.end(); i++)
+    {
+        CardTable *cards = CardTableForSpace(*i);
+        if (cards != 0 && cards->Created())
+            cards->ClearAll();
+    }
+    for (std::vector<PermanentMemSpace*>::iterator i = pSpaces.begin(); i < pSpaces.end(); i++)
+    {
+        CardTable *cards = CardTableForSpace(*i);
+        if (cards != 0 && cards->Created())
+            cards->ClearAll();
+    }
+    cardsClean = true;
+}
+
+void MemMgr::MarkCardsDirty(const void *start, size_t bytes)
+{
+    if (! cardMarking || bytes == 0)
+        return;
+    MemSpace *space = SpaceForAddress(start);
+    if (space == 0)
+        return;
+    CardTable *cards = CardTableForSpace(space);
+    if (cards == 0 || ! cards->writeProtected)
+        return;
+    const PolyWord *s = (const PolyWord*)start, *e = (const PolyWord*)((const char*)start + bytes);
+    if (s < cards->cardBase) s = cards->cardBase;
+    if (e > cards->CardsEnd()) e = cards->CardsEnd();
+    if (s >= e)
+        return;
+    uintptr_t last = cards->CardNo(e-1);
+    for (uintptr_t n = cards->CardNo(s); n <= last; n++)
+    {
+        if (! cards->IsDirty(n))
+        {
+            cards->SetDirty(n);
+            osHeapAlloc.EnableWrite(true, cards->CardAddr(n), CardTable::CardBytes());
+        }
+    }
+}
+
+bool MemMgr::HandleCardFault(const void *addr)
+{
+    MemSpace *space = SpaceForAddress(addr);
+    if (space == 0)
+        return false;
+    CardTable *cards = CardTableForSpace(space);
+    if (cards == 0 || ! cards->writeProtected || ! cards->InCards(addr))
+        return false;
+    uintptr_t n = cards->CardNo((const PolyWord*)addr);
+    cards->SetDirty(n);
+    if (osHeapAlloc.EnableWrite(true, cards->CardAddr(n), CardTable::CardBytes()))
+        return true;
+    // This can fail if the process has too many separate mappings.  Treat the
+    // whole space as dirty.  We leave writeProtected set because another thread
+    // may be handling a fault in the same space.
+    cards->SetAllDirty();
+    return osHeapAlloc.EnableWrite(true, cards->cardBase, cards->nCards * CardTable::CardBytes());
+}
+
+bool MemMgr::MakeSpaceLazy(PermanentMemSpace *space, size_t unitBytes, LazySpaceLoader *loader)
+{
+#ifdef CARD_MARKING_SUPPORTED
+    size_t bytes = (char*)space->top - (char*)space->bottom;
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    // Mutable spaces are scanned by every GC so there is no point.
+    if (! faultHandler || space->isMutable || space->isCode || bytes == 0 ||
+            unitBytes % pageSize != 0 || (loader != 0 && ! osHeapAlloc.CanFillOnDemand()))
+        return false;
+    if (loader != 0)
+    {
+        PLocker lock(&lazyLock);
+        if (! lazyThreadRunning)
+        {
+            pthread_t threadId;
+            lazyThreadRunning = pthread_create(&threadId, NULL, LazyLoaderThread, this) == 0;
+            if (! lazyThreadRunning)
+                return false;
+            pthread_detach(threadId);
+        }
+    }
+    try {
+        space->lazyState.assign((bytes + unitBytes - 1) / unitBytes, LAZY_UNLOADED);
+    }
+    catch (std::bad_alloc&) {
+        return false;
+    }
+    space->lazyUnitBytes = unitBytes;
+    space->lazyUnitsLoaded = 0;
+    space->lazyLoader = loader;
+    // If the space is at its original address the pages mapped from the file are
+    // used unchanged and access is restored in the signal handler.  Otherwise the
+    // mapping is replaced by missing pages and the loader thread fills them.
+    if (loader == 0 ? osHeapAlloc.DisableAccess(space->bottom, bytes) :
+            osHeapAlloc.MakeFillOnDemand(space->bottom, (bytes + pageSize - 1) / pageSize * pageSize))
+    {
+        if (loader != 0) loader->useCount++;
+        return true;
+    }
+    space->lazyState.clear();
+    space->lazyLoader = 0;
+#endif
+    return false;
+}
+
+#ifdef CARD_MARKING_SUPPORTED
+// Wait for threads to touch missing pages of relocated lazy spaces and load the units.
+// The faulting thread is blocked in the kernel so this runs outside signal context.
+void *MemMgr::LazyLoaderThread(void *arg)
+{
+    // Block all signals so they will be delivered to the ML threads.
+    sigset_t active_signals;
+    sigfillset(&active_signals);
+    pthread_sigmask(SIG_SETMASK, &active_signals, NULL);
+    MemMgr *memMgr = (MemMgr*)arg;
+    void *addr;
+    while ((addr = memMgr->osHeapAlloc.WaitForFill()) != 0)
+    {
+        MemSpace *space = memMgr->SpaceForAddress(addr);
+        if (space == 0 || space->spaceType != ST_PERMANENT)
+            continue;
+        PermanentMemSpace *pSpace = (PermanentMemSpace*)space;
+        // The faulting thread cannot continue without the data.
+        if (! memMgr->LoadLazyUnit(pSpace, ((char*)addr - (char*)pSpace->bottom) / pSpace->lazyUnitBytes))
+            Crash("Unable to load part of a saved state");
+    }
+    return 0;
+}
+#endif
+
+// Load a unit of a lazy space.  If the space is at its original address this only
+// changes the protection.  It is called from the signal handler so it must not
+// block; two threads may both enable the same unit.  Units that are relocated are
+// loaded by the loader thread or by an RTS call with lazyLock held.  Once loaded
+// a unit has the protection CompletePermanentSpaceAllocation would have given it.
+bool MemMgr::LoadLazyUnit(PermanentMemSpace *space, uintptr_t unitNo)
+{
+#ifdef CARD_MARKING_SUPPORTED
+    // Only top-level immutable spaces are write-protected.  Saving a child state
+    // writes to the objects in lower-level spaces.
+    bool writeable = space->isMutable || space->hierarchy != 0;
+    unsigned char *state = &space->lazyState[unitNo];
+    char *start = (char*)space->bottom + unitNo * space->lazyUnitBytes;
+    size_t bytes = (char*)space->top - start;
+    if (bytes > space->lazyUnitBytes) bytes = space->lazyUnitBytes;
+    if (space->lazyLoader == 0)
+    {
+        if (! osHeapAlloc.EnableWrite(writeable, start, bytes))
+            return false;
+        unsigned char expected = LAZY_UNLOADED;
+        if (__atomic_compare_exchange_n(state, &expected, LAZY_LOADED, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            __atomic_add_fetch(&space->lazyUnitsLoaded, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+    PLocker lock(&lazyLock);
+    if (__atomic_load_n(state, __ATOMIC_ACQUIRE) == LAZY_LOADED)
+        return true;
+    // Fill whole pages.  Any part beyond the end of the space is zero.
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t fillBytes = (bytes + pageSize - 1) / pageSize * pageSize;
+    PolyWord *buffer = (PolyWord*)calloc(fillBytes, 1);
+    bool loaded = buffer != 0 && space->lazyLoader->ReadUnit(space, unitNo, buffer, bytes) &&
+        osHeapAlloc.FillArea(start, buffer, fillBytes) && osHeapAlloc.EnableWrite(writeable, start, fillBytes);
+    free(buffer);
+    if (loaded)
+    {
+        __atomic_add_fetch(&space->lazyUnitsLoaded, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(state, LAZY_LOADED, __ATOMIC_RELEASE);
+    }
+    return loaded;
+#else
+    return false;
+#endif
+}
+
+bool MemMgr::CompleteLazySpace(PermanentMemSpace *space)
+{
+    if (space->lazyState.empty())
+        return true;
+    for (uintptr_t n = 0; n < space->lazyState.size(); n++)
+    {
+        if (space->lazyState[n] != LAZY_LOADED && ! LoadLazyUnit(space, n))
+            return false;
+    }
+    space->lazyState.clear();
+    if (space->lazyLoader != 0 && --space->lazyLoader->useCount == 0)
+        delete space->lazyLoader;
+    space->lazyLoader = 0;
+    return true;
+}
+
+void MemMgr::LoadLazyData(const void *start, size_t bytes)
+{
+    if (bytes == 0)
+        return;
+    MemSpace *space = SpaceForAddress(start);
+    if (space == 0 || space->spaceType != ST_PERMANENT)
+        return;
+    PermanentMemSpace *pSpace = (PermanentMemSpace*)space;
+    if (pSpace->lazyState.empty())
+        return;
+    const char *end = (const char*)start + bytes;
+    if (end > (char*)pSpace->top) end = (char*)pSpace->top;
+    uintptr_t last = (end - 1 - (char*)pSpace->bottom) / pSpace->lazyUnitBytes;
+    for (uintptr_t n = ((const char*)start - (char*)pSpace->bottom) / pSpace->lazyUnitBytes; n <= last; n++)
+    {
+        if (pSpace->lazyState[n] != LAZY_LOADED)
+            LoadLazyUnit(pSpace, n);
+    }
+}
+
+void MemMgr::LoadRelocatedLazySpaces()
+{
+    for (std::vector<PermanentMemSpace*>::iterator i = pSpaces.begin(); i < pSpaces.end(); i++)
+    {
+        PermanentMemSpace *space = *i;
+        if (space->lazyLoader == 0)
+            continue;
+        for (uintptr_t n = 0; n < space->lazyState.size(); n++)
+        {
+            if (space->lazyState[n] != LAZY_LOADED)
+                LoadLazyUnit(space, n);
+        }
+    }
+}
+
+bool MemMgr::HandleLazyFault(const void *addr)
+{
+    MemSpace *space = SpaceForAddress(addr);
+    if (space == 0 || space->spaceType != ST_PERMANENT)
+        return false;
+    PermanentMemSpace *pSpace = (PermanentMemSpace*)space;
+    // Relocated spaces are loaded by the loader thread and do not fault.
+    if (pSpace->lazyState.empty() || pSpace->lazyLoader != 0)
+        return false;
+    uintptr_t unitNo = ((const char*)addr - (char*)pSpace->bottom) / pSpace->lazyUnitBytes;
+#ifdef CARD_MARKING_SUPPORTED
+    if (__atomic_load_n(&pSpace->lazyState[unitNo], __ATOMIC_ACQUIRE) == LAZY_LOADED)
+    {
+        // Another thread may have loaded the unit after this one faulted so retry
+        // the access once.  If it faults again it must have been a write.
+        if (lastLazyFault == addr)
+            return false;
+        lastLazyFault = addr;
+        return true;
+    }
+#endif
+    return LoadLazyUnit(pSpace, unitNo);
+}
+
 bool MemMgr::GrowOrShrinkStack(TaskData *taskData, uintptr_t newSize)
 {
     StackSpace *space = taskData->stack;
@@ -22,8 +22,10 @@
 #define MEMMGR_H
 
 #include "bitmap.h"
+#include "cardtable.h"
 #include "locking.h"
 #include "osmem.h"
+#include "numa.h"
 #include <vector>
 
 // utility conversion macros
@@ -34,6 +36,11 @@
 class ScanAddress;
 class GCTaskId;
 class TaskData;
+class LazySpaceLoader;
+
+// States of a unit of a lazily loaded space.
+#define LAZY_UNLOADED   0
+#define LAZY_LOADED     1
 
 typedef enum {
     ST_PERMANENT,   // Permanent areas are part of the object code
@@ -118,7 +125,8 @@ class PermanentMemSpace: public MemSpace
 {
 protected:
     PermanentMemSpace(OSMem *alloc): MemSpace(alloc), index(0), hierarchy(0), noOverwrite(false),
-        byteOnly(false), constArea(false), topPointer(0) {}
+        byteOnly(false), constArea(false), topPointer(0), lazyUnitBytes(0),
+        lazyUnitsLoaded(0), lazyLoader(0) {}
 
 public:
     unsigned    index;      // An identifier for the space.  Used when saving and loading.
@@ -133,10 +141,31 @@ public:
 
     Bitmap      shareBitmap; // Used in sharedata
     Bitmap      profileCode; // Used when profiling
+    CardTable   cardTable;   // Cards written since the last GC.  Mutable spaces only.
+
+    // A lazily loaded space is mapped from a saved state with no access.  Each
+    // unit is made accessible when it is first used.  lazyState is empty if the
+    // space is not lazy.
+    std::vector<unsigned char> lazyState;
+    size_t      lazyUnitBytes;
+    uintptr_t   lazyUnitsLoaded;
+    LazySpaceLoader *lazyLoader; // Null if the units do not need relocating.
 
     friend class MemMgr;
 };
 
+// Reads a unit of a lazily loaded space that has to be relocated.  The unit is
+// read and relocated into a buffer that is then copied into the missing pages.
+class LazySpaceLoader
+{
+public:
+    LazySpaceLoader(): useCount(0) {}
+    virtual ~LazySpaceLoader() {}
+    // Called with the lazy loading lock held, never from a signal handler.
+    virtual bool ReadUnit(PermanentMemSpace *space, uintptr_t unitNo, PolyWord *buffer, size_t bytes) = 0;
+    unsigned useCount; // The number of spaces using this.
+};
+
 #define NSTARTS 10
 
 // Markable spaces are used as the base class for local heap
@@ -150,6 +179,7 @@ public:
     PolyWord    *fullGCRescanStart; // Upper and lower limits for rescan during mark phase.
     PolyWord    *fullGCRescanEnd;
     PLock       spaceLock;        // Lock used to protect forwarding pointers
+    Bitmap      concurrentMarks;  // Objects marked while the ML threads are running.
 };
 
 // Local areas can be garbage collected.
@@ -171,19 +201,25 @@ public:
 
     PolyWord    *fullGCLowerLimit;// Lowest object in area before copying.
     PolyWord    *partialGCTop;    // Value of upperAllocPtr before the current partial GC.
+    PolyWord    *concurrentMarkBase; // Value of lowerAllocPtr when concurrent marking started.
     PolyWord    *partialGCScan;   // Scan pointer used in minor GC
     PolyWord    *partialGCRootBase; // Start of the root objects.
     PolyWord    *partialGCRootTop;// Value of lowerAllocPtr after the roots have been copied.
     GCTaskId    *spaceOwner;      // The thread that "owns" this space during a GC.
+    bool         evacuate;        // All the live data is to be copied out in this GC.
+    bool         evacuationTarget;// New space that evacuated data is copied into.
 
     Bitmap       bitmap;          /* bitmap with one bit for each word in the GC area. */
     PLock        bitmapLock;      // Lock used in GC sharing pass.
     bool         allocationSpace; // True if this is (mutable) space for initial allocation
+    bool         largeObjectSpace;// True if this holds a single large object.  It is never copied.
+    unsigned     numaNode;        // The node the memory is placed on in NUMA mode.
     uintptr_t start[NSTARTS];  /* starting points for bit searches.                 */
     unsigned     start_index;     /* last index used to index start array              */
     uintptr_t i_marked;        /* count of immutable words marked.                  */
     uintptr_t m_marked;        /* count of mutable words marked.                    */
     uintptr_t updated;         /* count of words updated.                           */
+    CardTable    cardTable;       // Cards written since the last GC.  Mutable spaces only.
 
     uintptr_t allocatedSpace(void)const // Words allocated
         { return (top-upperAllocPtr) + (lowerAllocPtr-bottom); }
@@ -198,7 +234,7 @@ public:
 #endif
 
     virtual const char *spaceTypeString()
-        { return allocationSpace ? "allocation" : MemSpace::spaceTypeString(); }
+        { return allocationSpace ? "allocation" : largeObjectSpace ? "large object" : MemSpace::spaceTypeString(); }
 
     // Used when converting to and from bit positions in the bitmap
     uintptr_t wordNo(PolyWord *pt) { return pt - bottom; }
@@ -236,10 +272,11 @@ public:
     ~MemMgr();
     bool Initialise();
 
-    // Create a local space for initial allocation.
-    LocalMemSpace *CreateAllocationSpace(uintptr_t size);
-    // Create and initialise a new local space and add it to the table.
-    LocalMemSpace *NewLocalSpace(uintptr_t size, bool mut);
+    // Create a local space for initial allocation.  In NUMA mode the memory is placed on the node.
+    LocalMemSpace *CreateAllocationSpace(uintptr_t size, unsigned node = 0);
+    // Create and initialise a new local space and add it to the table.  In NUMA mode
+    // the memory is placed on the node or, by default, the node of the calling thread.
+    LocalMemSpace *NewLocalSpace(uintptr_t size, bool mut, unsigned node = NUMA_ANY_NODE);
     // Create an entry for a permanent space.
     PermanentMemSpace *NewPermanentSpace(PolyWord *base, uintptr_t words,
         unsigned flags, unsigned index, unsigned hierarchy = 0);
@@ -248,6 +285,10 @@ public:
     // Sets bottom and top to the actual memory size.
     PermanentMemSpace *AllocateNewPermanentSpace(uintptr_t byteSize, unsigned flags,
                             unsigned index, unsigned hierarchy = 0);
+    // Create a permanent data space by mapping part of a saved state file at
+    // the given address.  Returns NULL if the file cannot be mapped there.
+    PermanentMemSpace *MapPermanentSpace(int fd, uint64_t offset, uintptr_t byteSize, void *address,
+                            unsigned flags, unsigned index, unsigned hierarchy = 0);
     // Called after an allocated permanent area has been filled in.
     bool CompletePermanentSpaceAllocation(PermanentMemSpace *space);
 
@@ -259,10 +300,17 @@ public:
     // This is used both when allocating single objects (when minWords and maxWords
     // are the same) and when allocating heap segments.  If there is insufficient
     // space to satisfy the minimum it will return 0.  Updates "maxWords" with
-    // the space actually allocated
-    PolyWord *AllocHeapSpace(uintptr_t minWords, uintptr_t &maxWords, bool doAllocation = true);
+    // the space actually allocated.  In NUMA mode spaces on the node are preferred.
+    PolyWord *AllocHeapSpace(uintptr_t minWords, uintptr_t &maxWords, bool doAllocation = true, unsigned node = 0);
     PolyWord *AllocHeapSpace(uintptr_t words)
         { uintptr_t allocated = words; return AllocHeapSpace(words, allocated); }
+    // Allocate a large object in a space of its own.  Returns zero if this would
+    // take the heap over the limit.  The object is treated as already being in the
+    // major heap: it is never copied and the space is deleted when it becomes unreachable.
+    PolyWord *AllocLargeObject(uintptr_t words, unsigned node = 0);
+    bool IsLargeObjectSize(uintptr_t words) const { return words >= defaultSpaceSize; }
+    // Called by the GC when the allocation spaces have been emptied.
+    void ResetCurrentAllocation() { currentAllocation = 0; }
 
     CodeSpace *NewCodeSpace(uintptr_t size);
     // Allocate space for code.  This is initially mutable to allow the code to be built.
@@ -297,6 +345,40 @@ public:
     // As a debugging check, write protect the immutable areas apart from during the GC.
     void ProtectImmutable(bool on);
 
+    // Card marking.  The minor GC only scans the parts of the mutable areas that have
+    // been written since the last GC.
+    bool CardMarking() const { return cardMarking; }
+    void SetCardMarking(bool on) { cardMarking = on; }
+    // Return the card table for a space if it is one that is scanned by card.
+    CardTable *CardTableForSpace(MemSpace *space);
+    // Remove the protection before a GC or other main-thread request and restore it afterwards.
+    void ProtectCards(bool on);
+    // Called at the end of a successful GC.  There are no longer any references from
+    // the mutable areas to the allocation areas so all the cards are clean.
+    void ResetCards();
+    // Mark the cards as dirty before a system call writes into the heap.  The
+    // kernel cannot write to a protected page.
+    void MarkCardsDirty(const void *start, size_t bytes);
+    // Called from the signal handler.  Returns true if this was a write to a clean card.
+    bool HandleCardFault(const void *addr);
+
+    // Lazy loading.  Remove access to a space that has been mapped from a saved state
+    // so that the units of it are only read from the file when they are used.  If
+    // loader is null the space is at its original address and nothing needs relocating.
+    bool MakeSpaceLazy(PermanentMemSpace *space, size_t unitBytes, LazySpaceLoader *loader);
+    // Load all the remaining units of a lazy space.
+    bool CompleteLazySpace(PermanentMemSpace *space);
+    // Load the parts of lazy spaces before a system call reads from the heap.  The
+    // kernel does not fault them in.
+    void LoadLazyData(const void *start, size_t bytes);
+    // Load the units of spaces that are relocated as they are loaded.  This is
+    // done before a fork because the child does not inherit the loader thread.
+    void LoadRelocatedLazySpaces();
+    // Called from the signal handler.  Returns true if this was in an unloaded unit
+    // of a space at its original address.
+    bool HandleLazyFault(const void *addr);
+    bool LoadLazyUnit(PermanentMemSpace *space, uintptr_t unitNo);
+
     // Find a space that contains a given address.  This is called for every cell
     // during a GC so needs to be fast.,
     // N.B.  This must be called on an address at the beginning or within the cell.
@@ -410,10 +492,24 @@ public:
 
 private:
     bool AddLocalSpace(LocalMemSpace *space);
+    bool AddPermanentSpace(PermanentMemSpace *space, unsigned flags, unsigned index, unsigned hierarchy);
+    PolyWord *AllocInSpace(LocalMemSpace *space, uintptr_t minWords, uintptr_t &maxWords, bool doAllocation);
+    void ProtectCardsInSpace(MemSpace *space, bool on);
     bool AddCodeSpace(CodeSpace *space);
 
     uintptr_t reservedSpace;
     unsigned nextAllocator;
+    // The allocation space used for the last heap segment.  Segments are
+    // allocated from this without taking allocLock until it is full.
+    LocalMemSpace *currentAllocation;
+    bool cardMarking; // Use card marking in the minor GC
+    bool faultHandler; // The signal handler for card marking and lazy loading is installed.
+    // Spaces that have to be relocated are loaded by a separate thread when a
+    // thread touches a missing page.
+    PLock lazyLock;
+    bool lazyThreadRunning;
+    static void *LazyLoaderThread(void *);
+    bool cardsClean; // Set by ResetCards.
     // The default size in words when creating new segments.
     uintptr_t defaultSpaceSize;
     // The number of words that can be used for initial allocation.
@@ -81,6 +81,7 @@
 #include "statistics.h"
 #include "noreturn.h"
 #include "savestate.h"
+#include "numa.h"
 
 #if (defined(_WIN32))
 #include "winstartup.h"
@@ -109,7 +110,14 @@ enum {
     OPT_DEBUGFILE,
     OPT_DDESERVICE,
     OPT_CODEPAGE,
-    OPT_REMOTESTATS
+    OPT_REMOTESTATS,
+    OPT_NOGCCARDS,
+    OPT_GCCONCURRENT,
+    OPT_GCSHAREBUDGET,
+    OPT_GCEVACUATE,
+    OPT_GCPAUSE,
+    OPT_GCNUMA,
+    OPT_GCSIMNUMA
 };
 
 static struct __argtab {
@@ -122,10 +130,17 @@ static struct __argtab {
     { _T("--minheap"),      "Minimum heap size (MB)",                               OPT_HEAPMIN },
     { _T("--maxheap"),      "Maximum heap size (MB)",                               OPT_HEAPMAX },
     { _T("--gcpercent"),    "Target percentage time in GC (1-99)",                  OPT_GCPERCENT },
+    { _T("--gcpause"),      "Size the heap for a target GC pause time (ms)",        OPT_GCPAUSE },
     { _T("--stackspace"),   "Space to reserve for thread stacks and C++ heap(MB)",  OPT_RESERVE },
     { _T("--gcthreads"),    "Number of threads to use for garbage collection",      OPT_GCTHREADS },
     { _T("--debug"),        "Debug options: checkmem, gc, x",                       OPT_DEBUGOPTS },
     { _T("--logfile"),      "Logging file (default is to log to stdout)",           OPT_DEBUGFILE },
+    { _T("--nogccards"),    "Scan all the mutable data in a minor GC",              OPT_NOGCCARDS },
+    { _T("--gcconcurrent"), "Mark the heap while ML threads are running",           OPT_GCCONCURRENT },
+    { _T("--gcsharebudget"), "Time limit for each incremental sharing pass (ms)",   OPT_GCSHAREBUDGET },
+    { _T("--gcevacuate"),   "Number of sparse heap segments to evacuate in a full GC", OPT_GCEVACUATE },
+    { _T("--gcnuma"),       "Place heap segments and GC threads by NUMA node",      OPT_GCNUMA },
+    { _T("--gcsimnuma"),    "Simulate this number of NUMA nodes",                   OPT_GCSIMNUMA },
 #if (defined(_WIN32))
 #ifdef UNICODE
     { _T("--codepage"),     "Code-page to use for file-names etc in Windows",       OPT_CODEPAGE },
@@ -215,7 +230,7 @@ POLYUNSIGNED parseSize(const TCHAR *p, const TCHAR *arg)
 int polymain(int argc, TCHAR **argv, exportDescription *exports)
 {
     POLYUNSIGNED minsize=0, maxsize=0, initsize=0;
-    unsigned gcpercent=0;
+    unsigned gcpercent=0, gcpause=0;
     /* Get arguments. */
     memset(&userOptions, 0, sizeof(userOptions)); /* Reset it */
     userOptions.gcthreads = 0; // Default multi-threaded
@@ -250,7 +265,8 @@ int polymain(int argc, TCHAR **argv, exportDescription *exports)
                 {
                     const TCHAR *p = 0;
                     TCHAR *endp = 0;
-                    if (argTable[j].argKey != OPT_REMOTESTATS)
+                    if (argTable[j].argKey != OPT_REMOTESTATS && argTable[j].argKey != OPT_NOGCCARDS &&
+                        argTable[j].argKey != OPT_GCCONCURRENT && argTable[j].argKey != OPT_GCNUMA)
                     {
                         if (_tcslen(argv[i]) == argl)
                         { // If it has used all the argument pick the next
@@ -286,6 +302,11 @@ int polymain(int argc, TCHAR **argv, exportDescription *exports)
                             gcpercent = 0;
                         }
                         break;
+                    case OPT_GCPAUSE:
+                        gcpause = _tcstol(p, &endp, 10);
+                        if (*endp != '\0') 
+                            Usage("Malformed %s option\n", argTable[j].argName);
+                        break;
                     case OPT_RESERVE:
                         {
                             POLYUNSIGNED reserve = parseSize(p, argTable[j].argName);
@@ -298,6 +319,22 @@ int polymain(int argc, TCHAR **argv, exportDescription *exports)
                         if (*endp != '\0') 
                             Usage("Incomplete %s option\n", argTable[j].argName);
                         break;
+                    case OPT_GCSHAREBUDGET:
+                        userOptions.gcsharebudget = _tcstol(p, &endp, 10);
+                        if (*endp != '\0') 
+                            Usage("Incomplete %s option\n", argTable[j].argName);
+                        break;
+                    case OPT_GCEVACUATE:
+                        userOptions.gcevacuate = _tcstol(p, &endp, 10);
+                        if (*endp != '\0') 
+                            Usage("Incomplete %s option\n", argTable[j].argName);
+                        break;
+                    case OPT_GCSIMNUMA:
+                        userOptions.gcsimnuma = _tcstol(p, &endp, 10);
+                        if (*endp != '\0' || userOptions.gcsimnuma == 0)
+                            Usage("Incomplete %s option\n", argTable[j].argName);
+                        userOptions.gcnuma = true;
+                        break;
                     case OPT_DEBUGOPTS:
                         while (*p != '\0')
                         {
@@ -341,6 +378,15 @@ int polymain(int argc, TCHAR **argv, exportDescription *exports)
                         // If set we export the statistics on Unix.
                         globalStats.exportStats = true;
                         break;
+                    case OPT_NOGCCARDS:
+                        gMem.SetCardMarking(false);
+                        break;
+                    case OPT_GCCONCURRENT:
+                        userOptions.gcconcurrent = true;
+                        break;
+                    case OPT_GCNUMA:
+                        userOptions.gcnuma = true;
+                        break;
                     }
                     argUsed = true;
                     break;
@@ -383,8 +429,12 @@ int polymain(int argc, TCHAR **argv, exportDescription *exports)
             userOptions.gcthreads = NumberOfProcessors();
     }
 
+    // This must be done before the GC threads and the heap are created.
+    if (userOptions.gcnuma && ! gNumaTopology.Initialise(userOptions.gcsimnuma))
+        Usage("Unable to simulate %u NUMA nodes\n", userOptions.gcsimnuma);
+
     // Set the heap size if it has been provided otherwise use the default.
-    gHeapSizeParameters.SetHeapParameters(minsize, maxsize, initsize, gcpercent);
+    gHeapSizeParameters.SetHeapParameters(minsize, maxsize, initsize, gcpercent, gcpause);
 
 #if (defined(_WIN32))
     SetupDDEHandler(lpszServiceName); // Windows: Start the DDE handler now we processed any service name.
@@ -37,6 +37,11 @@ extern struct _userOptions {
     TCHAR       **user_arg_strings;
     const TCHAR *programName;
     unsigned    gcthreads;    // Number of threads to use for gc
+    bool        gcconcurrent; // Mark concurrently with the ML threads
+    unsigned    gcsharebudget; // Time limit for an incremental sharing pass (ms)
+    unsigned    gcevacuate;   // Number of sparse spaces to evacuate in a full GC
+    bool        gcnuma;       // Place the heap and GC threads by NUMA node
+    unsigned    gcsimnuma;    // Number of NUMA nodes to simulate
 } userOptions;
 
 class PolyWord;
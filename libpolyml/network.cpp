@@ -100,6 +100,10 @@
 #include <sys/select.h>
 #endif
 
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
 #ifdef HAVE_ARPA_INET_H
 #include <arpa/inet.h>
 #endif
@@ -125,6 +129,8 @@ typedef int SOCKET;
 #endif
 
 #include <new>
+#include <vector>
+#include <set>
 
 #include "globals.h"
 #include "gc.h"
@@ -142,6 +148,9 @@ typedef int SOCKET;
 #include "errors.h"
 #include "rtsentry.h"
 #include "timing.h"
+#include "memmgr.h"
+#include "ioreactor.h"
+#include "asyncio.h"
 
 extern "C" {
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkGetAddrList(POLYUNSIGNED threadId);
@@ -507,22 +516,39 @@ static Handle getSocketOption(TaskData *taskData, Handle args, int level, int op
 
 
 // Wait until "select" returns.  In Windows this is used only for networking.
+// In Unix the sockets are polled rather than using "select" so there is no
+// limit on the descriptor numbers.
 class WaitSelect: public Waiter
 {
 public:
     WaitSelect(unsigned maxMillisecs=(unsigned)-1);
     virtual void Wait(unsigned maxMillisecs);
+#if (defined(_WIN32))
     void SetRead(SOCKET fd) {  FD_SET(fd, &readSet); }
     void SetWrite(SOCKET fd) {  FD_SET(fd, &writeSet); }
     void SetExcept(SOCKET fd)  {  FD_SET(fd, &exceptSet); }
     bool IsSetRead(SOCKET fd) { return FD_ISSET(fd, &readSet) != 0; }
     bool IsSetWrite(SOCKET fd) { return FD_ISSET(fd, &writeSet) != 0; }
     bool IsSetExcept(SOCKET fd) { return FD_ISSET(fd, &exceptSet) != 0; }
+#else
+    void SetRead(SOCKET fd) { AddDescriptor(fd, POLLIN); }
+    void SetWrite(SOCKET fd) { AddDescriptor(fd, POLLOUT); }
+    void SetExcept(SOCKET fd)  { AddDescriptor(fd, POLLPRI); }
+    bool IsSetRead(SOCKET fd) { return readReady.find(fd) != readReady.end(); }
+    bool IsSetWrite(SOCKET fd) { return writeReady.find(fd) != writeReady.end(); }
+    bool IsSetExcept(SOCKET fd) { return exceptReady.find(fd) != exceptReady.end(); }
+#endif
     // Save the result of the select call and any associated error
     int SelectResult(void) { return selectResult; }
     int SelectError(void) { return errorResult; }
 private:
+#if (defined(_WIN32))
     fd_set readSet, writeSet, exceptSet;
+#else
+    void AddDescriptor(SOCKET fd, short events);
+    std::vector<struct pollfd> pollVec;
+    std::set<SOCKET> readReady, writeReady, exceptReady;
+#endif
     int selectResult;
     int errorResult;
     unsigned maxTime;
@@ -530,14 +556,17 @@ private:
 
 WaitSelect::WaitSelect(unsigned maxMillisecs)
 {
+#if (defined(_WIN32))
     FD_ZERO(&readSet);
     FD_ZERO(&writeSet);
     FD_ZERO(&exceptSet);
+#endif
     selectResult = 0;
     errorResult = 0;
     maxTime = maxMillisecs;
 }
 
+#if (defined(_WIN32))
 void WaitSelect::Wait(unsigned maxMillisecs)
 {
     if (maxTime < maxMillisecs) maxMillisecs = maxTime;
@@ -547,6 +576,54 @@ void WaitSelect::Wait(unsigned maxMillisecs)
     selectResult = select(FD_SETSIZE, &readSet, &writeSet, &exceptSet, &toWait);
     if (selectResult < 0) errorResult = GETERROR;
 }
+#else
+void WaitSelect::AddDescriptor(SOCKET fd, short events)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    pollVec.push_back(pfd);
+}
+
+void WaitSelect::Wait(unsigned maxMillisecs)
+{
+    if (maxTime < maxMillisecs) maxMillisecs = maxTime;
+    int pollResult = WaitForDescriptors(pollVec.empty() ? 0 : &pollVec[0], (unsigned)pollVec.size(), maxMillisecs);
+    if (pollResult < 0)
+    {
+        selectResult = -1;
+        errorResult = GETERROR;
+        return;
+    }
+    // Convert the results to those that select would give.  End-of-file
+    // and errors count as ready for reading and writing.
+    selectResult = 0;
+    for (std::vector<struct pollfd>::iterator i = pollVec.begin(); i != pollVec.end(); i++)
+    {
+        if (i->revents & POLLNVAL)
+        {
+            selectResult = -1;
+            errorResult = EBADF;
+            return;
+        }
+        bool ready = false;
+        switch (i->events)
+        {
+        case POLLIN:
+            if (i->revents & (POLLIN | POLLHUP | POLLERR)) { readReady.insert(i->fd); ready = true; }
+            break;
+        case POLLOUT:
+            if (i->revents & (POLLOUT | POLLHUP | POLLERR)) { writeReady.insert(i->fd); ready = true; }
+            break;
+        case POLLPRI:
+            if (i->revents & POLLPRI) { exceptReady.insert(i->fd); ready = true; }
+            break;
+        }
+        if (ready) selectResult++;
+    }
+}
+#endif
 
 #if (defined(_WIN32))
 class WinSocket : public WinStreamBase
@@ -924,6 +1001,7 @@ POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkSend(POLYUNSIGNED threadId, POLYUNSIG
         if (dontRoute != 0) flags |= MSG_DONTROUTE;
         if (outOfBand != 0) flags |= MSG_OOB;
         char *base = (char*)pBase.AsObjPtr()->AsBytePtr();
+        gMem.LoadLazyData(base + offset, length);
         sent = send(sock, base + offset, length, flags);
         if (sent == SOCKET_ERROR)
             raise_syscall(taskData, "send failed", GETERROR);
@@ -965,6 +1043,8 @@ POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkSendTo(POLYUNSIGNED threadId, POLYUNS
         if (dontRoute != 0) flags |= MSG_DONTROUTE;
         if (outOfBand != 0) flags |= MSG_OOB;
         char *base = (char*)pBase.AsObjPtr()->AsBytePtr();
+        gMem.LoadLazyData(base + offset, length);
+        gMem.LoadLazyData(psAddr->chars, psAddr->length);
         sent = sendto(sock, base + offset, length, flags,
                 (struct sockaddr *)psAddr->chars, (int)psAddr->length);
         if (sent == SOCKET_ERROR)
@@ -1005,6 +1085,7 @@ POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkReceive(POLYUNSIGNED threadId, POLYUN
         if (peek != 0) flags |= MSG_PEEK;
         if (outOfBand != 0) flags |= MSG_OOB;
 
+        gMem.MarkCardsDirty(base + offset, length);
         recvd = recv(sock, base + offset, length, flags);
         if (recvd == SOCKET_ERROR)
             raise_syscall(taskData, "recv failed", GETERROR);
@@ -1048,6 +1129,7 @@ POLYEXTERNALSYMBOL POLYUNSIGNED PolyNetworkReceiveFrom(POLYUNSIGNED threadId, PO
 #else
         ssize_t recvd;
 #endif
+        gMem.MarkCardsDirty(base + offset, length);
         recvd = recvfrom(sock, base + offset, length, flags, (struct sockaddr*)&resultAddr, &addrLen);
         if (recvd == SOCKET_ERROR)
             raise_syscall(taskData, "recvfrom failed", GETERROR);
@@ -1144,6 +1226,7 @@ POLYUNSIGNED PolyNetworkCreateSocket(POLYUNSIGNED threadId, POLYUNSIGNED family,
 #if (defined(_WIN32) && ! defined(__CYGWIN__))
             closesocket(skt);
 #else
+            ForgetDescriptor(skt);
             close(skt);
 #endif
             raise_syscall(taskData, "ioctl failed", GETERROR);
@@ -1557,7 +1640,9 @@ POLYUNSIGNED PolyNetworkCreateSocketPair(POLYUNSIGNED threadId, POLYUNSIGNED fam
         if (ioctl(skt[0], FIONBIO, &onOff) < 0 ||
             ioctl(skt[1], FIONBIO, &onOff) < 0)
         {
+            ForgetDescriptor(skt[0]);
             close(skt[0]);
+            ForgetDescriptor(skt[1]);
             close(skt[1]);
             raise_syscall(taskData, "ioctl failed", GETERROR);
         }
@@ -1915,6 +2000,8 @@ POLYUNSIGNED PolyNetworkCloseSocket(POLYUNSIGNED threadId, POLYUNSIGNED strm)
         int descr = getStreamFileDescriptorWithoutCheck(pushedStream->Word());
         if (descr >= 0)
         {
+            ForgetDescriptor(descr);
+            CancelAsyncIO(descr);
             if (close(descr) != 0)
                 raise_syscall(taskData, "Error during close", GETERROR);
         }
@@ -0,0 +1,199 @@
+/*
+    Title:  numa.cpp - NUMA topology for heap placement and GC workers
+
+    Copyright (c) 2026 David C.J. Matthews
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License version 2.1 as published by the Free Software Foundation.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#elif defined(_WIN32)
+#include "winconfig.h"
+#else
+#error "No configuration file"
+#endif
+
+#if defined __linux__ && !defined _GNU_SOURCE
+// _GNU_SOURCE is needed for sched_getcpu and pthread_setaffinity_np.
+#define _GNU_SOURCE 1
+#endif
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+#include "globals.h"
+#include "numa.h"
+#include "gctaskfarm.h"
+#include "gc.h"
+#include "locking.h"
+#include "diagnostics.h"
+#include "statistics.h"
+
+#ifdef __linux__
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED  1
+#endif
+#endif
+
+// The number of nodes is limited by the node mask passed to mbind.
+#define MAX_NUMA_NODES  (sizeof(unsigned long)*8)
+
+NumaTopology gNumaTopology;
+
+// Protects the scan counts.  These are only updated once for each space in a phase.
+static PLock scanLock("NUMA scan counts");
+
+#ifdef __linux__
+// Parse a list of processors in the form "0-3,8,10-11" and set the node for each.
+static void parseCpuList(const char *list, unsigned node, std::vector<unsigned> &cpuNodes)
+{
+    const char *p = list;
+    while (*p >= '0' && *p <= '9')
+    {
+        char *endp;
+        unsigned long first = strtoul(p, &endp, 10), last = first;
+        p = endp;
+        if (*p == '-')
+        {
+            last = strtoul(p+1, &endp, 10);
+            p = endp;
+        }
+        if (last >= cpuNodes.size()) cpuNodes.resize(last+1, 0);
+        for (unsigned long cpu = first; cpu <= last; cpu++)
+            cpuNodes[cpu] = node;
+        if (*p == ',') p++;
+    }
+}
+#endif
+
+bool NumaTopology::Initialise(unsigned simulatedNodes)
+{
+    enabled = true;
+    if (simulatedNodes != 0)
+    {
+        if (simulatedNodes > MAX_NUMA_NODES)
+            return false;
+        simulated = true;
+        nodeCount = simulatedNodes;
+    }
+    else
+    {
+        nodeCount = 1;
+#ifdef __linux__
+        // Each node has a list of the processors attached to it.
+        for (unsigned node = 0; node < MAX_NUMA_NODES; node++)
+        {
+            char path[80], list[1024];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+            FILE *f = fopen(path, "r");
+            if (f == 0) break;
+            if (fgets(list, sizeof(list), f) != 0)
+                parseCpuList(list, node, cpuNodes);
+            fclose(f);
+            nodeCount = node+1;
+        }
+#endif
+        // On other systems, or if the information is not available, there is a single node.
+    }
+    if (debugOptions & DEBUG_GC)
+        Log("GC: NUMA mode with %u %snode%s\n", nodeCount, simulated ? "simulated " : "", nodeCount == 1 ? "" : "s");
+    return true;
+}
+
+unsigned NumaTopology::NodeForNewThread()
+{
+    if (! enabled) return 0;
+    // A race between threads creating new threads only affects the balance.
+    unsigned node = nextThreadNode;
+    nextThreadNode = (nextThreadNode + 1) % nodeCount;
+    return node;
+}
+
+unsigned NumaTopology::CurrentNode(unsigned homeNode)
+{
+    if (! enabled || simulated) return homeNode;
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    if (cpu >= 0 && (unsigned)cpu < cpuNodes.size())
+        return cpuNodes[cpu];
+#endif
+    return homeNode;
+}
+
+void NumaTopology::PinThreadToNode(unsigned node)
+{
+    if (! enabled || simulated || nodeCount == 1) return;
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (unsigned cpu = 0; cpu < cpuNodes.size() && cpu < CPU_SETSIZE; cpu++)
+    {
+        if (cpuNodes[cpu] == node)
+            CPU_SET(cpu, &cpus);
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0 && (debugOptions & DEBUG_GC))
+        Log("GC: Unable to pin GC thread to node %u\n", node);
+#endif
+}
+
+void NumaTopology::BindMemory(void *start, size_t bytes, unsigned node)
+{
+    if (! enabled || simulated || nodeCount == 1) return;
+#if defined(__linux__) && defined(SYS_mbind)
+    // This is only a preference.  If the node has no free memory the kernel
+    // takes it from another node.  Failure is not an error.
+    unsigned long mask = 1UL << node;
+    if (syscall(SYS_mbind, start, bytes, MPOL_PREFERRED, &mask, MAX_NUMA_NODES+1, 0) != 0 && (debugOptions & DEBUG_MEMMGR))
+        Log("MMGR: Unable to bind %p to node %u\n", start, node);
+#endif
+}
+
+void NumaTopology::RecordScan(unsigned spaceNode, uintptr_t words)
+{
+    if (! enabled) return;
+    bool isLocal = gpTaskFarm->CurrentNode() == spaceNode;
+    PLocker l(&scanLock);
+    if (isLocal) localWords += words; else remoteWords += words;
+}
+
+void NumaTopology::ReportScans()
+{
+    if (! enabled) return;
+    uintptr_t local, remote;
+    {
+        PLocker l(&scanLock);
+        local = localWords;
+        remote = remoteWords;
+        localWords = remoteWords = 0;
+    }
+    globalStats.setSize(PSS_GC_NUMA_LOCAL, local * sizeof(PolyWord));
+    globalStats.setSize(PSS_GC_NUMA_REMOTE, remote * sizeof(PolyWord));
+    if (debugOptions & DEBUG_GC)
+        Log("GC: NUMA scans: %" PRI_SIZET " words local, %" PRI_SIZET " words remote (%1.0f%% local)\n",
+            local, remote, local+remote == 0 ? 100.0 : (double)local * 100.0 / (double)(local+remote));
+}
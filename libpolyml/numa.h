@@ -0,0 +1,73 @@
+/*
+    Title:  numa.h - NUMA topology for heap placement and GC workers
+
+    Copyright (c) 2026 David C.J. Matthews
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License version 2.1 as published by the Free Software Foundation.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*/
+
+#ifndef NUMA_H_INCLUDED
+#define NUMA_H_INCLUDED 1
+
+#include <vector>
+
+// Used when adding GC work that is not associated with a particular node.
+#define NUMA_ANY_NODE   ((unsigned)-1)
+
+// In NUMA mode each ML thread has a home node and allocates in spaces whose
+// memory is placed on that node.  The GC workers are spread across the nodes
+// and prefer to take work on spaces local to their own node.  With a simulated
+// topology the nodes are assigned in the same way but nothing is pinned or bound
+// so the policy can be exercised on a single-node machine.
+class NumaTopology {
+public:
+    NumaTopology(): enabled(false), simulated(false), nodeCount(1),
+        nextThreadNode(0), localWords(0), remoteWords(0) {}
+
+    // Enable NUMA mode.  If simulatedNodes is non-zero that many nodes are simulated,
+    // otherwise the topology is read from the system.
+    bool Initialise(unsigned simulatedNodes);
+
+    bool Enabled() const { return enabled; }
+    unsigned NodeCount() const { return nodeCount; }
+
+    // The node for a new ML thread.  Threads are spread across the nodes.
+    unsigned NodeForNewThread();
+    // The node of the processor this thread is running on.  With a simulated
+    // topology threads stay on the node they were given.
+    unsigned CurrentNode(unsigned homeNode);
+    // GC worker threads are spread across the nodes.
+    unsigned NodeOfWorker(unsigned workerNo) const { return workerNo % nodeCount; }
+    // Restrict the calling thread to the processors of the node.
+    void PinThreadToNode(unsigned node);
+    // Ask for the pages of an area to be placed on the node.
+    void BindMemory(void *start, size_t bytes, unsigned node);
+
+    // Record the words scanned by a GC thread in a space on spaceNode.
+    void RecordScan(unsigned spaceNode, uintptr_t words);
+    // Report the local and remote counts for this GC and reset them.
+    void ReportScans();
+
+private:
+    bool enabled, simulated;
+    unsigned nodeCount;
+    unsigned nextThreadNode;
+    std::vector<unsigned> cpuNodes; // The node for each processor.
+    uintptr_t localWords, remoteWords;
+};
+
+extern NumaTopology gNumaTopology;
+
+#endif
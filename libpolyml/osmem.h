@@ -77,6 +77,23 @@ public:
     // either from importing a portable export file or copying the area in 32-in-64.
     virtual bool DisableWriteForCode(void* codeAddr, void* dataAddr, size_t space) = 0;
 
+    // Map part of a file as a data area at exactly the given address.  The mapping
+    // is private so writes to it do not change the file.  Returns NULL if mapping is
+    // not supported or if the address is not free.  The area is released with FreeDataArea.
+    virtual void *MapFileDataArea(int /*fd*/, uint64_t /*offset*/, size_t /*bytes*/, void* /*address*/) { return 0; }
+
+    // Remove all access to a mapped area.  Access is restored with EnableWrite.
+    virtual bool DisableAccess(void* /*p*/, size_t /*space*/) { return false; }
+
+    // Replace part of a data area with pages that are filled in when they are first
+    // used.  A thread that touches one of them blocks in the kernel until FillArea
+    // has been called for it.  WaitForFill blocks until that happens and returns the
+    // address that was touched.  This uses userfaultfd on Linux.
+    virtual bool CanFillOnDemand() { return false; }
+    virtual bool MakeFillOnDemand(void* /*p*/, size_t /*space*/) { return false; }
+    virtual bool FillArea(void* /*p*/, const void* /*data*/, size_t /*space*/) { return false; }
+    virtual void *WaitForFill() { return 0; }
+
 protected:
     size_t pageSize;
     enum _MemUsage memUsage;
@@ -101,6 +118,8 @@ public:
     OSMemUnrestricted() {
 #ifndef _WIN32
         allocPtr = 0;
+        fillFd = -1;
+        fillOpened = false;
 #endif
     }
 public:
@@ -112,9 +131,19 @@ public:
     virtual bool FreeCodeArea(void* codeAddr, void* dataAddr, size_t space);
     virtual bool DisableWriteForCode(void* codeAddr, void* dataAddr, size_t space);
 #ifndef _WIN32
+    virtual void* MapFileDataArea(int fd, uint64_t offset, size_t bytes, void* address);
+    virtual bool DisableAccess(void* p, size_t space);
+    virtual bool CanFillOnDemand();
+    virtual bool MakeFillOnDemand(void* p, size_t space);
+    virtual bool FillArea(void* p, const void* data, size_t space);
+    virtual void *WaitForFill();
     // Used if wxFix is WXFixDualArea but now only in x86/32.
     PLock allocLock;
     size_t allocPtr;
+    // The userfaultfd descriptor used for areas filled on demand.
+    PLock fillLock;
+    int fillFd;
+    bool fillOpened;
 #endif
 };
 
@@ -68,6 +68,17 @@
 #include <fcntl.h>
 #endif
 
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/userfaultfd.h>)
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/userfaultfd.h>
+#ifdef __NR_userfaultfd
+#define HAVE_USERFAULTFD 1
+#endif
+#endif
+#endif
+
 // Linux prefers MAP_ANONYMOUS to MAP_ANON
 #ifndef MAP_ANON
 #ifdef MAP_ANONYMOUS
@@ -437,6 +448,128 @@ bool OSMemUnrestricted::FreeDataArea(void *p, size_t space)
     return munmap(FIXTYPE p, space) == 0;
 }
 
+// Map a saved state segment at its original address.  Older kernels ignore
+// MAP_FIXED_NOREPLACE and treat the address as a hint so the result has to be checked.
+void* OSMemUnrestricted::MapFileDataArea(int fd, uint64_t offset, size_t bytes, void* address)
+{
+    if (((uintptr_t)address & (pageSize - 1)) != 0 || (offset & (pageSize - 1)) != 0)
+        return 0;
+    int flags = MAP_PRIVATE;
+#ifdef MAP_FIXED_NOREPLACE
+    flags |= MAP_FIXED_NOREPLACE;
+#endif
+    void* result = mmap(FIXTYPE address, bytes, PROT_READ | PROT_WRITE, flags, fd, (off_t)offset);
+    if (result == MAP_FAILED)
+        return 0;
+    if (result != address)
+    {
+        munmap(FIXTYPE result, bytes);
+        return 0;
+    }
+    return result;
+}
+
+bool OSMemUnrestricted::DisableAccess(void* p, size_t space)
+{
+    int res = mprotect(FIXTYPE p, space, PROT_NONE);
+    return res != -1;
+}
+
+// Open the userfaultfd descriptor the first time.  Unprivileged processes may
+// only be allowed to handle faults from user mode.  Faults in system calls then
+// return EFAULT so the callers load the data first with LoadLazyData.
+bool OSMemUnrestricted::CanFillOnDemand()
+{
+#ifdef HAVE_USERFAULTFD
+    PLocker lock(&fillLock);
+    if (! fillOpened)
+    {
+        fillOpened = true;
+#ifdef UFFD_USER_MODE_ONLY
+        fillFd = (int)syscall(__NR_userfaultfd, O_CLOEXEC | UFFD_USER_MODE_ONLY);
+        if (fillFd < 0)
+#endif
+            fillFd = (int)syscall(__NR_userfaultfd, O_CLOEXEC);
+        if (fillFd >= 0)
+        {
+            struct uffdio_api api;
+            api.api = UFFD_API;
+            api.features = 0;
+            if (ioctl(fillFd, UFFDIO_API, &api) != 0)
+            {
+                close(fillFd);
+                fillFd = -1;
+            }
+        }
+    }
+    return fillFd >= 0;
+#else
+    return false;
+#endif
+}
+
+// Replace the pages with empty anonymous ones and register them.  Only missing
+// pages cause faults so this cannot be used on the file mapping itself.
+bool OSMemUnrestricted::MakeFillOnDemand(void* p, size_t space)
+{
+#ifdef HAVE_USERFAULTFD
+    if (! CanFillOnDemand())
+        return false;
+    if (mmap(FIXTYPE p, space, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_FIXED, -1, 0) != p)
+        return false;
+    struct uffdio_register reg;
+    reg.range.start = (uintptr_t)p;
+    reg.range.len = space;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+    return ioctl(fillFd, UFFDIO_REGISTER, &reg) == 0;
+#else
+    return false;
+#endif
+}
+
+// Copy the data into the pages and wake any threads waiting for them.  If
+// the pages have already been filled just wake the threads.
+bool OSMemUnrestricted::FillArea(void* p, const void* data, size_t space)
+{
+#ifdef HAVE_USERFAULTFD
+    struct uffdio_copy copy;
+    copy.dst = (uintptr_t)p;
+    copy.src = (uintptr_t)data;
+    copy.len = space;
+    copy.mode = 0;
+    copy.copy = 0;
+    if (ioctl(fillFd, UFFDIO_COPY, &copy) == 0)
+        return true;
+    if (errno != EEXIST)
+        return false;
+    struct uffdio_range range;
+    range.start = (uintptr_t)p;
+    range.len = space;
+    return ioctl(fillFd, UFFDIO_WAKE, &range) == 0;
+#else
+    return false;
+#endif
+}
+
+void *OSMemUnrestricted::WaitForFill()
+{
+#ifdef HAVE_USERFAULTFD
+    while (true)
+    {
+        struct uffd_msg msg;
+        ssize_t n = read(fillFd, &msg, sizeof(msg));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n != sizeof(msg))
+            return 0;
+        if (msg.event == UFFD_EVENT_PAGEFAULT)
+            return (void*)(uintptr_t)msg.arg.pagefault.address;
+    }
+#else
+    return 0;
+#endif
+}
+
 bool OSMemUnrestricted::EnableWrite(bool enable, void* p, size_t space)
 {
     int res = mprotect(FIXTYPE p, space, enable ? PROT_READ|PROT_WRITE: PROT_READ);
@@ -34,6 +34,10 @@
 #include <errno.h>
 #endif
 
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
 #ifdef HAVE_ASSERT_H
 #include <assert.h>
 #define ASSERT(x) assert(x)
@@ -53,13 +57,17 @@
 #include "memmgr.h"
 #include "rtsentry.h"
 #include "mpoly.h" // For polyStderr
+#include "gc.h" // For gpTaskFarm
+#include "gctaskfarm.h"
+
+#include <new>
 
 /*
 This file contains the code both to export the file and to import it
 in a new session.
 */
 
-PExport::PExport()
+PExport::PExport(bool binary): binaryFormat(binary)
 {
 }
 
@@ -295,11 +303,22 @@ void PExport::exportStore(void)
             p++;
             PolyObject *obj = (PolyObject*)p;
             POLYUNSIGNED length = obj->Length();
+#ifdef POLYML32IN64
+            // Filler cells are not included.
+            if (((uintptr_t)obj & 4) != 0 && length == 0)
+                continue;
+#endif
             pMap.push_back(obj);
             p += length;
         }
     }
 
+    if (binaryFormat)
+    {
+        exportBinary(indexOrder);
+        return;
+    }
+
     /* Start writing the information. */
     fprintf(exportFile, "Objects\t%" PRI_SIZET "\n", pMap.size());
     char arch = '?';
@@ -339,6 +358,313 @@ void PExport::exportStore(void)
 }
 
 
+/*
+The binary format is the same on every platform.  After the signature and the
+header there is a string table with the names of the entry points, then a table
+with the type and size of each object in index order and then the contents of
+the objects in the same order.  The tables are each preceded by their length in
+bytes.  All numbers are unsigned LEB128 varints.  A value is encoded as twice
+the index plus three for an address, twice the zig-zag encoding for a tagged
+integer and one for a zero word.
+*/
+
+// Types of object.  These are the same as in the text format.
+#define PXB_ORDINARY    'O'
+#define PXB_BYTES       'B'
+#define PXB_STRING      'S'
+#define PXB_CODE        'F'
+#define PXB_CLOSURE     'C'
+#define PXB_WEAKREF     'K'
+#define PXB_ENTRYPOINT  'E'
+
+// The encoding of a zero word.
+#define PXB_ZERO        1
+
+// Flags for each object.
+#define PXB_MUTABLE     1
+#define PXB_NEGATIVE    2
+#define PXB_NOOVERWRITE 4
+#define PXB_WEAK        8
+
+static void putVarint(std::vector<byte> &buff, uint64_t n)
+{
+    while (n >= 0x80)
+    {
+        buff.push_back((byte)(n | 0x80));
+        n >>= 7;
+    }
+    buff.push_back((byte)n);
+}
+
+static inline uint64_t encodeTagged(POLYSIGNED n)
+{
+    int64_t v = n;
+    return (((uint64_t)v << 1) ^ (uint64_t)(v >> 63)) << 1;
+}
+
+static inline POLYSIGNED decodeTagged(uint64_t u)
+{
+    u >>= 1;
+    return (POLYSIGNED)(int64_t)((u >> 1) ^ (~(u & 1) + 1));
+}
+
+// Is this byte object a string?  This is not infallible but it seems to be
+// good enough to detect the strings.
+static bool looksLikeString(PolyObject *p)
+{
+    POLYUNSIGNED length = p->Length();
+    PolyStringObject* ps = (PolyStringObject*)p;
+    POLYUNSIGNED bytes = length * sizeof(PolyWord);
+    return length >= 2 && ps->length <= bytes - sizeof(POLYUNSIGNED) &&
+        ps->length > bytes - 2 * sizeof(POLYUNSIGNED);
+}
+
+static inline bool isEntryPoint(PolyObject *p)
+{
+    return p->IsByteObject() && p->IsMutable() && p->IsWeakRefObject() &&
+        p->Length() > sizeof(uintptr_t) / sizeof(PolyWord);
+}
+
+static inline bool isWeakRef(PolyObject *p)
+{
+    return p->IsByteObject() && p->IsMutable() && p->IsWeakRefObject() &&
+        p->Length() == sizeof(uintptr_t) / sizeof(PolyWord);
+}
+
+// Encodes the objects of one segment.  The segments are encoded in parallel and
+// then written out in order.  This is also used to collect the constants within code.
+class PExportSegment: public ScanAddress
+{
+public:
+    PExportSegment(PExport *e, PolyWord *s, PolyWord *t, size_t str):
+        exporter(e), start(s), end(t), firstString(str), failed(false) {}
+
+    void Encode();
+    static void encodeTask(GCTaskId *, void *arg1, void *);
+
+    std::vector<byte> table, contents;
+
+private:
+    void putValue(PolyWord w);
+    virtual void ScanConstant(PolyObject *base, byte *addrOfConst, ScanRelocationKind code, intptr_t displacement);
+    virtual PolyObject *ScanObjectAddress(PolyObject *base) { return base; }
+
+    PExport *exporter;
+    PolyWord *start, *end;
+    size_t firstString;
+    std::vector<byte> relocations;
+    size_t relocationCount;
+public:
+    bool failed;
+};
+
+void PExportSegment::putValue(PolyWord w)
+{
+    if (w == PolyWord::FromUnsigned(0))
+        putVarint(contents, PXB_ZERO);
+    else if (IS_INT(w))
+        putVarint(contents, encodeTagged(UNTAGGED(w)));
+    else putVarint(contents, (uint64_t)exporter->getIndex(w.AsObjPtr()) * 2 + 3);
+}
+
+void PExportSegment::ScanConstant(PolyObject *base, byte *addr, ScanRelocationKind code, intptr_t displacement)
+{
+    PolyObject *p = GetConstantValue(addr, code, displacement);
+    if (p == 0) return; // Don't put in tagged constants
+    putVarint(relocations, (POLYUNSIGNED)(addr - (byte*)base));
+    putVarint(relocations, code);
+    putVarint(relocations, exporter->getIndex(p));
+    relocationCount++;
+}
+
+void PExportSegment::Encode()
+{
+    size_t stringNo = firstString;
+    for (PolyWord *pt = start; pt < end; )
+    {
+        pt++;
+        PolyObject *p = (PolyObject*)pt;
+        POLYUNSIGNED length = p->Length();
+        pt += length;
+#ifdef POLYML32IN64
+        if (((uintptr_t)p & 4) != 0 && length == 0)
+            continue;
+#endif
+        unsigned flags = 0;
+        if (p->IsMutable()) flags |= PXB_MUTABLE;
+        if (OBJ_IS_NEGATIVE(p->LengthWord())) flags |= PXB_NEGATIVE;
+        if (OBJ_IS_NO_OVERWRITE(p->LengthWord())) flags |= PXB_NOOVERWRITE;
+        if (OBJ_IS_WEAKREF_OBJECT(p->LengthWord())) flags |= PXB_WEAK;
+
+        if (isWeakRef(p))
+        {
+            table.push_back(PXB_WEAKREF);
+            table.push_back((byte)flags);
+        }
+        else if (isEntryPoint(p))
+        {
+            table.push_back(PXB_ENTRYPOINT);
+            table.push_back((byte)flags);
+            putVarint(table, stringNo++);
+        }
+        else if (p->IsByteObject())
+        {
+            if (looksLikeString(p))
+            {
+                PolyStringObject* ps = (PolyStringObject*)p;
+                table.push_back(PXB_STRING);
+                table.push_back((byte)flags);
+                putVarint(table, ps->length);
+                contents.insert(contents.end(), (byte*)ps->chars, (byte*)ps->chars + ps->length);
+            }
+            else
+            {
+                // See the comment in printObject about arbitrary precision values.
+                POLYUNSIGNED bytes = length * sizeof(PolyWord);
+                table.push_back(PXB_BYTES);
+                table.push_back((byte)flags);
+                putVarint(table, bytes);
+                contents.insert(contents.end(), (byte*)p, (byte*)p + bytes);
+            }
+        }
+        else if (p->IsCodeObject())
+        {
+            POLYUNSIGNED constCount;
+            PolyWord *cp;
+            machineDependent->GetConstSegmentForCode(p, cp, constCount);
+            POLYUNSIGNED byteCount = (length - constCount - 2) * sizeof(PolyWord);
+            table.push_back(PXB_CODE);
+            table.push_back((byte)flags);
+            putVarint(table, constCount);
+            putVarint(table, byteCount);
+            contents.insert(contents.end(), (byte*)p, (byte*)p + byteCount);
+            for (POLYUNSIGNED i = 0; i < constCount; i++)
+                putValue(cp[i]);
+            // Any constants within the code are added as relocations.
+            relocations.clear();
+            relocationCount = 0;
+            machineDependent->ScanConstantsWithinCode(p, this);
+            putVarint(contents, relocationCount);
+            contents.insert(contents.end(), relocations.begin(), relocations.end());
+        }
+        else
+        {
+            POLYUNSIGNED i = 0;
+            if (p->IsClosureObject())
+            {
+                table.push_back(PXB_CLOSURE);
+                table.push_back((byte)flags);
+                putVarint(table, length - sizeof(PolyObject*) / sizeof(PolyWord) + 1);
+                // The first word is always a code address.
+                putVarint(contents, exporter->getIndex(*(PolyObject**)p));
+                i = sizeof(PolyObject*) / sizeof(PolyWord);
+            }
+            else
+            {
+                table.push_back(PXB_ORDINARY);
+                table.push_back((byte)flags);
+                putVarint(table, length);
+            }
+            for (; i < length; i++)
+                putValue(p->Get(i));
+        }
+    }
+}
+
+void PExportSegment::encodeTask(GCTaskId *, void *arg1, void *)
+{
+    PExportSegment *segment = (PExportSegment *)arg1;
+    try {
+        segment->Encode();
+    }
+    catch (std::bad_alloc &) {
+        segment->failed = true;
+    }
+}
+
+void PExport::exportBinary(const std::vector<size_t> &indexOrder)
+{
+    try {
+        // The entry point names go into the string table.  Each segment records
+        // the number of its first string so the segments can be encoded in parallel.
+        std::vector<const char *> strings;
+        std::vector<PExportSegment*> segments;
+        for (std::vector<size_t>::const_iterator i = indexOrder.begin(); i != indexOrder.end(); i++)
+        {
+            PolyWord *start = (PolyWord*)memTable[*i].mtOriginalAddr;
+            PolyWord *end = (PolyWord*)((char*)start + memTable[*i].mtLength);
+            segments.push_back(new PExportSegment(this, start, end, strings.size()));
+            for (PolyWord *pt = start; pt < end; )
+            {
+                pt++;
+                PolyObject *obj = (PolyObject*)pt;
+                if (isEntryPoint(obj))
+                    strings.push_back((const char*)obj + sizeof(uintptr_t));
+                pt += obj->Length();
+            }
+        }
+
+        for (std::vector<PExportSegment*>::iterator i = segments.begin(); i != segments.end(); i++)
+            gpTaskFarm->AddWorkOrRunNow(&PExportSegment::encodeTask, *i, 0);
+        gpTaskFarm->WaitForCompletion();
+
+        std::vector<byte> header;
+        size_t tableBytes = 0, contentBytes = 0;
+        bool failed = false;
+        for (std::vector<PExportSegment*>::iterator i = segments.begin(); i != segments.end(); i++)
+        {
+            tableBytes += (*i)->table.size();
+            contentBytes += (*i)->contents.size();
+            if ((*i)->failed) failed = true;
+        }
+        if (! failed)
+        {
+            header.insert(header.end(), PORTABLESIGNATURE, PORTABLESIGNATURE + sizeof(PORTABLESIGNATURE));
+            header.push_back(PORTABLEVERSION);
+            char arch = '?';
+            switch (machineDependent->MachineArchitecture())
+            {
+            case MA_Interpreted:
+                arch = 'I'; break;
+            case MA_I386: case MA_X86_64: case MA_X86_64_32:
+                arch = 'X'; break;
+            case MA_Arm64: case MA_Arm64_32:
+                arch = 'A'; break;
+            }
+            header.push_back(arch);
+            header.push_back(sizeof(PolyWord));
+            putVarint(header, pMap.size());
+            putVarint(header, getIndex(rootFunction));
+            putVarint(header, strings.size());
+            for (std::vector<const char *>::iterator i = strings.begin(); i != strings.end(); i++)
+            {
+                size_t len = strlen(*i);
+                putVarint(header, len);
+                header.insert(header.end(), (const byte*)*i, (const byte*)*i + len);
+            }
+            putVarint(header, tableBytes);
+            fwrite(&header[0], 1, header.size(), exportFile);
+            for (std::vector<PExportSegment*>::iterator i = segments.begin(); i != segments.end(); i++)
+                fwrite((*i)->table.data(), 1, (*i)->table.size(), exportFile);
+            header.clear();
+            putVarint(header, contentBytes);
+            fwrite(&header[0], 1, header.size(), exportFile);
+            for (std::vector<PExportSegment*>::iterator i = segments.begin(); i != segments.end(); i++)
+                fwrite((*i)->contents.data(), 1, (*i)->contents.size(), exportFile);
+            if (ferror(exportFile))
+                errorMessage = "Error while writing export file";
+        }
+        else errorMessage = "Insufficient memory";
+        for (std::vector<PExportSegment*>::iterator i = segments.begin(); i != segments.end(); i++)
+            delete(*i);
+    }
+    catch (std::bad_alloc &) {
+        errorMessage = "Insufficient memory";
+    }
+
+    fclose(exportFile); exportFile = NULL;
+}
+
 /*
 Import a portable export file and load it into memory.
 Creates "permanent" address entries in the global memory table.
@@ -349,6 +675,11 @@ class SpaceAlloc
 public:
     SpaceAlloc(unsigned *indexCtr, unsigned perms, POLYUNSIGNED def);
     PolyObject *NewObj(POLYUNSIGNED objWords);
+    // Make the next space large enough for objects totalling this many words
+    // including their length words.
+    void Reserve(size_t words) { if (words + 2 > defaultSize) defaultSize = words + 2; }
+    // The words used by an object including the length word.
+    static size_t ObjectWords(POLYUNSIGNED objWords);
 
     size_t defaultSize;
     PermanentMemSpace *memSpace;
@@ -367,6 +698,15 @@ SpaceAlloc::SpaceAlloc(unsigned *indexCtr, unsigned perms, POLYUNSIGNED def)
     spaceIndexCtr = indexCtr;
 }
 
+size_t SpaceAlloc::ObjectWords(POLYUNSIGNED objWords)
+{
+#ifdef POLYML32IN64
+    // Objects are aligned on 8-byte boundaries.
+    if ((objWords & 1) == 0) objWords++;
+#endif
+    return objWords + 1;
+}
+
 // Allocate a new object.  May create a new space and add the old one to the permanent
 // memory table if this is exhausted.
 #ifndef POLYML32IN64
@@ -432,11 +772,15 @@ public:
     PImport();
     ~PImport();
     bool DoImport(void);
+    bool DoBinaryImport(void);
     FILE *f;
     PolyObject *Root(void) { return objMap[nRoot]; }
 private:
     bool ReadValue(PolyObject *p, POLYUNSIGNED i);
     bool GetValue(PolyWord *result);
+    bool GetBinaryValue(const byte *&p, const byte *end, PolyWord &result);
+    bool ReadBinaryEntry(const byte *&table, const byte *tableEnd, byte &type, unsigned &objBits,
+                         POLYUNSIGNED &nWords, POLYUNSIGNED &size1, POLYUNSIGNED &size2);
     
     POLYUNSIGNED nObjects, nRoot;
     PolyObject **objMap;
@@ -878,25 +1222,363 @@ bool PImport::DoImport()
     return true;
 }
 
+// Read an unsigned varint from the binary format.
+static bool getVarint(const byte *&p, const byte *end, uint64_t &result)
+{
+    result = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7)
+    {
+        if (p == end) return false;
+        byte b = *p++;
+        result |= (uint64_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) return true;
+    }
+    return false;
+}
+
+bool PImport::GetBinaryValue(const byte *&p, const byte *end, PolyWord &result)
+{
+    uint64_t u;
+    if (! getVarint(p, end, u))
+        return false;
+    if (u == PXB_ZERO)
+        result = PolyWord::FromUnsigned(0);
+    else if (u & 1)
+    {
+        if ((u >> 1) - 1 >= nObjects)
+            return false;
+        result = objMap[(u >> 1) - 1];
+    }
+    else result = TAGGED(decodeTagged(u));
+    return true;
+}
+
+// Read an entry in the object table and return the size of the object.
+bool PImport::ReadBinaryEntry(const byte *&table, const byte *tableEnd, byte &type, unsigned &objBits,
+                              POLYUNSIGNED &nWords, POLYUNSIGNED &size1, POLYUNSIGNED &size2)
+{
+    uint64_t n1 = 0, n2 = 0;
+    if (tableEnd - table < 2) return false;
+    type = table[0];
+    unsigned flags = table[1];
+    table += 2;
+    objBits = 0;
+    if (flags & PXB_MUTABLE) objBits |= F_MUTABLE_BIT;
+    if (flags & PXB_NEGATIVE) objBits |= F_NEGATIVE_BIT;
+    if (flags & PXB_NOOVERWRITE) objBits |= F_NO_OVERWRITE;
+    if (flags & PXB_WEAK) objBits |= F_WEAK_BIT;
+    switch (type)
+    {
+    case PXB_ORDINARY:
+        if (! getVarint(table, tableEnd, n1)) return false;
+        nWords = (POLYUNSIGNED)n1;
+        break;
+    case PXB_BYTES:
+        objBits |= F_BYTE_OBJ;
+        if (! getVarint(table, tableEnd, n1)) return false;
+        nWords = (POLYUNSIGNED)((n1 + sizeof(PolyWord) - 1) / sizeof(PolyWord));
+        break;
+    case PXB_STRING:
+        objBits |= F_BYTE_OBJ;
+        if (! getVarint(table, tableEnd, n1)) return false;
+        nWords = (POLYUNSIGNED)((n1 + sizeof(PolyWord) - 1) / sizeof(PolyWord) + 1);
+        break;
+    case PXB_CODE:
+        objBits |= F_CODE_OBJ;
+        // The number of constants and the number of bytes of code.
+        if (! getVarint(table, tableEnd, n1) || ! getVarint(table, tableEnd, n2)) return false;
+        nWords = (POLYUNSIGNED)(n1 + 2 + (n2 + sizeof(PolyWord) - 1) / sizeof(PolyWord));
+        break;
+    case PXB_CLOSURE:
+        objBits |= F_CLOSURE_OBJ;
+        if (! getVarint(table, tableEnd, n1)) return false;
+        nWords = (POLYUNSIGNED)(n1 + sizeof(PolyObject*) / sizeof(PolyWord) - 1);
+        break;
+    case PXB_WEAKREF:
+        objBits |= F_BYTE_OBJ;
+        nWords = sizeof(uintptr_t) / sizeof(PolyWord);
+        break;
+    case PXB_ENTRYPOINT:
+        // The index of the name in the string table.
+        objBits |= F_BYTE_OBJ;
+        if (! getVarint(table, tableEnd, n1)) return false;
+        nWords = 0; // Set by the caller.
+        break;
+    default:
+        return false;
+    }
+    size1 = (POLYUNSIGNED)n1;
+    size2 = (POLYUNSIGNED)n2;
+    return true;
+}
+
+bool PImport::DoBinaryImport()
+{
+    ASSERT(gMem.pSpaces.size() == 0);
+    ASSERT(gMem.eSpaces.size() == 0);
+
+    // Read the whole file.  The signature has already been read.
+    std::vector<byte> buffer;
+    try {
+        byte block[65536];
+        size_t n;
+        while ((n = fread(block, 1, sizeof(block), f)) != 0)
+            buffer.insert(buffer.end(), block, block + n);
+    }
+    catch (std::bad_alloc &) {
+        fprintf(polyStderr, "Unable to allocate memory\n");
+        return false;
+    }
+    if (buffer.size() < 3 || buffer[0] != PORTABLEVERSION)
+    {
+        fprintf(polyStderr, "Unsupported portable file version\n");
+        return false;
+    }
+    const byte *p = &buffer[0] + 3, *end = &buffer[0] + buffer.size();
+    machineDependent->SetBootArchitecture((char)buffer[1], buffer[2]);
+
+    uint64_t objects, root, stringCount;
+    if (! getVarint(p, end, objects) || ! getVarint(p, end, root) || root >= objects ||
+            ! getVarint(p, end, stringCount))
+    {
+        fprintf(polyStderr, "Invalid portable file header\n");
+        return false;
+    }
+    nObjects = (POLYUNSIGNED)objects;
+    nRoot = (POLYUNSIGNED)root;
+    std::vector<const byte *> strings;
+    std::vector<size_t> stringLengths;
+    for (uint64_t i = 0; i < stringCount; i++)
+    {
+        uint64_t len;
+        if (! getVarint(p, end, len) || len > (uint64_t)(end - p))
+        {
+            fprintf(polyStderr, "Invalid portable file string table\n");
+            return false;
+        }
+        strings.push_back(p);
+        stringLengths.push_back((size_t)len);
+        p += len;
+    }
+    uint64_t tableBytes, contentBytes;
+    if (! getVarint(p, end, tableBytes) || tableBytes > (uint64_t)(end - p))
+    {
+        fprintf(polyStderr, "Invalid portable file object table\n");
+        return false;
+    }
+    const byte *tableStart = p, *tableEnd = p + tableBytes;
+    p = tableEnd;
+    if (! getVarint(p, end, contentBytes) || contentBytes != (uint64_t)(end - p))
+    {
+        fprintf(polyStderr, "Invalid portable file contents\n");
+        return false;
+    }
+    const byte *contents = p;
+
+    objMap = (PolyObject**)calloc(nObjects, sizeof(PolyObject*));
+    if (objMap == 0)
+    {
+        fprintf(polyStderr, "Unable to allocate memory\n");
+        return false;
+    }
+
+    // The first pass over the table finds the total size of each kind of
+    // object so that each can be allocated in a single space.
+    size_t mutWords = 0, immutWords = 0, codeWords = 0;
+    const byte *table = tableStart;
+    for (POLYUNSIGNED objNo = 0; objNo < nObjects; objNo++)
+    {
+        byte type;
+        unsigned objBits;
+        POLYUNSIGNED nWords, size1, size2;
+        if (! ReadBinaryEntry(table, tableEnd, type, objBits, nWords, size1, size2) ||
+                (type == PXB_ENTRYPOINT && size1 >= strings.size()))
+        {
+            fprintf(polyStderr, "Invalid portable file object table\n");
+            return false;
+        }
+        if (type == PXB_ENTRYPOINT)
+            nWords = (POLYUNSIGNED)((stringLengths[size1] + sizeof(uintptr_t) + sizeof(PolyWord)) / sizeof(PolyWord));
+        if (objBits & F_MUTABLE_BIT)
+            mutWords += SpaceAlloc::ObjectWords(nWords);
+        else if ((objBits & 3) == F_CODE_OBJ)
+            codeWords += SpaceAlloc::ObjectWords(nWords);
+        else immutWords += SpaceAlloc::ObjectWords(nWords);
+    }
+    mutSpace.Reserve(mutWords);
+    immutSpace.Reserve(immutWords);
+    codeSpace.Reserve(codeWords);
+
+    // The second pass allocates the objects.
+    table = tableStart;
+    for (POLYUNSIGNED objNo = 0; objNo < nObjects; objNo++)
+    {
+        byte type;
+        unsigned objBits;
+        POLYUNSIGNED nWords, size1, size2;
+        ReadBinaryEntry(table, tableEnd, type, objBits, nWords, size1, size2);
+        if (type == PXB_ENTRYPOINT)
+            nWords = (POLYUNSIGNED)((stringLengths[size1] + sizeof(uintptr_t) + sizeof(PolyWord)) / sizeof(PolyWord));
+        SpaceAlloc* alloc;
+        if (objBits & F_MUTABLE_BIT)
+            alloc = &mutSpace;
+        else if ((objBits & 3) == F_CODE_OBJ)
+            alloc = &codeSpace;
+        else alloc = &immutSpace;
+        PolyObject* obj = alloc->NewObj(nWords);
+        if (obj == 0)
+            return false;
+        objMap[objNo] = obj;
+        alloc->memSpace->writeAble(obj)->SetLengthWord(nWords, objBits);
+    }
+
+    // The third pass fills in the contents.
+    table = tableStart;
+    p = contents;
+    for (POLYUNSIGNED objNo = 0; objNo < nObjects; objNo++)
+    {
+        byte type;
+        unsigned objBits;
+        POLYUNSIGNED nWords, size1, size2;
+        ReadBinaryEntry(table, tableEnd, type, objBits, nWords, size1, size2);
+        PolyObject *obj = objMap[objNo];
+        MemSpace* space = gMem.SpaceForObjectAddress(obj);
+        PolyObject *wr = space->writeAble(obj);
+        bool ok = true;
+        switch (type)
+        {
+        case PXB_ORDINARY:
+        case PXB_CLOSURE:
+            {
+                POLYUNSIGNED i = 0;
+                if (type == PXB_CLOSURE)
+                {
+                    uint64_t codeObj;
+                    ok = getVarint(p, end, codeObj) && codeObj < nObjects;
+                    if (ok) *(PolyObject**)wr = objMap[codeObj];
+                    i = sizeof(PolyObject*) / sizeof(PolyWord);
+                }
+                for (; ok && i < nWords; i++)
+                {
+                    PolyWord w = TAGGED(0);
+                    ok = GetBinaryValue(p, end, w);
+                    wr->Set(i, w);
+                }
+                break;
+            }
+
+        case PXB_BYTES:
+            ok = size1 <= (uint64_t)(end - p);
+            if (ok) { memcpy(wr, p, size1); p += size1; }
+            break;
+
+        case PXB_STRING:
+            ok = size1 <= (uint64_t)(end - p);
+            if (ok)
+            {
+                PolyStringObject * ps = (PolyStringObject *)wr;
+                ps->length = size1;
+                memcpy(ps->chars, p, size1);
+                p += size1;
+            }
+            break;
+
+        case PXB_CODE:
+            {
+                POLYUNSIGNED length = obj->Length(), constCount = size1, codeBytes = size2;
+                ok = codeBytes <= (uint64_t)(end - p);
+                if (! ok) break;
+                memcpy(wr, p, codeBytes);
+                p += codeBytes;
+                wr->Set(length - constCount - 2, PolyWord::FromUnsigned(constCount));
+                machineDependent->SetAddressOfConstants(obj, wr, length, obj->Offset(length - constCount - 1));
+                for (POLYUNSIGNED i = 0; ok && i < constCount; i++)
+                {
+                    PolyWord w = TAGGED(0);
+                    ok = GetBinaryValue(p, end, w);
+                    wr->Set(i + length - constCount - 1, w);
+                }
+                uint64_t relocs;
+                ok = ok && getVarint(p, end, relocs);
+                for (uint64_t i = 0; ok && i < relocs; i++)
+                {
+                    uint64_t offset, code, target;
+                    ok = getVarint(p, end, offset) && getVarint(p, end, code) && getVarint(p, end, target) &&
+                        offset < length * sizeof(PolyWord) && target < nObjects;
+                    if (ok)
+                        ScanAddress::SetConstantValue((byte*)obj + offset, objMap[target], (ScanRelocationKind)code);
+                }
+                // Clear the mutable bit
+                wr->SetLengthWord(length, F_CODE_OBJ);
+                break;
+            }
+
+        case PXB_WEAKREF:
+            // Weak reference - must be zeroed
+            *(uintptr_t*)wr = 0;
+            break;
+
+        case PXB_ENTRYPOINT:
+            {
+                *(uintptr_t*)wr = 0;
+                char* b = (char*)wr + sizeof(uintptr_t);
+                memcpy(b, strings[size1], stringLengths[size1]);
+                b[stringLengths[size1]] = 0;
+                bool loadEntryPt = setEntryPoint(obj);
+                ASSERT(loadEntryPt);
+                break;
+            }
+        }
+        if (! ok)
+        {
+            fprintf(polyStderr, "Invalid portable file contents\n");
+            return false;
+        }
+    }
+
+    // Now remove write access from immutable spaces.
+    for (std::vector<PermanentMemSpace*>::iterator i = gMem.pSpaces.begin(); i < gMem.pSpaces.end(); i++)
+        gMem.CompletePermanentSpaceAllocation(*i);
+    return true;
+}
+
 // Import a file in the portable format and return a pointer to the root object.
 PolyObject *ImportPortable(const TCHAR *fileName)
 {
     PImport pImport;
+    // Open the file in binary mode to check for the binary format.  If it is
+    // in the text format it is reopened in text mode.
 #if (defined(_WIN32) && defined(UNICODE))
-    pImport.f = _wfopen(fileName, L"r");
+    pImport.f = _wfopen(fileName, L"rb");
     if (pImport.f == 0)
     {
         fprintf(polyStderr, "Unable to open file: %S\n", fileName);
         return 0;
     }
 #else
-    pImport.f = fopen(fileName, "r");
+    pImport.f = fopen(fileName, "rb");
     if (pImport.f == 0)
     {
         fprintf(polyStderr, "Unable to open file: %s\n", fileName);
         return 0;
     }
 #endif
+    char signature[sizeof(PORTABLESIGNATURE)];
+    if (fread(signature, 1, sizeof(signature), pImport.f) == sizeof(signature) &&
+            memcmp(signature, PORTABLESIGNATURE, sizeof(signature)) == 0)
+    {
+        if (pImport.DoBinaryImport())
+            return pImport.Root();
+        else
+            return 0;
+    }
+#if (defined(_WIN32) && defined(UNICODE))
+    pImport.f = _wfreopen(fileName, L"r", pImport.f);
+#else
+    pImport.f = freopen(fileName, "r", pImport.f);
+#endif
+    if (pImport.f == 0)
+        return 0;
     if (pImport.DoImport())
         return pImport.Root();
     else
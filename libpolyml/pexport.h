@@ -34,10 +34,15 @@ typedef char TCHAR;
 #include "exporter.h"
 #include "globals.h"
 
+// The binary portable format starts with this signature.  Otherwise the file is
+// in the text format.
+#define PORTABLESIGNATURE   "POLYPXB"
+#define PORTABLEVERSION     1
+
 class PExport: public Exporter, public ScanAddress
 {
 public:
-    PExport();
+    PExport(bool binary=false);
     virtual ~PExport();
 public:
     virtual void exportStore(void);
@@ -53,12 +58,18 @@ private:
     void printAddress(void *p);
     void printValue(PolyWord q);
     void printObject(PolyObject *p);
+    void exportBinary(const std::vector<size_t> &indexOrder);
+
+    // The portable format has the constants within the code.
+    virtual bool separateConstants() { return false; }
 
     // We don't use the relocation code so just provide a dummy function here.
     virtual PolyWord createRelocation(PolyWord p, void *relocAddr) { return p; }
 
     std::vector<PolyObject *> pMap;
+    bool binaryFormat;
 
+    friend class PExportSegment;
 };
 
 // Import a file in the portable format and return a pointer to the root object.
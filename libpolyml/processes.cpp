@@ -78,6 +78,10 @@
 #include <sys/select.h>
 #endif
 
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
 #ifdef HAVE_WINDOWS_H
 #include <windows.h>
 #endif
@@ -126,10 +130,13 @@
 #include "statistics.h"
 #include "rtsentry.h"
 #include "gc_progress.h"
+#include "numa.h"
+#include "ioreactor.h"
 
 extern "C" {
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyThreadKillSelf(POLYUNSIGNED threadId);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyThreadMutexBlock(POLYUNSIGNED threadId, POLYUNSIGNED arg);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyThreadMutexBlockQueued(POLYUNSIGNED threadId, POLYUNSIGNED arg);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyThreadMutexUnlock(POLYUNSIGNED threadId, POLYUNSIGNED arg);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyThreadCondVarWait(POLYUNSIGNED threadId, POLYUNSIGNED arg);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyThreadCondVarWaitUntil(POLYUNSIGNED threadId, POLYUNSIGNED lockArg, POLYUNSIGNED timeArg);
@@ -163,6 +170,7 @@ struct _entrypts processesEPT[] =
 {
     { "PolyThreadKillSelf",             (polyRTSFunction)&PolyThreadKillSelf},
     { "PolyThreadMutexBlock",           (polyRTSFunction)&PolyThreadMutexBlock},
+    { "PolyThreadMutexBlockQueued",     (polyRTSFunction)&PolyThreadMutexBlockQueued},
     { "PolyThreadMutexUnlock",          (polyRTSFunction)&PolyThreadMutexUnlock},
     { "PolyThreadCondVarWait",          (polyRTSFunction)&PolyThreadCondVarWait},
     { "PolyThreadCondVarWaitUntil",     (polyRTSFunction)&PolyThreadCondVarWaitUntil},
@@ -264,7 +272,7 @@ public:
     virtual void SignalArrived(void);
 
     // Operations on mutexes
-    void MutexBlock(TaskData *taskData, Handle hMutex);
+    void MutexBlock(TaskData *taskData, Handle hMutex, bool recordsContention);
     void MutexUnlock(TaskData *taskData, Handle hMutex);
 
     // Operations on condition variables.
@@ -279,6 +287,20 @@ public:
     // Each thread has an entry in this vector.
     std::vector<TaskData*> taskArray;
 
+    // Threads blocked on mutexes are kept in a hash table keyed by the address of
+    // the mutex.  Each bucket is a list in the order the threads blocked.  The GC
+    // may move mutexes so the table is rebuilt after a GC.  Protected by schedLock
+    // and only used by threads that are using ML memory so the GC can't run.
+#define MUTEX_WAIT_BUCKETS 256
+    TaskData *mutexWaitHead[MUTEX_WAIT_BUCKETS], *mutexWaitTail[MUTEX_WAIT_BUCKETS];
+    bool mutexWaitRehash;
+    static unsigned MutexWaitBucket(PolyObject *mutex)
+        { return (unsigned)(((uintptr_t)mutex / sizeof(PolyWord)) % MUTEX_WAIT_BUCKETS); }
+    void AddMutexWaiter(TaskData *taskData);
+    void RemoveMutexWaiter(TaskData *taskData);
+    void RehashMutexWaiters(void);
+    void WakeMutexWaiters(PolyObject *mutex);
+
     /* schedLock: This lock must be held when making scheduling decisions.
        It must also be held before adding items to taskArray, removing
        them or scanning the vector.
@@ -324,10 +346,12 @@ public:
 static Processes processesModule;
 ProcessExternal *processes = &processesModule;
 
-Processes::Processes(): singleThreaded(false),
+Processes::Processes(): singleThreaded(false), mutexWaitRehash(false),
     schedLock("Scheduler"), interrupt_exn(0),
     threadRequest(0), exitResult(0), exitRequest(false), sigTask(0)
 {
+    for (unsigned i = 0; i < MUTEX_WAIT_BUCKETS; i++)
+        mutexWaitHead[i] = mutexWaitTail[i] = 0;
 #ifdef HAVE_WINDOWS_H
     hStopEvent = NULL;
     profilingHd = NULL;
@@ -356,7 +380,34 @@ POLYUNSIGNED PolyThreadMutexBlock(POLYUNSIGNED threadId, POLYUNSIGNED arg)
         taskData->addProfileCount(1);
 
     try {
-        processesModule.MutexBlock(taskData, pushedArg);
+        processesModule.MutexBlock(taskData, pushedArg, false);
+    }
+    catch (KillException &) {
+        processes->ThreadExit(taskData); // TestSynchronousRequests may test for kill
+    }
+    catch (...) { } // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    return TAGGED(0).AsUnsigned();
+}
+
+// As PolyThreadMutexBlock except that when the thread takes the mutex after this
+// returns it records that there may be other waiters.  Only one waiter is woken
+// when the mutex is unlocked.
+POLYUNSIGNED PolyThreadMutexBlockQueued(POLYUNSIGNED threadId, POLYUNSIGNED arg)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle pushedArg = taskData->saveVec.push(arg);
+
+    if (profileMode == kProfileMutexContention)
+        taskData->addProfileCount(1);
+
+    try {
+        processesModule.MutexBlock(taskData, pushedArg, true);
     }
     catch (KillException &) {
         processes->ThreadExit(taskData); // TestSynchronousRequests may test for kill
@@ -393,8 +444,12 @@ POLYUNSIGNED PolyThreadMutexUnlock(POLYUNSIGNED threadId, POLYUNSIGNED arg)
   ~1. This code blocks if the count is still ~1.  It does actually return
   if another thread tries to lock the mutex and hasn't yet set the value
   to ~1 but that doesn't matter since whenever we return we simply try to
-  get the lock again. */
-void Processes::MutexBlock(TaskData *taskData, Handle hMutex)
+  get the lock again.
+  Waiting threads are queued and an unlock wakes the first of them.  When
+  recordsContention is true the thread increments the count again when it
+  has taken the mutex so its unlock will wake the next thread.  Older code
+  does not do that so those threads are woken with all the other waiters. */
+void Processes::MutexBlock(TaskData *taskData, Handle hMutex, bool recordsContention)
 {
     PLocker lock(&schedLock);
     // We have to check the value again with schedLock held rather than
@@ -403,34 +458,49 @@ void Processes::MutexBlock(TaskData *taskData, Handle hMutex)
     // before we actually got to wait.  
     if (UNTAGGED(DEREFHANDLE(hMutex)->Get(0)) > 1)
     {
-        // Set this so we can see what we're blocked on.
-        taskData->blockMutex = DEREFHANDLE(hMutex);
-        // Now release the ML memory.  A GC can start.
-        ThreadReleaseMLMemoryWithSchedLock(taskData);
         // Wait until we're woken up.  We mustn't block if we have been
         // interrupted, and are processing interrupts asynchronously, or
         // we've been killed.
+        bool wait = true;
         switch (taskData->requests)
         {
         case kRequestKill:
             // We've been killed.  Handle this later.
+            wait = false;
             break;
         case kRequestInterrupt:
             {
                 // We've been interrupted.  
                 POLYUNSIGNED attrs = ThreadAttrs(taskData) & PFLAG_INTMASK;
                 if (attrs == PFLAG_ASYNCH || attrs == PFLAG_ASYNCH_ONCE)
-                    break;
+                    wait = false;
                 // If we're ignoring interrupts or handling them synchronously
                 // we don't do anything here.
             }
         case kRequestNone:
+            break;
+        }
+        if (wait)
+        {
+            // Set this so we can see what we're blocked on.
+            taskData->blockMutex = DEREFHANDLE(hMutex);
+            taskData->wakeWithAllWaiters = ! recordsContention;
+            // Join the queue while we still have the ML memory.
+            AddMutexWaiter(taskData);
+            // Now release the ML memory.  A GC can start.
+            ThreadReleaseMLMemoryWithSchedLock(taskData);
             globalStats.incCount(PSC_THREADS_WAIT_MUTEX);
             taskData->threadLock.Wait(&schedLock);
             globalStats.decCount(PSC_THREADS_WAIT_MUTEX);
+            ThreadUseMLMemoryWithSchedLock(taskData);
+            // If we were woken by an unlock we have already been removed.
+            if (taskData->inMutexQueue)
+                RemoveMutexWaiter(taskData);
+            else if (taskData->requests != kRequestNone)
+                // We may not now take the mutex so pass the wake-up on.
+                WakeMutexWaiters(taskData->blockMutex);
+            taskData->blockMutex = 0; // No longer blocked.
         }
-        taskData->blockMutex = 0; // No longer blocked.
-        ThreadUseMLMemoryWithSchedLock(taskData);
     }
     // Test to see if we have been interrupted and if this thread
     // processes interrupts asynchronously we should raise an exception
@@ -448,13 +518,84 @@ void Processes::MutexUnlock(TaskData *taskData, Handle hMutex)
     // the updated value (and so doesn't wait) or has successfully
     // waited on its threadLock (and so will be woken up).
     PLocker lock(&schedLock);
-    // Unlock any waiters.
-    for (std::vector<TaskData*>::iterator i = taskArray.begin(); i != taskArray.end(); i++)
+    WakeMutexWaiters(DEREFHANDLE(hMutex));
+}
+
+// Add a thread to the end of the queue for its mutex.
+void Processes::AddMutexWaiter(TaskData *taskData)
+{
+    if (mutexWaitRehash)
+        RehashMutexWaiters();
+    unsigned bucket = MutexWaitBucket(taskData->blockMutex);
+    taskData->nextMutexWaiter = 0;
+    taskData->prevMutexWaiter = mutexWaitTail[bucket];
+    if (mutexWaitTail[bucket] == 0)
+        mutexWaitHead[bucket] = taskData;
+    else mutexWaitTail[bucket]->nextMutexWaiter = taskData;
+    mutexWaitTail[bucket] = taskData;
+    taskData->inMutexQueue = true;
+}
+
+// Remove a thread from its queue.
+void Processes::RemoveMutexWaiter(TaskData *taskData)
+{
+    if (mutexWaitRehash)
+        RehashMutexWaiters();
+    unsigned bucket = MutexWaitBucket(taskData->blockMutex);
+    if (taskData->prevMutexWaiter == 0)
+        mutexWaitHead[bucket] = taskData->nextMutexWaiter;
+    else taskData->prevMutexWaiter->nextMutexWaiter = taskData->nextMutexWaiter;
+    if (taskData->nextMutexWaiter == 0)
+        mutexWaitTail[bucket] = taskData->prevMutexWaiter;
+    else taskData->nextMutexWaiter->prevMutexWaiter = taskData->prevMutexWaiter;
+    taskData->nextMutexWaiter = taskData->prevMutexWaiter = 0;
+    taskData->inMutexQueue = false;
+}
+
+// Put the waiting threads into the buckets for the current addresses of
+// their mutexes.  Threads waiting for the same mutex were in the same bucket so
+// taking each bucket in turn keeps them in the order they blocked.
+void Processes::RehashMutexWaiters(void)
+{
+    TaskData *waiters = 0, *lastWaiter = 0;
+    for (unsigned i = 0; i < MUTEX_WAIT_BUCKETS; i++)
     {
-        TaskData *p = *i;
-        // If the thread is blocked on this mutex we can signal the thread.
-        if (p && p->blockMutex == DEREFHANDLE(hMutex))
+        if (mutexWaitHead[i] != 0)
+        {
+            if (lastWaiter == 0)
+                waiters = mutexWaitHead[i];
+            else lastWaiter->nextMutexWaiter = mutexWaitHead[i];
+            lastWaiter = mutexWaitTail[i];
+        }
+        mutexWaitHead[i] = mutexWaitTail[i] = 0;
+    }
+    mutexWaitRehash = false;
+    while (waiters != 0)
+    {
+        TaskData *p = waiters;
+        waiters = p->nextMutexWaiter;
+        AddMutexWaiter(p);
+    }
+}
+
+// Wake the first thread waiting for the mutex and any that have to be woken
+// with all the waiters.
+void Processes::WakeMutexWaiters(PolyObject *mutex)
+{
+    if (mutexWaitRehash)
+        RehashMutexWaiters();
+    bool wokenFirst = false;
+    TaskData *p = mutexWaitHead[MutexWaitBucket(mutex)];
+    while (p != 0)
+    {
+        TaskData *next = p->nextMutexWaiter;
+        if (p->blockMutex == mutex && (! wokenFirst || p->wakeWithAllWaiters))
+        {
+            RemoveMutexWaiter(p);
             p->threadLock.Signal();
+            wokenFirst = true;
+        }
+        p = next;
     }
 }
 
@@ -515,15 +656,8 @@ void Processes::WaitInfinite(TaskData *taskData, Handle hMutex)
     // so no other thread can call signal or broadcast.
     if (! taskData->AtomicallyReleaseMutex(hMutex->WordP()))
     {
-        // The mutex was locked so we have to release any waiters.
-        // Unlock any waiters.
-        for (std::vector<TaskData*>::iterator i = taskArray.begin(); i != taskArray.end(); i++)
-        {
-            TaskData *p = *i;
-            // If the thread is blocked on this mutex we can signal the thread.
-            if (p && p->blockMutex == DEREFHANDLE(hMutex))
-                p->threadLock.Signal();
-        }
+        // The mutex was locked so we have to release a waiter.
+        WakeMutexWaiters(DEREFHANDLE(hMutex));
     }
     // Wait until we're woken up.  Don't block if we have been interrupted
     // or killed.
@@ -563,15 +697,8 @@ void Processes::WaitUntilTime(TaskData *taskData, Handle hMutex, Handle hWakeTim
     // so no other thread can call signal or broadcast.
     if (!taskData->AtomicallyReleaseMutex(hMutex->WordP()))
     {
-        // The mutex was locked so we have to release any waiters.
-        // Unlock any waiters.
-        for (std::vector<TaskData*>::iterator i = taskArray.begin(); i != taskArray.end(); i++)
-        {
-            TaskData *p = *i;
-            // If the thread is blocked on this mutex we can signal the thread.
-            if (p && p->blockMutex == DEREFHANDLE(hMutex))
-                p->threadLock.Signal();
-        }
+        // The mutex was locked so we have to release a waiter.
+        WakeMutexWaiters(DEREFHANDLE(hMutex));
     }
     // Wait until we're woken up.  Don't block if we have been interrupted
     // or killed.
@@ -734,7 +861,7 @@ Handle Processes::ThreadDispatch(TaskData *taskData, Handle args, Handle code)
     switch (c)
     {
     case 1:
-        MutexBlock(taskData, args);
+        MutexBlock(taskData, args, false);
         return SAVE(TAGGED(0));
 
     case 2:
@@ -770,9 +897,11 @@ void TaskData::FillUnusedSpace(void)
 
 
 TaskData::TaskData(): allocPointer(0), allocLimit(0), allocSize(MIN_HEAP_SIZE), allocCount(0),
-        stack(0), threadObject(0), signalStack(0),
-        requests(kRequestNone), blockMutex(0), inMLHeap(false),
-        runningProfileTimer(false)
+        allocWords(0), allocRate(MIN_HEAP_SIZE*HEAP_SEGMENTS_PER_GC),
+        numaNode(gNumaTopology.NodeForNewThread()), stack(0), threadObject(0), signalStack(0),
+        profileBuffer(0), allocSinceSample(0), requests(kRequestNone), blockMutex(0),
+        nextMutexWaiter(0), prevMutexWaiter(0), inMutexQueue(false), wakeWithAllWaiters(false),
+        inMLHeap(false), runningProfileTimer(false)
 {
 #ifdef HAVE_WINDOWS_H
     lastCPUTime = 0;
@@ -787,6 +916,7 @@ TaskData::~TaskData()
 {
     if (signalStack) free(signalStack);
     if (stack) gMem.DeleteStackSpace(stack);
+    releaseProfileBuffer(this);
 #ifdef HAVE_WINDOWS_H
     if (threadHandle) CloseHandle(threadHandle);
 #endif
@@ -915,7 +1045,11 @@ void Processes::MakeRootRequest(TaskData *taskData, MainThreadRequest *request)
     {
         mainThreadPhase = request->mtp;
         ThreadReleaseMLMemoryWithSchedLock(taskData); // Primarily to call FillUnusedSpace
+        GCSuspendConcurrentMark();
+        gMem.ProtectCards(false);
         request->Perform();
+        gMem.ProtectCards(true);
+        GCResumeConcurrentMark();
         ThreadUseMLMemoryWithSchedLock(taskData);
         mainThreadPhase = MTP_USER_CODE;
     }
@@ -968,28 +1102,55 @@ PolyWord *Processes::FindAllocationSpace(TaskData *taskData, POLYUNSIGNED words,
         }
         else // Insufficient space in this area. 
         {
+            // In NUMA mode new memory comes from the node this thread is running on.
+            taskData->numaNode = gNumaTopology.CurrentNode(taskData->numaNode);
+            // Very large objects are given a space of their own so they are never
+            // copied.  The caller must use the result rather than allocPointer.
+            if (gMem.IsLargeObjectSize(words))
+            {
+                PolyWord *foundSpace = gMem.AllocLargeObject(words, taskData->numaNode);
+                if (foundSpace)
+                {
+                    if (alwaysInSeg)
+                    {
+                        // Compiled code sets its allocation pointer to the new object
+                        // so the rest of the current segment cannot be used.  Make the
+                        // segment empty so the next allocation gets a new one.
+                        taskData->FillUnusedSpace();
+                        if (taskData->allocPointer > taskData->allocLimit)
+                            taskData->allocWords -= taskData->allocPointer - taskData->allocLimit;
+                        taskData->allocPointer = taskData->allocLimit = foundSpace;
+                    }
+                    return foundSpace;
+                }
+            }
             if (words > taskData->allocSize && ! alwaysInSeg)
             {
                 // If the object we want is larger than the heap segment size
                 // we allocate it separately rather than in the segment.
-                PolyWord *foundSpace = gMem.AllocHeapSpace(words);
+                uintptr_t allocated = words;
+                PolyWord *foundSpace = gMem.AllocHeapSpace(words, allocated, true, taskData->numaNode);
                 if (foundSpace) return foundSpace;
             }
             else
             {
                 // Fill in any unused space in the existing segment
                 taskData->FillUnusedSpace();
+                // The unused space does not count towards the allocation rate.
+                // Make the segment empty so that it is not subtracted again
+                // if we fail to get a new one and retry or GC.
+                if (taskData->allocPointer > taskData->allocLimit)
+                    taskData->allocWords -= taskData->allocPointer - taskData->allocLimit;
+                taskData->allocPointer = taskData->allocLimit = 0;
                 // Get another heap segment with enough space for this object.
-                uintptr_t requestSpace = taskData->allocSize+words;
-                uintptr_t spaceSize = requestSpace;
+                // The size was set at the last GC from the allocation rate.
+                uintptr_t spaceSize = taskData->allocSize+words;
                 // Get the space and update spaceSize with the actual size.
-                PolyWord *space = gMem.AllocHeapSpace(words, spaceSize);
+                PolyWord *space = gMem.AllocHeapSpace(words, spaceSize, true, taskData->numaNode);
                 if (space)
                 {
-                    // Double the allocation size for the next time if
-                    // we succeeded in allocating the whole space.
-                    taskData->allocCount++; 
-                    if (spaceSize == requestSpace) taskData->allocSize = taskData->allocSize*2;
+                    taskData->allocCount++;
+                    taskData->allocWords += spaceSize;
                     taskData->allocLimit = space;
                     taskData->allocPointer = space+spaceSize;
                     // Actually allocate the object
@@ -1136,15 +1297,11 @@ void WaitHandle::Wait(unsigned maxMillisecs)
 // Unix and Cygwin: Wait for a file descriptor on input.
 void WaitInputFD::Wait(unsigned maxMillisecs)
 {
-    fd_set read_fds, write_fds, except_fds;
-    struct timeval toWait = { 0, 0 };
-    toWait.tv_sec = maxMillisecs / 1000;
-    toWait.tv_usec = (maxMillisecs % 1000) * 1000;
-    FD_ZERO(&read_fds);
-    if (m_waitFD >= 0) FD_SET(m_waitFD, &read_fds);
-    FD_ZERO(&write_fds);
-    FD_ZERO(&except_fds);
-    select(FD_SETSIZE, &read_fds, &write_fds, &except_fds, &toWait);
+    struct pollfd fds[1];
+    fds[0].fd = m_waitFD; // Ignored if it is negative.
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    WaitForDescriptors(fds, 1, maxMillisecs);
 }
 #endif
 
@@ -1193,6 +1350,7 @@ TaskData *Processes::CreateNewTaskData()
         {
             taskArray[thrdIndex] = taskData;
         }
+        allocateProfileBuffer(taskData);
     }
 
     taskData->stack = gMem.NewStackSpace(machineDependent->InitialStackSize());
@@ -1412,9 +1570,14 @@ void Processes::BeginRootThread(PolyObject *rootFunction)
         {
             mainThreadPhase = threadRequest->mtp;
             gcProgressBeginOtherGC(); // The default unless we're doing a GC.
+            // Stop any concurrent marking before the heap is modified.
+            GCSuspendConcurrentMark();
             gMem.ProtectImmutable(false); // GC, sharing and export may all write to the immutable area
+            gMem.ProtectCards(false); // Clean cards in the mutable areas are write-protected.
             threadRequest->Perform();
             gMem.ProtectImmutable(true);
+            gMem.ProtectCards(true);
+            GCResumeConcurrentMark();
             mainThreadPhase = MTP_USER_CODE;
             gcProgressReturnToML();
             threadRequest->completed = true;
@@ -1546,6 +1709,7 @@ Handle Processes::ForkThread(TaskData *taskData, Handle threadFunction, PolyWord
         {
             taskArray[thrdIndex] = newTaskData;
         }
+        allocateProfileBuffer(newTaskData);
         schedLock.Unlock();
 
         newTaskData->stack = gMem.NewStackSpace(machineDependent->InitialStackSize());
@@ -1670,6 +1834,7 @@ bool Processes::ProcessAsynchRequests(TaskData *taskData)
         if (! ptaskData->runningProfileTimer)
         {
             ptaskData->runningProfileTimer = true;
+            allocateProfileBuffer(ptaskData);
             StartProfilingTimer();
         }
     }
@@ -1778,7 +1943,7 @@ static bool testCPUtime(HANDLE hThread, LONGLONG &lastCPUTime)
         li.LowPart = uTime.dwLowDateTime;
         li.HighPart = uTime.dwHighDateTime;
         totalTime += li.QuadPart;
-        if (totalTime - lastCPUTime >= 10000)
+        if (totalTime - lastCPUTime >= (LONGLONG)profileInterval * 10)
         {
             lastCPUTime = totalTime;
             return true;
@@ -1791,8 +1956,9 @@ static bool testCPUtime(HANDLE hThread, LONGLONG &lastCPUTime)
 
 void Processes::ProfileInterrupt(void)
 {               
-    // Wait for millisecond or until the stop event is signalled.
-    while (WaitForSingleObject(hStopEvent, 1) == WAIT_TIMEOUT)        
+    // Wait for the profile interval or until the stop event is signalled.
+    DWORD interval = profileInterval < 1000 ? 1 : profileInterval / 1000;
+    while (WaitForSingleObject(hStopEvent, interval) == WAIT_TIMEOUT)
     {
         // We need to hold schedLock to examine the taskArray but
         // that is held during garbage collection.
@@ -1836,6 +2002,11 @@ DWORD WINAPI ProfilingTimer(LPVOID parm)
 // Profiling control.  Called by the root thread.
 void Processes::StartProfiling(void)
 {
+    // Each thread needs a buffer for the samples.
+    for (std::vector<TaskData*>::iterator i = taskArray.begin(); i != taskArray.end(); i++)
+    {
+        if (*i) allocateProfileBuffer(*i);
+    }
 #ifdef HAVE_WINDOWS_H
     DWORD threadId;
     extern FILE *polyStdout;
@@ -1959,10 +2130,10 @@ void Processes::Init(void)
 // On Linux, at least, each thread needs to run this.
 void Processes::StartProfilingTimer(void)
 {
-    // set virtual timer to go off every millisecond
+    // set virtual timer to go off at the profile interval
     struct itimerval starttime;
-    starttime.it_interval.tv_sec = starttime.it_value.tv_sec = 0;
-    starttime.it_interval.tv_usec = starttime.it_value.tv_usec = 1000;
+    starttime.it_interval.tv_sec = starttime.it_value.tv_sec = profileInterval / 1000000;
+    starttime.it_interval.tv_usec = starttime.it_value.tv_usec = profileInterval % 1000000;
     setitimer(ITIMER_VIRTUAL,&starttime,NULL);
 }
 #endif
@@ -2011,6 +2182,8 @@ void Processes::GarbageCollect(ScanAddress *process)
         if (*i)
             (*i)->GarbageCollect(process);
     }
+    // The addresses of the mutexes may have changed.
+    mutexWaitRehash = true;
 }
 
 void TaskData::GarbageCollect(ScanAddress *process)
@@ -2025,18 +2198,23 @@ void TaskData::GarbageCollect(ScanAddress *process)
     }
     if (blockMutex != 0)
         process->ScanRuntimeAddress(&blockMutex, ScanAddress::STRENGTH_STRONG);
-    // The allocation spaces are no longer valid.
+    // The allocation spaces are no longer valid.  The space that was not
+    // used does not count towards the allocation rate.
+    if (allocPointer > allocLimit)
+        allocWords -= allocPointer - allocLimit;
     allocPointer = 0;
     allocLimit = 0;
-    // Divide the allocation size by four. If we have made a single allocation
-    // since the last GC the size will have been doubled after the allocation.
-    // On average for each thread, apart from the one that ran out of space
-    // and requested the GC, half of the space will be unused so reducing by
-    // four should give a good estimate for next time.
+    // Set the segment size from the amount this thread has allocated since
+    // the last GC, smoothed with the previous rate, so that a thread would
+    // normally need a few segments between GCs.  A thread that allocates
+    // little gets a small segment rather than one that has been doubled.
+    // This may be called more than once in a GC so only do it once.
     if (allocCount != 0)
-    { // Do this only once for each GC.
+    {
         allocCount = 0;
-        allocSize = allocSize/4;
+        allocRate = (allocRate + allocWords) / 2;
+        allocWords = 0;
+        allocSize = allocRate / HEAP_SEGMENTS_PER_GC;
         if (allocSize < MIN_HEAP_SIZE)
             allocSize = MIN_HEAP_SIZE;
     }
@@ -45,6 +45,7 @@ class ScanAddress;
 class MDTaskData;
 class Exporter;
 class StackObject;
+class ProfileSampleBuffer;
 
 #ifdef HAVE_WINDOWS_H
 typedef void *HANDLE;
@@ -77,6 +78,7 @@ typedef void *HANDLE;
 #endif
 
 #define MIN_HEAP_SIZE   4096 // Minimum and initial heap segment size (words)
+#define HEAP_SEGMENTS_PER_GC 8 // Target number of heap segments for a thread between GCs
 
 // This is the ML "thread identifier" object.  The fields
 // are read and set by the ML code.
@@ -132,6 +134,8 @@ public:
     virtual uintptr_t currentStackSpace(void) const = 0;
     // Add a count to the local function if we are using store profiling.
     virtual void addProfileCount(POLYUNSIGNED words) = 0;
+    // Count an object allocated in the RTS if we are sampling allocations.
+    virtual void sampleAllocation(POLYUNSIGNED words, PolyObject *obj) = 0;
 
     // Functions called before and after an RTS call.
     virtual void PreRTSCall(void) {}
@@ -142,10 +146,15 @@ public:
     PolyWord    *allocLimit;    // ... lower limit of allocation
     uintptr_t   allocSize;     // The preferred heap segment size
     unsigned    allocCount;     // The number of allocations since the last GC
+    uintptr_t   allocWords;     // Words allocated in heap segments since the last GC
+    uintptr_t   allocRate;      // Smoothed number of words allocated between GCs
+    unsigned    numaNode;       // Node for allocation spaces in NUMA mode
     StackSpace  *stack;
     ThreadObject *threadObject;  // Pointer to the thread object.
     int         lastError;      // Last error from foreign code.
     void        *signalStack;  // Stack to handle interrupts (Unix only)
+    ProfileSampleBuffer *profileBuffer; // Samples if we are time profiling
+    uintptr_t   allocSinceSample; // Words allocated since the last allocation sample
 
     // Get a TaskData pointer given the ML taskId.
     // This is called at the start of every RTS function that may allocate memory.
@@ -169,6 +178,12 @@ private:
     ThreadRequests requests;
     // Pointer to the mutex when blocked. Set to NULL when it doesn't apply.
     PolyObject *blockMutex;
+    // Threads blocked on the same mutex are linked in the order they blocked.
+    TaskData *nextMutexWaiter, *prevMutexWaiter;
+    bool inMutexQueue; // Set while the thread is in a mutex queue.
+    // Set if the thread will not record contention when it takes the mutex
+    // and must be woken along with all the other waiters.
+    bool wakeWithAllWaiters;
     // This is set to false when a thread blocks or enters foreign code,
     // While it is true the thread can manipulate ML memory so no other
     // thread can garbage collect.
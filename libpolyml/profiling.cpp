@@ -37,6 +37,10 @@
 #include <malloc.h>
 #endif
 
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
 #ifdef HAVE_ASSERT_H
 #include <assert.h>
 #define ASSERT(x) assert(x)
@@ -59,8 +63,15 @@
 #include "rtsentry.h"
 #include "machine_dep.h"
 
+#include <map>
+#include <string>
+#include <vector>
+#include <new>
+
 extern "C" {
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyProfiling(POLYUNSIGNED threadId, POLYUNSIGNED mode);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolySetProfileInterval(POLYUNSIGNED threadId, POLYUNSIGNED interval);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolySetAllocationSampleInterval(POLYUNSIGNED threadId, POLYUNSIGNED interval);
 }
 
 static long mainThreadCounts[MTP_MAXENTRY];
@@ -107,24 +118,93 @@ static const char * const extraStoreText[EST_MAX_ENTRY] =
 
 // Poly strings for "standard" counts.  These are generated from the C strings
 // above the first time profiling is activated.
-static PolyWord psRTSString[MTP_MAXENTRY], psExtraStrings[EST_MAX_ENTRY], psGCTotal;
+static PolyWord psRTSString[MTP_MAXENTRY], psExtraStrings[EST_MAX_ENTRY], psGCTotal, psLostSamples;
 
 ProfileMode profileMode;
 // If we are just profiling a single thread, this is the thread data.
 static TaskData *singleThreadProfile = 0;
 
-// The queue is processed every 400ms and an entry can be
-// added every ms of CPU time by each thread.
-#define PCQUEUESIZE 4000
+// Interval between samples in microseconds of CPU time.
+unsigned profileInterval = 1000;
+
+// Set if we are recording the stack with each sample.
+static bool profileStacks = false;
+// Set if the samples are counted separately for each thread.
+static bool profileByThread = false;
+
+// When time profiling each thread has a ring buffer of samples.  The thread
+// adds samples in the signal handler and the main thread removes them so
+// neither needs a lock.  Each sample is the number of code addresses followed
+// by the addresses, starting with the current pc.  Unless we are profiling
+// stacks there is only the pc.
+#define SAMPLEBUFFERSIZE 32768
+#define MAXSTACKDEPTH   128
+
+#if (defined(__GNUC__))
+static inline uintptr_t atomicLoad(uintptr_t *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline void atomicStore(uintptr_t *p, uintptr_t v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+static inline void atomicIncrement(long *p) { __atomic_add_fetch(p, 1, __ATOMIC_RELAXED); }
+static inline void atomicAdd(long *p, long n) { __atomic_add_fetch(p, n, __ATOMIC_RELAXED); }
+static inline long atomicExchange(long *p, long v) { return __atomic_exchange_n(p, v, __ATOMIC_RELAXED); }
+#elif (defined(_MSC_VER))
+static inline uintptr_t atomicLoad(uintptr_t *p) { uintptr_t v = *(volatile uintptr_t*)p; _ReadWriteBarrier(); return v; }
+static inline void atomicStore(uintptr_t *p, uintptr_t v) { _ReadWriteBarrier(); *(volatile uintptr_t*)p = v; }
+static inline void atomicIncrement(long *p) { InterlockedIncrement(p); }
+static inline void atomicAdd(long *p, long n) { InterlockedExchangeAdd(p, n); }
+static inline long atomicExchange(long *p, long v) { return InterlockedExchange(p, v); }
+#endif
+
+class ProfileSampleBuffer
+{
+public:
+    ProfileSampleBuffer(): head(0), tail(0), lost(0), lostReported(0), inUse(false), threadNumber(0) {}
+
+    void AddSample(POLYCODEPTR pc, stackItem *sp, stackItem *top);
+    void ProcessSamples();
 
-static long queuePtr = 0;
-static POLYCODEPTR pcQueue[PCQUEUESIZE];
-static PLock queueLock;
+    // Only the producer updates head and lost and only the main thread updates
+    // tail and lostReported.
+    uintptr_t head, tail, lost, lostReported;
+    bool inUse; // Set while a thread owns this.  Protected by bufferLock.
+    unsigned threadNumber; // Identifies the thread when profiling by thread.
+    POLYCODEPTR samples[SAMPLEBUFFERSIZE];
+};
+
+// Buffers are retained when a thread exits and reused for new threads.
+static std::vector<ProfileSampleBuffer*> sampleBuffers;
+static PLock bufferLock;
+static unsigned threadCount = 0;
+
+// Samples that couldn't be recorded because a buffer was full or a thread
+// had no buffer.
+static long lostSamples;
+
+// The number of samples for each stack.  The stack is the function names
+// separated by semicolons, outermost first, as used in flame graphs.
+static std::map<std::string, POLYUNSIGNED> stackCounts;
+// Names of the code objects.  This is cleared at each GC because code may be freed.
+static std::map<PolyObject*, std::string> codeNames;
+
+// When sampling allocations a thread records a sample each time it has
+// allocated at least this many words since its last sample.
+static POLYUNSIGNED allocationSampleWords = 65536 / sizeof(PolyWord);
+
+// A sampled object waiting for the next GC to find whether it survives.
+typedef struct _ALLOCATIONSAMPLE
+{
+    PolyObject *obj;
+    POLYUNSIGNED words; // Words allocated by the thread since its previous sample.
+    std::string stack;
+} ALLOCATIONSAMPLE;
+
+static std::vector<ALLOCATIONSAMPLE> allocationSamples;
+static PLock allocationLock;
 
 typedef struct _PROFENTRY
 {
     POLYUNSIGNED count;
     PolyWord functionName;
+    char *stackName; // The stack if we are profiling stacks.
     struct _PROFENTRY *nextEntry;
 } PROFENTRY, *PPROFENTRY;
 
@@ -158,6 +238,7 @@ ProfileRequest::~ProfileRequest()
     {
         PPROFENTRY toFree = p;
         p = p->nextEntry;
+        free(toFree->stackName);
         free(toFree); 
     }
 }
@@ -182,6 +263,22 @@ static PolyObject *getProfileObjectForCode(PolyObject *code)
     else return 0;
 }
 
+// Return the profile count for a piece of code.  This is used when exporting
+// so the profile object may have been copied already.
+POLYUNSIGNED getProfileCountForCode(PolyObject *code)
+{
+    PolyWord *consts;
+    POLYUNSIGNED constCount;
+    machineDependent->GetConstSegmentForCode(code, consts, constCount);
+    if (constCount < 2 || consts[1].AsUnsigned() == 0 || ! consts[1].IsDataPtr()) return 0;
+    PolyObject *profObject = consts[1].AsObjPtr();
+    if (profObject->ContainsForwardingPtr())
+        profObject = profObject->FollowForwardingChain();
+    if (profObject->IsMutable() && profObject->IsByteObject() && profObject->Length() == 1)
+        return profObject->Get(0).AsUnsigned();
+    else return 0;
+}
+
 // Adds incr to the profile count for the function pointed at by
 // pc or by one of its callers.
 void addSynchronousCount(POLYCODEPTR fpc, POLYUNSIGNED incr)
@@ -199,11 +296,7 @@ void addSynchronousCount(POLYCODEPTR fpc, POLYUNSIGNED incr)
         }
     }
     // Didn't find it.
-    else
-    {
-        PLocker locker(&countLock);
-        mainThreadCounts[MTP_USER_CODE]++;
-    }
+    else atomicIncrement(&mainThreadCounts[MTP_USER_CODE]);
 }
 
 
@@ -212,6 +305,7 @@ PPROFENTRY ProfileRequest::newProfileEntry(void)
 {
     PPROFENTRY newEntry = (PPROFENTRY)malloc(sizeof(PROFENTRY));
     if (newEntry == 0) { errorMessage = "Insufficient memory"; return 0; }
+    newEntry->stackName = 0;
     newEntry->nextEntry = pTab;
     pTab = newEntry;
     return newEntry;
@@ -286,6 +380,20 @@ void ProfileRequest::getResults(void)
         getProfileResults(space->bottom, space->top);
     }
 
+    for (std::map<std::string, POLYUNSIGNED>::iterator i = stackCounts.begin(); i != stackCounts.end(); i++)
+    {
+        PPROFENTRY pEnt = newProfileEntry();
+        if (pEnt == 0) return;
+        pEnt->count = i->second;
+        pEnt->functionName = TAGGED(0);
+        pEnt->stackName = strdup(i->first.c_str());
+        if (pEnt->stackName == 0) { errorMessage = "Insufficient memory"; return; }
+    }
+    stackCounts.clear();
+    codeNames.clear();
+
+    // The GC total would count the samples twice in a flame graph.
+    if (! profileStacks && ! profileByThread)
     {
         POLYUNSIGNED gc_count =
             mainThreadCounts[MTP_GCPHASESHARING]+
@@ -314,6 +422,16 @@ void ProfileRequest::getResults(void)
         }
     }
 
+    // Signal handlers may add to this at the same time.
+    long lost = atomicExchange(&lostSamples, 0);
+    if (lost)
+    {
+        PPROFENTRY pEnt = newProfileEntry();
+        if (pEnt == 0) return;
+        pEnt->count = lost;
+        pEnt->functionName = psLostSamples;
+    }
+
     for (unsigned l = 0; l < EST_MAX_ENTRY; l++)
     {
         if (extraStoreCounts[l])
@@ -335,10 +453,13 @@ Handle ProfileRequest::extractAsList(TaskData *taskData)
 
     for (PPROFENTRY p = pTab; p != 0; p = p->nextEntry)
     {
+        Handle name = taskData->saveVec.push(p->functionName);
+        if (p->stackName != 0)
+            name = taskData->saveVec.push(C_string_to_Poly(taskData, p->stackName));
         Handle pair = alloc_and_save(taskData, 2);
         Handle countValue = Make_arbitrary_precision(taskData, p->count);
         pair->WordP()->Set(0, countValue->Word());
-        pair->WordP()->Set(1, p->functionName);
+        pair->WordP()->Set(1, name->Word());
         Handle next  = alloc_and_save(taskData, sizeof(ML_Cons_Cell) / sizeof(PolyWord));
         DEREFLISTHANDLE(next)->h = pair->Word();
         DEREFLISTHANDLE(next)->t =list->Word();
@@ -350,36 +471,294 @@ Handle ProfileRequest::extractAsList(TaskData *taskData)
     return list;
 }
 
-// We have had an asynchronous interrupt and found a potential PC but
-// we're in a signal handler.
-void incrementCountAsynch(POLYCODEPTR pc)
+// The stacks recorded with the samples are an approximate attribution rather
+// than an exact walk.  ML frames have no frame pointer and the code does not
+// record the layout of its frames so any word on the stack that points into code
+// is taken to be a return address.  A stale return address or a handler address
+// left in a frame adds a caller that is not active, and a caller whose return
+// address is in a register, such as the link register on ARM64, is missing.
+static inline bool mayBeReturnAddress(POLYCODEPTR addr)
 {
-    PLocker locker(&queueLock);
-    int q = queuePtr++;
-    if (q < PCQUEUESIZE) pcQueue[q] = pc;
+    MemSpace *space = gMem.SpaceForAddress(addr);
+    return space != 0 && space->isCode && (space->spaceType == ST_CODE || space->spaceType == ST_PERMANENT);
 }
 
-// Called by the main thread to process the queue of PC values
-void processProfileQueue()
+// Add a sample to the buffer.  This is called in a signal handler so it must not
+// allocate memory or take a lock.
+void ProfileSampleBuffer::AddSample(POLYCODEPTR pc, stackItem *sp, stackItem *top)
 {
-    while (1)
+    uintptr_t h = head;
+    if (SAMPLEBUFFERSIZE - (h - atomicLoad(&tail)) < MAXSTACKDEPTH + 1)
     {
-        POLYCODEPTR pc = 0;
+        atomicStore(&lost, lost + 1); // The main thread hasn't kept up.
+        return;
+    }
+    uintptr_t depth = 0;
+    samples[(h + 1) % SAMPLEBUFFERSIZE] = pc;
+    depth++;
+    for (stackItem *p = sp; p != 0 && p < top && depth < MAXSTACKDEPTH; p++)
+    {
+        POLYCODEPTR addr = p->codeAddr;
+        if (mayBeReturnAddress(addr))
+            samples[(h + 1 + depth++) % SAMPLEBUFFERSIZE] = addr;
+    }
+    samples[h % SAMPLEBUFFERSIZE] = (POLYCODEPTR)depth;
+    atomicStore(&head, h + depth + 1);
+}
+
+// Get the name of the function containing a code address.
+static const std::string &nameForCode(POLYCODEPTR pc)
+{
+    static const std::string unknown("UNKNOWN"), anonymous("<anonymous>");
+    PolyObject *codeObj = gMem.FindCodeObject(pc);
+    if (codeObj == 0)
+        return unknown;
+    std::map<PolyObject*, std::string>::iterator i = codeNames.find(codeObj);
+    if (i != codeNames.end())
+        return i->second;
+    PolyWord name = machineDependent->ConstPtrForCode(codeObj)[0];
+    if (name == TAGGED(0) || ! name.IsDataPtr())
+        return codeNames[codeObj] = anonymous;
+    char *cName = Poly_string_to_C_alloc(name);
+    if (cName == 0)
+        return unknown;
+    // Semicolons separate the names in the stack.
+    for (char *p = cName; *p != 0; p++)
+        if (*p == ';') *p = ',';
+    std::string &result = codeNames[codeObj] = cName;
+    free(cName);
+    return result;
+}
+
+// Called by the main thread to remove the samples and add them to the counts.
+// This runs while the threads continue to add samples.
+void ProfileSampleBuffer::ProcessSamples()
+{
+    uintptr_t h = atomicLoad(&head), t = tail;
+    try {
+        std::string stack;
+        while (t != h)
         {
-            PLocker locker(&queueLock);
-            if (queuePtr == 0) return;
-            if (queuePtr < PCQUEUESIZE)
-                pc = pcQueue[queuePtr];
-            queuePtr--;
+            uintptr_t depth = (uintptr_t)samples[t % SAMPLEBUFFERSIZE];
+            if (! profileStacks && ! profileByThread)
+                addSynchronousCount(samples[(t + 1) % SAMPLEBUFFERSIZE], 1);
+            else
+            {
+                stack.clear();
+                if (profileByThread)
+                {
+                    char threadName[30];
+                    sprintf(threadName, "Thread %u;", threadNumber);
+                    stack += threadName;
+                }
+                for (uintptr_t i = depth; i > 0; i--)
+                {
+                    if (i != depth) stack += ';';
+                    stack += nameForCode(samples[(t + i) % SAMPLEBUFFERSIZE]);
+                }
+                stackCounts[stack]++;
+            }
+            t += depth + 1;
         }
-        if (pc != 0)
-            addSynchronousCount(pc, 1);
-        else
+    }
+    catch (std::bad_alloc &) {
+        t = h; // Discard the rest of the samples.
+    }
+    atomicStore(&tail, t);
+    uintptr_t nowLost = atomicLoad(&lost);
+    if (nowLost != lostReported)
+    {
+        atomicAdd(&lostSamples, (long)(nowLost - lostReported));
+        lostReported = nowLost;
+    }
+}
+
+POLYUNSIGNED allocationWordsBeforeSample(TaskData *taskData)
+{
+    if (taskData->allocSinceSample >= allocationSampleWords)
+        return 1;
+    return allocationSampleWords - taskData->allocSinceSample;
+}
+
+void addAllocationSample(TaskData *taskData, POLYCODEPTR pc, stackItem *sp, POLYUNSIGNED words, PolyObject *obj)
+{
+    taskData->allocSinceSample += words;
+    if (taskData->allocSinceSample < allocationSampleWords)
+        return;
+    POLYUNSIGNED sampleWords = taskData->allocSinceSample;
+    taskData->allocSinceSample = 0;
+
+    POLYCODEPTR pcs[MAXSTACKDEPTH];
+    unsigned depth = 0;
+    pcs[depth++] = pc;
+    StackSpace *stack = taskData->stack;
+    if (stack != 0 && sp >= (stackItem*)stack->bottom)
+    {
+        for (stackItem *p = sp; p < (stackItem*)stack->top && depth < MAXSTACKDEPTH; p++)
         {
-            PLocker locker(&countLock);
-            mainThreadCounts[MTP_USER_CODE]++;
+            if (mayBeReturnAddress(p->codeAddr))
+                pcs[depth++] = p->codeAddr;
         }
     }
+
+    PLocker locker(&allocationLock);
+    try {
+        allocationSamples.push_back(ALLOCATIONSAMPLE());
+        ALLOCATIONSAMPLE &sample = allocationSamples.back();
+        sample.obj = obj;
+        sample.words = sampleWords;
+        for (unsigned i = depth; i > 0; i--)
+        {
+            if (i != depth) sample.stack += ';';
+            sample.stack += nameForCode(pcs[i-1]);
+        }
+    }
+    catch (std::bad_alloc &) {
+        // Drop the sample.
+    }
+}
+
+// Describe the kind of a sampled object.  This is added to the stack as
+// though it were the function that was called.
+static const char *allocationKind(PolyObject *obj)
+{
+    if (obj->IsCodeObject())
+        return "[code]";
+    else if (obj->IsClosureObject())
+        return "[closure]";
+    else if (obj->IsByteObject())
+        return obj->IsMutable() ? "[mutable bytes]" : "[bytes]";
+    else return obj->IsMutable() ? "[mutable words]" : "[words]";
+}
+
+// Add a sample to the counts in bytes.  The results for allocated and for
+// surviving objects are distinguished by the outermost entry in the stack.
+static void addAllocationResult(const char *prefix, const ALLOCATIONSAMPLE &sample, PolyObject *obj)
+{
+    std::string stack(prefix);
+    stack += sample.stack;
+    stack += ';';
+    stack += allocationKind(obj);
+    stackCounts[stack] += sample.words * sizeof(PolyWord);
+}
+
+void checkAllocationSamples(bool minorGC)
+{
+    PLocker locker(&allocationLock);
+    try {
+        for (std::vector<ALLOCATIONSAMPLE>::iterator i = allocationSamples.begin(); i != allocationSamples.end(); i++)
+        {
+            PolyObject *obj = i->obj;
+            LocalMemSpace *space = gMem.LocalSpaceForAddress((PolyWord*)obj - 1);
+            bool survived;
+            if (minorGC)
+                // A minor GC only collects the allocation areas and it copies
+                // anything it retains.
+                survived = space == 0 || ! space->allocationSpace || obj->ContainsForwardingPtr();
+            else
+            {
+                // An earlier minor GC that failed may have copied it.
+                if (obj->ContainsForwardingPtr())
+                {
+                    obj = obj->FollowForwardingChain();
+                    space = gMem.LocalSpaceForAddress((PolyWord*)obj - 1);
+                }
+                survived = space == 0 || space->bitmap.TestBit(space->wordNo((PolyWord*)obj));
+            }
+            if (obj->ContainsForwardingPtr())
+                obj = obj->FollowForwardingChain();
+            addAllocationResult("Allocated;", *i, obj);
+            if (survived)
+                addAllocationResult("Survived;", *i, obj);
+        }
+    }
+    catch (std::bad_alloc &) {
+        // Discard the rest of the samples.
+    }
+    allocationSamples.clear();
+}
+
+// Add the samples taken since the last GC when profiling stops.  We don't know
+// yet whether they will survive.
+static void addPendingAllocationSamples()
+{
+    PLocker locker(&allocationLock);
+    try {
+        for (std::vector<ALLOCATIONSAMPLE>::iterator i = allocationSamples.begin(); i != allocationSamples.end(); i++)
+            addAllocationResult("Allocated;", *i, i->obj);
+    }
+    catch (std::bad_alloc &) {
+    }
+    allocationSamples.clear();
+}
+
+void allocateProfileBuffer(TaskData *taskData)
+{
+    if (profileMode != kProfileTime || taskData->profileBuffer != 0)
+        return;
+    PLocker locker(&bufferLock);
+    ProfileSampleBuffer *buffer = 0;
+    for (std::vector<ProfileSampleBuffer*>::iterator i = sampleBuffers.begin(); i != sampleBuffers.end(); i++)
+    {
+        if (! (*i)->inUse)
+        {
+            buffer = *i;
+            break;
+        }
+    }
+    if (buffer == 0)
+    {
+        buffer = new(std::nothrow) ProfileSampleBuffer;
+        if (buffer == 0)
+            return; // Samples for this thread will be counted as lost.
+        try {
+            sampleBuffers.push_back(buffer);
+        }
+        catch (std::bad_alloc &) {
+            delete buffer;
+            return;
+        }
+    }
+    buffer->inUse = true;
+    buffer->threadNumber = ++threadCount;
+    taskData->profileBuffer = buffer;
+}
+
+void releaseProfileBuffer(TaskData *taskData)
+{
+    if (taskData->profileBuffer == 0)
+        return;
+    PLocker locker(&bufferLock);
+    // Any samples still in the buffer are processed later.
+    taskData->profileBuffer->inUse = false;
+    taskData->profileBuffer = 0;
+}
+
+// We have had an asynchronous interrupt and found a potential PC but
+// we're in a signal handler.
+void incrementCountAsynch(TaskData *taskData, POLYCODEPTR pc, stackItem *sp)
+{
+    ProfileSampleBuffer *buffer = taskData->profileBuffer;
+    if (buffer == 0)
+    {
+        atomicIncrement(&lostSamples);
+        return;
+    }
+    StackSpace *stack = taskData->stack;
+    stackItem *top = 0;
+    if (stack != 0)
+        top = (stackItem*)stack->top;
+    if (! profileStacks || stack == 0 || sp < (stackItem*)stack->bottom || sp >= top)
+        sp = 0; // Just record the pc.
+    buffer->AddSample(pc, sp, top);
+}
+
+// Called by the main thread to process the samples from each thread.
+void processProfileQueue()
+{
+    PLocker locker(&bufferLock);
+    for (std::vector<ProfileSampleBuffer*>::iterator i = sampleBuffers.begin(); i != sampleBuffers.end(); i++)
+        (*i)->ProcessSamples();
 }
 
 // Handle a SIGVTALRM or the simulated equivalent in Windows.  This may be called
@@ -394,18 +773,11 @@ void handleProfileTrap(TaskData *taskData, SIGNALCONTEXT *context)
     if (mainThreadPhase == MTP_USER_CODE)
     {
         if (taskData == 0 || !taskData->AddTimeProfileCount(context))
-        {
-            PLocker lock(&countLock);
-            mainThreadCounts[MTP_USER_CODE]++;
-        }
+            atomicIncrement(&mainThreadCounts[MTP_USER_CODE]);
         // On Mac OS X all virtual timer interrupts seem to be directed to the root thread
         // so all the counts will be "unknown".
     }
-    else
-    {
-        PLocker lock(&countLock);
-        mainThreadCounts[mainThreadPhase]++;
-    }
+    else atomicIncrement(&mainThreadCounts[mainThreadPhase]);
 }
 
 // Called from the GC when allocation profiling is on.
@@ -487,6 +859,8 @@ static Handle profilerc(TaskData *taskData, Handle mode_handle)
         }
         if (psGCTotal == TAGGED(0))
             psGCTotal = C_string_to_Poly(taskData, "GARBAGE COLLECTION (total)");
+        if (psLostSamples == TAGGED(0))
+            psLostSamples = C_string_to_Poly(taskData, "Lost samples");
     }
     // All these actions are performed by the root thread.  Only profile
     // printing needs to be performed with all the threads stopped but it's
@@ -534,7 +908,10 @@ void ProfileRequest::Perform()
         // Turn off old profiling mechanism and print out accumulated results 
         profileMode = kProfileOff;
         processes->StopProfiling();
+        processProfileQueue(); // Process any remaining samples.
+        addPendingAllocationSamples();
         getResults();
+        profileStacks = profileByThread = false;
         // Remove all the bitmaps to free up memory
         gMem.RemoveProfilingBitmaps(); 
         break;
@@ -567,6 +944,25 @@ void ProfileRequest::Perform()
     case kProfileMutexContention:
         profileMode = kProfileMutexContention;
         break;
+
+    case kProfileTimeStacks:
+        // Time profiling recording the stack with each sample.
+        profileStacks = true;
+        profileMode = kProfileTime;
+        processes->StartProfiling();
+        break;
+
+    case kProfileTimeByThread:
+        // Time profiling with the counts for each thread kept separately.
+        profileByThread = true;
+        profileMode = kProfileTime;
+        processes->StartProfiling();
+        break;
+
+    case kProfileAllocationStacks:
+        // Store profiling recording the stack for a sample of the allocations.
+        profileMode = kProfileAllocationStacks;
+        break;
        
     default: /* do nothing */
         break;
@@ -574,10 +970,55 @@ void ProfileRequest::Perform()
 
 }
 
+// Set the interval between samples for time profiling.  This takes effect
+// the next time profiling is started.
+POLYUNSIGNED PolySetProfileInterval(POLYUNSIGNED threadId, POLYUNSIGNED interval)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle pushedInterval = taskData->saveVec.push(interval);
+
+    try {
+        unsigned microSecs = get_C_unsigned(taskData, pushedInterval->Word());
+        if (microSecs == 0)
+            raise_exception_string(taskData, EXC_Fail, "The profile interval must be positive");
+        profileInterval = microSecs;
+    } catch (...) { } // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    return TAGGED(0).AsUnsigned();
+}
+
+// Set the number of bytes a thread allocates between samples when sampling allocations.
+POLYUNSIGNED PolySetAllocationSampleInterval(POLYUNSIGNED threadId, POLYUNSIGNED interval)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle pushedInterval = taskData->saveVec.push(interval);
+
+    try {
+        POLYUNSIGNED bytes = getPolyUnsigned(taskData, pushedInterval->Word());
+        if (bytes == 0)
+            raise_exception_string(taskData, EXC_Fail, "The sample interval must be positive");
+        allocationSampleWords = (bytes + sizeof(PolyWord) - 1) / sizeof(PolyWord);
+    } catch (...) { } // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    return TAGGED(0).AsUnsigned();
+}
+
 struct _entrypts profilingEPT[] =
 {
     // Profiling
     { "PolyProfiling",                  (polyRTSFunction)&PolyProfiling},
+    { "PolySetProfileInterval",         (polyRTSFunction)&PolySetProfileInterval},
+    { "PolySetAllocationSampleInterval", (polyRTSFunction)&PolySetAllocationSampleInterval},
 
     { NULL, NULL} // End of list.
 };
@@ -608,4 +1049,7 @@ void Profiling::GarbageCollect(ScanAddress *process)
     for (unsigned k = 0; k < EST_MAX_ENTRY; k++)
         process->ScanRuntimeWord(&psExtraStrings[k]);
     process->ScanRuntimeWord(&psGCTotal);
+    process->ScanRuntimeWord(&psLostSamples);
+    // Code may be freed by the GC so we have to look up the names again.
+    codeNames.clear();
 }
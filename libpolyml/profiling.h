@@ -36,7 +36,10 @@ typedef enum {
     kProfileLiveData,
     kProfileLiveMutables,
     kProfileTimeThread,
-    kProfileMutexContention
+    kProfileMutexContention,
+    kProfileTimeStacks,
+    kProfileTimeByThread,
+    kProfileAllocationStacks
 } ProfileMode;
 
 extern ProfileMode profileMode;
@@ -47,14 +50,41 @@ extern ProfileMode profileMode;
 extern void handleProfileTrap(TaskData *taskData, SIGNALCONTEXT *context);
 // Add count.  Must not be called from a signal handler.
 extern void addSynchronousCount(POLYCODEPTR pc, POLYUNSIGNED incr);
-// Add one to the timing counter.  May occur at any time.
-extern void incrementCountAsynch(POLYCODEPTR pc);
+// Add one to the timing counter.  May occur at any time.  If we are profiling
+// stacks the code addresses on the stack from sp to the top are taken to be
+// the callers.  This is approximate.  See mayBeReturnAddress.
+extern void incrementCountAsynch(TaskData *taskData, POLYCODEPTR pc, stackItem *sp);
 // Process the queue of profile pc values if we're time profiling.
 // Only called by the main thread.
 extern void processProfileQueue();
 
+// Give a thread a buffer for samples if we are time profiling.
+// Must not be called from a signal handler.
+extern void allocateProfileBuffer(TaskData *taskData);
+// Return the buffer when the thread exits.
+extern void releaseProfileBuffer(TaskData *taskData);
+
+// Interval between samples in microseconds of CPU time.
+extern unsigned profileInterval;
+
+// Count an allocation of words at obj if we are sampling allocations.  When
+// the thread has allocated enough since its last sample this records the
+// code addresses on the stack from sp to the top along with the object.  Must not be called from
+// a signal handler.
+extern void addAllocationSample(TaskData *taskData, POLYCODEPTR pc, stackItem *sp,
+                                POLYUNSIGNED words, PolyObject *obj);
+// The number of words the thread can allocate before its next sample is due.
+// Native code only traps for a sample when this has been reached.
+extern POLYUNSIGNED allocationWordsBeforeSample(TaskData *taskData);
+// Called by the GC, after it has found the reachable objects but before
+// anything has been overwritten, to record which sampled objects survived.
+extern void checkAllocationSamples(bool minorGC);
+
 extern void AddObjectProfile(PolyObject *obj);
 
+// The profile count for a piece of code or zero if it has none.
+extern POLYUNSIGNED getProfileCountForCode(PolyObject *code);
+
 extern struct _entrypts profilingEPT[];
 
 #endif /* _PROFILING_H_DEFINED */
@@ -57,6 +57,8 @@ these has filled up it fails and a full garbage collection must be done.
 #include "gctaskfarm.h"
 #include "statistics.h"
 #include "gc_progress.h"
+#include "cardtable.h"
+#include "profiling.h"
 
 // This protects access to the gMem.lSpace table.
 static PLock localTableLock("Minor GC tables");
@@ -72,7 +74,10 @@ public:
     // Overrides for ScanAddress class
     virtual POLYUNSIGNED ScanAddressAt(PolyWord *pt);
     virtual PolyObject *ScanObjectAddress(PolyObject *base);
+
+    void ScanDirtyCards(CardTable *cards, PolyWord *regionStart, PolyWord *regionEnd);
 private:
+    void ScanCardInterval(CardTable *cards, PolyWord *regionStart, PolyWord *start, PolyWord *end);
     PolyObject *FindNewAddress(PolyObject *obj, POLYUNSIGNED L, LocalMemSpace *srcSpace);
     virtual LocalMemSpace *FindSpace(POLYUNSIGNED length, bool isMutable) = 0;
 protected:
@@ -97,6 +102,7 @@ public:
     virtual ~ThreadScanner() { free(spaceTable); }
 
     void ScanOwnedAreas(void);
+    void ScanCardsInSpace(LocalMemSpace *space);
 private:
     virtual LocalMemSpace *FindSpace(POLYUNSIGNED length, bool isMutable);
     bool TakeOwnership(LocalMemSpace *space);
@@ -245,7 +251,7 @@ LocalMemSpace *RootScanner::FindSpace(POLYUNSIGNED n, bool isMutable)
     for (std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
     {
         LocalMemSpace *sp = *i;
-        if (sp->isMutable == isMutable && !sp->allocationSpace &&
+        if (sp->isMutable == isMutable && !sp->allocationSpace && !sp->largeObjectSpace &&
                 (lSpace == 0 || sp->freeSpace() > lSpace->freeSpace()))
             lSpace = sp;
     }
@@ -275,7 +281,7 @@ LocalMemSpace *ThreadScanner::FindSpace(POLYUNSIGNED n, bool isMutable)
     {
         lSpace = spaceTable[i];
         if (lSpace->isMutable == isMutable &&
-            ! lSpace->allocationSpace && lSpace->freeSpace() > n /* At least n+1*/)
+            ! lSpace->allocationSpace && ! lSpace->largeObjectSpace && lSpace->freeSpace() > n /* At least n+1*/)
         {
             if (n < 10)
             {
@@ -297,7 +303,7 @@ LocalMemSpace *ThreadScanner::FindSpace(POLYUNSIGNED n, bool isMutable)
         {
             lSpace = *i;
             if (lSpace->spaceOwner == 0 && lSpace->isMutable == isMutable &&
-                ! lSpace->allocationSpace && lSpace->freeSpace() > n /* At least n+1*/)
+                ! lSpace->allocationSpace && ! lSpace->largeObjectSpace && lSpace->freeSpace() > n /* At least n+1*/)
             {
                 if (debugOptions & DEBUG_GC_ENHANCED)
                     Log("GC: Quick: Thread %p is taking ownership of space %p\n", taskID, lSpace);
@@ -408,6 +414,107 @@ PolyObject *QuickGCScanner::ScanObjectAddress(PolyObject *base)
     return val.AsObjPtr();
 }
 
+// Scan the dirty cards within a region.  Any part of the region that is not
+// covered by a whole card is not protected and so is always treated as dirty.
+// The object map must have been built for the region.
+void QuickGCScanner::ScanDirtyCards(CardTable *cards, PolyWord *regionStart, PolyWord *regionEnd)
+{
+    PolyWord *cardsEnd = cards->CardsEnd();
+    PolyWord *p = regionStart;
+    while (p < regionEnd)
+    {
+        // Find the start of the next dirty interval.
+        PolyWord *start = p;
+        if (p >= cards->cardBase && p < cardsEnd)
+        {
+            uintptr_t n = cards->CardNo(p);
+            if (! cards->IsDirty(n))
+            {
+                while (n < cards->nCards && ! cards->IsDirty(n)) n++;
+                start = cards->CardAddr(n);
+            }
+        }
+        if (start >= regionEnd)
+            break;
+        // Extend it to include any following dirty cards.
+        PolyWord *end = start < cards->cardBase ? cards->cardBase : start;
+        while (end < cardsEnd && cards->IsDirty(cards->CardNo(end)))
+            end = cards->CardAddr(cards->CardNo(end)+1);
+        if (end >= cardsEnd || end > regionEnd)
+            end = regionEnd;
+        ScanCardInterval(cards, regionStart, start, end);
+        p = end;
+    }
+}
+
+// Scan the addresses in the interval.  The interval will normally begin part way
+// through an object.  For simple word objects we only need to scan the words
+// within the interval.  Other objects are scanned completely.  That may mean
+// an object is scanned twice but that is safe.
+void QuickGCScanner::ScanCardInterval(CardTable *cards, PolyWord *regionStart, PolyWord *start, PolyWord *end)
+{
+    PolyWord *pt = start == regionStart ? regionStart : cards->ObjectStart(cards->CardNo(start));
+    ASSERT(pt != 0 && pt >= regionStart && pt <= start);
+    while (pt < end)
+    {
+#ifdef POLYML32IN64
+        if ((((uintptr_t)pt) & 4) == 0)
+        {
+            pt++; // Skip padding.
+            continue;
+        }
+#endif
+        PolyObject *obj = (PolyObject*)(pt+1);
+        if (obj->ContainsForwardingPtr())
+        {
+            // This is a tombstone left by the last full GC.  Skip it.
+            pt += obj->FollowForwardingChain()->Length() + 1;
+            continue;
+        }
+        POLYUNSIGNED L = obj->LengthWord();
+        ASSERT(OBJ_IS_LENGTH(L));
+        PolyWord *objEnd = pt + OBJ_OBJECT_LENGTH(L) + 1;
+        if (OBJ_IS_WORD_OBJECT(L))
+        {
+            PolyWord *s = pt+1 < start ? start : pt+1;
+            PolyWord *e = objEnd > end ? end : objEnd;
+            for (PolyWord *q = s; q < e; q++)
+            {
+                PolyWord w = *q;
+                if (! w.IsTagged() && w != PolyWord::FromUnsigned(0))
+                    ScanAddressAt(q);
+            }
+        }
+        else if (! OBJ_IS_BYTE_OBJECT(L) && OBJ_OBJECT_LENGTH(L) != 0)
+            ScanAddressesInObject(obj, L);
+        pt = objEnd;
+        if (! succeeded)
+            return;
+    }
+}
+
+// Scan the old data in a mutable space using the card table.  This replaces
+// scanning the whole of the area below partialGCRootBase and above partialGCTop.
+void ThreadScanner::ScanCardsInSpace(LocalMemSpace *space)
+{
+    CardTable *cards = &space->cardTable;
+    // Extend the object map to cover any objects added to the lower region since
+    // the last GC.  The upper region only changes in a full GC.
+    if (cards->mappedLowerTop < space->partialGCRootBase)
+    {
+        cards->MapObjects(cards->mappedLowerTop, space->partialGCRootBase);
+        cards->mappedLowerTop = space->partialGCRootBase;
+    }
+    if (cards->mappedUpperBase != space->partialGCTop)
+    {
+        cards->MapObjects(space->partialGCTop, space->top);
+        cards->mappedUpperBase = space->partialGCTop;
+    }
+    ScanDirtyCards(cards, space->bottom, space->partialGCRootBase);
+    if (succeeded)
+        ScanDirtyCards(cards, space->partialGCTop, space->top);
+}
+
 // Add this to the set of spaces we own.  Must be called with the
 // localTableLock held.
 bool ThreadScanner::TakeOwnership(LocalMemSpace *space)
@@ -433,6 +540,28 @@ static void scanArea(GCTaskId *id, void *arg1, void *arg2)
     marker.ScanOwnedAreas();
 }
 
+// Thread function to scan a mutable space using its card table.
+static void scanCards(GCTaskId *id, void *arg1, void *)
+{
+    ThreadScanner marker(id);
+    marker.ScanCardsInSpace((LocalMemSpace*)arg1);
+    marker.ScanOwnedAreas();
+}
+
+// Return the card table if this space is scanned using it in this GC.  The
+// table is created the first time and then all the cards are dirty.
+static CardTable *cardTableForMinorGC(MemSpace *space)
+{
+    if (! gMem.CardMarking())
+        return 0;
+    CardTable *cards = gMem.CardTableForSpace(space);
+    if (cards == 0)
+        return 0;
+    if (! cards->Created() && ! cards->Create(space->bottom, space->top))
+        return 0; // Too small or we couldn't allocate it.
+    return cards;
+}
+
 void ThreadScanner::ScanOwnedAreas()
 {
     while (true)
@@ -520,6 +649,8 @@ bool RunQuickGC(const POLYUNSIGNED wordsRequiredToAllocate)
     // If the last minor GC took too long force a full GC.
     if (gHeapSizeParameters.RunMajorGCImmediately())
         return false;
+    // The minor GC moves objects and resets the cards.
+    GCDiscardConcurrentMark();
 
     gHeapSizeParameters.RecordGCTime(HeapSizeParameters::GCTimeStart);
     globalStats.incCount(PSC_GC_PARTIALGC);
@@ -534,6 +665,7 @@ bool RunQuickGC(const POLYUNSIGNED wordsRequiredToAllocate)
         gMem.ReportHeapSizes("Minor GC (before)");
 
     uintptr_t spaceBeforeGC = 0;
+    uintptr_t cardsScanned = 0, cardsTotal = 0;
 
     for(std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
     {
@@ -551,8 +683,9 @@ bool RunQuickGC(const POLYUNSIGNED wordsRequiredToAllocate)
         // If we're scanning a space this is where we start.
         // For immutable areas this only includes newly added
         // data but for mutable areas we have to scan data added
-        // by previous partial GCs.
-        if (lSpace->isMutable && ! lSpace->allocationSpace)
+        // by previous partial GCs.  If the space has a card table
+        // that data is scanned separately.
+        if (lSpace->isMutable && ! lSpace->allocationSpace && cardTableForMinorGC(lSpace) == 0)
             lSpace->partialGCRootBase = lSpace->bottom;
         else lSpace->partialGCRootBase = lSpace->lowerAllocPtr;
         lSpace->spaceOwner = 0; // Not currently owned
@@ -569,7 +702,22 @@ bool RunQuickGC(const POLYUNSIGNED wordsRequiredToAllocate)
     {
         PermanentMemSpace *space = *i;
         if (space->isMutable && ! space->byteOnly)
-            rootScan.ScanAddressesInRegion(space->bottom, space->top);
+        {
+            CardTable *cards = cardTableForMinorGC(space);
+            if (cards == 0)
+                rootScan.ScanAddressesInRegion(space->bottom, space->top);
+            else
+            {
+                if (cards->mappedLowerTop < space->top)
+                {
+                    cards->MapObjects(cards->mappedLowerTop, space->top);
+                    cards->mappedLowerTop = space->top;
+                }
+                cardsScanned += cards->CountDirty();
+                cardsTotal += cards->nCards;
+                rootScan.ScanDirtyCards(cards, space->bottom, space->top);
+            }
+        }
     }
     // Scan code spaces.  
     for (std::vector<CodeSpace *>::iterator i = gMem.cSpaces.begin(); i < gMem.cSpaces.end(); i++)
@@ -631,9 +779,23 @@ bool RunQuickGC(const POLYUNSIGNED wordsRequiredToAllocate)
                     break;
                 space = gMem.lSpaces[l++];
             }
+            CardTable *cards = 0;
+            if (space->isMutable && ! space->allocationSpace && gMem.CardMarking())
+            {
+                // Spaces added during this GC won't have a card table yet.
+                cards = gMem.CardTableForSpace(space);
+                if (cards != 0 && ! cards->Created())
+                    cards = 0;
+            }
             if (space->partialGCRootBase != space->partialGCRootTop)
                 gpTaskFarm->AddWorkOrRunNow(scanArea, space->partialGCRootBase, space->partialGCRootTop);
-            if (space->partialGCTop != space->top)
+            if (cards != 0)
+            {
+                cardsScanned += cards->CountDirty();
+                cardsTotal += cards->nCards;
+                gpTaskFarm->AddWorkOrRunNow(scanCards, space, 0);
+            }
+            else if (space->partialGCTop != space->top)
                 gpTaskFarm->AddWorkOrRunNow(scanArea, space->partialGCTop, space->top);
         }
     }
@@ -642,12 +804,20 @@ bool RunQuickGC(const POLYUNSIGNED wordsRequiredToAllocate)
 
     uintptr_t spaceAfterGC = 0;
 
+    globalStats.setCount(PSC_GC_CARDS_SCANNED, cardsScanned);
+    globalStats.setCount(PSC_GC_CARDS_TOTAL, cardsTotal);
+    if (gMem.CardMarking() && (debugOptions & DEBUG_GC_ENHANCED))
+        Log("GC: Quick: Scanned %" PRI_SIZET " dirty cards out of %" PRI_SIZET "\n", cardsScanned, cardsTotal);
+
     if (succeeded)
     {
+        // Any sampled objects that survived have now been copied.
+        checkAllocationSamples(true);
         globalStats.setSize(PSS_AFTER_LAST_GC, 0);
         globalStats.setSize(PSS_ALLOCATION, 0);
         globalStats.setSize(PSS_ALLOCATION_FREE, 0);
         // If it succeeded the allocation areas are now empty.
+        gMem.ResetCurrentAllocation();
         for(std::vector<LocalMemSpace*>::iterator i = gMem.lSpaces.begin(); i < gMem.lSpaces.end(); i++)
         {
             LocalMemSpace *lSpace = *i;
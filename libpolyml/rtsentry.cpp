@@ -69,6 +69,8 @@
 #include "statistics.h"
 #include "savestate.h"
 #include "bytecode.h"
+#include "asyncio.h"
+#include "bitmap.h"
 
 extern struct _entrypts rtsCallEPT[];
 
@@ -96,6 +98,8 @@ static entrypts entryPointTable[] =
     savestateEPT,
     machineSpecificEPT,
     byteCodeEPT,
+    asyncIOEPT,
+    bitmapEPT,
     NULL
 };
 
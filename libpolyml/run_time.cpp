@@ -90,6 +90,9 @@ PolyObject *alloc(TaskData *taskData, uintptr_t data_words, unsigned flags)
 
     PolyObject *pObj = (PolyObject*)(foundSpace + 1);
     pObj->SetLengthWord((POLYUNSIGNED)data_words, flags);
+
+    if (profileMode == kProfileAllocationStacks)
+        taskData->sampleAllocation(words, pObj);
     
     // Must initialise object here, because GC doesn't clean store.
     // Is this necessary any more?  This used to be necessary when we used
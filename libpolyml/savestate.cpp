@@ -59,10 +59,17 @@
 #include <unistd.h>
 #endif
 
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
+
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
 
+#include <vector>
+#include <algorithm>
+
 #ifdef HAVE_ASSERT_H
 #include <assert.h>
 #define ASSERT(x)   assert(x)
@@ -81,6 +88,8 @@ typedef char TCHAR;
 #define _tcscpy strcpy
 #define _tcsdup strdup
 #define _tcslen strlen
+#define _tcscat strcat
+#define _tremove remove
 #define _fputtc fputc
 #define _fputts fputs
 #ifndef lstrcmpi
@@ -111,6 +120,11 @@ typedef char TCHAR;
 
 #include "../polyexports.h" // For InitHeaderFromExport
 #include "version.h" // For InitHeaderFromExport
+#include "gctaskfarm.h"
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
 
 #ifdef _MSC_VER
 // Don't tell me about ISO C++ changes.
@@ -127,6 +141,10 @@ extern "C" {
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyLoadModule(POLYUNSIGNED threadId, POLYUNSIGNED arg);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyLoadHierarchy(POLYUNSIGNED threadId, POLYUNSIGNED arg);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyGetModuleDirectory(POLYUNSIGNED threadId);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolySetSaveCompression(POLYUNSIGNED threadId, POLYUNSIGNED level);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolySetSaveDeltas(POLYUNSIGNED threadId, POLYUNSIGNED arg);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolySetLazyLoading(POLYUNSIGNED threadId, POLYUNSIGNED arg);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyLazyLoadCounts(POLYUNSIGNED threadId);
 }
 
 // Helper class to close files on exit.
@@ -171,6 +189,9 @@ private:
 
 #define SAVEDSTATESIGNATURE "POLYSAVE"
 #define SAVEDSTATEVERSION   2
+// A saved state with compressed or patched segments has a different version so that
+// older versions of Poly/ML do not try to load it.
+#define SAVEDSTATEEXTENDEDVERSION   3
 
 // File header for a saved state file.  This appears as the first entry
 // in the file.
@@ -213,6 +234,48 @@ typedef struct _savedStateSegmentDescr
 #define SSF_NOOVERWRITE 4               // The segment must not be further overwritten
 #define SSF_BYTES       8               // The segment contains only byte data
 #define SSF_CODE        16              // The segment contains only code
+#define SSF_COMPRESSED  32              // The segment data is compressed in blocks
+#define SSF_PATCH       64              // The segment data is a set of patches (with SSF_OVERWRITE)
+#define SSF_UNITTABLE   128             // The segment data is followed by a table of object positions
+#define SSF_REFERENCES  256             // The segment data is followed by the segments it refers to
+
+// If a segment is compressed segmentData is the position of a table with an entry for each
+// block of SAVEDSTATE_BLOCK_SIZE bytes of the segment.  The last block may be shorter.
+// The blocks are compressed separately so they can be decompressed in parallel.
+typedef struct _savedStateBlock
+{
+    off_t       blockData;              // Position of the compressed data for the block
+    size_t      blockSize;              // Size of the compressed data
+} SavedStateBlock;
+
+#define SAVEDSTATE_BLOCK_SIZE       (1024*1024)
+// The number of blocks compressed or decompressed at once.  This limits the memory needed.
+#define SAVEDSTATE_BLOCK_BATCH      64
+
+// An overwritten mutable segment can be saved as patches to its contents when the parents
+// were loaded.  segmentData is then the position of a count of the patches followed by
+// a table with an entry for each patch and then the data for each patch in order.
+// The data in a patch has not been relocated.  The rest of the segment has already been.
+typedef struct _savedStatePatch
+{
+    size_t      patchOffset;            // Byte offset of the patch within the segment
+    size_t      patchLength;            // Number of bytes
+} SavedStatePatch;
+
+// The segments are compared in units of this many bytes.  Adjacent changed units are
+// combined into a single patch.
+#define SAVEDSTATE_PATCH_UNIT       512
+
+// The data of an uncompressed immutable segment may be followed by a table with an entry
+// for each unit of this many bytes.  The entry is the word offset of the length word of
+// the object containing the start of the unit.  This allows a lazily loaded segment
+// to be relocated one unit at a time.
+#define SAVEDSTATE_UNIT_SIZE        65536
+
+// The data of new segments, other than code, is aligned on this boundary in the file.
+// This is at least the page size on all the systems we support so the loader can
+// map the data directly at its original address.
+#define SAVEDSTATE_SEGMENT_ALIGN    65536
 
 typedef struct _relocationEntry
 {
@@ -378,6 +441,253 @@ void SaveStateExport::ScanConstant(PolyObject *base, byte *addr, ScanRelocationK
     relocationCount++;
 }
 
+// The zlib compression level for saved states and modules.  Zero means no compression.
+static int saveCompressionLevel = 0;
+
+#ifdef HAVE_LIBZ
+typedef struct _compressionBlock
+{
+    Bytef       *source;
+    uLong       sourceLength;
+    Bytef       *dest;
+    uLongf      destLength;
+    bool        succeeded;
+} CompressionBlock;
+
+static void compressBlockTask(GCTaskId *, void *arg1, void *)
+{
+    CompressionBlock *block = (CompressionBlock *)arg1;
+    block->succeeded =
+        compress2(block->dest, &block->destLength, block->source, block->sourceLength, saveCompressionLevel) == Z_OK;
+}
+
+static void decompressBlockTask(GCTaskId *, void *arg1, void *)
+{
+    CompressionBlock *block = (CompressionBlock *)arg1;
+    uLongf expected = block->destLength;
+    block->succeeded =
+        uncompress(block->dest, &block->destLength, block->source, block->sourceLength) == Z_OK &&
+            block->destLength == expected;
+}
+#endif
+
+// Write out the data of a segment and set segmentData.  If compression has been
+// requested the data is compressed in blocks, in parallel, and the segment is
+// marked as compressed.  Returns true if the segment was compressed.
+static bool writeSegmentData(FILE *exportFile, void *data, size_t size, SavedStateSegmentDescr *descr)
+{
+#ifdef HAVE_LIBZ
+    if (saveCompressionLevel != 0 && size != 0)
+    {
+        size_t nBlocks = (size + SAVEDSTATE_BLOCK_SIZE - 1) / SAVEDSTATE_BLOCK_SIZE;
+        uLong bound = compressBound(SAVEDSTATE_BLOCK_SIZE);
+        SavedStateBlock *blockTable = new SavedStateBlock[nBlocks];
+        memset(blockTable, 0, nBlocks * sizeof(SavedStateBlock));
+        CompressionBlock batch[SAVEDSTATE_BLOCK_BATCH];
+        Bytef *buffer = new Bytef[bound * SAVEDSTATE_BLOCK_BATCH];
+        bool succeeded = true;
+
+        descr->segmentData = ftell(exportFile);
+        // Write the table now to reserve the space and again when it is complete.
+        fwrite(blockTable, sizeof(SavedStateBlock), nBlocks, exportFile);
+        for (size_t first = 0; first < nBlocks && succeeded; first += SAVEDSTATE_BLOCK_BATCH)
+        {
+            size_t count = nBlocks - first < SAVEDSTATE_BLOCK_BATCH ? nBlocks - first : SAVEDSTATE_BLOCK_BATCH;
+            for (size_t b = 0; b < count; b++)
+            {
+                size_t offset = (first + b) * SAVEDSTATE_BLOCK_SIZE;
+                batch[b].source = (Bytef*)data + offset;
+                batch[b].sourceLength = (uLong)(size - offset < SAVEDSTATE_BLOCK_SIZE ? size - offset : SAVEDSTATE_BLOCK_SIZE);
+                batch[b].dest = buffer + b * bound;
+                batch[b].destLength = bound;
+                gpTaskFarm->AddWorkOrRunNow(&compressBlockTask, &batch[b], 0);
+            }
+            gpTaskFarm->WaitForCompletion();
+            for (size_t b = 0; b < count; b++)
+            {
+                if (! batch[b].succeeded) succeeded = false;
+                blockTable[first + b].blockData = ftell(exportFile);
+                blockTable[first + b].blockSize = batch[b].destLength;
+                fwrite(batch[b].dest, batch[b].destLength, 1, exportFile);
+            }
+        }
+        delete[](buffer);
+        if (succeeded)
+        {
+            off_t endOfData = ftell(exportFile);
+            fseek(exportFile, descr->segmentData, SEEK_SET);
+            fwrite(blockTable, sizeof(SavedStateBlock), nBlocks, exportFile);
+            fseek(exportFile, endOfData, SEEK_SET);
+            delete[](blockTable);
+            descr->segmentFlags |= SSF_COMPRESSED;
+            return true;
+        }
+        // If compression failed write the data uncompressed after what we've written.
+        delete[](blockTable);
+    }
+#endif
+    descr->segmentData = ftell(exportFile);
+    fwrite(data, size, 1, exportFile);
+    return false;
+}
+
+// Whether overwritten mutable segments are saved as patches.
+static bool saveDeltas = false;
+
+// Whether immutable segments mapped from a saved state are only loaded when used.
+static bool lazyLoading = false;
+
+static bool readSegmentBaseline(unsigned segmentIndex, unsigned depth, byte *buffer, size_t size);
+
+// Write the changes to an overwritten segment since the parents were loaded as a set
+// of patches and set segmentData.  Returns false, having written nothing, if the
+// contents when the parents were loaded are not available or if the patches would
+// not be much smaller than the segment.  The whole segment is then written.
+static bool writeSegmentPatches(FILE *exportFile, byte *data, size_t size, unsigned depth, SavedStateSegmentDescr *descr)
+{
+    AutoFree<byte*> baseline((byte*)malloc(size));
+    if ((byte*)baseline == 0 || ! readSegmentBaseline(descr->segmentIndex, depth, baseline, size))
+        return false;
+    std::vector<SavedStatePatch> patches;
+    size_t patchBytes = 0;
+    for (size_t offset = 0; offset < size; offset += SAVEDSTATE_PATCH_UNIT)
+    {
+        size_t length = size - offset < SAVEDSTATE_PATCH_UNIT ? size - offset : SAVEDSTATE_PATCH_UNIT;
+        if (memcmp(data + offset, baseline + offset, length) == 0)
+            continue;
+        if (! patches.empty() && patches.back().patchOffset + patches.back().patchLength == offset)
+            patches.back().patchLength += length;
+        else
+        {
+            SavedStatePatch patch = { offset, length };
+            patches.push_back(patch);
+        }
+        patchBytes += length;
+    }
+    if (patchBytes + patches.size() * sizeof(SavedStatePatch) > size / 2)
+        return false;
+
+    descr->segmentData = ftell(exportFile);
+    descr->segmentFlags |= SSF_PATCH;
+    size_t count = patches.size();
+    fwrite(&count, sizeof(count), 1, exportFile);
+    if (count != 0)
+        fwrite(&patches[0], sizeof(SavedStatePatch), count, exportFile);
+    for (std::vector<SavedStatePatch>::iterator i = patches.begin(); i != patches.end(); i++)
+        fwrite(data + i->patchOffset, i->patchLength, 1, exportFile);
+    if (debugOptions & DEBUG_SAVING)
+        Log("SAVE: Segment %u saved as %" PRI_SIZET " patches with %" PRI_SIZET " bytes out of %" PRI_SIZET "\n",
+            descr->segmentIndex, count, patchBytes, size);
+    return true;
+}
+
+// Write the table of object positions that follows the data of an immutable segment.
+// The entry for each unit is the word offset of the length word of the object that
+// contains the start of the unit.
+static void writeUnitTable(FILE *exportFile, PolyWord *base, size_t size)
+{
+    uintptr_t words = size / sizeof(PolyWord), unitWords = SAVEDSTATE_UNIT_SIZE / sizeof(PolyWord);
+    std::vector<uintptr_t> table((words + unitWords - 1) / unitWords);
+    size_t n = 0;
+    for (PolyWord *p = base; p < base + words; )
+    {
+        PolyObject *obj = (PolyObject*)(p + 1);
+        PolyWord *end = p + 1 + obj->Length();
+        while (n < table.size() && n * unitWords < (uintptr_t)(end - base))
+            table[n++] = p - base;
+        p = end;
+    }
+    if (! table.empty())
+        fwrite(&table[0], sizeof(uintptr_t), table.size(), exportFile);
+}
+
+// The data of a new data segment, and its unit table if it has one, may be followed by
+// a count and then the indexes of the segments that its objects refer to.  When the
+// state is loaded the segment only has to be relocated if one of these has moved.
+class SegmentReferences
+{
+public:
+    SegmentReferences(memoryTableEntry *t, unsigned n): table(t), entries(n), referenced(n, false)
+    {
+        // Sort the segments by address so that each address can be found quickly.
+        for (unsigned i = 0; i < entries; i++)
+            starts.push_back(std::make_pair((uintptr_t)table[i].mtOriginalAddr, i));
+        std::sort(starts.begin(), starts.end());
+    }
+
+    // Record the segment containing the address.  Returns false if there isn't one.
+    bool Mark(PolyObject *addr)
+    {
+        // As with SpaceForAddress subtract 1 to point to the length word.
+        uintptr_t t = (uintptr_t)((PolyWord*)addr - 1);
+        std::vector<std::pair<uintptr_t, unsigned> >::iterator i =
+            std::upper_bound(starts.begin(), starts.end(), std::make_pair(t, entries));
+        if (i == starts.begin())
+            return false;
+        i--;
+        if (t >= i->first + table[i->second].mtLength)
+            return false;
+        referenced[i->second] = true;
+        return true;
+    }
+
+    bool MarkObjects(PolyWord *base, size_t size);
+    void Write(FILE *exportFile);
+
+private:
+    memoryTableEntry *table;
+    unsigned entries;
+    std::vector<bool> referenced;
+    std::vector<std::pair<uintptr_t, unsigned> > starts;
+};
+
+// Record the segments referred to by the objects in a segment.  Returns false if
+// the segment contains code or an address that is not in any segment.
+bool SegmentReferences::MarkObjects(PolyWord *base, size_t size)
+{
+    PolyWord *top = base + size / sizeof(PolyWord);
+    for (PolyWord *p = base; p < top; )
+    {
+        p++;
+        PolyObject *obj = (PolyObject*)p;
+        PolyWord *objEnd = p + obj->Length();
+        if (obj->IsCodeObject())
+            return false;
+        if (! obj->IsByteObject())
+        {
+            PolyWord *w = p;
+            if (obj->IsClosureObject())
+            {
+                // The first word of a closure is the address of the code.
+                if (! Mark(*(PolyObject**)p))
+                    return false;
+                w += sizeof(PolyObject*)/sizeof(PolyWord);
+            }
+            for (; w < objEnd; w++)
+            {
+                if (! w->IsTagged() && ! Mark(w->AsObjPtr()))
+                    return false;
+            }
+        }
+        p = objEnd;
+    }
+    return true;
+}
+
+void SegmentReferences::Write(FILE *exportFile)
+{
+    std::vector<unsigned> indexes;
+    for (unsigned i = 0; i < entries; i++)
+    {
+        if (referenced[i])
+            indexes.push_back((unsigned)table[i].mtIndex);
+    }
+    unsigned count = (unsigned)indexes.size();
+    fwrite(&count, sizeof(count), 1, exportFile);
+    if (count != 0)
+        fwrite(&indexes[0], sizeof(unsigned), count, exportFile);
+}
+
 // Request to the main thread to save data.
 class SaveRequest: public MainThreadRequest
 {
@@ -391,6 +701,9 @@ public:
     unsigned newHierarchy;
     const char *errorMessage;
     int errCode;
+
+private:
+    void WriteState(SaveStateExport &exports);
 };
 
 // This class is used to update references to objects that have moved.  If
@@ -487,9 +800,23 @@ void SaveRequest::Perform()
         }
     }
 
+    // Write to a temporary file and rename it when it is complete.  If we are
+    // replacing a file that has been loaded its data segments may be mapped into
+    // memory so it must not be overwritten.  If saving fails the old file is left.
+    static const TCHAR tempSuffix[] = _T(".tmp");
+    AutoFree<TCHAR*> tempName((TCHAR*)malloc((_tcslen(fileName) + _tcslen(tempSuffix) + 1) * sizeof(TCHAR)));
+    if ((TCHAR*)tempName == 0)
+    {
+        errorMessage = "Insufficient memory";
+        errCode = NOMEMORY;
+        return;
+    }
+    _tcscpy(tempName, fileName);
+    _tcscat(tempName, tempSuffix);
+
     SaveStateExport exports;
     // Open the file.  This could quite reasonably fail if the path is wrong.
-    exports.exportFile = _tfopen(fileName, _T("wb"));
+    exports.exportFile = _tfopen(tempName, _T("wb"));
     if (exports.exportFile == NULL)
     {
         errorMessage = "Cannot open save file";
@@ -499,6 +826,37 @@ void SaveRequest::Perform()
         return;
     }
 
+    WriteState(exports);
+
+    bool writeFailed = ferror(exports.exportFile) != 0;
+    if (fclose(exports.exportFile) != 0)
+        writeFailed = true;
+    exports.exportFile = NULL;
+    if (errorMessage == 0 && writeFailed)
+    {
+        errorMessage = "Cannot write save file";
+        errCode = ERRORNUMBER;
+    }
+#if (defined(_WIN32))
+    if (errorMessage == 0 && ! MoveFileEx(tempName, fileName, MOVEFILE_REPLACE_EXISTING))
+    {
+        errorMessage = "Cannot rename save file";
+        errCode = GetLastError();
+    }
+#else
+    if (errorMessage == 0 && rename(tempName, fileName) != 0)
+    {
+        errorMessage = "Cannot rename save file";
+        errCode = ERRORNUMBER;
+    }
+#endif
+    if (errorMessage != 0)
+        (void)_tremove(tempName);
+}
+
+// Write the saved state to the open file.  Sets errorMessage if it fails.
+void SaveRequest::WriteState(SaveStateExport &exports)
+{
     // Scan over the permanent mutable area copying all reachable data that is
     // not in a lower hierarchy into new permanent segments.
     CopyScan copyScan(newHierarchy);
@@ -516,6 +874,7 @@ void SaveRequest::Perform()
                 copyScan.ScanAddressesInRegion(space->bottom, space->top);
             }
         }
+        copyScan.ScanQueuedObjects();
     }
     catch (MemoryException &)
     {
@@ -723,9 +1082,34 @@ void SaveRequest::Perform()
                 p += length;
             }
             descrs[k].relocationCount = exports.relocationCount;
-            // Write out the data.
-            descrs[k].segmentData = ftell(exports.exportFile);
-            fwrite(entry->mtOriginalAddr, entry->mtLength, 1, exports.exportFile);
+            // Align the data of new data segments so that the loader can map it
+            // directly rather than reading it.
+            if (k >= permanentEntries && (entry->mtFlags & MTF_EXECUTABLE) == 0 && saveCompressionLevel == 0)
+            {
+                while (ftell(exports.exportFile) % SAVEDSTATE_SEGMENT_ALIGN != 0)
+                    fputc(0, exports.exportFile);
+            }
+            // Write out the data.  An overwritten segment may only need the changes.
+            if ((descrs[k].segmentFlags & SSF_OVERWRITE) && saveDeltas && newHierarchy > 1 &&
+                    writeSegmentPatches(exports.exportFile, (byte*)entry->mtOriginalAddr, entry->mtLength, newHierarchy-1, &descrs[k]))
+                saveHeader.headerVersion = SAVEDSTATEEXTENDEDVERSION;
+            else if (writeSegmentData(exports.exportFile, entry->mtOriginalAddr, entry->mtLength, &descrs[k]))
+                saveHeader.headerVersion = SAVEDSTATEEXTENDEDVERSION;
+            else if (k >= permanentEntries && (entry->mtFlags & MTF_EXECUTABLE) == 0)
+            {
+                if ((entry->mtFlags & MTF_WRITEABLE) == 0)
+                {
+                    // This may be loaded lazily.
+                    writeUnitTable(exports.exportFile, (PolyWord*)entry->mtOriginalAddr, entry->mtLength);
+                    descrs[k].segmentFlags |= SSF_UNITTABLE;
+                }
+                SegmentReferences references(exports.memTable, exports.memTableEntries);
+                if (references.MarkObjects((PolyWord*)entry->mtOriginalAddr, entry->mtLength))
+                {
+                    references.Write(exports.exportFile);
+                    descrs[k].segmentFlags |= SSF_REFERENCES;
+                }
+            }
        }
     }
 
@@ -877,49 +1261,14 @@ void ClearVolatile::ScanAddressesInObject(PolyObject *base, POLYUNSIGNED lengthW
     }
 }
 
-// This is copied from the B-tree in MemMgr.  It probably should be
-// merged but will do for the moment.  It's intended to reduce the
-// cost of finding the segment for relocation.
-
-class SpaceBTree
-{
-public:
-    SpaceBTree(bool is, unsigned i = 0) : isLeaf(is), index(i) { }
-    virtual ~SpaceBTree() {}
-
-    bool isLeaf;
-    unsigned index; // The index if this is a leaf
-};
-
-// A non-leaf node in the B-tree
-class SpaceBTreeTree : public SpaceBTree
-{
-public:
-    SpaceBTreeTree();
-    virtual ~SpaceBTreeTree();
-
-    SpaceBTree *tree[256];
-};
-
-SpaceBTreeTree::SpaceBTreeTree() : SpaceBTree(false)
-{
-    for (unsigned i = 0; i < 256; i++)
-        tree[i] = 0;
-}
-
-SpaceBTreeTree::~SpaceBTreeTree()
-{
-    for (unsigned i = 0; i < 256; i++)
-        delete(tree[i]);
-}
-
-
 // This class is used to relocate addresses in areas that have been loaded.
+// Once the segments have been placed the relocation can be done by several
+// threads in parallel.
 class LoadRelocate: public ScanAddress
 {
 public:
     LoadRelocate(bool pcc = false): processCodeConstants(pcc), originalBaseAddr(0), descrs(0),
-        targetAddresses(0), nDescrs(0), spaceTree(0) {}
+        targetAddresses(0), nDescrs(0), relativeOffset(0) {}
     ~LoadRelocate();
 
     void RelocateObject(PolyObject *p);
@@ -927,100 +1276,219 @@ public:
     virtual void ScanConstant(PolyObject *base, byte *addressOfConstant, ScanRelocationKind code, intptr_t displacement);
     void RelocateAddressAt(PolyWord *pt);
     PolyObject *RelocateAddress(PolyObject *obj);
-    void AddTreeRange(SpaceBTree **t, unsigned index, uintptr_t startS, uintptr_t endS);
+    // Build the table used by RelocateAddress.  Must be called after
+    // the target addresses have been set.
+    void SetRanges();
+
+    // Relocate all the objects in a region using the GC task farm.  The region is
+    // split into chunks at object boundaries.  Call RelocateChunks to process them.
+    void AddRelocationRegion(PolyWord *bottom, PolyWord *top);
+    void RelocateChunks();
+    // Relocate only the words in a region that are within the patches.
+    void RelocatePatches(PolyWord *bottom, PolyWord *top, const std::vector<SavedStatePatch> &patches);
+    // Copy the relocation table for use after the file has been loaded.
+    void CopyRanges(const LoadRelocate &r) { ranges = r.ranges; originalBaseAddr = r.originalBaseAddr; }
+
+    // Apply a table of explicit relocations to a segment.  These are also split into chunks.
+    void AddRelocationEntries(PolyWord *baseAddr, RelocationEntry *entries, unsigned count);
 
     bool processCodeConstants;
     PolyWord *originalBaseAddr;
     SavedStateSegmentDescr *descrs;
     PolyWord **targetAddresses;
     unsigned nDescrs;
-    SpaceBTree *spaceTree;
     intptr_t relativeOffset;
+
+private:
+    // The original address range of a segment and the displacement to its new position.
+    struct RelocationRange {
+        uintptr_t start, end; // Start and end (exclusive) of the original address range
+        intptr_t displacement; // Added to an original address to get the new address.
+        bool operator < (const RelocationRange &r) const { return start < r.start; }
+    };
+    std::vector<RelocationRange> ranges;
+
+    // A chunk of work.  Either a range of objects or a group of relocation entries.
+    struct RelocationChunk {
+        PolyWord *start, *end;
+        RelocationEntry *entries;
+        unsigned entryCount;
+    };
+    std::vector<RelocationChunk> chunks;
+    std::vector<RelocationEntry*> entryTables;
+
+    static void relocateChunkTask(GCTaskId *, void *arg1, void *arg2);
 };
 
+// The size in words of a chunk of objects to relocate and the number of
+// relocation entries in a chunk.  Large enough that the overhead of the
+// task farm is small.
+#define RELOCATION_CHUNK_WORDS      (64*1024)
+#define RELOCATION_CHUNK_ENTRIES    (16*1024)
+
 LoadRelocate::~LoadRelocate()
 {
     if (descrs) delete[](descrs);
     if (targetAddresses) delete[](targetAddresses);
-    delete(spaceTree);
+    for (std::vector<RelocationEntry*>::iterator i = entryTables.begin(); i != entryTables.end(); i++)
+        delete[](*i);
 }
 
-// Add an entry to the space B-tree.
-void LoadRelocate::AddTreeRange(SpaceBTree **tt, unsigned index, uintptr_t startS, uintptr_t endS)
+void LoadRelocate::SetRanges()
 {
-    if (*tt == 0)
-        *tt = new SpaceBTreeTree;
-    ASSERT(!(*tt)->isLeaf);
-    SpaceBTreeTree *t = (SpaceBTreeTree*)*tt;
-
-    const unsigned shift = (sizeof(void*) - 1) * 8; // Takes the high-order byte
-    uintptr_t r = startS >> shift;
-    ASSERT(r < 256);
-    const uintptr_t s = endS == 0 ? 256 : endS >> shift;
-    ASSERT(s >= r && s <= 256);
+    ranges.clear();
+    for (unsigned i = 0; i < nDescrs; i++)
+    {
+        SavedStateSegmentDescr *descr = &descrs[i];
+        RelocationRange range;
+        range.start = (uintptr_t)descr->originalAddress;
+        range.end = range.start + descr->segmentSize;
+        PolyWord *newAddress = targetAddresses[descr->segmentIndex];
+        ASSERT(newAddress != 0);
+        range.displacement = (byte*)newAddress - (byte*)descr->originalAddress;
+        ranges.push_back(range);
+    }
+    std::sort(ranges.begin(), ranges.end());
+}
 
-    if (r == s) // Wholly within this entry
-        AddTreeRange(&(t->tree[r]), index, startS << 8, endS << 8);
-    else
+// Update the addresses in a group of words.
+void LoadRelocate::RelocateAddressAt(PolyWord *pt)
+{
+    PolyWord val = *pt;
+    if (! val.IsTagged())
     {
-        // Deal with any remainder at the start.
-        if ((r << shift) != startS)
+        PolyWord newVal = RelocateAddress(val.AsObjPtr(originalBaseAddr));
+        // Only write if the address has changed.  That leaves mapped pages shared with the file.
+        // The words may be in a buffer rather than a space if we are saving patches.
+        if (newVal != val)
         {
-            AddTreeRange(&(t->tree[r]), index, startS << 8, 0 /*End of range*/);
-            r++;
+            MemSpace *space = gMem.SpaceForAddress(pt);
+            if (space == 0) *pt = newVal; else *space->writeAble(pt) = newVal;
         }
-        // Whole entries.
-        while (r < s)
+    }
+}
+
+PolyObject *LoadRelocate::RelocateAddress(PolyObject *obj)
+{
+    // Which segment is this address in?  Find the last range starting at or before it.
+    // N.B. As with SpaceForAddress we need to subtract 1 to point to the length word.
+    uintptr_t t = (uintptr_t)((PolyWord*)obj - 1);
+    size_t lower = 0, upper = ranges.size();
+    while (upper - lower > 1)
+    {
+        size_t middle = (lower + upper) / 2;
+        if (ranges[middle].start <= t) lower = middle; else upper = middle;
+    }
+    ASSERT(lower < ranges.size() && t >= ranges[lower].start && t < ranges[lower].end);
+    return (PolyObject*)((byte*)obj + ranges[lower].displacement);
+}
+
+void LoadRelocate::AddRelocationRegion(PolyWord *bottom, PolyWord *top)
+{
+    PolyWord *chunkStart = bottom;
+    for (PolyWord *p = bottom; p < top; )
+    {
+        p++;
+        PolyObject *obj = (PolyObject*)p;
+        p += obj->Length();
+        if (p - chunkStart >= RELOCATION_CHUNK_WORDS || p >= top)
         {
-            ASSERT(t->tree[r] == 0);
-            t->tree[r] = new SpaceBTree(true, index);
-            r++;
+            RelocationChunk chunk = { chunkStart, p, 0, 0 };
+            chunks.push_back(chunk);
+            chunkStart = p;
         }
-        // Remainder at the end.
-        if ((s << shift) != endS)
-            AddTreeRange(&(t->tree[r]), index, 0, endS << 8);
     }
 }
 
+void LoadRelocate::AddRelocationEntries(PolyWord *baseAddr, RelocationEntry *entries, unsigned count)
+{
+    // We take ownership of the table.
+    entryTables.push_back(entries);
+    for (unsigned i = 0; i < count; i += RELOCATION_CHUNK_ENTRIES)
+    {
+        unsigned n = count - i < RELOCATION_CHUNK_ENTRIES ? count - i : RELOCATION_CHUNK_ENTRIES;
+        RelocationChunk chunk = { baseAddr, 0, entries + i, n };
+        chunks.push_back(chunk);
+    }
+}
 
-// Update the addresses in a group of words.
-void LoadRelocate::RelocateAddressAt(PolyWord *pt)
+void LoadRelocate::relocateChunkTask(GCTaskId *, void *arg1, void *arg2)
 {
-    PolyWord val = *pt;
-    if (! val.IsTagged())
-        *gMem.SpaceForAddress(pt)->writeAble(pt) = RelocateAddress(val.AsObjPtr(originalBaseAddr));
+    LoadRelocate *relocate = (LoadRelocate *)arg1;
+    RelocationChunk *chunk = (RelocationChunk *)arg2;
+    if (chunk->entries == 0)
+    {
+        for (PolyWord *p = chunk->start; p < chunk->end; )
+        {
+            p++;
+            PolyObject *obj = (PolyObject*)p;
+            POLYUNSIGNED length = obj->Length();
+            relocate->RelocateObject(obj);
+            p += length;
+        }
+    }
+    else
+    {
+        for (unsigned k = 0; k < chunk->entryCount; k++)
+        {
+            RelocationEntry *reloc = &chunk->entries[k];
+            byte *setAddress = (byte*)chunk->start + reloc->relocAddress;
+            byte *targetAddress = (byte*)relocate->targetAddresses[reloc->targetSegment] + reloc->targetAddress;
+            ScanAddress::SetConstantValue(setAddress, (PolyObject*)(targetAddress), reloc->relKind);
+        }
+    }
 }
 
-PolyObject *LoadRelocate::RelocateAddress(PolyObject *obj)
+void LoadRelocate::RelocatePatches(PolyWord *bottom, PolyWord *top, const std::vector<SavedStatePatch> &patches)
 {
-    // Which segment is this address in?
-    // N.B. As with SpaceForAddress we need to subtract 1 to point to the length word.
-    uintptr_t t = (uintptr_t)((PolyWord*)obj - 1);
-    SpaceBTree *tr = spaceTree;
-
-    // Each level of the tree is either a leaf or a vector of trees.
-    unsigned j = sizeof(void *) * 8;
-    for (;;)
-    {
-        if (tr == 0) break;
-        if (tr->isLeaf) {
-            // It's in this segment: relocate it to the current position.
-            unsigned i = tr->index;
-            SavedStateSegmentDescr *descr = &descrs[i];
-            PolyWord *newAddress = targetAddresses[descr->segmentIndex];
-            ASSERT((char*)obj > descr->originalAddress &&
-                (char*)obj <= (char*)descr->originalAddress + descr->segmentSize);
-            ASSERT(newAddress != 0);
-            byte *setAddress = (byte*)newAddress + ((char*)obj - (char*)descr->originalAddress);
-            return (PolyObject*)setAddress;
+    std::vector<SavedStatePatch>::const_iterator patch = patches.begin();
+    for (PolyWord *p = bottom; p < top && patch != patches.end(); )
+    {
+        p++;
+        PolyObject *obj = (PolyObject*)p;
+        PolyWord *objEnd = p + obj->Length();
+        // Skip patches that finish before this object.
+        while (patch != patches.end() && (byte*)bottom + patch->patchOffset + patch->patchLength <= (byte*)p)
+            patch++;
+        // Overwritten segments contain only data so there is no code to deal with.
+        if (! obj->IsByteObject() && ! obj->IsCodeObject())
+        {
+            // An object may be covered by several patches.
+            for (std::vector<SavedStatePatch>::const_iterator q = patch; q != patches.end(); q++)
+            {
+                PolyWord *start = (PolyWord*)((byte*)bottom + q->patchOffset);
+                PolyWord *end = (PolyWord*)((byte*)start + q->patchLength);
+                if (start >= objEnd) break;
+                if (start < p) start = p;
+                if (end > objEnd) end = objEnd;
+                for (PolyWord *w = start; w < end; w++)
+                {
+                    if (obj->IsClosureObject() && w < p + sizeof(PolyObject*)/sizeof(PolyWord))
+                    {
+                        // The first word of a closure is the address of the code.
+                        if (w == p)
+                        {
+                            PolyObject *newCode = RelocateAddress(*(PolyObject**)p);
+                            if (newCode != *(PolyObject**)p)
+                                *(PolyObject**)p = newCode;
+                        }
+                    }
+                    else RelocateAddressAt(w);
+                }
+            }
         }
-        j -= 8;
-        tr = ((SpaceBTreeTree*)tr)->tree[(t >> j) & 0xff];
+        p = objEnd;
     }
+}
 
-    // This should never happen.
-    ASSERT(0);
-    return 0;
+void LoadRelocate::RelocateChunks()
+{
+    if (debugOptions & DEBUG_SAVING)
+        Log("SAVE: Relocating %" PRI_SIZET " chunks with %u threads.\n", chunks.size(), gpTaskFarm->ThreadCount());
+    for (std::vector<RelocationChunk>::iterator i = chunks.begin(); i != chunks.end(); i++)
+        gpTaskFarm->AddWorkOrRunNow(&relocateChunkTask, this, &(*i));
+    gpTaskFarm->WaitForCompletion();
+    chunks.clear();
 }
 
 // This is based on Exporter::relocateObject but does the reverse.
@@ -1051,7 +1519,9 @@ void LoadRelocate::RelocateObject(PolyObject *p)
     {
         // The first word is the address of the code.
         POLYUNSIGNED length = p->Length();
-        *(PolyObject**)p = RelocateAddress(*(PolyObject**)p);
+        PolyObject *newCode = RelocateAddress(*(PolyObject**)p);
+        if (newCode != *(PolyObject**)p)
+            *(PolyObject**)p = newCode;
         for (POLYUNSIGNED i = sizeof(PolyObject*)/sizeof(PolyWord); i < length; i++)
             RelocateAddressAt(p->Offset(i));
     }
@@ -1099,6 +1569,260 @@ static size_t readData(void *ptr, size_t size, FILE *stream)
 #endif
 }
 
+// The number of page faults, minor and major, in this process so far.  Used to report
+// how much of a mapped file has actually been touched while loading.  The kernel
+// may map several pages of a file on each fault so this is only a guide.
+static uintptr_t pageFaultCount()
+{
+#if defined(HAVE_SYS_RESOURCE_H) && !defined(_WIN32)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        return usage.ru_minflt + usage.ru_majflt;
+#endif
+    return 0;
+}
+
+// Read the data for a segment, decompressing it if necessary.
+// Compressed blocks are decompressed in parallel directly into the destination.
+static bool readSegmentData(void *dest, SavedStateSegmentDescr *descr, FILE *loadFile)
+{
+    if (fseek(loadFile, descr->segmentData, SEEK_SET) != 0)
+        return false;
+    if ((descr->segmentFlags & SSF_COMPRESSED) == 0)
+        return readData(dest, descr->segmentSize, loadFile) == 1;
+#ifdef HAVE_LIBZ
+    size_t nBlocks = (descr->segmentSize + SAVEDSTATE_BLOCK_SIZE - 1) / SAVEDSTATE_BLOCK_SIZE;
+    AutoFree<SavedStateBlock*> blockTable((SavedStateBlock*)malloc(nBlocks * sizeof(SavedStateBlock)));
+    if ((SavedStateBlock*)blockTable == 0 ||
+        fread(blockTable, sizeof(SavedStateBlock), nBlocks, loadFile) != nBlocks)
+        return false;
+    CompressionBlock batch[SAVEDSTATE_BLOCK_BATCH];
+    for (size_t first = 0; first < nBlocks; first += SAVEDSTATE_BLOCK_BATCH)
+    {
+        size_t count = nBlocks - first < SAVEDSTATE_BLOCK_BATCH ? nBlocks - first : SAVEDSTATE_BLOCK_BATCH;
+        // Read the compressed data for this batch.  It is contiguous in the file.
+        size_t batchBytes = 0;
+        for (size_t b = 0; b < count; b++)
+        {
+            if (blockTable[first + b].blockData != blockTable[first].blockData + (off_t)batchBytes)
+                return false;
+            batchBytes += blockTable[first + b].blockSize;
+        }
+        AutoFree<Bytef*> buffer((Bytef*)malloc(batchBytes));
+        if ((Bytef*)buffer == 0 || fseek(loadFile, blockTable[first].blockData, SEEK_SET) != 0 ||
+            fread(buffer, batchBytes, 1, loadFile) != 1)
+            return false;
+        Bytef *source = buffer;
+        for (size_t b = 0; b < count; b++)
+        {
+            size_t offset = (first + b) * SAVEDSTATE_BLOCK_SIZE;
+            batch[b].source = source;
+            batch[b].sourceLength = (uLong)blockTable[first + b].blockSize;
+            source += blockTable[first + b].blockSize;
+            batch[b].dest = (Bytef*)dest + offset;
+            batch[b].destLength =
+                (uLongf)(descr->segmentSize - offset < SAVEDSTATE_BLOCK_SIZE ? descr->segmentSize - offset : SAVEDSTATE_BLOCK_SIZE);
+            gpTaskFarm->AddWorkOrRunNow(&decompressBlockTask, &batch[b], 0);
+        }
+        gpTaskFarm->WaitForCompletion();
+        for (size_t b = 0; b < count; b++)
+        {
+            if (! batch[b].succeeded)
+                return false;
+        }
+    }
+    return true;
+#else
+    return false; // Compression is not supported.
+#endif
+}
+
+#ifndef _WIN32
+// Loads the units of lazily loaded segments that are not at their original addresses.
+// The file is kept open.  Each unit is read and relocated separately using the
+// table of object positions that follows the segment data.
+class LazyStateLoader: public LazySpaceLoader
+{
+public:
+    LazyStateLoader(int f): fd(f) {}
+    ~LazyStateLoader() { close(fd); }
+
+    bool AddSegment(PermanentMemSpace *space, SavedStateSegmentDescr *descr, FILE *loadFile);
+    virtual bool ReadUnit(PermanentMemSpace *space, uintptr_t unitNo, PolyWord *buffer, size_t bytes);
+
+    LoadRelocate relocate;
+
+private:
+    struct LazySegment {
+        PermanentMemSpace *space;
+        off_t dataOffset;
+        std::vector<uintptr_t> unitStarts;
+    };
+    std::vector<LazySegment> segments;
+    int fd;
+};
+
+bool LazyStateLoader::AddSegment(PermanentMemSpace *space, SavedStateSegmentDescr *descr, FILE *loadFile)
+{
+    LazySegment seg;
+    seg.space = space;
+    seg.dataOffset = descr->segmentData;
+    size_t units = (descr->segmentSize + SAVEDSTATE_UNIT_SIZE - 1) / SAVEDSTATE_UNIT_SIZE;
+    seg.unitStarts.resize(units);
+    if (fseek(loadFile, descr->segmentData + descr->segmentSize, SEEK_SET) != 0 ||
+        fread(&seg.unitStarts[0], sizeof(uintptr_t), units, loadFile) != units)
+        return false;
+    for (size_t n = 0; n < units; n++)
+    {
+        if (seg.unitStarts[n] > n * (SAVEDSTATE_UNIT_SIZE / sizeof(PolyWord)))
+            return false;
+    }
+    segments.push_back(seg);
+    return true;
+}
+
+bool LazyStateLoader::ReadUnit(PermanentMemSpace *space, uintptr_t unitNo, PolyWord *buffer, size_t bytes)
+{
+    LazySegment *seg = 0;
+    for (std::vector<LazySegment>::iterator i = segments.begin(); i != segments.end(); i++)
+    {
+        if (i->space == space) seg = &(*i);
+    }
+    if (seg == 0 || unitNo >= seg->unitStarts.size())
+        return false;
+    size_t unitOffset = unitNo * SAVEDSTATE_UNIT_SIZE;
+    if (pread(fd, buffer, bytes, seg->dataOffset + unitOffset) != (ssize_t)bytes)
+        return false;
+    PolyWord *unitStart = (PolyWord*)((byte*)space->bottom + unitOffset);
+    PolyWord *unitEnd = unitStart + bytes / sizeof(PolyWord);
+    // Start with the object that contains the start of the unit.  Its length word
+    // may be in an earlier unit in which case it is read from the file.
+    for (PolyWord *p = space->bottom + seg->unitStarts[unitNo]; p < unitEnd; )
+    {
+        POLYUNSIGNED lengthWord;
+        if (p >= unitStart)
+            lengthWord = buffer[p - unitStart].AsUnsigned();
+        else if (pread(fd, &lengthWord, sizeof(lengthWord),
+                       seg->dataOffset + (p - space->bottom) * sizeof(PolyWord)) != sizeof(lengthWord))
+            return false;
+        PolyWord *obj = p + 1, *objEnd = obj + OBJ_OBJECT_LENGTH(lengthWord);
+        // Immutable data segments do not contain code.
+        if (! OBJ_IS_BYTE_OBJECT(lengthWord) && ! OBJ_IS_CODE_OBJECT(lengthWord))
+        {
+            PolyWord *start = obj < unitStart ? unitStart : obj;
+            PolyWord *end = objEnd > unitEnd ? unitEnd : objEnd;
+            for (PolyWord *w = start; w < end; w++)
+            {
+                PolyWord *pt = buffer + (w - unitStart);
+                if (OBJ_IS_CLOSURE_OBJECT(lengthWord) && w < obj + sizeof(PolyObject*)/sizeof(PolyWord))
+                {
+                    // The first word of a closure is the address of the code.
+                    if (w == obj)
+                        *(PolyObject**)pt = relocate.RelocateAddress(*(PolyObject**)pt);
+                }
+                else relocate.RelocateAddressAt(pt);
+            }
+        }
+        p = objEnd;
+    }
+    return true;
+}
+#endif
+
+// Read the patches for a segment and apply them.  The patches are returned so
+// that the patched words can be relocated.
+static bool readSegmentPatches(PolyWord *dest, SavedStateSegmentDescr *descr, FILE *loadFile,
+                               std::vector<SavedStatePatch> &patches)
+{
+    size_t count;
+    if (fseek(loadFile, descr->segmentData, SEEK_SET) != 0 ||
+        fread(&count, sizeof(count), 1, loadFile) != 1 ||
+        count > descr->segmentSize / SAVEDSTATE_PATCH_UNIT + 1)
+        return false;
+    patches.resize(count);
+    if (count != 0 && fread(&patches[0], sizeof(SavedStatePatch), count, loadFile) != count)
+        return false;
+    for (std::vector<SavedStatePatch>::iterator i = patches.begin(); i != patches.end(); i++)
+    {
+        if (i->patchOffset % sizeof(PolyWord) != 0 || i->patchOffset > descr->segmentSize ||
+            i->patchLength > descr->segmentSize - i->patchOffset ||
+            fread((byte*)dest + i->patchOffset, i->patchLength, 1, loadFile) != 1)
+            return false;
+    }
+    return true;
+}
+
+// Reconstruct the contents of an overwritable segment as they were after the saved states
+// in the hierarchy up to "depth" were loaded, relocated to the current addresses.
+// This is compared with the current contents when saving the segment as patches.
+static bool readSegmentBaseline(unsigned segmentIndex, unsigned depth, byte *buffer, size_t size)
+{
+    bool haveData = false;
+    for (unsigned h = 0; h < depth; h++)
+    {
+        AutoClose loadFile(_tfopen(hierarchyTable[h]->fileName, _T("rb")));
+        if ((FILE*)loadFile == NULL)
+            return false;
+        SavedStateHeader header;
+        // If the file has changed since it was loaded we can't use it.
+        if (fread(&header, sizeof(SavedStateHeader), 1, loadFile) != 1 ||
+            strncmp(header.headerSignature, SAVEDSTATESIGNATURE, sizeof(header.headerSignature)) != 0 ||
+            (header.headerVersion != SAVEDSTATEVERSION && header.headerVersion != SAVEDSTATEEXTENDEDVERSION) ||
+            header.headerLength != sizeof(SavedStateHeader) ||
+            header.segmentDescrLength != sizeof(SavedStateSegmentDescr) ||
+            header.timeStamp != hierarchyTable[h]->timeStamp)
+            return false;
+        LoadRelocate relocate;
+        relocate.nDescrs = header.segmentDescrCount;
+        relocate.descrs = new SavedStateSegmentDescr[relocate.nDescrs];
+        relocate.originalBaseAddr = (PolyWord*)header.originalBaseAddr;
+        if (fseek(loadFile, header.segmentDescr, SEEK_SET) != 0 ||
+            fread(relocate.descrs, sizeof(SavedStateSegmentDescr), relocate.nDescrs, loadFile) != relocate.nDescrs)
+            return false;
+        SavedStateSegmentDescr *descr = 0;
+        unsigned maxIndex = 0;
+        for (unsigned i = 0; i < relocate.nDescrs; i++)
+        {
+            if (relocate.descrs[i].segmentIndex > maxIndex)
+                maxIndex = relocate.descrs[i].segmentIndex;
+            if (relocate.descrs[i].segmentIndex == segmentIndex && relocate.descrs[i].segmentData != 0)
+                descr = &relocate.descrs[i];
+        }
+        if (descr == 0)
+            continue; // Not in this file.
+        if (descr->segmentSize != size)
+            return false;
+        // The segments in this file are now at their current addresses.
+        relocate.targetAddresses = new PolyWord*[maxIndex+1];
+        for (unsigned i = 0; i <= maxIndex; i++) relocate.targetAddresses[i] = 0;
+        for (unsigned i = 0; i < relocate.nDescrs; i++)
+        {
+            MemSpace *space = gMem.SpaceForIndex(relocate.descrs[i].segmentIndex);
+            if (space == 0)
+                return false;
+            relocate.targetAddresses[relocate.descrs[i].segmentIndex] = space->bottom;
+        }
+        relocate.SetRanges();
+
+        if (descr->segmentFlags & SSF_PATCH)
+        {
+            std::vector<SavedStatePatch> patches;
+            if (! haveData || ! readSegmentPatches((PolyWord*)buffer, descr, loadFile, patches))
+                return false;
+            relocate.RelocatePatches((PolyWord*)buffer, (PolyWord*)(buffer + size), patches);
+        }
+        else
+        {
+            if (! readSegmentData(buffer, descr, loadFile))
+                return false;
+            relocate.AddRelocationRegion((PolyWord*)buffer, (PolyWord*)(buffer + size));
+            relocate.RelocateChunks();
+        }
+        haveData = true;
+    }
+    return haveData;
+}
+
 // Load a saved state file.  Calls itself to handle parent files.
 bool StateLoader::LoadFile(bool isInitial, time_t requiredStamp, PolyWord tail)
 {
@@ -1125,7 +1849,7 @@ bool StateLoader::LoadFile(bool isInitial, time_t requiredStamp, PolyWord tail)
         errorResult = "File is not a saved state";
         return false;
     }
-    if (header.headerVersion != SAVEDSTATEVERSION ||
+    if ((header.headerVersion != SAVEDSTATEVERSION && header.headerVersion != SAVEDSTATEEXTENDEDVERSION) ||
         header.headerLength != sizeof(SavedStateHeader) ||
         header.segmentDescrLength != sizeof(SavedStateSegmentDescr))
     {
@@ -1237,18 +1961,30 @@ bool StateLoader::LoadFile(bool isInitial, time_t requiredStamp, PolyWord tail)
         errorResult = "Unable to read segment descriptors";
         return false;
     }
+#ifndef HAVE_LIBZ
+    for (unsigned i = 0; i < relocate.nDescrs; i++)
     {
-        unsigned maxIndex = 0;
-        for (unsigned i = 0; i < relocate.nDescrs; i++)
+        if (relocate.descrs[i].segmentFlags & SSF_COMPRESSED)
         {
-            if (relocate.descrs[i].segmentIndex > maxIndex)
-                maxIndex = relocate.descrs[i].segmentIndex;
-            relocate.AddTreeRange(&relocate.spaceTree, i, (uintptr_t)relocate.descrs[i].originalAddress,
-                (uintptr_t)((char*)relocate.descrs[i].originalAddress + relocate.descrs[i].segmentSize-1));
+            errorResult = "Saved state is compressed but compression is not supported";
+            return false;
         }
-        relocate.targetAddresses = new PolyWord*[maxIndex+1];
-        for (unsigned i = 0; i <= maxIndex; i++) relocate.targetAddresses[i] = 0;
     }
+#endif
+    unsigned maxSegmentIndex = 0;
+    for (unsigned i = 0; i < relocate.nDescrs; i++)
+    {
+        if (relocate.descrs[i].segmentIndex > maxSegmentIndex)
+            maxSegmentIndex = relocate.descrs[i].segmentIndex;
+    }
+    relocate.targetAddresses = new PolyWord*[maxSegmentIndex+1];
+    for (unsigned i = 0; i <= maxSegmentIndex; i++) relocate.targetAddresses[i] = 0;
+
+    // Loading time and page faults are measured for this file not including the parents.
+    TIMEDATA startTime = GetRealTime();
+    uintptr_t startFaults = pageFaultCount();
+    uintptr_t bytesMapped = 0, bytesRead = 0, bytesLazy = 0;
+    std::vector<unsigned> mappedSegments;
 
     // Read in and create the new segments first.  If we have problems,
     // in particular if we have run out of memory, then it's easier to recover.  
@@ -1280,30 +2016,45 @@ bool StateLoader::LoadFile(bool isInitial, time_t requiredStamp, PolyWord tail)
                 (descr->segmentFlags & SSF_NOOVERWRITE ? MTF_NO_OVERWRITE : 0) |
                 (descr->segmentFlags & SSF_BYTES ? MTF_BYTES : 0) |
                 (descr->segmentFlags & SSF_CODE ? MTF_EXECUTABLE : 0);
-            PermanentMemSpace *newSpace =
-                gMem.AllocateNewPermanentSpace(descr->segmentSize, mFlags, descr->segmentIndex, hierarchyDepth + 1);
-            if (newSpace == 0)
+            PermanentMemSpace *newSpace = 0;
+#ifndef _WIN32
+            // If the original address is free map the data directly from the file.
+            // Pages are only read in when they are used and, unless they are
+            // written to, are shared with the file.
+            if (descr->segmentData % SAVEDSTATE_SEGMENT_ALIGN == 0 && (descr->segmentFlags & SSF_COMPRESSED) == 0)
             {
-                errorResult = "Unable to allocate memory";
-                return false;
-            }
-
-            PolyWord *mem  = newSpace->bottom;
-            PolyWord* writeAble = newSpace->writeAble(mem);
-            if (fseek(loadFile, descr->segmentData, SEEK_SET) != 0)
-            {
-                errorResult = "Unable to seek segment";
-                return false;
+                newSpace = gMem.MapPermanentSpace(fileno(loadFile), descr->segmentData, descr->segmentSize,
+                    descr->originalAddress, mFlags, descr->segmentIndex, hierarchyDepth + 1);
+                if (newSpace != 0)
+                {
+                    bytesMapped += descr->segmentSize;
+                    mappedSegments.push_back(i);
+                }
             }
-            if (readData(writeAble, descr->segmentSize, loadFile) != 1)
+#endif
+            if (newSpace == 0)
             {
-                errorResult = "Unable to read segment";
-                return false;
+                newSpace =
+                    gMem.AllocateNewPermanentSpace(descr->segmentSize, mFlags, descr->segmentIndex, hierarchyDepth + 1);
+                if (newSpace == 0)
+                {
+                    errorResult = "Unable to allocate memory";
+                    return false;
+                }
+
+                PolyWord* writeAble = newSpace->writeAble(newSpace->bottom);
+                if (! readSegmentData(writeAble, descr, loadFile))
+                {
+                    errorResult = "Unable to read segment";
+                    return false;
+                }
+                bytesRead += descr->segmentSize;
+                // Fill unused space to the top of the area.
+                gMem.FillUnusedSpace(writeAble +descr->segmentSize/sizeof(PolyWord),
+                    newSpace->spaceSize() - descr->segmentSize/sizeof(PolyWord));
+                // Leave it writable until we've done the relocations.
             }
-            // Fill unused space to the top of the area.
-            gMem.FillUnusedSpace(writeAble +descr->segmentSize/sizeof(PolyWord),
-                newSpace->spaceSize() - descr->segmentSize/sizeof(PolyWord));
-            // Leave it writable until we've done the relocations.
+            PolyWord *mem  = newSpace->bottom;
 
             relocate.targetAddresses[descr->segmentIndex] = mem;
             if (newSpace->noOverwrite)
@@ -1314,41 +2065,153 @@ bool StateLoader::LoadFile(bool isInitial, time_t requiredStamp, PolyWord tail)
         }
     }
 
-    // Now read in the mutable overwrites and relocate.
+    // If every segment, including those in the parents, is at its original address
+    // the addresses in the new segments are already correct.
+    bool allInPlace = true;
+#ifdef POLYML32IN64
+    bool baseMoved = relocate.originalBaseAddr != globalHeapBase;
+    if (baseMoved) allInPlace = false;
+#else
+    bool baseMoved = false;
+#endif
+    std::vector<bool> segmentMoved(maxSegmentIndex+1, false);
+    for (unsigned i = 0; i < relocate.nDescrs; i++)
+    {
+        SavedStateSegmentDescr *descr = &relocate.descrs[i];
+        if (relocate.targetAddresses[descr->segmentIndex] != (PolyWord*)descr->originalAddress)
+        {
+            allInPlace = false;
+            segmentMoved[descr->segmentIndex] = true;
+        }
+    }
+    // Otherwise a new segment only has to be relocated if it refers to a segment that has
+    // moved.  If we don't know which segments it refers to it is always relocated.
+    std::vector<bool> needsRelocation(relocate.nDescrs, ! allInPlace);
+    unsigned segmentsRelocated = 0;
+    for (unsigned i = 0; i < relocate.nDescrs; i++)
+    {
+        SavedStateSegmentDescr *descr = &relocate.descrs[i];
+        if (! allInPlace && ! baseMoved && (descr->segmentFlags & SSF_REFERENCES))
+        {
+            bool refersToMoved = true;
+            off_t refPos = descr->segmentData + descr->segmentSize;
+            if (descr->segmentFlags & SSF_UNITTABLE)
+                refPos += ((descr->segmentSize + SAVEDSTATE_UNIT_SIZE - 1) / SAVEDSTATE_UNIT_SIZE) * sizeof(uintptr_t);
+            unsigned count;
+            if (fseek(loadFile, refPos, SEEK_SET) == 0 && fread(&count, sizeof(count), 1, loadFile) == 1 &&
+                    count <= relocate.nDescrs)
+            {
+                std::vector<unsigned> indexes(count);
+                if (count == 0 || fread(&indexes[0], sizeof(unsigned), count, loadFile) == count)
+                {
+                    refersToMoved = false;
+                    for (unsigned k = 0; k < count; k++)
+                    {
+                        if (indexes[k] > maxSegmentIndex || segmentMoved[indexes[k]])
+                            refersToMoved = true;
+                    }
+                }
+            }
+            needsRelocation[i] = refersToMoved;
+        }
+        if (needsRelocation[i] && descr->segmentData != 0)
+        {
+            segmentsRelocated++;
+            if (debugOptions & DEBUG_SAVING)
+                Log("SAVE: Segment %u (%s%s, %" PRI_SIZET " bytes) must be relocated\n", descr->segmentIndex,
+                    descr->segmentFlags & SSF_CODE ? "code" : descr->segmentFlags & SSF_WRITABLE ? "mutable" : "immutable",
+                    descr->segmentFlags & SSF_REFERENCES ? "" : ", references not known", descr->segmentSize);
+        }
+    }
+
+    // In lazy mode the immutable segments that have been mapped are made inaccessible
+    // and each unit is loaded when it is first used.  If the segments are not at their
+    // original addresses each unit is relocated as it is loaded.
+#ifndef _WIN32
+    if (lazyLoading && ! mappedSegments.empty())
+    {
+        LazyStateLoader *lazyLoader = 0;
+        if (segmentsRelocated != 0)
+        {
+            int fd = dup(fileno(loadFile));
+            if (fd != -1)
+            {
+                lazyLoader = new LazyStateLoader(fd);
+                relocate.SetRanges();
+                lazyLoader->relocate.CopyRanges(relocate);
+            }
+        }
+        for (std::vector<unsigned>::iterator i = mappedSegments.begin(); i != mappedSegments.end(); i++)
+        {
+            SavedStateSegmentDescr *descr = &relocate.descrs[*i];
+            PermanentMemSpace *space = gMem.SpaceForIndex(descr->segmentIndex);
+            if (needsRelocation[*i] &&
+                (lazyLoader == 0 || (descr->segmentFlags & SSF_UNITTABLE) == 0 || ! lazyLoader->AddSegment(space, descr, loadFile)))
+                continue;
+            if (gMem.MakeSpaceLazy(space, SAVEDSTATE_UNIT_SIZE, needsRelocation[*i] ? lazyLoader : 0))
+                bytesLazy += descr->segmentSize;
+        }
+        if (lazyLoader != 0 && lazyLoader->useCount == 0)
+            delete lazyLoader;
+    }
+#endif
 
+    // Now read in the mutable overwrites.  These may be patches to the data in the parents.
+    std::vector<std::vector<SavedStatePatch> > segmentPatches(relocate.nDescrs);
     for (unsigned j = 0; j < relocate.nDescrs; j++)
     {
         SavedStateSegmentDescr *descr = &relocate.descrs[j];
         MemSpace *space = gMem.SpaceForIndex(descr->segmentIndex);
         ASSERT(space != NULL); // We should have created it.
-        if (descr->segmentFlags & SSF_OVERWRITE)
+        if (descr->segmentFlags & SSF_PATCH)
         {
-            if (fseek(loadFile, descr->segmentData, SEEK_SET) != 0 ||
-                fread(space->bottom, descr->segmentSize, 1, loadFile) != 1)
+            if (! readSegmentPatches(space->bottom, descr, loadFile, segmentPatches[j]))
             {
                 errorResult = "Unable to read segment";
                 return false;
             }
+            for (std::vector<SavedStatePatch>::iterator i = segmentPatches[j].begin(); i != segmentPatches[j].end(); i++)
+                bytesRead += i->patchLength;
         }
-
-        // Relocation.
-        if (descr->segmentData != 0)
+        else if (descr->segmentFlags & SSF_OVERWRITE)
         {
-            // Adjust the addresses in the loaded segment.
-            for (PolyWord *p = space->bottom; p < space->top; )
+            if (! readSegmentData(space->bottom, descr, loadFile))
             {
-                p++;
-                PolyObject *obj = (PolyObject*)p;
-                POLYUNSIGNED length = obj->Length();
-                relocate.RelocateObject(obj);
-                p += length;
+                errorResult = "Unable to read segment";
+                return false;
             }
+            bytesRead += descr->segmentSize;
+        }
+    }
+
+    // Adjust the addresses in the loaded segments.  The segments are independent
+    // so this is done in parallel.
+    if (! allInPlace)
+    {
+        relocate.SetRanges();
+        for (unsigned j = 0; j < relocate.nDescrs; j++)
+        {
+            SavedStateSegmentDescr *descr = &relocate.descrs[j];
+            PermanentMemSpace *space = gMem.SpaceForIndex(descr->segmentIndex);
+            // Only the patched words have to be relocated.  The rest were relocated
+            // when the parent was loaded.
+            if (descr->segmentFlags & SSF_PATCH)
+                relocate.RelocatePatches(space->bottom, space->top, segmentPatches[j]);
+            else if (descr->segmentData != 0 && needsRelocation[j] && space->lazyState.empty())
+                relocate.AddRelocationRegion(space->bottom, space->top);
         }
+        relocate.RelocateChunks();
+    }
+
+    for (unsigned j = 0; j < relocate.nDescrs; j++)
+    {
+        SavedStateSegmentDescr *descr = &relocate.descrs[j];
+        MemSpace *space = gMem.SpaceForIndex(descr->segmentIndex);
 
         // Process explicit relocations.
         // If we get errors just skip the error and continue rather than leave
         // everything in an unstable state.
-        if (descr->relocations)
+        if (descr->relocations && ! allInPlace)
         {
             if (fseek(loadFile, descr->relocations, SEEK_SET) != 0)
             {
@@ -1392,6 +2255,15 @@ bool StateLoader::LoadFile(bool isInitial, time_t requiredStamp, PolyWord tail)
         }
     }
 
+    if (debugOptions & DEBUG_SAVING)
+    {
+        TIMEDATA loadTime = GetRealTime();
+        loadTime.sub(startTime);
+        Log("SAVE: Loaded segments in %1.3fs: %" PRI_SIZET " bytes mapped, %" PRI_SIZET " bytes read, %" PRI_SIZET
+            " page faults, %u segments relocated, %" PRI_SIZET " bytes lazy\n", loadTime.toSeconds(), bytesMapped, bytesRead,
+            pageFaultCount() - startFaults, segmentsRelocated, bytesLazy);
+    }
+
     // Add an entry to the hierarchy table for this file.
     if (! AddHierarchyEntry(thisFile, header.timeStamp))
         return false;
@@ -1540,7 +2412,7 @@ static void RenameParent(TaskData *taskData, PolyWord childName, PolyWord parent
     if (strncmp(header.headerSignature, SAVEDSTATESIGNATURE, sizeof(header.headerSignature)) != 0)
         raise_fail(taskData, "File is not a saved state");
 
-    if (header.headerVersion != SAVEDSTATEVERSION ||
+    if ((header.headerVersion != SAVEDSTATEVERSION && header.headerVersion != SAVEDSTATEEXTENDEDVERSION) ||
         header.headerLength != sizeof(SavedStateHeader) ||
         header.segmentDescrLength != sizeof(SavedStateSegmentDescr))
     {
@@ -1613,7 +2485,7 @@ static Handle ShowParent(TaskData *taskData, Handle hFileName)
     if (strncmp(header.headerSignature, SAVEDSTATESIGNATURE, sizeof(header.headerSignature)) != 0)
         raise_fail(taskData, "File is not a saved state");
 
-    if (header.headerVersion != SAVEDSTATEVERSION ||
+    if ((header.headerVersion != SAVEDSTATEVERSION && header.headerVersion != SAVEDSTATEEXTENDEDVERSION) ||
         header.headerLength != sizeof(SavedStateHeader) ||
         header.segmentDescrLength != sizeof(SavedStateSegmentDescr))
     {
@@ -1672,6 +2544,7 @@ POLYUNSIGNED PolyShowParent(POLYUNSIGNED threadId, POLYUNSIGNED arg)
 // Module system
 #define MODULESIGNATURE "POLYMODU"
 #define MODULEVERSION   2
+#define MODULECOMPRESSEDVERSION 3
 
 typedef struct _moduleHeader
 {
@@ -1822,8 +2695,8 @@ void ModuleExport::exportStore(void)
             }
             thisDescr->relocationCount = this->relocationCount;
             // Write out the data.
-            thisDescr->segmentData = ftell(exportFile);
-            fwrite(entry->mtOriginalAddr, entry->mtLength, 1, exportFile);
+            if (writeSegmentData(exportFile, entry->mtOriginalAddr, entry->mtLength, thisDescr))
+                modHeader.headerVersion = MODULECOMPRESSEDVERSION;
         }
     }
 
@@ -1898,13 +2771,20 @@ void ModuleLoader::Perform()
         errorResult = "File is not a Poly/ML module";
         return;
     }
-    if (header.headerVersion != MODULEVERSION ||
+    if ((header.headerVersion != MODULEVERSION && header.headerVersion != MODULECOMPRESSEDVERSION) ||
         header.headerLength != sizeof(ModuleHeader) ||
         header.segmentDescrLength != sizeof(SavedStateSegmentDescr))
     {
         errorResult = "Unsupported version of module file";
         return;
     }
+#ifndef HAVE_LIBZ
+    if (header.headerVersion == MODULECOMPRESSEDVERSION)
+    {
+        errorResult = "Module is compressed but compression is not supported";
+        return;
+    }
+#endif
     if (header.executableTimeStamp != exportTimeStamp)
     {
         // Time-stamp does not match executable.
@@ -1982,12 +2862,7 @@ void ModuleLoader::Perform()
                 space = lSpace;
                 lSpace->lowerAllocPtr = (PolyWord*)((byte*)lSpace->bottom + descr->segmentSize);
             }
-            if (fseek(loadFile, descr->segmentData, SEEK_SET) != 0)
-            {
-                errorResult = "Unable to seek to segment";
-                return;
-            }
-            if (readData(space->bottom, descr->segmentSize, loadFile) != 1)
+            if (! readSegmentData(space->bottom, descr, loadFile))
             {
                 errorResult = "Unable to read segment";
                 return;
@@ -2000,7 +2875,8 @@ void ModuleLoader::Perform()
             }
         }
     }
-    // Now deal with relocation.
+    // Now deal with relocation.  The relocation tables are read in and
+    // then applied in parallel.
     for (unsigned j = 0; j < relocate.nDescrs; j++)
     {
         SavedStateSegmentDescr *descr = &relocate.descrs[j];
@@ -2009,21 +2885,20 @@ void ModuleLoader::Perform()
         // Process explicit relocations.
         // If we get errors just skip the error and continue rather than leave
         // everything in an unstable state.
-        if (descr->relocations)
+        if (descr->relocations && descr->relocationCount != 0)
         {
-            if (fseek(loadFile, descr->relocations, SEEK_SET) != 0)
-                errorResult = "Unable to read relocation segment";
-            for (unsigned k = 0; k < descr->relocationCount; k++)
+            RelocationEntry *entries = new RelocationEntry[descr->relocationCount];
+            if (fseek(loadFile, descr->relocations, SEEK_SET) != 0 ||
+                fread(entries, sizeof(RelocationEntry), descr->relocationCount, loadFile) != descr->relocationCount)
             {
-                RelocationEntry reloc;
-                if (fread(&reloc, sizeof(reloc), 1, loadFile) != 1)
-                    errorResult = "Unable to read relocation segment";
-                byte *setAddress = (byte*)baseAddr + reloc.relocAddress;
-                byte *targetAddress = (byte*)relocate.targetAddresses[reloc.targetSegment] + reloc.targetAddress;
-                ScanAddress::SetConstantValue(setAddress, (PolyObject*)(targetAddress), reloc.relKind);
+                errorResult = "Unable to read relocation segment";
+                delete[](entries);
+                continue;
             }
+            relocate.AddRelocationEntries(baseAddr, entries, descr->relocationCount);
         }
     }
+    relocate.RelocateChunks();
 
     // Get the root address.  Push this to the caller's save vec.  If we put the
     // newly created areas into local memory we could get a GC as soon as we
@@ -2137,8 +3012,6 @@ PolyObject *InitHeaderFromExport(struct _exportDescription *exports)
             Exit("Unable to initialise a permanent memory space");
 
         relocate.targetAddresses[i] = mem;
-        relocate.AddTreeRange(&relocate.spaceTree, i, (uintptr_t)relocate.descrs[i].originalAddress,
-            (uintptr_t)((char*)relocate.descrs[i].originalAddress + relocate.descrs[i].segmentSize - 1));
 
         // Relocate the root function.
         if (exports->rootFunction >= memTable[i].mtCurrentAddr && exports->rootFunction < (char*)memTable[i].mtCurrentAddr + memTable[i].mtLength)
@@ -2147,7 +3020,9 @@ PolyObject *InitHeaderFromExport(struct _exportDescription *exports)
         }
     }
 
-    // Now relocate the addresses
+    // Now relocate the addresses.  The relative offset depends on the segment
+    // so this is not done in parallel.
+    relocate.SetRanges();
     for (unsigned j = 0; j < exports->memTableEntries; j++)
     {
         SavedStateSegmentDescr *descr = &relocate.descrs[j];
@@ -2247,6 +3122,100 @@ POLYUNSIGNED PolyGetModuleDirectory(POLYUNSIGNED threadId)
     else return result->Word().AsUnsigned();
 }
 
+// Set the compression level used for saved states and modules.  Zero turns compression off.
+POLYUNSIGNED PolySetSaveCompression(POLYUNSIGNED threadId, POLYUNSIGNED level)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+
+    try {
+        int newLevel = get_C_int(taskData, PolyWord::FromUnsigned(level));
+        if (newLevel < 0 || newLevel > 9)
+            raise_fail(taskData, "Compression level must be between 0 and 9");
+#ifndef HAVE_LIBZ
+        if (newLevel != 0)
+            raise_fail(taskData, "Compression is not supported");
+#endif
+        saveCompressionLevel = newLevel;
+    }
+    catch (...) {} // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    return TAGGED(0).AsUnsigned();
+}
+
+// Set whether overwritten segments in child states are saved as patches.
+POLYUNSIGNED PolySetSaveDeltas(POLYUNSIGNED threadId, POLYUNSIGNED arg)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    saveDeltas = PolyWord::FromUnsigned(arg).UnTagged() != 0;
+    taskData->PostRTSCall();
+    return TAGGED(0).AsUnsigned();
+}
+
+// Set whether saved states loaded in future are loaded lazily.
+POLYUNSIGNED PolySetLazyLoading(POLYUNSIGNED threadId, POLYUNSIGNED arg)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    lazyLoading = PolyWord::FromUnsigned(arg).UnTagged() != 0;
+    taskData->PostRTSCall();
+    return TAGGED(0).AsUnsigned();
+}
+
+// Return a list of the lazily loaded segments.  Each entry is a triple of the segment
+// index, the number of units that have been loaded and the total number of units.
+static Handle LazyLoadCounts(TaskData *taskData)
+{
+    Handle saved = taskData->saveVec.mark();
+    Handle list  = SAVE(ListNull);
+
+    for (std::vector<PermanentMemSpace*>::reverse_iterator i = gMem.pSpaces.rbegin(); i != gMem.pSpaces.rend(); i++)
+    {
+        PermanentMemSpace *space = *i;
+        if (space->lazyState.empty())
+            continue;
+        Handle index = Make_arbitrary_precision(taskData, space->index);
+        Handle loaded = Make_arbitrary_precision(taskData, space->lazyUnitsLoaded);
+        Handle units = Make_arbitrary_precision(taskData, space->lazyState.size());
+        Handle triple = alloc_and_save(taskData, 3);
+        DEREFHANDLE(triple)->Set(0, index->Word());
+        DEREFHANDLE(triple)->Set(1, loaded->Word());
+        DEREFHANDLE(triple)->Set(2, units->Word());
+        Handle next  = alloc_and_save(taskData, sizeof(ML_Cons_Cell)/sizeof(PolyWord));
+        DEREFLISTHANDLE(next)->h = triple->Word();
+        DEREFLISTHANDLE(next)->t = list->Word();
+        taskData->saveVec.reset(saved);
+        list = SAVE(next->Word());
+    }
+    return list;
+}
+
+POLYUNSIGNED PolyLazyLoadCounts(POLYUNSIGNED threadId)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle result = 0;
+
+    try {
+        result = LazyLoadCounts(taskData);
+    }
+    catch (...) {} // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    if (result == 0) return TAGGED(0).AsUnsigned();
+    else return result->Word().AsUnsigned();
+}
+
 struct _entrypts savestateEPT[] =
 {
     { "PolySaveState",                  (polyRTSFunction)&PolySaveState },
@@ -2258,6 +3227,10 @@ struct _entrypts savestateEPT[] =
     { "PolyLoadModule",                 (polyRTSFunction)&PolyLoadModule },
     { "PolyLoadHierarchy",              (polyRTSFunction)&PolyLoadHierarchy },
     { "PolyGetModuleDirectory",         (polyRTSFunction)&PolyGetModuleDirectory },
+    { "PolySetSaveCompression",         (polyRTSFunction)&PolySetSaveCompression },
+    { "PolySetSaveDeltas",              (polyRTSFunction)&PolySetSaveDeltas },
+    { "PolySetLazyLoading",             (polyRTSFunction)&PolySetLazyLoading },
+    { "PolyLazyLoadCounts",             (polyRTSFunction)&PolyLazyLoadCounts },
 
     { NULL, NULL } // End of list.
 };
@@ -137,6 +137,7 @@ extern "C" {
     POLYEXTERNALSYMBOL POLYUNSIGNED PolySetUserStat(POLYUNSIGNED threadId, POLYUNSIGNED index, POLYUNSIGNED value);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyGetLocalStats(POLYUNSIGNED threadId);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyGetRemoteStats(POLYUNSIGNED threadId, POLYUNSIGNED procId);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyGetThreadAllocRate(POLYUNSIGNED threadId);
 }
 
 #define STATS_SPACE 4096 // Enough for all the statistics
@@ -267,6 +268,22 @@ void Statistics::Init()
     addCounter(PSC_GC_SHARING, POLY_STATS_ID_GC_SHARING, "GCSharingCount");
     addCounter(PSC_GC_STATE, POLY_STATS_ID_GC_STATE, "GCState");
     addCounter(PSC_GC_PERCENT, POLY_STATS_ID_GC_PERCENT, "GCPercent");
+    addCounter(PSC_GC_CARDS_SCANNED, POLY_STATS_ID_GC_CARDS_SCANNED, "GCCardsScanned");
+    addCounter(PSC_GC_CARDS_TOTAL, POLY_STATS_ID_GC_CARDS_TOTAL, "GCCardsTotal");
+    addCounter(PSC_GC_TASK_STEALS, POLY_STATS_ID_GC_TASK_STEALS, "GCTaskSteals");
+    addCounter(PSC_GC_TASK_IDLE, POLY_STATS_ID_GC_TASK_IDLE, "GCTaskIdleSpins");
+    addCounter(PSC_GC_PAUSE_1MS, POLY_STATS_ID_GC_PAUSE_1MS, "GCPausesUnder1ms");
+    addCounter(PSC_GC_PAUSE_2MS, POLY_STATS_ID_GC_PAUSE_2MS, "GCPausesUnder2ms");
+    addCounter(PSC_GC_PAUSE_5MS, POLY_STATS_ID_GC_PAUSE_5MS, "GCPausesUnder5ms");
+    addCounter(PSC_GC_PAUSE_10MS, POLY_STATS_ID_GC_PAUSE_10MS, "GCPausesUnder10ms");
+    addCounter(PSC_GC_PAUSE_50MS, POLY_STATS_ID_GC_PAUSE_50MS, "GCPausesUnder50ms");
+    addCounter(PSC_GC_PAUSE_100MS, POLY_STATS_ID_GC_PAUSE_100MS, "GCPausesUnder100ms");
+    addCounter(PSC_GC_PAUSE_500MS, POLY_STATS_ID_GC_PAUSE_500MS, "GCPausesUnder500ms");
+    addCounter(PSC_GC_PAUSE_LONGER, POLY_STATS_ID_GC_PAUSE_LONGER, "GCPausesLonger");
+    addCounter(PSC_GC_CONCURRENT, POLY_STATS_ID_GC_CONCURRENT, "GCConcurrentMarks");
+    addSize(PSS_GC_SHARE_SAVED, POLY_STATS_ID_GC_SHARE_SAVED, "GCShareBytesSaved");
+    addSize(PSS_GC_NUMA_LOCAL, POLY_STATS_ID_GC_NUMA_LOCAL, "GCNumaLocalBytes");
+    addSize(PSS_GC_NUMA_REMOTE, POLY_STATS_ID_GC_NUMA_REMOTE, "GCNumaRemoteBytes");
 
     addSize(PSS_TOTAL_HEAP, POLY_STATS_ID_TOTAL_HEAP, "TotalHeap");
     addSize(PSS_AFTER_LAST_GC, POLY_STATS_ID_AFTER_LAST_GC, "HeapAfterLastGC");
@@ -491,6 +508,17 @@ Statistics::~Statistics()
 }
 
 // Counters.  These are used for thread state so need interlocks
+// The upper limits, in seconds, of the buckets in the pause histogram.
+static const float pauseLimits[] = { 0.001F, 0.002F, 0.005F, 0.01F, 0.05F, 0.1F, 0.5F };
+
+void Statistics::recordGCPause(float seconds)
+{
+    int bucket = PSC_GC_PAUSE_1MS;
+    for (unsigned i = 0; i < sizeof(pauseLimits)/sizeof(pauseLimits[0]) && seconds >= pauseLimits[i]; i++)
+        bucket++;
+    incCount(bucket);
+}
+
 void Statistics::incCount(int which)
 {
     if (statMemory && counterAddrs[which])
@@ -874,12 +902,35 @@ POLYEXTERNALSYMBOL POLYUNSIGNED PolyGetRemoteStats(POLYUNSIGNED threadId, POLYUN
     else return result->Word().AsUnsigned();
 }
 
+// Return the allocation rate of the calling thread.  This is the smoothed
+// number of bytes allocated between GCs and is used to size its heap segments.
+POLYEXTERNALSYMBOL POLYUNSIGNED PolyGetThreadAllocRate(POLYUNSIGNED threadId)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle result = 0;
+
+    try {
+        result = Make_arbitrary_precision(taskData, taskData->allocRate * sizeof(PolyWord));
+    }
+    catch (...) {} // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+
+    if (result == 0) return TAGGED(0).AsUnsigned();
+    else return result->Word().AsUnsigned();
+}
+
 struct _entrypts statisticsEPT[] =
 {
     { "PolyGetUserStatsCount",            (polyRTSFunction)&PolyGetUserStatsCount },
     { "PolySetUserStat",                  (polyRTSFunction)&PolySetUserStat },
     { "PolyGetLocalStats",                (polyRTSFunction)&PolyGetLocalStats },
     { "PolyGetRemoteStats",               (polyRTSFunction)&PolyGetRemoteStats },
+    { "PolyGetThreadAllocRate",           (polyRTSFunction)&PolyGetThreadAllocRate },
 
     { NULL, NULL } // End of list.
 };
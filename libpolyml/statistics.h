@@ -53,6 +53,23 @@ enum {
     PSC_GC_STATE,                   // Whether in GC, ML or other phase
     PSC_GC_PERCENT,                 // How far through the GC.
 
+    PSC_GC_CARDS_SCANNED,           // Dirty cards scanned in the last minor GC
+    PSC_GC_CARDS_TOTAL,             // Total cards in the last minor GC
+    PSC_GC_TASK_STEALS,             // Tasks stolen by GC worker threads
+    PSC_GC_TASK_IDLE,               // Times a GC worker found no work
+    PSC_GC_PAUSE_1MS,               // Histogram of GC pause times.  Must be consecutive.
+    PSC_GC_PAUSE_2MS,
+    PSC_GC_PAUSE_5MS,
+    PSC_GC_PAUSE_10MS,
+    PSC_GC_PAUSE_50MS,
+    PSC_GC_PAUSE_100MS,
+    PSC_GC_PAUSE_500MS,
+    PSC_GC_PAUSE_LONGER,
+    PSC_GC_CONCURRENT,              // Full GCs that used concurrent marks
+    PSS_GC_SHARE_SAVED,             // Bytes recovered by the last sharing pass
+    PSS_GC_NUMA_LOCAL,              // Bytes scanned by GC threads on the same node
+    PSS_GC_NUMA_REMOTE,             // Bytes scanned by GC threads on another node
+
     N_PS_INTS
 };
 
@@ -95,6 +112,9 @@ public:
 
     void setUserCounter(unsigned which, POLYSIGNED value);
 
+    // Add a GC pause to the histogram.
+    void recordGCPause(float seconds);
+
 #ifdef _WIN32
     // Native Windows
     void copyGCTimes(const FILETIME &gcUtime, const FILETIME &gcStime, const FILETIME &gcRtime);
@@ -729,6 +729,18 @@ void TimeValTime::sub(const TimeValTime &f)
 
 #endif
 
+TIMEDATA GetRealTime(void)
+{
+#if (defined(_WIN32))
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    return ft;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv;
+#endif
+}
 
 struct _entrypts timingEPT[] =
 {
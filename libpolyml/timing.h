@@ -100,6 +100,9 @@ extern void subTimevals(struct timeval *result, const struct timeval *x);
 extern float timevalToSeconds(const struct timeval *x);
 #endif
 
+// Get the current real (wall-clock) time.  Used for GC pause times.
+extern TIMEDATA GetRealTime(void);
+
 extern time_t getBuildTime(void);
 
 extern struct _entrypts timingEPT[];
@@ -126,6 +126,8 @@
 #include "machine_dep.h"
 #include "os_specific.h"
 #include "gc.h"
+#include "memmgr.h"
+#include "ioreactor.h"
 #include "processes.h"
 #include "mpoly.h"
 #include "sighandler.h"
@@ -412,6 +414,8 @@ Handle OS_spec_dispatch_c(TaskData *taskData, Handle args, Handle code)
 
     case 5: /* fork. */
         {
+            // The child does not have the thread that loads lazy spaces.
+            gMem.LoadRelocatedLazySpaces();
             pid_t pid = fork();
             if (pid < 0) raise_syscall(taskData, "fork failed", errno);
             // Have to clean up the RTS in the child.  It's single threaded among other things.
@@ -993,6 +997,8 @@ Handle OS_spec_dispatch_c(TaskData *taskData, Handle args, Handle code)
         {
             int oldFd = getStreamFileDescriptor(taskData, DEREFHANDLE(args)->Get(0));
             int newFd = getStreamFileDescriptor(taskData, DEREFHANDLE(args)->Get(1));
+            // dup2 closes newFd if it is open.
+            if (oldFd != newFd) ForgetDescriptor(newFd);
             if (dup2(oldFd, newFd) < 0)
                 raise_syscall(taskData, "dup2 failed", errno);
             return Make_fixed_precision(taskData, 0);
@@ -2046,7 +2052,9 @@ POLYUNSIGNED PolyUnixExecute(POLYUNSIGNED threadId, POLYUNSIGNED cmd, POLYUNSIGN
             _exit(126);
         }
         // In the parent
+        ForgetDescriptor(toChild[0]);
         close(toChild[0]); // These are used in the child
+        ForgetDescriptor(fromChild[1]);
         close(fromChild[1]);
         Handle childPid = Make_fixed_precision(taskData, pid);
         Handle writeStr = wrapFileDescriptor(taskData, toChild[1]);
@@ -2059,10 +2067,11 @@ POLYUNSIGNED PolyUnixExecute(POLYUNSIGNED threadId, POLYUNSIGNED cmd, POLYUNSIGN
     catch (...)
     {
         // If an ML exception is raised
-        if (toChild[0] != -1) close(toChild[0]);
-        if (toChild[1] != -1) close(toChild[1]);
-        if (fromChild[0] != -1) close(fromChild[0]);
-        if (fromChild[1] != -1) close(fromChild[1]);
+        for (int i = 0; i < 2; i++)
+        {
+            if (toChild[i] != -1) { ForgetDescriptor(toChild[i]); close(toChild[i]); }
+            if (fromChild[i] != -1) { ForgetDescriptor(fromChild[i]); close(fromChild[i]); }
+        }
     }
     free(path);
     freeStringVector(argl);
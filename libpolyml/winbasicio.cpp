@@ -145,6 +145,7 @@ extern "C" {
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyPollIODescriptors(POLYUNSIGNED threadId, POLYUNSIGNED streamVec, POLYUNSIGNED bitVec, POLYUNSIGNED maxMillisecs);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyTestForInput(POLYUNSIGNED threadId, POLYUNSIGNED strm, POLYUNSIGNED waitMillisecs);
     POLYEXTERNALSYMBOL POLYUNSIGNED PolyTestForOutput(POLYUNSIGNED threadId, POLYUNSIGNED strm, POLYUNSIGNED waitMillisecs);
+    POLYEXTERNALSYMBOL POLYUNSIGNED PolyBasicIOWriteVectors(POLYUNSIGNED threadId, POLYUNSIGNED strm, POLYUNSIGNED vecs);
 }
 
 // References to the standard streams.  They are only needed if we are compiling
@@ -659,6 +660,31 @@ static Handle writeArray(TaskData *taskData, Handle stream, Handle args, bool/*i
     return Make_fixed_precision(taskData, haveWritten);
 }
 
+// Write a list of (base, offset, length) buffers.  There is no gather write
+// for all the kinds of stream so this writes the first non-empty buffer and
+// the caller writes the rest later.
+static Handle writeVectors(TaskData *taskData, Handle stream, Handle args)
+{
+    WinStream *strm = *(WinStream**)(stream->WordP());
+    if (strm == 0) raise_syscall(taskData, "Stream is closed", STREAMCLOSED);
+
+    // We should check for interrupts even if we're not going to block.
+    processes->TestAnyEvents(taskData);
+    strm->waitUntilOutputPossible(taskData);
+
+    for (PolyWord p = DEREFWORD(args); !ML_Cons_Cell::IsNull(p); p = ((ML_Cons_Cell*)p.AsObjPtr())->t)
+    {
+        PolyObject *buff = ((ML_Cons_Cell*)p.AsObjPtr())->h.AsObjPtr();
+        POLYUNSIGNED offset = getPolyUnsigned(taskData, buff->Get(1));
+        size_t length = getPolyUnsigned(taskData, buff->Get(2));
+        if (length == 0) continue;
+        byte *toWrite = buff->Get(0).AsObjPtr()->AsBytePtr();
+        size_t haveWritten = strm->writeStream(taskData, toWrite + offset, length);
+        return Make_fixed_precision(taskData, haveWritten);
+    }
+    return Make_fixed_precision(taskData, 0);
+}
+
 Handle pollTest(TaskData *taskData, Handle stream)
 {
     WinStream *strm = *(WinStream**)(stream->WordP());
@@ -1403,6 +1429,30 @@ POLYEXTERNALSYMBOL POLYUNSIGNED PolyTestForOutput(POLYUNSIGNED threadId, POLYUNS
     return TAGGED(result ? 1 : 0).AsUnsigned();
 }
 
+POLYEXTERNALSYMBOL POLYUNSIGNED PolyBasicIOWriteVectors(POLYUNSIGNED threadId, POLYUNSIGNED strm, POLYUNSIGNED vecs)
+{
+    TaskData *taskData = TaskData::FindTaskForId(threadId);
+    ASSERT(taskData != 0);
+    taskData->PreRTSCall();
+    Handle reset = taskData->saveVec.mark();
+    Handle pushedStrm = taskData->saveVec.push(strm);
+    Handle pushedVecs = taskData->saveVec.push(vecs);
+    Handle result = 0;
+
+    try {
+        result = writeVectors(taskData, pushedStrm, pushedVecs);
+    }
+    catch (KillException &) {
+        processes->ThreadExit(taskData); // TestAnyEvents may test for kill
+    }
+    catch (...) {} // If an ML exception is raised
+
+    taskData->saveVec.reset(reset);
+    taskData->PostRTSCall();
+    if (result == 0) return TAGGED(0).AsUnsigned();
+    else return result->Word().AsUnsigned();
+}
+
 struct _entrypts basicIOEPT[] =
 {
     { "PolyChDir",                      (polyRTSFunction)&PolyChDir },
@@ -1410,6 +1460,7 @@ struct _entrypts basicIOEPT[] =
     { "PolyPollIODescriptors",          (polyRTSFunction)&PolyPollIODescriptors },
     { "PolyTestForInput",               (polyRTSFunction)&PolyTestForInput },
     { "PolyTestForOutput",              (polyRTSFunction)&PolyTestForOutput },
+    { "PolyBasicIOWriteVectors",        (polyRTSFunction)&PolyBasicIOWriteVectors },
 
     { NULL, NULL } // End of list.
 };
@@ -193,6 +193,7 @@ public:
     X86TaskData();
     unsigned allocReg; // The register to take the allocated space.
     POLYUNSIGNED allocWords; // The words to allocate.
+    PolyWord *allocSampleBase; // The allocation pointer when we last entered ML.
     AssemblyArgs assemblyInterface;
     int saveRegisterMask; // Registers that need to be updated by a GC.
 
@@ -217,6 +218,10 @@ public:
     virtual void addProfileCount(POLYUNSIGNED words)
     { addSynchronousCount(assemblyInterface.stackPtr[0].codeAddr, words); }
 
+    // Count an allocation if we are sampling allocations.
+    virtual void sampleAllocation(POLYUNSIGNED words, PolyObject *obj)
+    { addAllocationSample(this, assemblyInterface.stackPtr[0].codeAddr, assemblyInterface.stackPtr+1, words, obj); }
+
     // PreRTSCall: After calling from ML to the RTS we need to save the current heap pointer
     virtual void PreRTSCall(void) { TaskData::PreRTSCall();  SaveMemRegisters(); }
     // PostRTSCall: Before returning we need to restore the heap pointer.
@@ -356,7 +361,7 @@ extern "C" {
 };
 
 X86TaskData::X86TaskData(): ByteCodeInterpreter(&assemblyInterface.stackPtr, &assemblyInterface.stackLimit),
-    allocReg(0), allocWords(0), saveRegisterMask(0)
+    allocReg(0), allocWords(0), allocSampleBase(0), saveRegisterMask(0)
 {
     assemblyInterface.enterInterpreter = (byte*)X86AsmCallExtraRETURN_ENTER_INTERPRETER;
     assemblyInterface.heapOverFlowCall = (byte*)X86AsmCallExtraRETURN_HEAP_OVERFLOW;
@@ -850,7 +855,7 @@ bool X86TaskData::AddTimeProfileCount(SIGNALCONTEXT *context)
         MemSpace *space = gMem.SpaceForAddress(pc);
         if (space != 0 && (space->spaceType == ST_CODE || space->spaceType == ST_PERMANENT))
         {
-            incrementCountAsynch(pc);
+            incrementCountAsynch(this, pc, sp);
             return true;
         }
     }
@@ -862,7 +867,7 @@ bool X86TaskData::AddTimeProfileCount(SIGNALCONTEXT *context)
         MemSpace *space = gMem.SpaceForAddress(pc);
         if (space != 0 && (space->spaceType == ST_CODE || space->spaceType == ST_PERMANENT))
         {
-            incrementCountAsynch(pc);
+            incrementCountAsynch(this, pc, sp+1);
             return true;
         }
     }
@@ -877,7 +882,7 @@ bool X86TaskData::AddTimeProfileCount(SIGNALCONTEXT *context)
         MemSpace *space = gMem.SpaceForAddress(pc);
         if (space != 0 && (space->spaceType == ST_CODE || space->spaceType == ST_PERMANENT))
         {
-            incrementCountAsynch(pc);
+            incrementCountAsynch(this, pc, sp+1);
             return true;
         }
     }
@@ -930,6 +935,8 @@ void X86TaskData::SetMemRegisters()
         // We will have already garbage collected and recovered sufficient space.
         // This also happens if we have just trapped because of store profiling.
         this->allocPointer -= this->allocWords; // Now allocate
+        if (profileMode == kProfileAllocationStacks)
+            sampleAllocation(this->allocWords, (PolyObject*)(this->allocPointer + 1));
         // Set the allocation register to this area. N.B.  This is an absolute address.
         if (this->allocReg < 15)
             get_reg(this->allocReg)[0].codeAddr = (POLYCODEPTR)(this->allocPointer + 1); /* remember: it's off-by-one */
@@ -951,6 +958,14 @@ void X86TaskData::SetMemRegisters()
     // will be generated.
     if (profileMode == kProfileStoreAllocation)
         this->assemblyInterface.localMbottom = this->assemblyInterface.localMpointer;
+    // If we are sampling allocations we only need a trap when the next sample is due.
+    allocSampleBase = this->allocPointer;
+    if (profileMode == kProfileAllocationStacks)
+    {
+        POLYUNSIGNED toSample = allocationWordsBeforeSample(this);
+        if (toSample <= (POLYUNSIGNED)(this->allocPointer - this->allocLimit))
+            this->assemblyInterface.localMbottom = this->allocPointer + 2 - toSample;
+    }
 
     this->assemblyInterface.threadId = this->threadObject;
 }
@@ -959,7 +974,12 @@ void X86TaskData::SetMemRegisters()
 void X86TaskData::SaveMemRegisters()
 {
     if (interpreterPc == 0) // Not if we're already in the interpreter
+    {
         this->allocPointer = this->assemblyInterface.localMpointer - 1;
+        // Count what the ML code has allocated without a trap.
+        if (profileMode == kProfileAllocationStacks && this->allocPointer <= allocSampleBase)
+            this->allocSinceSample += allocSampleBase - this->allocPointer;
+    }
     this->allocWords = 0;
     this->assemblyInterface.exceptionPacket = TAGGED(0);
     this->saveRegisterMask = 0;
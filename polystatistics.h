@@ -81,6 +81,25 @@
 #define POLY_STATS_ID_GC_STATE               31
 #define POLY_STATS_ID_GC_PERCENT             32
 
+#define POLY_STATS_ID_GC_CARDS_SCANNED       33     // Dirty cards scanned in the last minor GC
+#define POLY_STATS_ID_GC_CARDS_TOTAL         34     // Total cards in mutable areas
+#define POLY_STATS_ID_GC_TASK_STEALS         35     // Tasks stolen by GC worker threads
+#define POLY_STATS_ID_GC_TASK_IDLE           36     // Idle spins by GC worker threads
+
+// Histogram of GC pause times.
+#define POLY_STATS_ID_GC_PAUSE_1MS           37     // Less than 1ms
+#define POLY_STATS_ID_GC_PAUSE_2MS           38     // 1ms to 2ms
+#define POLY_STATS_ID_GC_PAUSE_5MS           39     // 2ms to 5ms
+#define POLY_STATS_ID_GC_PAUSE_10MS          40     // 5ms to 10ms
+#define POLY_STATS_ID_GC_PAUSE_50MS          41     // 10ms to 50ms
+#define POLY_STATS_ID_GC_PAUSE_100MS         42     // 50ms to 100ms
+#define POLY_STATS_ID_GC_PAUSE_500MS         43     // 100ms to 500ms
+#define POLY_STATS_ID_GC_PAUSE_LONGER        44     // 500ms or more
+#define POLY_STATS_ID_GC_CONCURRENT          45     // Full GCs using concurrent marks
+#define POLY_STATS_ID_GC_SHARE_SAVED         46     // Bytes recovered by the last sharing pass
+#define POLY_STATS_ID_GC_NUMA_LOCAL          47     // Bytes scanned by GC threads on the same NUMA node
+#define POLY_STATS_ID_GC_NUMA_REMOTE         48     // Bytes scanned by GC threads on another NUMA node
+
 #endif // POLY_STATISTICS_INCLUDED
 
 